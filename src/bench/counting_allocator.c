@@ -0,0 +1,66 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "counting_allocator.h"
+
+static void* allocDebug(void* _self, size_t size, const char* sourceFile, int line, const char* description)
+{
+    NimbleServerBenchCountingAllocator* self = (NimbleServerBenchCountingAllocator*) _self;
+
+    self->allocationCount++;
+    self->allocatedOctetCount += size;
+
+    return self->allocator->allocDebugFn(self->allocator, size, sourceFile, line, description);
+}
+
+static void* callocDebug(void* _self, size_t size, const char* sourceFile, int line, const char* description)
+{
+    NimbleServerBenchCountingAllocator* self = (NimbleServerBenchCountingAllocator*) _self;
+
+    self->allocationCount++;
+    self->allocatedOctetCount += size;
+
+    return self->allocator->callocDebugFn(self->allocator, size, sourceFile, line, description);
+}
+
+static void freeDebug(void* _self, void* ptr, const char* sourceFile, int line, const char* description)
+{
+    NimbleServerBenchCountingAllocator* self = (NimbleServerBenchCountingAllocator*) _self;
+
+    self->freeCount++;
+
+    self->allocatorWithFree->freeDebugFn(self->allocatorWithFree, ptr, sourceFile, line, description);
+}
+
+/// Wraps an allocator without free
+/// @param self counting allocator
+/// @param allocator allocator to forward to
+void nimbleServerBenchCountingAllocatorInit(NimbleServerBenchCountingAllocator* self, ImprintAllocator* allocator)
+{
+    self->info.allocator.allocDebugFn = allocDebug;
+    self->info.allocator.callocDebugFn = callocDebug;
+    self->info.freeDebugFn = 0;
+    self->allocator = allocator;
+    self->allocatorWithFree = 0;
+    nimbleServerBenchCountingAllocatorReset(self);
+}
+
+/// Wraps an allocator that supports free
+/// @param self counting allocator
+/// @param allocatorWithFree allocator to forward to
+void nimbleServerBenchCountingAllocatorInitWithFree(NimbleServerBenchCountingAllocator* self,
+                                                    ImprintAllocatorWithFree* allocatorWithFree)
+{
+    nimbleServerBenchCountingAllocatorInit(self, &allocatorWithFree->allocator);
+    self->info.freeDebugFn = freeDebug;
+    self->allocatorWithFree = allocatorWithFree;
+}
+
+void nimbleServerBenchCountingAllocatorReset(NimbleServerBenchCountingAllocator* self)
+{
+    self->allocationCount = 0;
+    self->allocatedOctetCount = 0;
+    self->freeCount = 0;
+}
@@ -0,0 +1,28 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_BENCH_COUNTING_ALLOCATOR_H
+#define NIMBLE_SERVER_BENCH_COUNTING_ALLOCATOR_H
+
+#include <imprint/allocator.h>
+#include <stddef.h>
+
+/// Forwards to another allocator and counts the allocations passing through it.
+/// `info` must be the first member, since the allocator functions receive a pointer to it.
+typedef struct NimbleServerBenchCountingAllocator {
+    ImprintAllocatorWithFree info;
+    ImprintAllocator* allocator;
+    ImprintAllocatorWithFree* allocatorWithFree;
+    size_t allocationCount;
+    size_t allocatedOctetCount;
+    size_t freeCount;
+} NimbleServerBenchCountingAllocator;
+
+void nimbleServerBenchCountingAllocatorInit(NimbleServerBenchCountingAllocator* self, ImprintAllocator* allocator);
+void nimbleServerBenchCountingAllocatorInitWithFree(NimbleServerBenchCountingAllocator* self,
+                                                    ImprintAllocatorWithFree* allocatorWithFree);
+void nimbleServerBenchCountingAllocatorReset(NimbleServerBenchCountingAllocator* self);
+
+#endif
@@ -0,0 +1,134 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "loopback.h"
+#include <clog/clog.h>
+#include <tiny-libc/tiny_libc.h>
+
+void nimbleServerBenchLoopbackInit(NimbleServerBenchLoopback* self)
+{
+    for (size_t i = 0; i < NIMBLE_SERVER_BENCH_LOOPBACK_CAPACITY; ++i) {
+        self->freeSlots[i] = NIMBLE_SERVER_BENCH_LOOPBACK_CAPACITY - 1 - i;
+    }
+    self->freeSlotCount = NIMBLE_SERVER_BENCH_LOOPBACK_CAPACITY;
+    self->queuedCount = 0;
+    self->tick = 0;
+    self->receiveFn = 0;
+    self->receiveSelf = 0;
+
+    nimbleServerBenchLoopbackResetCounters(self);
+}
+
+void nimbleServerBenchLoopbackResetCounters(NimbleServerBenchLoopback* self)
+{
+    self->clientDatagramCount = 0;
+    self->clientOctetCount = 0;
+    self->clientOverflowCount = 0;
+    self->serverDatagramCount = 0;
+    self->serverOctetCount = 0;
+}
+
+/// Sets where the datagrams that the server sends are delivered
+/// @param self loopback
+/// @param receiveFn called for each datagram from the server
+/// @param receiveSelf passed to the receiveFn
+void nimbleServerBenchLoopbackSetReceiver(NimbleServerBenchLoopback* self, NimbleServerBenchLoopbackReceiveFn receiveFn,
+                                          void* receiveSelf)
+{
+    self->receiveFn = receiveFn;
+    self->receiveSelf = receiveSelf;
+}
+
+void nimbleServerBenchLoopbackSetTick(NimbleServerBenchLoopback* self, size_t tick)
+{
+    self->tick = tick;
+}
+
+/// Queues a datagram from a synthetic client to the server
+/// @param self loopback
+/// @param connectionIndex connection index that the server will see
+/// @param data datagram payload
+/// @param octetCount octet count of data
+/// @param deliverAtTick the first tick that the server can receive the datagram
+/// @return negative if the queue is full
+int nimbleServerBenchLoopbackClientSend(NimbleServerBenchLoopback* self, int connectionIndex, const uint8_t* data,
+                                        size_t octetCount, size_t deliverAtTick)
+{
+    if (self->freeSlotCount == 0 || octetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        self->clientOverflowCount++;
+        return -1;
+    }
+
+    size_t slot = self->freeSlots[--self->freeSlotCount];
+    NimbleServerBenchLoopbackDatagram* datagram = &self->datagrams[slot];
+    datagram->connectionIndex = connectionIndex;
+    datagram->deliverAtTick = deliverAtTick;
+    datagram->octetCount = octetCount;
+    tc_memcpy_octets(datagram->payload, data, octetCount);
+
+    self->queuedSlots[self->queuedCount++] = slot;
+
+    return 0;
+}
+
+static ssize_t receiveFrom(void* _self, int* connectionIndex, uint8_t* data, size_t maxOctetCount)
+{
+    NimbleServerBenchLoopback* self = (NimbleServerBenchLoopback*) _self;
+
+    for (size_t i = 0; i < self->queuedCount; ++i) {
+        size_t slot = self->queuedSlots[i];
+        const NimbleServerBenchLoopbackDatagram* datagram = &self->datagrams[slot];
+        if (datagram->deliverAtTick > self->tick) {
+            continue;
+        }
+
+        CLOG_ASSERT(datagram->octetCount <= maxOctetCount, "loopback datagram is too big %zu", datagram->octetCount)
+
+        *connectionIndex = datagram->connectionIndex;
+        tc_memcpy_octets(data, datagram->payload, datagram->octetCount);
+        ssize_t octetCount = (ssize_t) datagram->octetCount;
+
+        for (size_t j = i + 1; j < self->queuedCount; ++j) {
+            self->queuedSlots[j - 1] = self->queuedSlots[j];
+        }
+        self->queuedCount--;
+        self->freeSlots[self->freeSlotCount++] = slot;
+
+        self->clientDatagramCount++;
+        self->clientOctetCount += (size_t) octetCount;
+
+        return octetCount;
+    }
+
+    return 0;
+}
+
+static int sendTo(void* _self, int connectionIndex, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerBenchLoopback* self = (NimbleServerBenchLoopback*) _self;
+
+    self->serverDatagramCount++;
+    self->serverOctetCount += octetCount;
+
+    if (self->receiveFn != 0) {
+        self->receiveFn(self->receiveSelf, connectionIndex, data, octetCount);
+    }
+
+    return 0;
+}
+
+/// Creates a multi transport that the server can receive from and reply to
+/// @param self loopback
+/// @return multi transport
+DatagramTransportMulti nimbleServerBenchLoopbackMulti(NimbleServerBenchLoopback* self)
+{
+    DatagramTransportMulti multi;
+
+    multi.self = self;
+    multi.receiveFrom = receiveFrom;
+    multi.sendTo = sendTo;
+
+    return multi;
+}
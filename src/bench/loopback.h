@@ -0,0 +1,55 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_BENCH_LOOPBACK_H
+#define NIMBLE_SERVER_BENCH_LOOPBACK_H
+
+#include <datagram-transport/multi.h>
+#include <datagram-transport/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NIMBLE_SERVER_BENCH_LOOPBACK_CAPACITY (1024)
+
+typedef struct NimbleServerBenchLoopbackDatagram {
+    int connectionIndex;
+    size_t deliverAtTick;
+    size_t octetCount;
+    uint8_t payload[DATAGRAM_TRANSPORT_MAX_SIZE];
+} NimbleServerBenchLoopbackDatagram;
+
+typedef void (*NimbleServerBenchLoopbackReceiveFn)(void* self, int connectionIndex, const uint8_t* data,
+                                                   size_t octetCount);
+
+/// In-process transport between the synthetic clients and the server.
+/// Client datagrams are held until their delivery tick, so jitter also reorders them.
+/// Server datagrams are counted and handed to the receiveFn right away.
+typedef struct NimbleServerBenchLoopback {
+    NimbleServerBenchLoopbackDatagram datagrams[NIMBLE_SERVER_BENCH_LOOPBACK_CAPACITY];
+    size_t freeSlots[NIMBLE_SERVER_BENCH_LOOPBACK_CAPACITY];
+    size_t freeSlotCount;
+    size_t queuedSlots[NIMBLE_SERVER_BENCH_LOOPBACK_CAPACITY];
+    size_t queuedCount;
+    size_t tick;
+    NimbleServerBenchLoopbackReceiveFn receiveFn;
+    void* receiveSelf;
+
+    size_t clientDatagramCount;
+    size_t clientOctetCount;
+    size_t clientOverflowCount;
+    size_t serverDatagramCount;
+    size_t serverOctetCount;
+} NimbleServerBenchLoopback;
+
+void nimbleServerBenchLoopbackInit(NimbleServerBenchLoopback* self);
+void nimbleServerBenchLoopbackResetCounters(NimbleServerBenchLoopback* self);
+void nimbleServerBenchLoopbackSetReceiver(NimbleServerBenchLoopback* self, NimbleServerBenchLoopbackReceiveFn receiveFn,
+                                          void* receiveSelf);
+void nimbleServerBenchLoopbackSetTick(NimbleServerBenchLoopback* self, size_t tick);
+int nimbleServerBenchLoopbackClientSend(NimbleServerBenchLoopback* self, int connectionIndex, const uint8_t* data,
+                                        size_t octetCount, size_t deliverAtTick);
+DatagramTransportMulti nimbleServerBenchLoopbackMulti(NimbleServerBenchLoopback* self);
+
+#endif
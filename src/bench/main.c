@@ -0,0 +1,291 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "counting_allocator.h"
+#include "loopback.h"
+#include "report.h"
+#include "synthetic_client.h"
+#include <clog/clog.h>
+#include <clog/console.h>
+#include <imprint/default_setup.h>
+#include <inttypes.h>
+#include <nimble-server/profiler.h>
+#include <nimble-server/server.h>
+#include <nimble-server/trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+clog_config g_clog;
+
+char g_clog_temp_str[CLOG_TEMP_STR_SIZE];
+
+/// Ticks before measuring starts, so that all the clients have joined and downloaded the state
+#define NIMBLE_SERVER_BENCH_WARMUP_TICK_COUNT (120)
+
+#define NIMBLE_SERVER_BENCH_GAME_STATE_OCTET_COUNT (16 * 1024)
+
+typedef struct NimbleServerBenchGame {
+    uint8_t state[NIMBLE_SERVER_BENCH_GAME_STATE_OCTET_COUNT];
+    const NimbleServer* server;
+} NimbleServerBenchGame;
+
+static void authoritativeStateSerialize(void* _self, NimbleServerSerializedGameState* state)
+{
+    NimbleServerBenchGame* self = (NimbleServerBenchGame*) _self;
+
+    state->gameState = self->state;
+    state->gameStateOctetCount = sizeof(self->state);
+    state->stepId = self->server->game.authoritativeSteps.expectedWriteId - 1;
+    state->hash = 0;
+}
+
+typedef struct NimbleServerBenchClients {
+    NimbleServerBenchClient* clients;
+    size_t clientCount;
+    const NimbleServer* server;
+} NimbleServerBenchClients;
+
+static void receiveFromServer(void* _self, int connectionIndex, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerBenchClients* self = (NimbleServerBenchClients*) _self;
+    if (connectionIndex < 0 || (size_t) connectionIndex >= self->clientCount) {
+        return;
+    }
+
+    int err = nimbleServerBenchClientReceive(&self->clients[connectionIndex], data, octetCount);
+    if (err < 0) {
+        CLOG_ERROR("client %d could not receive %d", connectionIndex, err)
+    }
+}
+
+static size_t argumentOrDefault(int argc, char* argv[], int index, size_t defaultValue)
+{
+    if (index >= argc) {
+        return defaultValue;
+    }
+
+    return (size_t) strtoul(argv[index], 0, 10);
+}
+
+static int writeCaptureToFile(void* self, const uint8_t* octets, size_t octetCount)
+{
+    FILE* file = (FILE*) self;
+
+    return fwrite(octets, 1, octetCount, file) == octetCount ? 0 : -1;
+}
+
+static int writeTraceDump(const NimbleServerTrace* trace, const char* path)
+{
+    static uint8_t dump[NIMBLE_SERVER_TRACE_MAX_DUMP_OCTET_COUNT];
+    int octetCount = nimbleServerTraceDump(trace, dump, sizeof(dump));
+    if (octetCount < 0) {
+        return octetCount;
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (file == 0) {
+        return -1;
+    }
+    size_t writtenCount = fwrite(dump, 1, (size_t) octetCount, file);
+    fclose(file);
+
+    return writtenCount == (size_t) octetCount ? octetCount : -1;
+}
+
+/// Runs synthetic clients against a server in the same process, without any network.
+/// usage: nimble_server_bench [clientCount] [tickCount] [lossPercent] [maxJitterTicks] [downloadIntervalTicks]
+///                            [capture file] [trace dump file]
+int main(int argc, char* argv[])
+{
+    g_clog.log = clog_console;
+    g_clog.level = CLOG_TYPE_INFO;
+
+    size_t clientCount = argumentOrDefault(argc, argv, 1, 16);
+    size_t tickCount = argumentOrDefault(argc, argv, 2, 10000);
+    size_t lossPercent = argumentOrDefault(argc, argv, 3, 0);
+    size_t maxJitterTicks = argumentOrDefault(argc, argv, 4, 0);
+    size_t downloadIntervalTicks = argumentOrDefault(argc, argv, 5, 0);
+
+    if (clientCount == 0 || clientCount > NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
+        CLOG_ERROR("client count must be between 1 and %d", NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS)
+        return -1;
+    }
+
+    CLOG_OUTPUT("bench: clients:%zu ticks:%zu loss:%zu%% jitter:%zu ticks download interval:%zu ticks", clientCount,
+                tickCount, lossPercent, maxJitterTicks, downloadIntervalTicks)
+
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerBenchCountingAllocator memory;
+    nimbleServerBenchCountingAllocatorInit(&memory, &imprintSetup.tagAllocator.info);
+    NimbleServerBenchCountingAllocator blobMemory;
+    nimbleServerBenchCountingAllocatorInitWithFree(&blobMemory, &imprintSetup.slabAllocator.info);
+
+    static NimbleServerBenchLoopback loopback;
+    nimbleServerBenchLoopbackInit(&loopback);
+
+    static NimbleServerBenchGame game;
+    static NimbleServer server;
+    game.server = &server;
+
+    NimbleServerCallbackObjectVtbl vtbl = {.authoritativeStateSerializeFn = authoritativeStateSerialize,
+                                           .updateQualityChangedFn = 0};
+
+    const size_t targetTickTimeMs = 16;
+    MonotonicTimeMs now = 0;
+
+    NimbleServerSetup setup = {.applicationVersion.major = 0,
+                               .applicationVersion.minor = 0,
+                               .applicationVersion.patch = 0,
+                               .memory = &memory.info.allocator,
+                               .blobAllocator = &blobMemory.info,
+                               .maxConnectionCount = clientCount,
+                               .maxParticipantCount = clientCount,
+                               .maxSingleParticipantStepOctetCount = 20,
+                               .maxParticipantCountForEachConnection = 1,
+                               .maxWaitingForReconnectTicks = 62,
+                               .maxGameStateOctetCount = NIMBLE_SERVER_BENCH_GAME_STATE_OCTET_COUNT,
+                               .callbackObject.vtbl = &vtbl,
+                               .callbackObject.self = &game,
+                               .multiTransport = nimbleServerBenchLoopbackMulti(&loopback),
+                               .now = now,
+                               .targetTickTimeMs = targetTickTimeMs,
+                               .log.config = &g_clog,
+                               .log.constantPrefix = "bench"};
+
+    int initErr = nimbleServerInit(&server, setup);
+    if (initErr < 0) {
+        return initErr;
+    }
+
+    int reInitErr = nimbleServerReInitWithGame(&server, 0, now);
+    if (reInitErr < 0) {
+        return reInitErr;
+    }
+
+    FILE* captureFile = 0;
+    if (argc > 6) {
+        captureFile = fopen(argv[6], "wb");
+        if (captureFile == 0) {
+            CLOG_ERROR("could not open capture file '%s'", argv[6])
+            return -1;
+        }
+        NimbleServerCaptureOut captureOut = {.self = captureFile, .write = writeCaptureToFile};
+        int captureErr = nimbleServerCaptureStart(&server.capture, captureOut);
+        if (captureErr < 0) {
+            return captureErr;
+        }
+    }
+
+    CLOG_OUTPUT("init: allocations:%zu octets:%zu", memory.allocationCount + blobMemory.allocationCount,
+                memory.allocatedOctetCount + blobMemory.allocatedOctetCount)
+
+    static NimbleServerBenchClient clients[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+    NimbleServerBenchClientSetup clientSetup = {.stepOctetCount = 4,
+                                                .redundantStepCount = 4,
+                                                .lossPercent = lossPercent,
+                                                .maxJitterTicks = maxJitterTicks,
+                                                .downloadIntervalTicks = downloadIntervalTicks,
+                                                .memory = &imprintSetup.tagAllocator.info,
+                                                .blobAllocator = &imprintSetup.slabAllocator.info};
+    for (size_t i = 0; i < clientCount; ++i) {
+        Clog clientLog = {.config = &g_clog, .constantPrefix = "client"};
+        nimbleServerBenchClientInit(&clients[i], (int) i, &clientSetup, (uint32_t) (i + 1) * 7919U, clientLog);
+    }
+
+    NimbleServerBenchClients benchClients = {.clients = clients, .clientCount = clientCount, .server = &server};
+    nimbleServerBenchLoopbackSetReceiver(&loopback, receiveFromServer, &benchClients);
+
+    NimbleServerProfilerHistogram tickHistogram;
+    nimbleServerProfilerHistogramReset(&tickHistogram);
+
+    StepId measureStartStepId = 0;
+
+    for (size_t tick = 0; tick < NIMBLE_SERVER_BENCH_WARMUP_TICK_COUNT + tickCount; ++tick) {
+        if (tick == NIMBLE_SERVER_BENCH_WARMUP_TICK_COUNT) {
+            nimbleServerProfilerReset(&server.profiler);
+            nimbleServerBenchCountingAllocatorReset(&memory);
+            nimbleServerBenchCountingAllocatorReset(&blobMemory);
+            nimbleServerBenchLoopbackResetCounters(&loopback);
+            measureStartStepId = server.game.authoritativeSteps.expectedWriteId;
+        }
+
+        nimbleServerBenchLoopbackSetTick(&loopback, tick);
+
+        for (size_t i = 0; i < clientCount; ++i) {
+            int clientErr = nimbleServerBenchClientTick(&clients[i], &server, &loopback, tick);
+            if (clientErr < 0) {
+                CLOG_ERROR("client %zu could not send %d", i, clientErr)
+                return clientErr;
+            }
+        }
+
+        NimbleServerProfilerTime startedAt = nimbleServerProfilerNowNs();
+        int updateErr = nimbleServerUpdate(&server, now);
+        NimbleServerProfilerTime elapsedNs = nimbleServerProfilerNowNs() - startedAt;
+        if (updateErr < 0) {
+            CLOG_ERROR("server update failed %d at tick %zu", updateErr, tick)
+            return updateErr;
+        }
+
+        if (tick >= NIMBLE_SERVER_BENCH_WARMUP_TICK_COUNT) {
+            nimbleServerProfilerHistogramAdd(&tickHistogram, elapsedNs);
+        }
+
+        now += (MonotonicTimeMs) targetTickTimeMs;
+    }
+
+    size_t composedStepCount = (size_t) (server.game.authoritativeSteps.expectedWriteId - measureStartStepId);
+    size_t lostDatagramCount = 0;
+    size_t receivedBlobChunkCount = 0;
+    for (size_t i = 0; i < clientCount; ++i) {
+        lostDatagramCount += clients[i].lostDatagramCount;
+        receivedBlobChunkCount += clients[i].receivedBlobChunkCount;
+    }
+
+    uint64_t tickAverageNs = tickHistogram.count > 0 ? tickHistogram.totalNs / tickHistogram.count : 0;
+
+    CLOG_OUTPUT("authoritative steps: %zu (%.0f steps/s of server cpu time, %.1f per tick)", composedStepCount,
+                nimbleServerBenchPerSecond(composedStepCount, tickHistogram.totalNs),
+                tickCount > 0 ? (double) composedStepCount / (double) tickCount : 0.0)
+    CLOG_OUTPUT("tick cpu time: avg:%" PRIu64 "ns p50:%" PRIu64 "ns p99:%" PRIu64 "ns max:%" PRIu64 "ns",
+                tickAverageNs, nimbleServerProfilerHistogramPercentile(&tickHistogram, 50),
+                nimbleServerProfilerHistogramPercentile(&tickHistogram, 99), tickHistogram.maxNs)
+    CLOG_OUTPUT("datagrams in: %zu (%.0f/s, %zu octets, %zu lost, %zu overflowed) out: %zu (%.0f/s, %zu octets)",
+                loopback.clientDatagramCount,
+                nimbleServerBenchPerSecond(loopback.clientDatagramCount, tickHistogram.totalNs),
+                loopback.clientOctetCount, lostDatagramCount, loopback.clientOverflowCount,
+                loopback.serverDatagramCount,
+                nimbleServerBenchPerSecond(loopback.serverDatagramCount, tickHistogram.totalNs),
+                loopback.serverOctetCount)
+    CLOG_OUTPUT("game state chunks received and acknowledged by the clients: %zu", receivedBlobChunkCount)
+    CLOG_OUTPUT("allocations while running: %zu (%zu octets), blob frees: %zu",
+                memory.allocationCount + blobMemory.allocationCount,
+                memory.allocatedOctetCount + blobMemory.allocatedOctetCount, blobMemory.freeCount)
+    nimbleServerBenchOutputProfilerPhases(&server.profiler);
+    nimbleServerBenchOutputStepLatency(&server.game.participants);
+
+    if (captureFile != 0) {
+        nimbleServerCaptureStop(&server.capture);
+        fclose(captureFile);
+        CLOG_OUTPUT("captured %zu records (%zu octets) to '%s'", server.capture.recordCount, server.capture.octetCount,
+                    argv[6])
+    }
+
+    if (argc > 7) {
+        int dumpResult = writeTraceDump(&server.trace, argv[7]);
+        if (dumpResult < 0) {
+            CLOG_ERROR("could not write trace dump to '%s'", argv[7])
+            return dumpResult;
+        }
+        CLOG_OUTPUT("wrote the last %zu trace events (%d octets) to '%s'",
+                    (size_t) (dumpResult - NIMBLE_SERVER_TRACE_HEADER_OCTET_COUNT) /
+                        NIMBLE_SERVER_TRACE_EVENT_OCTET_COUNT,
+                    dumpResult, argv[7])
+    }
+
+    return 0;
+}
@@ -0,0 +1,315 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if defined _WIN32
+#include <windows.h>
+#else
+#define _POSIX_C_SOURCE 199309L
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "report.h"
+#include <clog/clog.h>
+#include <clog/console.h>
+#include <imprint/default_setup.h>
+#include <inttypes.h>
+#include <nimble-server/capture.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/profiler.h>
+#include <nimble-server/server.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <tiny-libc/tiny_libc.h>
+
+clog_config g_clog;
+
+char g_clog_temp_str[CLOG_TEMP_STR_SIZE];
+
+#define NIMBLE_SERVER_REPLAY_GAME_STATE_OCTET_COUNT (16 * 1024)
+
+typedef struct NimbleServerReplay {
+    NimbleServerCaptureReader reader;
+    size_t replayedInCount;
+    size_t recordedOutCount;
+    size_t replayedOutCount;
+    size_t updateCount;
+    uint8_t gameState[NIMBLE_SERVER_REPLAY_GAME_STATE_OCTET_COUNT];
+    const NimbleServer* server;
+} NimbleServerReplay;
+
+/// Hands out the captured incoming datagrams until the next update record
+static ssize_t receiveFrom(void* _self, int* connectionIndex, uint8_t* data, size_t maxOctetCount)
+{
+    NimbleServerReplay* self = (NimbleServerReplay*) _self;
+
+    while (true) {
+        NimbleServerCaptureReader readerBefore = self->reader;
+        NimbleServerCaptureRecord record;
+        int result = nimbleServerCaptureReaderRead(&self->reader, &record);
+        if (result <= 0) {
+            return result;
+        }
+
+        switch (record.type) {
+            case NimbleServerCaptureRecordTypeOut:
+                self->recordedOutCount++;
+                break;
+            case NimbleServerCaptureRecordTypeIn:
+                if (record.octetCount > maxOctetCount) {
+                    return NimbleServerErrCapture;
+                }
+                *connectionIndex = record.connectionIndex;
+                tc_memcpy_octets(data, record.octets, record.octetCount);
+                self->replayedInCount++;
+                return (ssize_t) record.octetCount;
+            case NimbleServerCaptureRecordTypeUpdate:
+                self->reader = readerBefore;
+                return 0;
+        }
+    }
+}
+
+static int sendTo(void* _self, int connectionIndex, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerReplay* self = (NimbleServerReplay*) _self;
+
+    (void) connectionIndex;
+    (void) data;
+    (void) octetCount;
+
+    self->replayedOutCount++;
+
+    return 0;
+}
+
+static int sendToDirectFeed(void* _self, const uint8_t* data, size_t octetCount)
+{
+    return sendTo(_self, 0, data, octetCount);
+}
+
+static void authoritativeStateSerialize(void* _self, NimbleServerSerializedGameState* state)
+{
+    NimbleServerReplay* self = (NimbleServerReplay*) _self;
+
+    state->gameState = self->gameState;
+    state->gameStateOctetCount = sizeof(self->gameState);
+    state->stepId = self->server->game.authoritativeSteps.expectedWriteId - 1;
+    state->hash = 0;
+}
+
+static void sleepUntil(MonotonicTimeMs targetTimeMs)
+{
+    while (true) {
+        MonotonicTimeMs now = monotonicTimeMsNow();
+        if (now >= targetTimeMs) {
+            return;
+        }
+#if defined _WIN32
+        Sleep((DWORD) (targetTimeMs - now));
+#else
+        struct timespec duration;
+        duration.tv_sec = (time_t) ((targetTimeMs - now) / 1000);
+        duration.tv_nsec = (long) ((targetTimeMs - now) % 1000) * 1000000L;
+        nanosleep(&duration, 0);
+#endif
+    }
+}
+
+/// Maps (or reads on Windows) the whole capture log into memory
+static const uint8_t* loadCapture(const char* path, size_t* outOctetCount)
+{
+#if defined _WIN32
+    FILE* file = fopen(path, "rb");
+    if (file == 0) {
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size <= 0) {
+        fclose(file);
+        return 0;
+    }
+    uint8_t* octets = (uint8_t*) malloc((size_t) size);
+    size_t readCount = fread(octets, 1, (size_t) size, file);
+    fclose(file);
+    *outOctetCount = readCount;
+    return octets;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) < 0 || fileStat.st_size <= 0) {
+        close(fd);
+        return 0;
+    }
+    void* mapped = mmap(0, (size_t) fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return 0;
+    }
+    *outOctetCount = (size_t) fileStat.st_size;
+    return (const uint8_t*) mapped;
+#endif
+}
+
+static size_t argumentOrDefault(int argc, char* argv[], int index, size_t defaultValue)
+{
+    if (index >= argc) {
+        return defaultValue;
+    }
+
+    return (size_t) strtoul(argv[index], 0, 10);
+}
+
+/// Feeds a capture log into a fresh server, with the same clock values as when it was captured.
+/// The server setup must match the one that was captured from, and capturing should have been started
+/// right after the server was initialized. Exits with 1 if the server sent a different number of datagrams
+/// than when it was captured.
+/// usage: nimble_server_replay <capture file> [realTime] [maxConnectionCount] [maxParticipantCount]
+int main(int argc, char* argv[])
+{
+    g_clog.log = clog_console;
+    g_clog.level = CLOG_TYPE_INFO;
+
+    if (argc < 2) {
+        CLOG_OUTPUT("usage: nimble_server_replay <capture file> [realTime] [maxConnectionCount] [maxParticipantCount]")
+        return -1;
+    }
+
+    bool useRealTime = argumentOrDefault(argc, argv, 2, 0) != 0;
+    size_t maxConnectionCount = argumentOrDefault(argc, argv, 3, NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS);
+    size_t maxParticipantCount = argumentOrDefault(argc, argv, 4, maxConnectionCount);
+
+    size_t captureOctetCount = 0;
+    const uint8_t* captureOctets = loadCapture(argv[1], &captureOctetCount);
+    if (captureOctets == 0) {
+        CLOG_ERROR("could not load capture file '%s'", argv[1])
+        return -1;
+    }
+
+    static NimbleServerReplay replay;
+    static NimbleServer server;
+    replay.server = &server;
+
+    int readerErr = nimbleServerCaptureReaderInit(&replay.reader, captureOctets, captureOctetCount);
+    if (readerErr < 0) {
+        CLOG_ERROR("'%s' is not a supported capture file", argv[1])
+        return readerErr;
+    }
+
+    NimbleServerCaptureReader firstRecordReader = replay.reader;
+    NimbleServerCaptureRecord firstRecord;
+    if (nimbleServerCaptureReaderRead(&firstRecordReader, &firstRecord) <= 0) {
+        CLOG_ERROR("capture file is empty")
+        return -1;
+    }
+
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerCallbackObjectVtbl vtbl = {.authoritativeStateSerializeFn = authoritativeStateSerialize,
+                                           .updateQualityChangedFn = 0};
+
+    DatagramTransportMulti multiTransport = {.self = &replay, .receiveFrom = receiveFrom, .sendTo = sendTo};
+
+    NimbleServerSetup setup = {.applicationVersion.major = 0,
+                               .applicationVersion.minor = 0,
+                               .applicationVersion.patch = 0,
+                               .memory = &imprintSetup.tagAllocator.info,
+                               .blobAllocator = &imprintSetup.slabAllocator.info,
+                               .maxConnectionCount = maxConnectionCount,
+                               .maxParticipantCount = maxParticipantCount,
+                               .maxSingleParticipantStepOctetCount = 20,
+                               .maxParticipantCountForEachConnection = 1,
+                               .maxWaitingForReconnectTicks = 62,
+                               .maxGameStateOctetCount = NIMBLE_SERVER_REPLAY_GAME_STATE_OCTET_COUNT,
+                               .callbackObject.vtbl = &vtbl,
+                               .callbackObject.self = &replay,
+                               .multiTransport = multiTransport,
+                               .now = firstRecord.timeMs,
+                               .targetTickTimeMs = 16,
+                               .log.config = &g_clog,
+                               .log.constantPrefix = "replay"};
+
+    int initErr = nimbleServerInit(&server, setup);
+    if (initErr < 0) {
+        return initErr;
+    }
+
+    int reInitErr = nimbleServerReInitWithGame(&server, 0, firstRecord.timeMs);
+    if (reInitErr < 0) {
+        return reInitErr;
+    }
+
+    DatagramTransportOut directFeedTransportOut = {.self = &replay, .send = sendToDirectFeed};
+    NimbleServerResponse directFeedResponse = {.transportOut = &directFeedTransportOut};
+
+    NimbleServerProfilerHistogram updateHistogram;
+    nimbleServerProfilerHistogramReset(&updateHistogram);
+    uint64_t totalNs = 0;
+
+    MonotonicTimeMs replayStartedAtMs = monotonicTimeMsNow();
+
+    while (true) {
+        NimbleServerCaptureRecord record;
+        int readResult = nimbleServerCaptureReaderRead(&replay.reader, &record);
+        if (readResult < 0) {
+            CLOG_ERROR("capture file is corrupt at octet %zu", replay.reader.pos)
+            return readResult;
+        }
+        if (readResult == 0) {
+            break;
+        }
+
+        switch (record.type) {
+            case NimbleServerCaptureRecordTypeUpdate: {
+                if (useRealTime) {
+                    sleepUntil(replayStartedAtMs + (record.timeMs - firstRecord.timeMs));
+                }
+                NimbleServerProfilerTime startedAt = nimbleServerProfilerNowNs();
+                int updateErr = nimbleServerUpdate(&server, record.timeMs);
+                NimbleServerProfilerTime elapsedNs = nimbleServerProfilerNowNs() - startedAt;
+                if (updateErr < 0) {
+                    CLOG_WARN("update %zu failed %d", replay.updateCount, updateErr)
+                }
+                nimbleServerProfilerHistogramAdd(&updateHistogram, elapsedNs);
+                totalNs += elapsedNs;
+                replay.updateCount++;
+                break;
+            }
+            case NimbleServerCaptureRecordTypeIn: {
+                // Fed directly, outside of an update
+                NimbleServerProfilerTime startedAt = nimbleServerProfilerNowNs();
+                nimbleServerFeed(&server, record.connectionIndex, record.octets, record.octetCount,
+                                 &directFeedResponse);
+                totalNs += nimbleServerProfilerNowNs() - startedAt;
+                replay.replayedInCount++;
+                break;
+            }
+            case NimbleServerCaptureRecordTypeOut:
+                replay.recordedOutCount++;
+                break;
+        }
+    }
+
+    uint64_t updateAverageNs = updateHistogram.count > 0 ? updateHistogram.totalNs / updateHistogram.count : 0;
+
+    CLOG_OUTPUT("replayed %zu updates and %zu datagrams in %" PRIu64 "ns (%.0f datagrams/s)", replay.updateCount,
+                replay.replayedInCount, totalNs, nimbleServerBenchPerSecond(replay.replayedInCount, totalNs))
+    CLOG_OUTPUT("update time: avg:%" PRIu64 "ns p50:%" PRIu64 "ns p99:%" PRIu64 "ns max:%" PRIu64 "ns",
+                updateAverageNs, nimbleServerProfilerHistogramPercentile(&updateHistogram, 50),
+                nimbleServerProfilerHistogramPercentile(&updateHistogram, 99), updateHistogram.maxNs)
+    CLOG_OUTPUT("datagrams sent: %zu (%zu when captured)", replay.replayedOutCount, replay.recordedOutCount)
+    nimbleServerBenchOutputProfilerPhases(&server.profiler);
+
+    return replay.replayedOutCount == replay.recordedOutCount ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "report.h"
+#include <clog/clog.h>
+#include <inttypes.h>
+#include <nimble-server/participant.h>
+#include <nimble-server/participants.h>
+#include <nimble-server/profiler.h>
+
+double nimbleServerBenchPerSecond(size_t count, uint64_t ns)
+{
+    if (ns == 0) {
+        return 0.0;
+    }
+
+    return (double) count * 1000000000.0 / (double) ns;
+}
+
+/// Outputs the summary of all phases that have been measured at least once
+/// @param profiler profiler to output
+void nimbleServerBenchOutputProfilerPhases(const NimbleServerProfiler* profiler)
+{
+    CLOG_OUTPUT("phases:")
+    for (size_t i = 0; i < NimbleServerProfilerPhaseCount; ++i) {
+        NimbleServerProfilerSummary summary;
+        nimbleServerProfilerSummarize(profiler, (NimbleServerProfilerPhase) i, &summary);
+        if (summary.count == 0) {
+            continue;
+        }
+        CLOG_OUTPUT("  %-24s count:%" PRIu64 " avg:%" PRIu64 "ns p50:%" PRIu64 "ns p99:%" PRIu64 "ns max:%" PRIu64 "ns",
+                    nimbleServerProfilerPhaseToString((NimbleServerProfilerPhase) i), summary.count,
+                    summary.averageNs, summary.p50Ns, summary.p99Ns, summary.maxNs)
+    }
+}
+
+/// Outputs the step arrival to commit latency summed over all participants, and the participant with the shortest
+/// median wait, which is the one that composition is waiting for.
+/// @param participants participants to output
+void nimbleServerBenchOutputStepLatency(const NimbleServerParticipants* participants)
+{
+    uint64_t committedCount = 0;
+    uint64_t missedCount = 0;
+    const NimbleServerParticipant* driver = 0;
+    NimbleServerStepLatencySummary driverSummary;
+
+    for (size_t i = 0; i < participants->participantCapacity; ++i) {
+        const NimbleServerParticipant* participant = &participants->participants[i];
+        if (!participant->isUsed) {
+            continue;
+        }
+        NimbleServerStepLatencySummary summary;
+        nimbleServerStepLatencySummarize(&participant->cold->stepLatency, &summary);
+        committedCount += summary.committedCount;
+        missedCount += summary.missedCount;
+        if (summary.committedCount > 0 && (driver == 0 || summary.waitTimeP50Ms < driverSummary.waitTimeP50Ms)) {
+            driver = participant;
+            driverSummary = summary;
+        }
+    }
+
+    CLOG_OUTPUT("step wait: committed:%" PRIu64 " missed:%" PRIu64, committedCount, missedCount)
+    if (driver != 0) {
+        CLOG_OUTPUT("  shortest wait: participant:%u p50:%" PRIu64 "ms p99:%" PRIu64 "ms steps avg:%" PRIu32
+                    " min:%" PRIu32 " missed:%" PRIu64,
+                    driver->id, driverSummary.waitTimeP50Ms, driverSummary.waitTimeP99Ms,
+                    driverSummary.averageWaitStepCount, driverSummary.minWaitStepCount, driverSummary.missedCount)
+    }
+}
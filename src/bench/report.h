@@ -0,0 +1,19 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_BENCH_REPORT_H
+#define NIMBLE_SERVER_BENCH_REPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct NimbleServerProfiler;
+struct NimbleServerParticipants;
+
+double nimbleServerBenchPerSecond(size_t count, uint64_t ns);
+void nimbleServerBenchOutputProfilerPhases(const struct NimbleServerProfiler* profiler);
+void nimbleServerBenchOutputStepLatency(const struct NimbleServerParticipants* participants);
+
+#endif
@@ -0,0 +1,444 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "synthetic_client.h"
+#include "loopback.h"
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
+#include <nimble-serialize/client_in.h>
+#include <nimble-serialize/client_out.h>
+#include <nimble-serialize/commands.h>
+#include <nimble-serialize/serialize.h>
+#include <nimble-server/server.h>
+#include <nimble-server/varint.h>
+#include <nimble-steps-serialize/pending_out_serialize.h>
+
+static uint32_t nextRandom(NimbleServerBenchClient* self)
+{
+    // xorshift32, so that runs with the same seed are comparable
+    uint32_t x = self->randomState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    self->randomState = x;
+
+    return x;
+}
+
+static int sendDatagram(NimbleServerBenchClient* self, NimbleServerBenchLoopback* loopback, size_t tick,
+                        const FldOutStream* outStream)
+{
+    self->sentDatagramCount++;
+    orderedDatagramOutLogicCommit(&self->orderedDatagramOut);
+
+    if (self->setup.lossPercent > 0 && (nextRandom(self) % 100U) < self->setup.lossPercent) {
+        self->lostDatagramCount++;
+        return 0;
+    }
+
+    size_t jitterTicks = 0;
+    if (self->setup.maxJitterTicks > 0) {
+        jitterTicks = nextRandom(self) % (self->setup.maxJitterTicks + 1);
+    }
+
+    return nimbleServerBenchLoopbackClientSend(loopback, self->connectionIndex, outStream->octets, outStream->pos,
+                                               tick + jitterTicks);
+}
+
+static int sendConnect(NimbleServerBenchClient* self, const NimbleServer* server, NimbleServerBenchLoopback* loopback,
+                       size_t tick)
+{
+    uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+
+    orderedDatagramOutLogicPrepare(&self->orderedDatagramOut, &outStream);
+
+    // Zero is the request id of connections that were never connected. A resend keeps the request id, since the
+    // server refuses a connect with another request id once the first one has arrived.
+    if (self->connectRequestId == 0) {
+        self->connectRequestId = 1;
+    }
+
+    NimbleSerializeConnectRequest connectRequest;
+    connectRequest.applicationVersion = server->applicationVersion;
+    connectRequest.nimbleVersion.major = 0;
+    connectRequest.nimbleVersion.minor = 0;
+    connectRequest.nimbleVersion.patch = 0;
+    connectRequest.clientRequestId = self->connectRequestId;
+    connectRequest.useDebugStreams = false;
+
+    int err = nimbleSerializeClientOutConnectRequest(&outStream, &connectRequest, &self->log);
+    if (err < 0) {
+        return err;
+    }
+
+    self->connectSentAtTick = tick;
+
+    return sendDatagram(self, loopback, tick, &outStream);
+}
+
+static int sendJoin(NimbleServerBenchClient* self, const NimbleServer* server, NimbleServerBenchLoopback* loopback,
+                    size_t tick)
+{
+    uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+
+    orderedDatagramOutLogicPrepare(&self->orderedDatagramOut, &outStream);
+
+    NimbleSerializeJoinGameRequest joinRequest;
+    joinRequest.joinGameType = NimbleSerializeJoinGameTypeNoSecret;
+    joinRequest.playerCount = 1;
+    joinRequest.players[0].localIndex = 0;
+    if (self->joinRequestId == 0) {
+        // The participant steps start at the authoritative step when the join arrives, which is not earlier than this
+        self->joinStepId = server->game.authoritativeSteps.expectedWriteId;
+    }
+    joinRequest.requestId = ++self->joinRequestId;
+
+    int err = nimbleSerializeClientOutJoinGameRequest(&outStream, &joinRequest, &self->log);
+    if (err < 0) {
+        return err;
+    }
+
+    self->joinSentAtTick = tick;
+
+    return sendDatagram(self, loopback, tick, &outStream);
+}
+
+static int sendDownloadRequest(NimbleServerBenchClient* self, NimbleServerBenchLoopback* loopback, size_t tick)
+{
+    uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+
+    orderedDatagramOutLogicPrepare(&self->orderedDatagramOut, &outStream);
+
+    // Zero is not a valid download request id
+    self->downloadRequestId++;
+    if (self->downloadRequestId == 0) {
+        self->downloadRequestId = 1;
+    }
+
+    nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdDownloadGameStateRequest, &self->log);
+    fldOutStreamWriteUInt8(&outStream, self->downloadRequestId);
+
+    self->downloadSentAtTick = tick;
+
+    return sendDatagram(self, loopback, tick, &outStream);
+}
+
+static int sendBlobStreamAck(NimbleServerBenchClient* self, NimbleServerBenchLoopback* loopback, size_t tick)
+{
+    uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+
+    orderedDatagramOutLogicPrepare(&self->orderedDatagramOut, &outStream);
+
+    nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdClientOutBlobStream, &self->log);
+    int err = blobStreamLogicInAckSend(&self->blobStreamLogicIn, &outStream);
+    if (err < 0) {
+        return err;
+    }
+
+    self->mustSendBlobStreamAck = false;
+
+    return sendDatagram(self, loopback, tick, &outStream);
+}
+
+/// Writes the newest predicted steps, including some already sent ones to cover for lost datagrams.
+/// The layout is the one read by nimbleServerLocalPartyDeserializePredictedSteps(), or by
+/// nimbleServerLocalPartyDeserializeCompactPredictedSteps() if the connection uses the compact step encoding.
+static int sendPredictedSteps(NimbleServerBenchClient* self, const NimbleServer* server,
+                              NimbleServerBenchLoopback* loopback, size_t tick)
+{
+    uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+
+    orderedDatagramOutLogicPrepare(&self->orderedDatagramOut, &outStream);
+
+    nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdGameStep, &self->log);
+
+    // Pretend that all the authoritative steps composed so far have been received
+    nbsPendingStepsSerializeOutHeader(&outStream, server->game.authoritativeSteps.expectedWriteId);
+
+    self->predictedStepCount++;
+    size_t stepsThatFollow = self->predictedStepCount;
+    if (stepsThatFollow > self->setup.redundantStepCount + 1) {
+        stepsThatFollow = self->setup.redundantStepCount + 1;
+    }
+
+    StepId firstStepId = self->nextPredictedStepId - (StepId) (stepsThatFollow - 1);
+
+    bool isCompact = server->transportConnections[self->connectionIndex].stepEncoding ==
+                     NimbleServerStepEncodingCompact;
+    if (isCompact) {
+        nimbleServerVarIntWriteSigned(&outStream,
+                                      (int32_t) (firstStepId - server->game.authoritativeSteps.expectedWriteId));
+        fldOutStreamWriteUInt8(&outStream, 1); // participant count
+        fldOutStreamWriteUInt8(&outStream, self->participantId);
+        nimbleServerVarIntWrite(&outStream, 0); // delta from the lowest step id
+        nimbleServerVarIntWrite(&outStream, (uint32_t) stepsThatFollow);
+    } else {
+        fldOutStreamWriteUInt32(&outStream, firstStepId);
+        fldOutStreamWriteUInt8(&outStream, 1); // participant count
+        fldOutStreamWriteUInt8(&outStream, self->participantId);
+        fldOutStreamWriteUInt8(&outStream, 0); // delta from the lowest step id
+        fldOutStreamWriteUInt8(&outStream, (uint8_t) stepsThatFollow);
+    }
+
+    uint8_t stepPayload[256];
+    for (size_t i = 0; i < stepsThatFollow; ++i) {
+        StepId stepId = firstStepId + (StepId) i;
+        for (size_t j = 0; j < self->setup.stepOctetCount; ++j) {
+            stepPayload[j] = (uint8_t) (stepId + j);
+        }
+        if (isCompact) {
+            nimbleServerVarIntWrite(&outStream, (uint32_t) self->setup.stepOctetCount);
+        } else {
+            fldOutStreamWriteUInt8(&outStream, (uint8_t) self->setup.stepOctetCount);
+        }
+        fldOutStreamWriteOctets(&outStream, stepPayload, self->setup.stepOctetCount);
+    }
+
+    self->nextPredictedStepId++;
+
+    return sendDatagram(self, loopback, tick, &outStream);
+}
+
+/// Initializes a synthetic client
+/// @param self client
+/// @param connectionIndex the connection index the server sees the client as
+/// @param setup how the client should behave
+/// @param seed random seed for loss and jitter
+/// @param log log to use
+void nimbleServerBenchClientInit(NimbleServerBenchClient* self, int connectionIndex,
+                                 const NimbleServerBenchClientSetup* setup, uint32_t seed, Clog log)
+{
+    self->connectionIndex = connectionIndex;
+    self->phase = NimbleServerBenchClientPhaseConnecting;
+    self->setup = *setup;
+    if (self->setup.stepOctetCount > 255) {
+        self->setup.stepOctetCount = 255;
+    }
+    if (self->setup.redundantStepCount > 254) {
+        self->setup.redundantStepCount = 254;
+    }
+    orderedDatagramOutLogicInit(&self->orderedDatagramOut);
+    orderedDatagramInLogicInit(&self->orderedDatagramIn);
+    self->connectRequestId = 0;
+    self->connectSentAtTick = 0;
+    self->isConnected = false;
+    self->participantId = 0;
+    self->hasJoined = false;
+    self->joinStepId = 0;
+    self->nextPredictedStepId = 0;
+    self->predictedStepCount = 0;
+    self->joinRequestId = 0;
+    self->joinSentAtTick = 0;
+    self->downloadRequestId = 0;
+    self->downloadSentAtTick = 0;
+    self->hasBlobStreamIn = false;
+    self->blobStreamTransferId = 0;
+    self->mustSendBlobStreamAck = false;
+    self->randomState = seed != 0 ? seed : 0x9e3779b9;
+    self->sentDatagramCount = 0;
+    self->lostDatagramCount = 0;
+    self->receivedBlobChunkCount = 0;
+    self->log = log;
+}
+
+static int receiveConnectResponse(NimbleServerBenchClient* self, FldInStream* inStream)
+{
+    NimbleSerializeConnectResponse connectResponse;
+    int err = nimbleSerializeClientInConnectResponse(inStream, &connectResponse);
+    if (err < 0) {
+        return err;
+    }
+
+    if (self->connectRequestId != 0 && connectResponse.responseToRequestId == self->connectRequestId) {
+        self->isConnected = true;
+    }
+
+    return 0;
+}
+
+static int receiveJoinGameResponse(NimbleServerBenchClient* self, FldInStream* inStream)
+{
+    NimbleSerializeJoinGameResponse joinResponse;
+    int err = nimbleSerializeClientInJoinGameResponse(inStream, &joinResponse);
+    if (err < 0) {
+        return err;
+    }
+
+    // A response to any of the sent join requests is accepted, since the server only creates one party for them
+    if (self->joinRequestId == 0 || self->hasJoined || joinResponse.participantCount == 0) {
+        return 0;
+    }
+
+    self->participantId = joinResponse.participants[0].participantId;
+    self->hasJoined = true;
+
+    return 0;
+}
+
+static int receiveGameStateResponse(NimbleServerBenchClient* self, FldInStream* inStream)
+{
+    NimbleSerializeGameResponse gameStateResponse;
+    int err = nimbleSerializeClientInGameStateResponse(inStream, &gameStateResponse);
+    if (err < 0) {
+        return err;
+    }
+
+    // The game state response is resent with the same transfer id until the download is done
+    BlobStreamTransferId transferId = (BlobStreamTransferId) gameStateResponse.blobStreamChannel;
+    if (self->hasBlobStreamIn && transferId == self->blobStreamTransferId) {
+        return 0;
+    }
+
+    if (self->hasBlobStreamIn) {
+        blobStreamInDestroy(&self->blobStreamIn);
+    }
+    blobStreamInInit(&self->blobStreamIn, self->setup.memory, self->setup.blobAllocator,
+                     gameStateResponse.octetCount, BLOB_STREAM_CHUNK_SIZE, self->log);
+    blobStreamLogicInInit(&self->blobStreamLogicIn, &self->blobStreamIn);
+    self->hasBlobStreamIn = true;
+    self->blobStreamTransferId = transferId;
+
+    return 0;
+}
+
+static int receiveBlobStream(NimbleServerBenchClient* self, FldInStream* inStream)
+{
+    if (!self->hasBlobStreamIn) {
+        return -1;
+    }
+
+    int err = blobStreamLogicInReceive(&self->blobStreamLogicIn, inStream);
+    if (err < 0) {
+        CLOG_C_VERBOSE(&self->log, "could not receive blob stream chunk %d", err)
+        return err;
+    }
+
+    self->receivedBlobChunkCount++;
+    self->mustSendBlobStreamAck = true;
+
+    return 0;
+}
+
+/// Receives a datagram from the server. The connect, join and game state replies and the game state chunks are
+/// parsed the same way as a real client does. The datagram is not read past the other replies, such as the
+/// authoritative steps.
+/// @param self client
+/// @param data datagram from the server
+/// @param octetCount octet count of data
+/// @return negative on error
+int nimbleServerBenchClientReceive(NimbleServerBenchClient* self, const uint8_t* data, size_t octetCount)
+{
+    FldInStream inStream;
+    fldInStreamInit(&inStream, data, octetCount);
+
+    if (orderedDatagramInLogicReceive(&self->orderedDatagramIn, &inStream) < 0) {
+        return 0;
+    }
+
+    while (inStream.pos < inStream.size) {
+        uint8_t cmd;
+        int err = fldInStreamReadUInt8(&inStream, &cmd);
+        if (err < 0) {
+            return err;
+        }
+
+        switch (cmd) {
+            case NimbleSerializeCmdConnectResponse:
+                err = receiveConnectResponse(self, &inStream);
+                break;
+            case NimbleSerializeCmdJoinGameResponse:
+                err = receiveJoinGameResponse(self, &inStream);
+                break;
+            case NimbleSerializeCmdGameStateResponse:
+                err = receiveGameStateResponse(self, &inStream);
+                break;
+            case NimbleSerializeCmdServerOutBlobStream:
+                err = receiveBlobStream(self, &inStream);
+                break;
+            default:
+                return 0;
+        }
+
+        if (err < 0) {
+            // The rest of the datagram can not be read
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/// Sends the datagrams for one tick.
+/// The authoritative step ranges are not parsed, so the latest authoritative step id and the step encoding are read
+/// from the in-process server.
+/// @param self client
+/// @param server server the client is connected to
+/// @param loopback transport to send on
+/// @param tick current tick
+/// @return negative on error
+int nimbleServerBenchClientTick(NimbleServerBenchClient* self, const NimbleServer* server,
+                                NimbleServerBenchLoopback* loopback, size_t tick)
+{
+    if (self->mustSendBlobStreamAck) {
+        int err = sendBlobStreamAck(self, loopback, tick);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    switch (self->phase) {
+        case NimbleServerBenchClientPhaseConnecting: {
+            if (self->isConnected) {
+                self->phase = NimbleServerBenchClientPhaseJoining;
+                return sendJoin(self, server, loopback, tick);
+            }
+
+            bool hasSentConnect = self->connectRequestId != 0;
+            if (hasSentConnect && tick - self->connectSentAtTick <= self->setup.maxJitterTicks + 1) {
+                return 0;
+            }
+
+            return sendConnect(self, server, loopback, tick);
+        }
+        case NimbleServerBenchClientPhaseJoining: {
+            if (self->hasJoined) {
+                // Steps before the participant steps start are skipped by the server, so it is fine to start early
+                self->nextPredictedStepId = self->joinStepId;
+                self->phase = NimbleServerBenchClientPhasePlaying;
+                CLOG_C_DEBUG(&self->log, "joined as participant %hhu", self->participantId)
+                return sendDownloadRequest(self, loopback, tick);
+            }
+
+            // Only resend after a previous join request should have arrived, or the server will create extra parties
+            bool hasSentJoin = self->joinRequestId != 0;
+            if (hasSentJoin && tick - self->joinSentAtTick <= self->setup.maxJitterTicks + 1) {
+                return 0;
+            }
+
+            return sendJoin(self, server, loopback, tick);
+        }
+        case NimbleServerBenchClientPhasePlaying:
+            if (self->setup.downloadIntervalTicks > 0 &&
+                tick - self->downloadSentAtTick >= self->setup.downloadIntervalTicks) {
+                int err = sendDownloadRequest(self, loopback, tick);
+                if (err < 0) {
+                    return err;
+                }
+            }
+            return sendPredictedSteps(self, server, loopback, tick);
+    }
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_BENCH_SYNTHETIC_CLIENT_H
+#define NIMBLE_SERVER_BENCH_SYNTHETIC_CLIENT_H
+
+#include <blob-stream/blob_stream_in.h>
+#include <blob-stream/blob_stream_logic_in.h>
+#include <clog/clog.h>
+#include <nimble-steps/steps.h>
+#include <ordered-datagram/in_logic.h>
+#include <ordered-datagram/out_logic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+struct ImprintAllocatorWithFree;
+struct NimbleServer;
+struct NimbleServerBenchLoopback;
+
+typedef enum NimbleServerBenchClientPhase {
+    NimbleServerBenchClientPhaseConnecting,
+    NimbleServerBenchClientPhaseJoining,
+    NimbleServerBenchClientPhasePlaying,
+} NimbleServerBenchClientPhase;
+
+typedef struct NimbleServerBenchClientSetup {
+    size_t stepOctetCount;
+    size_t redundantStepCount;
+    size_t lossPercent;
+    size_t maxJitterTicks;
+    size_t downloadIntervalTicks; // zero only downloads once, after joining
+    struct ImprintAllocator* memory; // for the received game state downloads
+    struct ImprintAllocatorWithFree* blobAllocator;
+} NimbleServerBenchClientSetup;
+
+typedef struct NimbleServerBenchClient {
+    int connectionIndex;
+    NimbleServerBenchClientPhase phase;
+    NimbleServerBenchClientSetup setup;
+    OrderedDatagramOutLogic orderedDatagramOut;
+    OrderedDatagramInLogic orderedDatagramIn;
+    uint8_t connectRequestId;
+    size_t connectSentAtTick;
+    bool isConnected;
+    uint8_t participantId;
+    bool hasJoined;
+    StepId joinStepId; // authoritative step id when the first join request was sent
+    StepId nextPredictedStepId;
+    size_t predictedStepCount;
+    uint8_t joinRequestId;
+    size_t joinSentAtTick;
+    uint8_t downloadRequestId;
+    size_t downloadSentAtTick;
+    BlobStreamIn blobStreamIn;
+    BlobStreamLogicIn blobStreamLogicIn;
+    bool hasBlobStreamIn;
+    BlobStreamTransferId blobStreamTransferId;
+    bool mustSendBlobStreamAck;
+    uint32_t randomState;
+
+    size_t sentDatagramCount;
+    size_t lostDatagramCount;
+    size_t receivedBlobChunkCount;
+    Clog log;
+} NimbleServerBenchClient;
+
+void nimbleServerBenchClientInit(NimbleServerBenchClient* self, int connectionIndex,
+                                 const NimbleServerBenchClientSetup* setup, uint32_t seed, Clog log);
+int nimbleServerBenchClientReceive(NimbleServerBenchClient* self, const uint8_t* data, size_t octetCount);
+int nimbleServerBenchClientTick(NimbleServerBenchClient* self, const struct NimbleServer* server,
+                                struct NimbleServerBenchLoopback* loopback, size_t tick);
+
+#endif
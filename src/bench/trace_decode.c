@@ -0,0 +1,122 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <clog/clog.h>
+#include <clog/console.h>
+#include <inttypes.h>
+#include <nimble-server/local_party.h>
+#include <nimble-server/trace.h>
+#include <nimble-server/update_quality.h>
+#include <stdio.h>
+
+clog_config g_clog;
+
+char g_clog_temp_str[CLOG_TEMP_STR_SIZE];
+
+static const char* partyStateToString(uint32_t state)
+{
+    switch (state) {
+        case NimbleServerLocalPartyStateNormal:
+            return "normal";
+        case NimbleServerLocalPartyStateWaitingForReJoin:
+            return "waiting for rejoin";
+        case NimbleServerLocalPartyStateDissolved:
+            return "dissolved";
+    }
+
+    return "unknown";
+}
+
+static void outputEvent(const NimbleServerTraceEvent* event, MonotonicTimeMs firstTimeMs)
+{
+    const char* typeName = nimbleServerTraceEventTypeToString((NimbleServerTraceEventType) event->type);
+    int64_t relativeMs = (int64_t) (event->timeMs - firstTimeMs);
+
+    switch ((NimbleServerTraceEventType) event->type) {
+        case NimbleServerTraceEventTypeDatagramIn:
+        case NimbleServerTraceEventTypeDatagramOut:
+            CLOG_OUTPUT("%10" PRId64 " %-16s connection:%u octets:%" PRIu32, relativeMs, typeName, event->target,
+                        event->value)
+            break;
+        case NimbleServerTraceEventTypeStepComposed:
+            CLOG_OUTPUT("%10" PRId64 " %-16s step:%08" PRIX32 " octets:%u", relativeMs, typeName, event->value,
+                        event->detail)
+            break;
+        case NimbleServerTraceEventTypeForcedStep:
+            CLOG_OUTPUT("%10" PRId64 " %-16s step:%08" PRIX32 " participant:%u party:%u", relativeMs, typeName,
+                        event->value, event->target, event->detail)
+            break;
+        case NimbleServerTraceEventTypePartyJoined:
+            CLOG_OUTPUT("%10" PRId64 " %-16s party:%u connection:%u participants:%" PRIu32, relativeMs, typeName,
+                        event->target, event->detail, event->value)
+            break;
+        case NimbleServerTraceEventTypePartyStateChanged:
+            CLOG_OUTPUT("%10" PRId64 " %-16s party:%u %s -> %s", relativeMs, typeName, event->target,
+                        partyStateToString(event->detail), partyStateToString(event->value))
+            break;
+        case NimbleServerTraceEventTypeBlobChunkSent:
+            CLOG_OUTPUT("%10" PRId64 " %-16s connection:%u chunk:%" PRIu32 " octets:%u", relativeMs, typeName,
+                        event->target, event->value, event->detail)
+            break;
+        case NimbleServerTraceEventTypeUpdateQualityChanged:
+            CLOG_OUTPUT("%10" PRId64 " %-16s %s -> %s", relativeMs, typeName,
+                        nimbleServerUpdateQualityStateToString((NimbleServerUpdateQualityState) event->detail),
+                        nimbleServerUpdateQualityStateToString((NimbleServerUpdateQualityState) event->value))
+            break;
+        case NimbleServerTraceEventTypeCount:
+            break;
+    }
+}
+
+/// Outputs a trace dump as a timeline, in milliseconds relative to the oldest event.
+/// usage: nimble_server_trace <trace dump file>
+int main(int argc, char* argv[])
+{
+    g_clog.log = clog_console;
+    g_clog.level = CLOG_TYPE_INFO;
+
+    if (argc < 2) {
+        CLOG_OUTPUT("usage: nimble_server_trace <trace dump file>")
+        return -1;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (file == 0) {
+        CLOG_ERROR("could not open trace dump '%s'", argv[1])
+        return -1;
+    }
+
+    static uint8_t dump[NIMBLE_SERVER_TRACE_MAX_DUMP_OCTET_COUNT];
+    size_t octetCount = fread(dump, 1, sizeof(dump), file);
+    fclose(file);
+
+    NimbleServerTraceReader reader;
+    int readerErr = nimbleServerTraceReaderInit(&reader, dump, octetCount);
+    if (readerErr < 0) {
+        CLOG_ERROR("'%s' is not a supported trace dump", argv[1])
+        return readerErr;
+    }
+
+    CLOG_OUTPUT("%zu events", reader.eventCount)
+
+    MonotonicTimeMs firstTimeMs = 0;
+    for (size_t i = 0;; ++i) {
+        NimbleServerTraceEvent event;
+        int readResult = nimbleServerTraceReaderRead(&reader, &event);
+        if (readResult < 0) {
+            CLOG_ERROR("trace dump is corrupt at event %zu", i)
+            return readResult;
+        }
+        if (readResult == 0) {
+            break;
+        }
+        if (i == 0) {
+            firstTimeMs = event.timeMs;
+        }
+        outputEvent(&event, firstTimeMs);
+    }
+
+    return 0;
+}
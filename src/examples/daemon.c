@@ -12,5 +12,6 @@ int nimbleServerDaemonInit(NimbleServerDaemon* self)
         return err;
     }
 
-    return udpServerInit(&self->socket, 27000, true);
+    // Non-blocking, so the caller can do periodic work, e.g. exporting metrics, when no datagrams arrive
+    return udpServerInit(&self->socket, 27000, false);
 }
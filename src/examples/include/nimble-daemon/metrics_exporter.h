@@ -0,0 +1,31 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_DAEMON_METRICS_EXPORTER_H
+#define NIMBLE_DAEMON_METRICS_EXPORTER_H
+
+#include <nimble-server/metrics.h>
+#include <nimble-server/server.h>
+
+#define NIMBLE_DAEMON_METRICS_MAX_TEXT_OCTET_COUNT (128 * 1024)
+
+/// Writes the server metrics in Prometheus text format to a file and/or serves them on a Unix domain socket.
+/// The file is replaced atomically, so it can be read by a textfile collector at any time.
+/// Every connection to the socket gets the latest text and is then closed.
+typedef struct NimbleDaemonMetricsExporter {
+    const char* session;
+    const char* filePath;
+    int listenSocket;
+    NimbleServerMetrics metrics;
+    char text[NIMBLE_DAEMON_METRICS_MAX_TEXT_OCTET_COUNT];
+    size_t textOctetCount;
+} NimbleDaemonMetricsExporter;
+
+int nimbleDaemonMetricsExporterInit(NimbleDaemonMetricsExporter* self, const char* session, const char* filePath,
+                                    const char* unixSocketPath);
+int nimbleDaemonMetricsExporterUpdate(NimbleDaemonMetricsExporter* self, const NimbleServer* server);
+void nimbleDaemonMetricsExporterDestroy(NimbleDaemonMetricsExporter* self);
+
+#endif
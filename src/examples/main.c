@@ -8,6 +8,7 @@
 #include <flood/in_stream.h>
 #include <flood/out_stream.h>
 #include <nimble-daemon/daemon.h>
+#include <nimble-daemon/metrics_exporter.h>
 
 #if !defined TORNADO_OS_WINDOWS
 #include <unistd.h>
@@ -33,11 +34,9 @@ static int sendToAddress(void* self_, const uint8_t* buf, size_t count)
     return udpServerSend(self->serverSocket, buf, count, self->sockAddrIn);
 }
 
+/// usage: nimbled [metrics file] [metrics unix socket]
 int main(int argc, char* argv[])
 {
-    (void) argc;
-    (void) argv;
-
     g_clog.log = clog_console;
 
     CLOG_OUTPUT("nimbled v%s starting up", NIMBLE_DAEMON_VERSION)
@@ -80,13 +79,9 @@ int main(int argc, char* argv[])
 
     nimbleServerInit(&server, setup);
 
-    nimbleServerGameInit(&server.game, &memory.tagAllocator.info, setup.maxSingleParticipantStepOctetCount,
-                         setup.maxGameStateOctetCount, setup.maxParticipantCount, setup.log);
-
     static uint8_t exampleGameState = 42;
     nimbleServerGameSetGameState(&server.game, 0, &exampleGameState, 1, &serverLog);
 
-
     uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
     size_t size;
     struct sockaddr_in address;
@@ -95,6 +90,12 @@ int main(int argc, char* argv[])
     FldOutStream outStream;
     fldOutStreamInit(&outStream, reply, DATAGRAM_TRANSPORT_MAX_SIZE);
 
+    static NimbleDaemonMetricsExporter metricsExporter;
+    const char* metricsFilePath = argc > 1 && argv[1][0] != '\0' ? argv[1] : 0;
+    const char* metricsSocketPath = argc > 2 ? argv[2] : 0;
+    nimbleDaemonMetricsExporterInit(&metricsExporter, "example", metricsFilePath, metricsSocketPath);
+    MonotonicTimeMs lastMetricsExportAtMs = monotonicTimeMsNow();
+
     CLOG_OUTPUT("ready for incoming packets")
 
     while (1) {
@@ -102,6 +103,11 @@ int main(int argc, char* argv[])
         ssize_t errorCode = udpServerReceive(&daemon.socket, buf, size, &address);
         if (errorCode < 0) {
             CLOG_WARN("problem with receive %zd", errorCode)
+        } else if (errorCode == 0) {
+            // Nothing received, the socket is non-blocking so the metrics are exported even without traffic
+#if !defined TORNADO_OS_WINDOWS
+            usleep(1000);
+#endif
         } else {
             NimbleServerResponse response;
             response.transportOut = &transportOut;
@@ -122,6 +128,12 @@ int main(int argc, char* argv[])
                                              &exampleGameState, 1, &serverLog);
             }
         }
+
+        MonotonicTimeMs now = monotonicTimeMsNow();
+        if (now - lastMetricsExportAtMs >= 1000) {
+            nimbleDaemonMetricsExporterUpdate(&metricsExporter, &server);
+            lastMetricsExportAtMs = now;
+        }
     }
 
     // imprintDefaultSetupDestroy(&memory);
@@ -0,0 +1,179 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if !defined TORNADO_OS_WINDOWS
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <clog/clog.h>
+#include <nimble-daemon/metrics_exporter.h>
+#include <stdio.h>
+
+#if !defined TORNADO_OS_WINDOWS
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if !defined TORNADO_OS_WINDOWS
+static int listenOnUnixSocket(const char* path)
+{
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+
+    int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    // A socket file left from a previous run would make bind fail
+    unlink(path);
+
+    if (bind(listenSocket, (const struct sockaddr*) &address, sizeof(address)) < 0 || listen(listenSocket, 8) < 0 ||
+        fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        close(listenSocket);
+        return -1;
+    }
+
+    return listenSocket;
+}
+
+static void serveWaitingConnections(NimbleDaemonMetricsExporter* self)
+{
+    while (true) {
+        int client = accept(self->listenSocket, 0, 0);
+        if (client < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                CLOG_WARN("metrics: accept failed %d", errno)
+            }
+            return;
+        }
+
+        size_t pos = 0;
+        while (pos < self->textOctetCount) {
+#if defined MSG_NOSIGNAL
+            ssize_t sentCount = send(client, self->text + pos, self->textOctetCount - pos, MSG_NOSIGNAL);
+#else
+            ssize_t sentCount = send(client, self->text + pos, self->textOctetCount - pos, 0);
+#endif
+            if (sentCount <= 0) {
+                break;
+            }
+            pos += (size_t) sentCount;
+        }
+        close(client);
+    }
+}
+#endif
+
+static int writeFileAtomically(const char* path, const char* text, size_t octetCount)
+{
+    char tempPath[512];
+    int tempPathLength = snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    if (tempPathLength < 0 || (size_t) tempPathLength >= sizeof(tempPath)) {
+        return -1;
+    }
+
+    FILE* file = fopen(tempPath, "wb");
+    if (file == 0) {
+        return -1;
+    }
+
+    size_t writtenCount = fwrite(text, 1, octetCount, file);
+    int closeResult = fclose(file);
+    if (writtenCount != octetCount || closeResult != 0) {
+        remove(tempPath);
+        return -1;
+    }
+
+#if defined TORNADO_OS_WINDOWS
+    // rename() does not replace an existing file on Windows
+    remove(path);
+#endif
+
+    return rename(tempPath, path);
+}
+
+/// Initializes the exporter
+/// @param self exporter
+/// @param session value of the session label, e.g. the match id
+/// @param filePath file to write the metrics to, or zero
+/// @param unixSocketPath path to create a Unix domain socket at, or zero. Not supported on Windows.
+/// @return negative on error
+int nimbleDaemonMetricsExporterInit(NimbleDaemonMetricsExporter* self, const char* session, const char* filePath,
+                                    const char* unixSocketPath)
+{
+    self->session = session;
+    self->filePath = filePath;
+    self->listenSocket = -1;
+    self->textOctetCount = 0;
+
+    if (unixSocketPath != 0) {
+#if defined TORNADO_OS_WINDOWS
+        CLOG_WARN("metrics: unix sockets are not supported, ignoring '%s'", unixSocketPath)
+#else
+        self->listenSocket = listenOnUnixSocket(unixSocketPath);
+        if (self->listenSocket < 0) {
+            CLOG_WARN("metrics: could not listen on '%s'", unixSocketPath)
+            return -1;
+        }
+#endif
+    }
+
+    return 0;
+}
+
+/// Takes a new snapshot of the server metrics and exports it.
+/// Must be called from the thread that updates the server, e.g. once a second.
+/// @param self exporter
+/// @param server server to export metrics for
+/// @return negative on error
+int nimbleDaemonMetricsExporterUpdate(NimbleDaemonMetricsExporter* self, const NimbleServer* server)
+{
+    nimbleServerMetricsSnapshot(server, &self->metrics);
+
+    int octetCount = nimbleServerMetricsWritePrometheus(&self->metrics, self->session, self->text,
+                                                        sizeof(self->text));
+    if (octetCount < 0) {
+        CLOG_WARN("metrics: text does not fit in %zu octets", sizeof(self->text))
+        return octetCount;
+    }
+    self->textOctetCount = (size_t) octetCount;
+
+    if (self->filePath != 0) {
+        int writeErr = writeFileAtomically(self->filePath, self->text, self->textOctetCount);
+        if (writeErr < 0) {
+            CLOG_WARN("metrics: could not write '%s'", self->filePath)
+            return writeErr;
+        }
+    }
+
+#if !defined TORNADO_OS_WINDOWS
+    if (self->listenSocket >= 0) {
+        serveWaitingConnections(self);
+    }
+#endif
+
+    return 0;
+}
+
+void nimbleDaemonMetricsExporterDestroy(NimbleDaemonMetricsExporter* self)
+{
+#if !defined TORNADO_OS_WINDOWS
+    if (self->listenSocket >= 0) {
+        close(self->listenSocket);
+        self->listenSocket = -1;
+    }
+#endif
+}
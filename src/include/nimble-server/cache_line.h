@@ -0,0 +1,12 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_CACHE_LINE_H
+#define NIMBLE_SERVER_CACHE_LINE_H
+
+/// Padding that keeps values written by different threads on separate cache lines
+#define NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT (64)
+
+#endif
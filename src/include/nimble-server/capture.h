@@ -0,0 +1,70 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_CAPTURE_H
+#define NIMBLE_SERVER_CAPTURE_H
+
+#include <monotonic-time/monotonic_time.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Capture log layout, all values little endian:
+///   file header (16 octets): magic "NIMBCAPT", uint32 version, uint32 reserved
+///   records: uint32 octetCount, uint8 type, uint8 connectionIndex, uint16 reserved, int64 timeMs,
+///            followed by the octets, zero padded to a multiple of eight.
+/// Every record starts eight octet aligned, so a memory mapped log can be read in place.
+#define NIMBLE_SERVER_CAPTURE_VERSION (1)
+#define NIMBLE_SERVER_CAPTURE_FILE_HEADER_OCTET_COUNT (16)
+#define NIMBLE_SERVER_CAPTURE_RECORD_HEADER_OCTET_COUNT (16)
+
+typedef enum NimbleServerCaptureRecordType {
+    NimbleServerCaptureRecordTypeUpdate, // nimbleServerUpdate() was called, timeMs is the `now` passed in
+    NimbleServerCaptureRecordTypeIn,     // datagram fed to the server
+    NimbleServerCaptureRecordTypeOut,    // datagram sent by the server as a response
+} NimbleServerCaptureRecordType;
+
+typedef int (*NimbleServerCaptureWriteFn)(void* self, const uint8_t* octets, size_t octetCount);
+
+/// Where the capture log is appended to, e.g. a file
+typedef struct NimbleServerCaptureOut {
+    void* self;
+    NimbleServerCaptureWriteFn write;
+} NimbleServerCaptureOut;
+
+typedef struct NimbleServerCapture {
+    NimbleServerCaptureOut out;
+    bool isEnabled;
+    size_t recordCount;
+    size_t octetCount;
+    size_t failedWriteCount;
+} NimbleServerCapture;
+
+typedef struct NimbleServerCaptureRecord {
+    NimbleServerCaptureRecordType type;
+    uint8_t connectionIndex;
+    MonotonicTimeMs timeMs;
+    const uint8_t* octets;
+    size_t octetCount;
+} NimbleServerCaptureRecord;
+
+/// Reads records directly from a capture log in memory, without copying the octets
+typedef struct NimbleServerCaptureReader {
+    const uint8_t* octets;
+    size_t octetCount;
+    size_t pos;
+} NimbleServerCaptureReader;
+
+void nimbleServerCaptureInit(NimbleServerCapture* self);
+int nimbleServerCaptureStart(NimbleServerCapture* self, NimbleServerCaptureOut out);
+void nimbleServerCaptureStop(NimbleServerCapture* self);
+int nimbleServerCaptureRecord(NimbleServerCapture* self, NimbleServerCaptureRecordType type, uint8_t connectionIndex,
+                              MonotonicTimeMs timeMs, const uint8_t* octets, size_t octetCount);
+
+int nimbleServerCaptureReaderInit(NimbleServerCaptureReader* self, const uint8_t* octets, size_t octetCount);
+int nimbleServerCaptureReaderRead(NimbleServerCaptureReader* self, NimbleServerCaptureRecord* record);
+const char* nimbleServerCaptureRecordTypeToString(NimbleServerCaptureRecordType type);
+
+#endif
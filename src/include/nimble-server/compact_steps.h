@@ -0,0 +1,57 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_COMPACT_STEPS_H
+#define NIMBLE_SERVER_COMPACT_STEPS_H
+
+#include <nimble-serialize/version.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct FldOutStream;
+struct FldInStream;
+
+/// First nimble protocol version where the clients can decode compact authoritative step ranges.
+/// The version alone is not enough, the server must also be set up with useCompactStepEncoding.
+#define NIMBLE_SERVER_COMPACT_STEPS_NIMBLE_VERSION_MAJOR (0)
+#define NIMBLE_SERVER_COMPACT_STEPS_NIMBLE_VERSION_MINOR (1)
+
+/// Compact range layout:
+///   uint32 first step id, uint8 step count, then for each step:
+///   uint8 0xFF if it is identical to the previous step in the range, otherwise uint8 participant count followed by
+///   the participant entries. The first octet of an entry holds the kind in the upper two bits, and the participant
+///   id in the lower six (63 means that the id follows in the next octet):
+///     00: normal step. uint8 octet count, octets
+///     01: normal step with the same octets as the participant had in the previous step in the range
+///     10: uint8 step type, then as in a composed step (party id and octets for joined)
+///     11: uint8 run length, uint8 step type. A run of participants with consecutive ids and a step type without
+///         octets, e.g. forced steps
+/// The first step in each range is never a reference, so every datagram can be decoded on its own.
+#define NIMBLE_SERVER_COMPACT_STEPS_REPEAT_PREVIOUS (0xFF)
+#define NIMBLE_SERVER_COMPACT_STEPS_KIND_NORMAL (0x00)
+#define NIMBLE_SERVER_COMPACT_STEPS_KIND_SAME_AS_PREVIOUS (0x40)
+#define NIMBLE_SERVER_COMPACT_STEPS_KIND_SPECIAL (0x80)
+#define NIMBLE_SERVER_COMPACT_STEPS_KIND_RUN (0xC0)
+#define NIMBLE_SERVER_COMPACT_STEPS_ID_ESCAPE (0x3F)
+
+/// Maximum octet count of a composed authoritative step
+#define NIMBLE_SERVER_COMPACT_STEPS_MAX_STEP_OCTET_COUNT (1024)
+
+typedef enum NimbleServerStepEncoding {
+    NimbleServerStepEncodingNormal,
+    NimbleServerStepEncodingCompact
+} NimbleServerStepEncoding;
+
+NimbleServerStepEncoding nimbleServerCompactStepsEncodingForVersion(const NimbleSerializeVersion* nimbleVersion);
+int nimbleServerCompactStepsEncode(struct FldOutStream* outStream, const uint8_t* step, size_t octetCount,
+                                   const uint8_t* previousStep, size_t previousOctetCount);
+int nimbleServerCompactStepsDecode(struct FldInStream* inStream, const uint8_t* previousStep,
+                                   size_t previousOctetCount, uint8_t* target, size_t maxTargetOctetCount);
+int nimbleServerCompactStepsWriteRange(struct FldOutStream* outStream, const NbsSteps* authoritativeSteps,
+                                       StepId startId, size_t stepCount);
+
+#endif
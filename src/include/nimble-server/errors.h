@@ -11,6 +11,17 @@ const static int NimbleServerErrSerializeVersion = -44;
 const static int NimbleServerErrSessionFull = -54;
 const static int NimbleServerErrDatagramFromDisconnectedConnection = -42;
 const static int NimbleServerErrOutOfParticipantMemory = -43;
+const static int NimbleServerErrRateLimited = -46;
+const static int NimbleServerErrCapture = -47;
+const static int NimbleServerErrTrace = -48;
+const static int NimbleServerErrMetrics = -49;
+const static int NimbleServerErrUnknownConnection = -50;
+const static int NimbleServerErrForcedStepNotProvided = -51;
+const static int NimbleServerErrOutOfDownloadMemory = -52;
+const static int NimbleServerErrSpectatorStepNotAvailable = -53;
+const static int NimbleServerErrRelayNotSynchronized = -55;
+const static int NimbleServerErrJournal = -56;
+const static int NimbleServerErrTransportConnectionInUse = -57;
 
 #endif
 
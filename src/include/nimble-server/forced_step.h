@@ -0,0 +1,43 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_FORCED_STEP_H
+#define NIMBLE_SERVER_FORCED_STEP_H
+
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Information about the participant that did not provide a step in time
+typedef struct NimbleServerForcedStepContext {
+    uint8_t participantId;
+    uint8_t partyId;
+    StepId stepId;
+    size_t forcedStepInRowCount; // including the step that is forced now
+    const uint8_t* lastStepOctets;
+    size_t lastStepOctetCount;
+    bool hasLastStep;
+} NimbleServerForcedStepContext;
+
+/// Creates the step to use for a participant that did not provide one in time
+/// @return octet count of a normal step written to target, or negative to use an empty "not provided in time" step
+typedef int (*NimbleServerForcedStepFn)(void* self, const NimbleServerForcedStepContext* context, uint8_t* target,
+                                        size_t maxTargetOctetCount);
+
+/// How forced steps are created. A zeroed strategy always uses empty "not provided in time" steps.
+typedef struct NimbleServerForcedStepStrategy {
+    NimbleServerForcedStepFn fn; // optional, application specific rules. Replaces the built-in repeat.
+    void* self;
+    size_t repeatLastStepCount; // the last received step is repeated for this many forced steps in a row
+} NimbleServerForcedStepStrategy;
+
+int nimbleServerForcedStepRepeatLast(size_t repeatLastStepCount, const NimbleServerForcedStepContext* context,
+                                     uint8_t* target, size_t maxTargetOctetCount);
+int nimbleServerForcedStepCreate(const NimbleServerForcedStepStrategy* self,
+                                 const NimbleServerForcedStepContext* context, uint8_t* target,
+                                 size_t maxTargetOctetCount);
+
+#endif
@@ -6,23 +6,52 @@
 #ifndef NIMBLE_SERVER_GAME_H
 #define NIMBLE_SERVER_GAME_H
 
+#include <monotonic-time/monotonic_time.h>
 #include <nimble-server/game_state.h>
+#include <nimble-server/journal.h>
 #include <nimble-server/local_parties.h>
 #include <nimble-steps/steps.h>
 #include <stdbool.h>
 
 struct ImprintAllocator;
+struct NimbleServerTrace;
+struct NimbleServerForcedStepStrategy;
+struct NimbleServerSpectatorSteps;
+
+/// Values that are changed when the server can not keep up a stable tick rate.
+typedef struct NimbleServerGameTuning {
+    size_t maxRedundancyStepCount;
+    size_t composeLookAheadStepCount;
+    size_t forcedComposeLookAheadStepCount;
+    size_t maxBlobStreamEntriesPerSend;
+    size_t maxCatchUpStepCount;
+    bool outputStats;
+} NimbleServerGameTuning;
 
 /// Tracks the latestState, as well as the all authoritative Steps after the game state.
 typedef struct NimbleServerGame {
     NbsSteps authoritativeSteps;
     NimbleServerParticipants participants;
+    size_t maxSingleParticipantStepOctetCount;
     bool debugIsFrozen;
+    NimbleServerGameTuning tuning;
+    struct NimbleServerTrace* trace;
+    const struct NimbleServerForcedStepStrategy* forcedStepStrategy;
+    struct NimbleServerSpectatorSteps* spectatorSteps; // zero if there are no in-process spectators
+    NimbleServerJournal* journal; // zero if the authoritative steps are not journaled
+    NimbleServerJournalSource journalSource; // read is zero if steps before the authoritative steps can not be sent
+    NbsSteps* catchUpSteps; // steps read from the journalSource for the reply that is being sent
+    MonotonicTimeMs now;
     Clog log;
 } NimbleServerGame;
 
 void nimbleServerGameInit(NimbleServerGame* self, struct ImprintAllocator* allocator,
-                          size_t maxSingleParticipantStepOctetCount, size_t maxParticipantCount, Clog log);
+                          struct ImprintAllocator* participantStepsAllocator, size_t maxSingleParticipantStepOctetCount,
+                          size_t maxParticipantCount, Clog log);
+void nimbleServerGameReset(NimbleServerGame* self);
+void nimbleServerGameTuningInit(NimbleServerGameTuning* self);
+int nimbleServerGameReadCatchUpSteps(NimbleServerGame* self, StepId startStepId, size_t maxOctetCount);
+void nimbleServerGameStepCommitted(NimbleServerGame* self, StepId stepId, const uint8_t* octets, size_t octetCount);
 
 
 #endif
@@ -0,0 +1,69 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_INGEST_H
+#define NIMBLE_SERVER_INGEST_H
+
+#include <datagram-transport/types.h>
+#include <flood/in_stream.h>
+#include <nimble-steps/steps.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+struct NimbleServerGame;
+struct NimbleServerLocalParty;
+struct NimbleServerTransportConnection;
+
+/// Same as the number of datagrams that are read from the transport each tick
+#define NIMBLE_SERVER_INGEST_MAX_DATAGRAM_COUNT (64)
+
+typedef void (*NimbleServerJobFn)(void* context, size_t jobIndex);
+
+/// Must call jobFn once for every job index in [0, jobCount), in any order and on any threads, and return when all
+/// of them are done.
+typedef void (*NimbleServerParallelForFn)(void* self, size_t jobCount, NimbleServerJobFn jobFn, void* context);
+
+/// Worker pool provided by the application. The library does not create any threads itself.
+/// Thread safety: a job only writes to the party it reads steps for, that party's participants and transport
+/// connection, including the connection quality and rate limit counters. The game is only read. The jobs can log,
+/// so the Clog log function of the application must be safe to call from several threads at the same time.
+typedef struct NimbleServerWorkerPool {
+    NimbleServerParallelForFn parallelForFn; // zero reads the predicted steps in arrival order instead
+    void* self;
+} NimbleServerWorkerPool;
+
+/// A received datagram with predicted steps. The ordered datagram header and the command has already been read from
+/// the inStream.
+typedef struct NimbleServerIngestEntry {
+    struct NimbleServerTransportConnection* transportConnection;
+    struct NimbleServerLocalParty* party;
+    FldInStream inStream;
+    StepId clientWaitingForStepId;
+    int result;
+    uint8_t transportIndex;
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+} NimbleServerIngestEntry;
+
+/// Predicted step datagrams that are read from the transport during a tick. The parties have disjoint participant
+/// step buffers, so each party is a job that can run in parallel with the others. The datagrams for the same party
+/// are read in arrival order.
+typedef struct NimbleServerIngestBatch {
+    NimbleServerIngestEntry* entries;
+    size_t entryCount;
+    uint8_t jobEntryIndices[NIMBLE_SERVER_INGEST_MAX_DATAGRAM_COUNT];
+    size_t jobStartIndices[NIMBLE_SERVER_INGEST_MAX_DATAGRAM_COUNT + 1];
+    size_t jobCount;
+    struct NimbleServerGame* game;
+} NimbleServerIngestBatch;
+
+void nimbleServerIngestBatchInit(NimbleServerIngestBatch* self, struct ImprintAllocator* allocator);
+NimbleServerIngestEntry* nimbleServerIngestBatchNext(NimbleServerIngestBatch* self);
+void nimbleServerIngestBatchCommit(NimbleServerIngestBatch* self);
+void nimbleServerIngestBatchRun(NimbleServerIngestBatch* self, struct NimbleServerGame* game,
+                                const NimbleServerWorkerPool* workerPool);
+void nimbleServerIngestBatchClear(NimbleServerIngestBatch* self);
+
+#endif
@@ -0,0 +1,62 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_IO_H
+#define NIMBLE_SERVER_IO_H
+
+#include <clog/clog.h>
+#include <datagram-transport/multi.h>
+#include <datagram-transport/types.h>
+#include <nimble-server/cache_line.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+
+typedef struct NimbleServerIoDatagram {
+    int connectionIndex;
+    size_t octetCount;
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+} NimbleServerIoDatagram;
+
+/// Lock-free ring of datagrams with a single producer thread and a single consumer thread.
+/// The capacity must be a power of two.
+typedef struct NimbleServerDatagramRing {
+    NimbleServerIoDatagram* datagrams;
+    size_t capacity;
+    volatile size_t writeIndex; // only written by the producer
+    uint8_t paddingAfterWrite[NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT];
+    volatile size_t readIndex; // only written by the consumer
+    uint8_t paddingAfterRead[NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT];
+} NimbleServerDatagramRing;
+
+void nimbleServerDatagramRingInit(NimbleServerDatagramRing* self, struct ImprintAllocator* allocator,
+                                  size_t capacity);
+NimbleServerIoDatagram* nimbleServerDatagramRingWriteBegin(NimbleServerDatagramRing* self);
+void nimbleServerDatagramRingWriteCommit(NimbleServerDatagramRing* self);
+const NimbleServerIoDatagram* nimbleServerDatagramRingReadBegin(NimbleServerDatagramRing* self);
+void nimbleServerDatagramRingReadCommit(NimbleServerDatagramRing* self);
+
+/// Moves the transport syscalls to an I/O thread. The I/O thread calls nimbleServerIoReceive() and
+/// nimbleServerIoSend(), and the server is set up with nimbleServerIoTickTransport(), so the thread that updates the
+/// server only reads and writes the rings.
+/// The counters are written by one thread each, and should only be read from that thread.
+typedef struct NimbleServerIo {
+    DatagramTransportMulti transport; // only used by the I/O thread
+    NimbleServerDatagramRing inbound; // I/O thread to tick thread
+    NimbleServerDatagramRing outbound; // tick thread to I/O thread
+    size_t invalidDatagramCount; // I/O thread
+    size_t droppedInboundCount; // I/O thread
+    size_t droppedOutboundCount; // tick thread
+    Clog log;
+} NimbleServerIo;
+
+void nimbleServerIoInit(NimbleServerIo* self, struct ImprintAllocator* allocator, DatagramTransportMulti transport,
+                        size_t ringCapacity, Clog log);
+int nimbleServerIoReceive(NimbleServerIo* self);
+int nimbleServerIoSend(NimbleServerIo* self);
+DatagramTransportMulti nimbleServerIoTickTransport(NimbleServerIo* self);
+
+#endif
@@ -0,0 +1,109 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_JOURNAL_H
+#define NIMBLE_SERVER_JOURNAL_H
+
+#include <clog/clog.h>
+#include <nimble-server/cache_line.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+
+/// Journal segment layout, all values little endian:
+///   segment header (16 octets): magic "NIMBJRNL", uint32 version, uint32 reserved
+///   records: uint32 stepId, uint32 octetCount, followed by the authoritative step, zero padded to a multiple of
+///            eight.
+/// The step ids are increasing within a segment. Every record starts eight octet aligned, so a memory mapped segment
+/// can be read in place.
+#define NIMBLE_SERVER_JOURNAL_VERSION (1)
+#define NIMBLE_SERVER_JOURNAL_SEGMENT_HEADER_OCTET_COUNT (16)
+#define NIMBLE_SERVER_JOURNAL_RECORD_HEADER_OCTET_COUNT (8)
+
+/// Number of chunks that the journal memory is split into. The tick thread fills one chunk while the others are
+/// written.
+#define NIMBLE_SERVER_JOURNAL_CHUNK_COUNT (8)
+
+typedef int (*NimbleServerJournalWriteFn)(void* self, const uint8_t* octets, size_t octetCount);
+
+/// Where the journal segment is appended to, e.g. a file
+typedef struct NimbleServerJournalOut {
+    void* self;
+    NimbleServerJournalWriteFn write;
+} NimbleServerJournalOut;
+
+typedef struct NimbleServerJournalChunk {
+    uint8_t* octets;
+    size_t octetCount;
+} NimbleServerJournalChunk;
+
+/// Appends every committed authoritative step to a segment. The tick thread only copies the steps into large chunks,
+/// nimbleServerJournalFlush() writes the full chunks and is usually called from a separate thread.
+/// When all chunks are waiting to be written, steps are dropped instead of blocking the tick thread.
+/// A failed write stops the segment, since the steps after it would be appended after a gap.
+typedef struct NimbleServerJournal {
+    NimbleServerJournalChunk chunks[NIMBLE_SERVER_JOURNAL_CHUNK_COUNT];
+    size_t chunkOctetCapacity;
+    volatile size_t committedChunkCount; // only written by the tick thread
+    uint8_t paddingAfterCommitted[NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT];
+    volatile size_t writtenChunkCount; // only written by the thread that flushes
+    uint8_t paddingAfterWritten[NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT];
+    NimbleServerJournalOut out;
+    bool isEnabled;
+    bool hasOpenChunk;
+    size_t stepCount; // tick thread
+    size_t droppedStepCount; // tick thread
+    size_t failedWriteCount; // flush thread
+    volatile size_t hasFailedWrite; // only written by the thread that flushes, stops the segment
+    Clog log;
+} NimbleServerJournal;
+
+typedef struct NimbleServerJournalRecordPosition {
+    StepId stepId;
+    size_t pos;
+} NimbleServerJournalRecordPosition;
+
+/// Random access by step id to a journal segment in memory, e.g. a memory mapped file. A segment that is still
+/// being written can be read as well, see nimbleServerJournalReaderInitLive().
+typedef struct NimbleServerJournalReader {
+    const uint8_t* octets;
+    size_t octetCount;
+    NimbleServerJournalRecordPosition* records; // increasing step ids, found with a binary search
+    size_t recordCount;
+    size_t recordCapacity;
+    size_t indexedOctetCount; // the records before it are in the index
+} NimbleServerJournalReader;
+
+typedef int (*NimbleServerJournalReadFn)(void* self, StepId stepId, const uint8_t** outOctets,
+                                         size_t* outOctetCount);
+
+/// Journaled steps that the server can send to clients that are behind the authoritative steps in memory, e.g. all
+/// the memory mapped segments of the current game. read returns 1 if the step was found and 0 if not.
+typedef struct NimbleServerJournalSource {
+    void* self;
+    NimbleServerJournalReadFn read;
+} NimbleServerJournalSource;
+
+void nimbleServerJournalInit(NimbleServerJournal* self, struct ImprintAllocator* allocator, size_t octetCount,
+                             Clog log);
+int nimbleServerJournalStart(NimbleServerJournal* self, NimbleServerJournalOut out);
+void nimbleServerJournalStop(NimbleServerJournal* self);
+int nimbleServerJournalAppend(NimbleServerJournal* self, StepId stepId, const uint8_t* octets, size_t octetCount);
+void nimbleServerJournalCommit(NimbleServerJournal* self);
+int nimbleServerJournalFlush(NimbleServerJournal* self);
+
+int nimbleServerJournalReaderInit(NimbleServerJournalReader* self, struct ImprintAllocator* allocator,
+                                  const uint8_t* octets, size_t octetCount);
+void nimbleServerJournalReaderInitLive(NimbleServerJournalReader* self, struct ImprintAllocator* allocator,
+                                       size_t maxRecordCount);
+int nimbleServerJournalReaderAppend(NimbleServerJournalReader* self, const uint8_t* octets, size_t octetCount);
+int nimbleServerJournalReaderRead(const NimbleServerJournalReader* self, StepId stepId, const uint8_t** outOctets,
+                                  size_t* outOctetCount);
+NimbleServerJournalSource nimbleServerJournalReaderSource(NimbleServerJournalReader* self);
+
+#endif
@@ -15,6 +15,7 @@
 #include <nimble-serialize/types.h>
 
 struct NimbleServerLocalParty;
+struct NimbleServerLocalPartyCold;
 
 struct ImprintAllocator;
 struct ImprintAllocatorWithFree;
@@ -22,6 +23,7 @@ struct NimbleServerTransportConnection;
 
 typedef struct NimbleServerLocalParties {
     struct NimbleServerLocalParty* parties;
+    struct NimbleServerLocalPartyCold* partiesCold; // parallel to parties
     size_t partiesCount;
     size_t capacityCount;
     struct ImprintAllocator* allocator;
@@ -13,6 +13,7 @@
 #include <nimble-server/delayed_quality.h>
 #include <nimble-server/participant_references.h>
 #include <nimble-server/participants.h>
+#include <nimble-server/step_latency.h>
 
 #include <stats/stats.h>
 #include <stdbool.h>
@@ -26,31 +27,35 @@ typedef enum NimbleServerLocalPartyState {
     NimbleServerLocalPartyStateDissolved
 } NimbleServerLocalPartyState;
 
-/// Represents the collection of participants joined from one device (one client transport connection). */
+/// Party data that is not needed when ticking parties or reading predicted steps. Kept in an array parallel to the
+/// parties.
+typedef struct NimbleServerLocalPartyCold {
+    StatsInt incomingStepCountInBufferStats;
+    uint32_t warningCount;
+    uint32_t warningAboutZeroAddedSteps;
+    NimbleServerStepLatency stepLatency;
+    char debugPrefix[32];
+    Clog log;
+} NimbleServerLocalPartyCold;
+
+/// Represents the collection of participants joined from one device (one client transport connection).
+/// The fields that are used every tick come first.
 typedef struct NimbleServerLocalParty {
-    NimbleSerializeLocalPartyId id;
     bool isUsed;
-
+    NimbleSerializeLocalPartyId id;
     NimbleServerLocalPartyState state;
-    NimbleServerParticipantReferences participantReferences;
-
-    StatsInt incomingStepCountInBufferStats;
+    StepId highestReceivedStepId;
+    size_t stepsInBufferCount;
     struct NimbleServerTransportConnection* transportConnection;
     size_t waitingForReconnectTimer;
     size_t waitingForReconnectMaxTimer;
+    NimbleServerLocalPartyCold* cold;
+    NimbleServerParticipantReferences participantReferences;
     NimbleServerConnectionQuality quality;
     NimbleServerConnectionQualityDelayed delayedQuality;
-    uint32_t warningCount;
-    uint32_t warningAboutZeroAddedSteps;
-
-    StepId highestReceivedStepId;
-    size_t stepsInBufferCount;
-
-    char debugPrefix[32];
-    Clog log;
 } NimbleServerLocalParty;
 
-void nimbleServerLocalPartyInit(NimbleServerLocalParty* self,
+void nimbleServerLocalPartyInit(NimbleServerLocalParty* self, NimbleServerLocalPartyCold* cold,
                                 NimbleSerializeLocalPartyId id, Clog log);
 void nimbleServerLocalPartyReset(NimbleServerLocalParty* self);
 void nimbleServerLocalPartyReInit(NimbleServerLocalParty* self,
@@ -60,6 +65,15 @@ void nimbleServerLocalPartyRejoin(NimbleServerLocalParty* self,
 void nimbleServerLocalPartyDestroy(NimbleServerLocalParty* self);
 bool nimbleServerLocalPartyHasParticipantId(const NimbleServerLocalParty* self, uint8_t participantId);
 bool nimbleServerLocalPartyTick(NimbleServerLocalParty* self);
-int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self, struct FldInStream* inStream);
+int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self, struct FldInStream* inStream,
+                                                    StepId authoritativeStepId, MonotonicTimeMs now);
+
+/// Compact predicted steps layout, used by connections with the compact step encoding:
+///   signed varint first step id relative to the step id the client is waiting for, uint8 participant count,
+///   then for each participant: uint8 participant id, varint step id delta from the first step id, varint step count,
+///   and for each step a varint octet count followed by the octets.
+int nimbleServerLocalPartyDeserializeCompactPredictedSteps(NimbleServerLocalParty* self, struct FldInStream* inStream,
+                                                           StepId baseStepId, size_t maxStepOctetCount,
+                                                           StepId authoritativeStepId, MonotonicTimeMs now);
 
 #endif
@@ -0,0 +1,68 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_MEMORY_H
+#define NIMBLE_SERVER_MEMORY_H
+
+#include <imprint/allocator.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum NimbleServerMemoryCategory {
+    NimbleServerMemoryCategoryGame,             // authoritative steps and the participant collection
+    NimbleServerMemoryCategoryParticipantSteps, // steps pool slabs
+    NimbleServerMemoryCategoryLocalParties,
+    NimbleServerMemoryCategoryDownloads,   // game state copies for the transport connections
+    NimbleServerMemoryCategoryBlobStreams, // outgoing blob streams
+    NimbleServerMemoryCategoryCount
+} NimbleServerMemoryCategory;
+
+typedef struct NimbleServerMemoryUsage {
+    size_t octetCount;
+    size_t highWaterOctetCount;
+    size_t allocationCount;
+} NimbleServerMemoryUsage;
+
+/// Memory allocated by a server, for each category. It is a plain value, so it can be copied to the metrics.
+typedef struct NimbleServerMemory {
+    NimbleServerMemoryUsage categories[NimbleServerMemoryCategoryCount];
+    NimbleServerMemoryUsage total;
+    size_t budgetOctetCount; // zero is no budget
+    size_t refusedAllocationCount;
+} NimbleServerMemory;
+
+/// Forwards to another allocator and records the allocations in a category of a NimbleServerMemory.
+/// If enforceBudget is set, allocations that would exceed the budget return NULL, so it must only be used where
+/// the caller can handle it.
+typedef struct NimbleServerTrackedAllocator {
+    ImprintAllocator allocator; // must be first, the allocator functions cast back to the tracked allocator
+    ImprintAllocator* parent;
+    NimbleServerMemory* memory;
+    NimbleServerMemoryCategory category;
+    bool enforceBudget;
+} NimbleServerTrackedAllocator;
+
+/// Same as NimbleServerTrackedAllocator, but for allocators that can free. The octet count of each allocation is
+/// stored in front of it, so the free can be recorded.
+typedef struct NimbleServerTrackedAllocatorWithFree {
+    ImprintAllocatorWithFree allocator; // must be first
+    ImprintAllocatorWithFree* parent;
+    NimbleServerMemory* memory;
+    NimbleServerMemoryCategory category;
+    bool enforceBudget;
+} NimbleServerTrackedAllocatorWithFree;
+
+void nimbleServerMemoryInit(NimbleServerMemory* self, size_t budgetOctetCount);
+bool nimbleServerMemoryHasRoom(const NimbleServerMemory* self, size_t octetCount);
+const char* nimbleServerMemoryCategoryToString(NimbleServerMemoryCategory category);
+
+void nimbleServerTrackedAllocatorInit(NimbleServerTrackedAllocator* self, ImprintAllocator* parent,
+                                      NimbleServerMemory* memory, NimbleServerMemoryCategory category,
+                                      bool enforceBudget);
+void nimbleServerTrackedAllocatorWithFreeInit(NimbleServerTrackedAllocatorWithFree* self,
+                                              ImprintAllocatorWithFree* parent, NimbleServerMemory* memory,
+                                              NimbleServerMemoryCategory category, bool enforceBudget);
+
+#endif
@@ -0,0 +1,99 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_METRICS_H
+#define NIMBLE_SERVER_METRICS_H
+
+#include <monotonic-time/monotonic_time.h>
+#include <nimble-server/local_party.h>
+#include <nimble-server/profiler.h>
+#include <nimble-server/server.h>
+#include <nimble-server/step_latency.h>
+#include <nimble-server/transport_connection.h>
+#include <nimble-server/update_quality.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Copy of a StatsInt, isSet is false until the first average has been calculated
+typedef struct NimbleServerMetricsStatsInt {
+    int average;
+    int min;
+    int max;
+    bool isSet;
+} NimbleServerMetricsStatsInt;
+
+typedef struct NimbleServerConnectionMetrics {
+    uint8_t connectionId;
+    NimbleServerTransportConnectionPhase phase;
+    NimbleServerMetricsStatsInt stepsBehind;
+    size_t droppedDatagramCount;
+    size_t droppedOctetCount;
+    size_t droppedPredictedStepCount;
+    size_t roundTripTimeMs;
+    size_t roundTripTimeVarianceMs;
+    size_t pingJitterMs;
+    size_t roundTripTimeSampleCount;
+    size_t lossPermille;
+    size_t lostDatagramCount;
+    size_t retransmitCount;
+} NimbleServerConnectionMetrics;
+
+typedef struct NimbleServerPartyMetrics {
+    uint8_t partyId;
+    bool hasConnection;
+    uint8_t connectionId;
+    NimbleServerLocalPartyState state;
+    size_t participantCount;
+    NimbleServerMetricsStatsInt incomingStepCountInBuffer;
+    size_t stepsInBufferCount;
+    size_t forcedStepInRowCount;
+    size_t providedStepsInARowCount;
+    size_t addedStepsToBufferCount;
+    size_t waitingForReconnectTicks;
+    NimbleServerStepLatencySummary stepLatency;
+} NimbleServerPartyMetrics;
+
+#define NIMBLE_SERVER_METRICS_MAX_PARTICIPANT_COUNT (64)
+
+typedef struct NimbleServerParticipantMetrics {
+    uint8_t participantId;
+    uint8_t partyId;
+    NimbleServerStepLatencySummary stepLatency;
+} NimbleServerParticipantMetrics;
+
+/// Snapshot of all the counters, gauges and histograms of a server.
+/// It is a plain value, so it can be copied to another thread and exported from there.
+typedef struct NimbleServerMetrics {
+    MonotonicTimeMs timeMs;
+    int authoritativeStepsPerSecond;
+    StepId lastAuthoritativeStepId;
+    size_t authoritativeStepCountInBuffer;
+    size_t participantCount;
+    NimbleServerUpdateQualityState updateQualityState;
+    NimbleServerMetricsStatsInt tickDeltaTimeMs;
+    uint64_t traceEventCount;
+    NimbleServerMemory memory;
+    NimbleServerProfilerHistogram phases[NimbleServerProfilerPhaseCount];
+
+    NimbleServerConnectionMetrics connections[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+    size_t connectionCount;
+    NimbleServerPartyMetrics parties[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+    size_t partyCount;
+    NimbleServerParticipantMetrics participants[NIMBLE_SERVER_METRICS_MAX_PARTICIPANT_COUNT];
+    size_t participantMetricsCount;
+
+    /// The participant whose predicted steps waited the least before being composed. Composition is most often
+    /// waiting for this participant, so it is the one that decides how far the lookahead must reach.
+    bool hasStepLatencyDriver;
+    uint8_t stepLatencyDriverParticipantId;
+} NimbleServerMetrics;
+
+void nimbleServerMetricsSnapshot(const NimbleServer* self, NimbleServerMetrics* metrics);
+int nimbleServerMetricsWritePrometheus(const NimbleServerMetrics* metrics, const char* session, char* target,
+                                       size_t maxOctetCount);
+
+#endif
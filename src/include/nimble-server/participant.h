@@ -6,12 +6,14 @@
 #ifndef NIMBLE_SERVER_PARTICIPANT_H
 #define NIMBLE_SERVER_PARTICIPANT_H
 
+#include <nimble-server/step_latency.h>
 #include <nimble-steps/steps.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
 struct NimbleServerLocalParty;
-struct ImprintAllocator;
+struct NimbleServerStepsPool;
+struct NimbleServerStepsPoolSlot;
 struct FldInStream;
 
 typedef enum NimbleServerParticipantState {
@@ -22,29 +24,47 @@ typedef enum NimbleServerParticipantState {
     NimbleServerParticipantStateDestroyed,
 } NimbleServerParticipantState;
 
-typedef struct NimbleServerParticipant {
+/// Participant data that is not needed when composing authoritative steps. Kept in an array parallel to the
+/// participants, so composing does not stride over it.
+typedef struct NimbleServerParticipantCold {
     size_t localIndex;
-    uint8_t id;
-    bool isUsed;
-    NbsSteps steps;
-
-    struct NimbleServerLocalParty* inParty;
-    NimbleServerParticipantState state;
+    NimbleServerStepArrivals stepArrivals;
+    NimbleServerStepLatency stepLatency;
+    struct NimbleServerStepsPool* stepsPool;
+    struct NimbleServerStepsPoolSlot* stepsSlot;
     Clog log;
     char debugPrefix[32];
+} NimbleServerParticipantCold;
+
+/// The fields that are used every tick come first
+typedef struct NimbleServerParticipant {
+    bool isUsed;
+    bool hasLastStep;
+    uint8_t id;
+    NimbleServerParticipantState state;
+    struct NimbleServerLocalParty* inParty;
+    size_t forcedStepInRowCount;
+    size_t lastStepOctetCount;
+    size_t maxLastStepOctetCount;
+    uint8_t* lastStepOctets;
+    NimbleServerParticipantCold* cold;
+    NbsSteps steps;
 } NimbleServerParticipant;
 
 typedef struct NimbleServerParticipantSetup {
     uint8_t id;
-    struct ImprintAllocator* connectionAllocator;
+    NimbleServerParticipantCold* cold;
+    struct NimbleServerStepsPool* stepsPool;
     size_t maxStepOctetSizeForOneParticipant;
     Clog log;
 } NimbleServerParticipantSetup;
 
 void nimbleServerParticipantInit(NimbleServerParticipant* self, NimbleServerParticipantSetup setup);
-void nimbleServerParticipantReInit(NimbleServerParticipant* self, struct NimbleServerLocalParty* party, StepId stepId);
+int nimbleServerParticipantReInit(NimbleServerParticipant* self, struct NimbleServerLocalParty* party, StepId stepId);
 void nimbleServerParticipantDestroy(NimbleServerParticipant* self);
 void nimbleServerParticipantMarkAsLeaving(NimbleServerParticipant* self);
+void nimbleServerParticipantSetLastStep(NimbleServerParticipant* self, const uint8_t* octets, size_t octetCount);
+int nimbleServerParticipantSkipStepOctets(struct FldInStream* inStream, size_t octetCount);
 int nimbleServerParticipantDeserializeSingleStep(NimbleServerParticipant* self, StepId stepId,
                                                  struct FldInStream* inStream);
 
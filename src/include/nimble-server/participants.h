@@ -9,20 +9,24 @@
 #include <clog/clog.h>
 #include <nimble-serialize/types.h>
 #include <nimble-server/circular_buffer.h>
+#include <nimble-server/steps_pool.h>
 #include <nimble-steps/types.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 struct NimbleServerParticipant;
+struct NimbleServerParticipantCold;
 struct ImprintAllocator;
 struct NimbleServerLocalParty;
 
 /// All the participants that are within a game
 typedef struct NimbleServerParticipants {
     struct NimbleServerParticipant* participants;
+    struct NimbleServerParticipantCold* participantsCold; // parallel to participants
     size_t participantCapacity;
     size_t participantCount;
     NimbleServerCircularBuffer freeList;
+    NimbleServerStepsPool stepsPool;
     Clog log;
     char debugPrefix[32];
 } NimbleServerParticipants;
@@ -31,11 +35,13 @@ typedef struct NimbleServerParticipantJoinInfo {
     uint8_t localIndex;
 } NimbleServerParticipantJoinInfo;
 
-void nimbleServerParticipantsInit(NimbleServerParticipants* self, struct ImprintAllocator* allocator, size_t maxCount,
-                                  size_t maxStepOctetSize, Clog* log);
+void nimbleServerParticipantsInit(NimbleServerParticipants* self, struct ImprintAllocator* allocator,
+                                  struct ImprintAllocator* stepsAllocator, size_t maxCount, size_t maxStepOctetSize,
+                                  Clog* log);
 int nimbleServerParticipantsJoin(NimbleServerParticipants* self, const NimbleSerializeJoinGameRequestPlayer* joinInfo,
                                  size_t localParticipantCount, struct NimbleServerLocalParty* party, StepId stepId,
                                  struct NimbleServerParticipant** results);
+void nimbleServerParticipantsReset(NimbleServerParticipants* self);
 void nimbleServerParticipantsDestroy(NimbleServerParticipants* self, NimbleSerializeParticipantId participantId);
 int nimbleServerParticipantsPrepare(NimbleServerParticipants* self, NimbleSerializeParticipantId participantId,
                                     struct NimbleServerLocalParty* party, StepId currentAuthoritativeStepId,
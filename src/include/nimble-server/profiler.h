@@ -0,0 +1,85 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_PROFILER_H
+#define NIMBLE_SERVER_PROFILER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined NIMBLE_SERVER_PROFILER_ENABLED
+#define NIMBLE_SERVER_PROFILER_ENABLED (1)
+#endif
+
+/// The phases overlap, e.g. the game step command includes composition and range serialization.
+typedef enum NimbleServerProfilerPhase {
+    NimbleServerProfilerPhaseUpdate,
+    NimbleServerProfilerPhaseTickParties,
+    NimbleServerProfilerPhaseTransportDrain,
+    NimbleServerProfilerPhaseFeed,
+    NimbleServerProfilerPhaseCmdConnect,
+    NimbleServerProfilerPhaseCmdPing,
+    NimbleServerProfilerPhaseCmdGameStep,
+    NimbleServerProfilerPhaseCmdJoinGame,
+    NimbleServerProfilerPhaseCmdDownloadGameState,
+    NimbleServerProfilerPhaseCmdBlobStream,
+    NimbleServerProfilerPhaseIngest,
+    NimbleServerProfilerPhaseCompose,
+    NimbleServerProfilerPhaseSerializeRanges,
+    NimbleServerProfilerPhaseBlobStreamSend,
+    NimbleServerProfilerPhaseStateSerializeCallback,
+    NimbleServerProfilerPhaseCount
+} NimbleServerProfilerPhase;
+
+/// Four linear sub-buckets for each power of two, covering up to about four seconds.
+#define NIMBLE_SERVER_PROFILER_HISTOGRAM_BUCKET_COUNT (128)
+
+typedef struct NimbleServerProfilerHistogram {
+    uint32_t buckets[NIMBLE_SERVER_PROFILER_HISTOGRAM_BUCKET_COUNT];
+    uint64_t count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+} NimbleServerProfilerHistogram;
+
+typedef struct NimbleServerProfilerSummary {
+    uint64_t count;
+    uint64_t averageNs;
+    uint64_t p50Ns;
+    uint64_t p99Ns;
+    uint64_t maxNs;
+} NimbleServerProfilerSummary;
+
+typedef struct NimbleServerProfiler {
+    NimbleServerProfilerHistogram phases[NimbleServerProfilerPhaseCount];
+    bool isEnabled;
+} NimbleServerProfiler;
+
+typedef uint64_t NimbleServerProfilerTime;
+
+void nimbleServerProfilerHistogramReset(NimbleServerProfilerHistogram* self);
+void nimbleServerProfilerHistogramAdd(NimbleServerProfilerHistogram* self, uint64_t ns);
+uint64_t nimbleServerProfilerHistogramPercentile(const NimbleServerProfilerHistogram* self, size_t percent);
+
+void nimbleServerProfilerInit(NimbleServerProfiler* self);
+void nimbleServerProfilerReset(NimbleServerProfiler* self);
+NimbleServerProfilerTime nimbleServerProfilerNowNs(void);
+void nimbleServerProfilerAdd(NimbleServerProfiler* self, NimbleServerProfilerPhase phase,
+                             NimbleServerProfilerTime startedAt);
+void nimbleServerProfilerSummarize(const NimbleServerProfiler* self, NimbleServerProfilerPhase phase,
+                                   NimbleServerProfilerSummary* summary);
+const char* nimbleServerProfilerPhaseToString(NimbleServerProfilerPhase phase);
+
+#if NIMBLE_SERVER_PROFILER_ENABLED
+#define NIMBLE_SERVER_PROFILER_BEGIN(startVariable)                                                                   \
+    NimbleServerProfilerTime startVariable = nimbleServerProfilerNowNs();
+#define NIMBLE_SERVER_PROFILER_END(profiler, phase, startVariable)                                                    \
+    nimbleServerProfilerAdd(profiler, phase, startVariable);
+#else
+#define NIMBLE_SERVER_PROFILER_BEGIN(startVariable)
+#define NIMBLE_SERVER_PROFILER_END(profiler, phase, startVariable)
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_RATE_LIMIT_H
+#define NIMBLE_SERVER_RATE_LIMIT_H
+
+#include <monotonic-time/monotonic_time.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Ingress limits for a single transport connection. A zero value disables that limit.
+typedef struct NimbleServerRateLimitSetup {
+    size_t datagramsPerSecond;
+    size_t octetsPerSecond;
+    size_t predictedStepsPerSecond;
+} NimbleServerRateLimitSetup;
+
+/// Tokens are stored as milli-tokens so refill can be done with integer math at millisecond resolution.
+typedef struct NimbleServerTokenBucket {
+    uint64_t milliTokens;
+    uint64_t capacityMilliTokens;
+    size_t tokensPerSecond;
+} NimbleServerTokenBucket;
+
+typedef struct NimbleServerRateLimit {
+    NimbleServerTokenBucket datagrams;
+    NimbleServerTokenBucket octets;
+    NimbleServerTokenBucket predictedSteps;
+    MonotonicTimeMs lastRefillTimeMs;
+    size_t droppedDatagramCount;
+    size_t droppedOctetCount;
+    size_t droppedPredictedStepCount;
+} NimbleServerRateLimit;
+
+void nimbleServerTokenBucketInit(NimbleServerTokenBucket* self, size_t tokensPerSecond, size_t burstTokenCount);
+void nimbleServerTokenBucketRefill(NimbleServerTokenBucket* self, size_t elapsedMs);
+bool nimbleServerTokenBucketHasTokens(const NimbleServerTokenBucket* self, size_t tokenCount);
+bool nimbleServerTokenBucketConsume(NimbleServerTokenBucket* self, size_t tokenCount);
+
+void nimbleServerRateLimitInit(NimbleServerRateLimit* self, const NimbleServerRateLimitSetup* setup,
+                               MonotonicTimeMs now);
+void nimbleServerRateLimitRefill(NimbleServerRateLimit* self, MonotonicTimeMs now);
+bool nimbleServerRateLimitAllowDatagram(NimbleServerRateLimit* self, size_t octetCount);
+bool nimbleServerRateLimitAllowPredictedSteps(NimbleServerRateLimit* self, size_t stepCount);
+
+#endif
@@ -0,0 +1,32 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_REDUNDANCY_H
+#define NIMBLE_SERVER_REDUNDANCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Already sent steps that are always resent, so a single lost reply does not stall the client for a round trip
+#define NIMBLE_SERVER_REDUNDANCY_MIN_STEP_COUNT (2)
+
+/// Loss where the redundancy reaches maxRedundancyStepCount
+#define NIMBLE_SERVER_REDUNDANCY_MAX_LOSS_PERMILLE (200)
+
+/// Chooses how many already sent authoritative steps to resend to a transport connection, from the observed loss.
+typedef struct NimbleServerRedundancy {
+    uint32_t lossPermilleTimesSixteen;
+    size_t receivedDatagramCount;
+    size_t lostDatagramCount;
+    size_t retransmitCount;
+    size_t maxOctetCountPerReply;
+} NimbleServerRedundancy;
+
+void nimbleServerRedundancyInit(NimbleServerRedundancy* self, size_t maxOctetCountPerReply);
+void nimbleServerRedundancyDatagramReceived(NimbleServerRedundancy* self, size_t lostDatagramCount);
+uint32_t nimbleServerRedundancyLossPermille(const NimbleServerRedundancy* self);
+size_t nimbleServerRedundancyStepCount(const NimbleServerRedundancy* self, size_t maxRedundancyStepCount);
+
+#endif
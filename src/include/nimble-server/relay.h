@@ -0,0 +1,40 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_RELAY_H
+#define NIMBLE_SERVER_RELAY_H
+
+#include <nimble-server/game_state.h>
+#include <nimble-server/serialized_game_state.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+struct NimbleServer;
+struct NimbleServerSpectatorSteps;
+
+/// The copy of the upstream server that a relay serves to its spectators
+typedef struct NimbleServerRelay {
+    NimbleServerGameState gameState;
+    bool hasGameState;
+    uint8_t* stepOctets; // scratch for nimbleServerRelayPull()
+    size_t maxStepOctetCount;
+} NimbleServerRelay;
+
+void nimbleServerRelayInit(NimbleServerRelay* self, struct ImprintAllocator* allocator, size_t maxGameStateOctetCount,
+                           size_t maxStepOctetCount);
+void nimbleServerRelayReset(NimbleServerRelay* self);
+void nimbleServerRelaySerializedGameState(const NimbleServerRelay* self, NimbleServerSerializedGameState* target);
+
+int nimbleServerRelaySetGameState(struct NimbleServer* self, StepId stepId, const uint8_t* gameState,
+                                  size_t gameStateOctetCount);
+int nimbleServerRelayAddAuthoritativeStep(struct NimbleServer* self, StepId stepId, const uint8_t* octets,
+                                          size_t octetCount);
+int nimbleServerRelayPull(struct NimbleServer* self, const struct NimbleServerSpectatorSteps* upstream);
+int nimbleServerRelayPullGameState(struct NimbleServer* self, struct NimbleServer* upstream);
+
+#endif
@@ -6,6 +6,7 @@
 #ifndef NIMBLE_SERVER_REQ_DOWNLOAD_GAME_STATE_ACK_H
 #define NIMBLE_SERVER_REQ_DOWNLOAD_GAME_STATE_ACK_H
 
+#include <monotonic-time/monotonic_time.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -13,12 +14,17 @@ struct NimbleServerLocalParty;
 struct NimbleServerTransportConnection;
 struct DatagramTransportOut;
 struct FldInStream;
+struct NimbleServerGame;
+struct NimbleServerProfiler;
+struct NimbleServerTrace;
 
 int nimbleServerReqBlobStream(struct NimbleServerGame* game,
                                         struct NimbleServerTransportConnection* transportConnection,
-                                        struct FldInStream* inStream, struct DatagramTransportOut* transportOut);
+                                        struct NimbleServerProfiler* profiler, struct FldInStream* inStream,
+                                        struct DatagramTransportOut* transportOut);
 
 int nimbleServerSendBlobStream(struct NimbleServerTransportConnection* transportConnection,
-                               struct DatagramTransportOut* transportOut);
+                               struct DatagramTransportOut* transportOut, size_t maxEntryCount,
+                               MonotonicTimeMs now, struct NimbleServerTrace* trace);
 
 #endif
@@ -14,6 +14,9 @@ struct FldOutStream;
 struct FldInStream;
 struct NimbleServerTransportConnection;
 
+/// Party id in the join response for a spectator, a join request without participants
+#define NIMBLE_SERVER_SPECTATOR_PARTY_ID (0xff)
+
 int nimbleServerReqGameJoin(struct NimbleServer* self, struct NimbleServerTransportConnection* transportConnection,
                             struct FldInStream* inStream, struct FldOutStream* outStream);
 
@@ -6,13 +6,16 @@
 #ifndef NIMBLE_SERVER_REQ_PING_H
 #define NIMBLE_SERVER_REQ_PING_H
 
+#include <monotonic-time/monotonic_time.h>
 #include <stddef.h>
 #include <stdint.h>
 
 struct FldOutStream;
 struct FldInStream;
 struct Clog;
+struct NimbleServerTransportConnection;
 
-int nimbleServerReqPing(struct FldInStream* inStream, struct FldOutStream* outStream, struct Clog* log);
+int nimbleServerReqPing(struct NimbleServerTransportConnection* transportConnection, MonotonicTimeMs now,
+                        struct FldInStream* inStream, struct FldOutStream* outStream, struct Clog* log);
 
 #endif
@@ -6,6 +6,7 @@
 #ifndef NIMBLE_SERVER_REQ_STEP_H
 #define NIMBLE_SERVER_REQ_STEP_H
 
+#include <nimble-steps/steps.h>
 #include <stats/stats_per_second.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -16,9 +17,21 @@ struct NimbleServerLocalParties;
 struct NimbleServerTransportConnection;
 struct FldOutStream;
 struct FldInStream;
+struct NimbleServerProfiler;
 
 int nimbleServerReqGameStep(struct NimbleServerGame* game, struct NimbleServerTransportConnection* transportConnection,
-                            StatsIntPerSecond* authoritativeStepsPerSecondStat, struct FldInStream* inStream,
-                            struct FldOutStream* response);
+                            StatsIntPerSecond* authoritativeStepsPerSecondStat, struct NimbleServerProfiler* profiler,
+                            struct FldInStream* inStream, struct FldOutStream* response);
+int nimbleServerReqGameStepDiscardOldAuthoritativeSteps(struct NimbleServerGame* game);
+int nimbleServerReqGameStepCompose(struct NimbleServerGame* game, StatsIntPerSecond* authoritativeStepsPerSecondStat,
+                                   struct NimbleServerProfiler* profiler);
+int nimbleServerReqGameStepReply(struct NimbleServerGame* game,
+                                 struct NimbleServerTransportConnection* transportConnection,
+                                 struct NimbleServerProfiler* profiler, StepId clientWaitingForStepId,
+                                 struct FldOutStream* response);
+int nimbleServerReqSpectatorGameStep(struct NimbleServerGame* game,
+                                     struct NimbleServerTransportConnection* transportConnection,
+                                     struct NimbleServerProfiler* profiler, struct FldInStream* inStream,
+                                     struct FldOutStream* response);
 
 #endif
@@ -0,0 +1,70 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_ROUND_TRIP_TIME_H
+#define NIMBLE_SERVER_ROUND_TRIP_TIME_H
+
+#include <monotonic-time/monotonic_time.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Must be a power of two. Acknowledgements of steps that were sent longer ago than this are not sampled.
+#define NIMBLE_SERVER_ROUND_TRIP_TIME_SENT_STEP_WINDOW (64)
+
+typedef struct NimbleServerSentStep {
+    StepId stepId;
+    MonotonicTimeMs sentAtMs;
+    bool isSet;
+} NimbleServerSentStep;
+
+/// Smoothed round trip time and variance for a transport connection, in the same way as TCP (RFC 6298).
+/// The samples are the time from when an authoritative step was first sent until the client reports that it is
+/// waiting for the step after it, so they include up to one client tick of processing.
+/// Ping requests only carry the client time, so they can not give a round trip time on the server. They are used to
+/// estimate the one way jitter instead (RFC 3550).
+typedef struct NimbleServerRoundTripTime {
+    NimbleServerSentStep sentSteps[NIMBLE_SERVER_ROUND_TRIP_TIME_SENT_STEP_WINDOW];
+    StepId highestSentStepId;
+    bool hasSentSteps;
+    StepId highestSampledStepId;
+
+    uint32_t smoothedMsTimesEight;
+    uint32_t varianceMsTimesFour;
+    uint32_t latestMs;
+    uint32_t minMs;
+    size_t sampleCount;
+
+    bool hasPing;
+    uint64_t lastPingClientTime;
+    MonotonicTimeMs lastPingArrivalMs;
+    uint32_t pingJitterMsTimesSixteen;
+} NimbleServerRoundTripTime;
+
+typedef struct NimbleServerRoundTripTimeSummary {
+    uint32_t smoothedMs;
+    uint32_t varianceMs;
+    uint32_t latestMs;
+    uint32_t minMs;
+    uint32_t pingJitterMs;
+    size_t sampleCount;
+} NimbleServerRoundTripTimeSummary;
+
+void nimbleServerRoundTripTimeInit(NimbleServerRoundTripTime* self);
+void nimbleServerRoundTripTimeAddSample(NimbleServerRoundTripTime* self, uint32_t roundTripTimeMs);
+void nimbleServerRoundTripTimeStepsSent(NimbleServerRoundTripTime* self, StepId firstStepId, size_t stepCount,
+                                        MonotonicTimeMs now);
+void nimbleServerRoundTripTimeStepsAcknowledged(NimbleServerRoundTripTime* self, StepId waitingForStepId,
+                                                MonotonicTimeMs now);
+void nimbleServerRoundTripTimePingReceived(NimbleServerRoundTripTime* self, uint64_t clientTime,
+                                           MonotonicTimeMs now);
+bool nimbleServerRoundTripTimeIsStepInFlight(const NimbleServerRoundTripTime* self, StepId stepId,
+                                             MonotonicTimeMs now);
+uint32_t nimbleServerRoundTripTimeTimeoutMs(const NimbleServerRoundTripTime* self, uint32_t fallbackMs);
+void nimbleServerRoundTripTimeSummarize(const NimbleServerRoundTripTime* self,
+                                        NimbleServerRoundTripTimeSummary* summary);
+
+#endif
@@ -9,9 +9,20 @@
 #include <clog/clog.h>
 #include <datagram-transport/multi.h>
 #include <nimble-serialize/version.h>
+#include <nimble-server/capture.h>
 #include <nimble-server/game.h>
+#include <nimble-server/ingest.h>
+#include <nimble-server/journal.h>
+#include <nimble-server/forced_step.h>
 #include <nimble-server/local_parties.h>
+#include <nimble-server/memory.h>
+#include <nimble-server/profiler.h>
+#include <nimble-server/rate_limit.h>
+#include <nimble-server/relay.h>
+#include <nimble-server/round_trip_time.h>
 #include <nimble-server/serialized_game_state.h>
+#include <nimble-server/spectator_steps.h>
+#include <nimble-server/trace.h>
 #include <nimble-server/transport_connection.h>
 #include <nimble-server/update_quality.h>
 #include <nimble-steps/steps.h>
@@ -23,12 +34,13 @@ struct ImprintAllocatorWithFree;
 struct ImprintAllocator;
 struct NimbleServerParticipant;
 
-#define NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS 64
-
 typedef void (*NimbleServerSerializeStateFn)(void* self, NimbleServerSerializedGameState* state);
+typedef void (*NimbleServerUpdateQualityChangedFn)(void* self, NimbleServerUpdateQualityState previousState,
+                                                   NimbleServerUpdateQualityState state);
 
 typedef struct NimbleServerCallbackObjectVtbl {
     NimbleServerSerializeStateFn authoritativeStateSerializeFn;
+    NimbleServerUpdateQualityChangedFn updateQualityChangedFn; // optional
 } NimbleServerCallbackObjectVtbl;
 
 typedef struct NimbleServerCallbackObject {
@@ -50,15 +62,33 @@ typedef struct NimbleServerSetup {
     DatagramTransportMulti multiTransport;
     MonotonicTimeMs now;
     size_t targetTickTimeMs;
+    NimbleServerRateLimitSetup ingressRateLimit;
+    size_t maxStepRangeOctetCountPerReply; // zero only limits by the datagram size
+    NimbleServerForcedStepStrategy forcedStepStrategy; // zeroed for empty forced steps
+    size_t memoryBudgetOctetCount; // joins and game state downloads fail beyond it. zero is no budget
+    NimbleServerWorkerPool workerPool; // zeroed to read all datagrams on the calling thread
+    size_t maxSpectatorCount; // connections that join without participants. not part of maxParticipantCount
+    size_t spectatorStepCapacity; // composed steps kept for nimbleServerSpectatorSteps(), a power of two or zero
+    bool isRelay; // steps and game state come from an upstream server, see relay.h. only spectators can join
+    size_t journalOctetCount; // memory for authoritative steps waiting to be journaled, zero disables the journal
+    bool useCompactStepEncoding; // clients with a nimble version that decodes it get compact steps, see compact_steps.h
     Clog log;
 } NimbleServerSetup;
 
 typedef struct NimbleServer {
+    NimbleServerTransportConnectionsHot transportConnectionsHot;
     NimbleServerTransportConnection transportConnections[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
     NimbleServerLocalParties localParties;
     NimbleServerGame game;
     struct ImprintAllocator* pageAllocator;
     struct ImprintAllocatorWithFree* blobAllocator;
+    NimbleServerMemory memory;
+    NimbleServerTrackedAllocator gameAllocator;
+    NimbleServerTrackedAllocator participantStepsAllocator;
+    NimbleServerTrackedAllocator localPartiesAllocator;
+    NimbleServerTrackedAllocator blobStreamPageAllocator;
+    NimbleServerTrackedAllocatorWithFree downloadAllocator;
+    NimbleServerTrackedAllocatorWithFree blobStreamAllocator;
     NimbleSerializeVersion applicationVersion;
     Clog log;
     DatagramTransportMulti multiTransport;
@@ -66,9 +96,18 @@ typedef struct NimbleServer {
     uint16_t statsCounter;
     StatsIntPerSecond authoritativeStepsPerSecondStat;
     NimbleServerUpdateQuality updateQuality;
+    NimbleServerProfiler profiler;
+    NimbleServerCapture capture;
+    NimbleServerTrace trace;
+    NimbleServerIngestBatch ingestBatch; // only used with a worker pool
+    NimbleServerSpectatorSteps spectatorSteps; // only used with a spectatorStepCapacity
+    size_t spectatorCount;
+    NimbleServerRelay relay; // only used when the setup isRelay
+    NimbleServerJournal journal; // only used with a journalOctetCount, see journal.h
+    NbsSteps catchUpSteps; // only used after nimbleServerSetJournalSource()
     NimbleServerCallbackObject callbackObject;
+    MonotonicTimeMs now;
 
-    NimbleServerCircularBuffer freeTransportConnectionList;
     NimbleSerializeSessionSecret sessionSecret;
 } NimbleServer;
 
@@ -89,6 +128,11 @@ bool nimbleServerMustProvideGameState(const NimbleServer* self);
 void nimbleServerSetGameState(NimbleServer* self, const uint8_t* gameState, size_t gameStateOctetCount, StepId stepId);
 int nimbleServerConnectionConnected(NimbleServer* self, uint8_t connectionIndex);
 int nimbleServerConnectionDisconnected(NimbleServer* self, uint8_t connectionIndex);
+int nimbleServerConnectionRoundTripTime(const NimbleServer* self, uint8_t connectionIndex,
+                                        NimbleServerRoundTripTimeSummary* summary);
 bool nimbleServerIsErrorExternal(int err);
+const NimbleServerMemory* nimbleServerMemory(const NimbleServer* self);
+const NimbleServerSpectatorSteps* nimbleServerSpectatorSteps(const NimbleServer* self);
+void nimbleServerSetJournalSource(NimbleServer* self, NimbleServerJournalSource source);
 
 #endif
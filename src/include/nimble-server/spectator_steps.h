@@ -0,0 +1,47 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_SPECTATOR_STEPS_H
+#define NIMBLE_SERVER_SPECTATOR_STEPS_H
+
+#include <clog/clog.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+
+/// A composed authoritative step. The sequence is odd while the tick thread writes to the slot.
+typedef struct NimbleServerSpectatorStepSlot {
+    volatile size_t sequence;
+    bool hasStep;
+    StepId stepId;
+    size_t octetCount;
+    uint8_t* octets;
+} NimbleServerSpectatorStepSlot;
+
+/// Copies of the latest composed authoritative steps, for in-process spectators such as broadcast encoders.
+/// The tick thread publishes each step as it is composed and never waits for the readers. Readers, on any thread,
+/// copy a step out and get NimbleServerErrSpectatorStepNotAvailable if it was replaced while they read it.
+typedef struct NimbleServerSpectatorSteps {
+    NimbleServerSpectatorStepSlot* slots;
+    size_t capacity;
+    size_t maxStepOctetCount;
+    volatile size_t publishedCount;
+    volatile size_t lastPublishedStepId;
+    Clog log;
+} NimbleServerSpectatorSteps;
+
+void nimbleServerSpectatorStepsInit(NimbleServerSpectatorSteps* self, struct ImprintAllocator* allocator,
+                                    size_t capacity, size_t maxStepOctetCount, Clog log);
+void nimbleServerSpectatorStepsReset(NimbleServerSpectatorSteps* self);
+void nimbleServerSpectatorStepsPublish(NimbleServerSpectatorSteps* self, StepId stepId, const uint8_t* octets,
+                                       size_t octetCount);
+int nimbleServerSpectatorStepsRead(const NimbleServerSpectatorSteps* self, StepId stepId, uint8_t* target,
+                                   size_t maxTargetOctetCount);
+bool nimbleServerSpectatorStepsLatest(const NimbleServerSpectatorSteps* self, StepId* outStepId);
+
+#endif
@@ -0,0 +1,64 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_STEP_LATENCY_H
+#define NIMBLE_SERVER_STEP_LATENCY_H
+
+#include <monotonic-time/monotonic_time.h>
+#include <nimble-server/profiler.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Must be a power of two. Steps that are further ahead of composition than this are not measured.
+#define NIMBLE_SERVER_STEP_ARRIVAL_WINDOW (64)
+
+/// When a predicted step was received, and which authoritative step the server was about to compose at that time.
+typedef struct NimbleServerStepArrival {
+    StepId stepId;
+    StepId authoritativeStepId;
+    MonotonicTimeMs timeMs;
+    bool isSet;
+} NimbleServerStepArrival;
+
+typedef struct NimbleServerStepArrivals {
+    NimbleServerStepArrival arrivals[NIMBLE_SERVER_STEP_ARRIVAL_WINDOW];
+} NimbleServerStepArrivals;
+
+/// How long predicted steps waited from arrival until they were used in an authoritative step.
+/// A short wait means that the steps arrive just in time, and that the source is the one that the composition
+/// lookahead is waiting for.
+typedef struct NimbleServerStepLatency {
+    NimbleServerProfilerHistogram waitTime;
+    uint64_t totalWaitStepCount;
+    uint32_t minWaitStepCount;
+    uint32_t maxWaitStepCount;
+    uint64_t committedCount;
+    uint64_t missedCount;
+} NimbleServerStepLatency;
+
+typedef struct NimbleServerStepLatencySummary {
+    uint64_t committedCount;
+    uint64_t missedCount;
+    uint64_t waitTimeP50Ms;
+    uint64_t waitTimeP99Ms;
+    uint32_t averageWaitStepCount;
+    uint32_t minWaitStepCount;
+    uint32_t maxWaitStepCount;
+} NimbleServerStepLatencySummary;
+
+void nimbleServerStepArrivalsReset(NimbleServerStepArrivals* self);
+void nimbleServerStepArrivalsAdd(NimbleServerStepArrivals* self, StepId stepId, StepId authoritativeStepId,
+                                 MonotonicTimeMs now);
+bool nimbleServerStepArrivalsFind(const NimbleServerStepArrivals* self, StepId stepId,
+                                  NimbleServerStepArrival* outArrival);
+
+void nimbleServerStepLatencyReset(NimbleServerStepLatency* self);
+void nimbleServerStepLatencyAddCommitted(NimbleServerStepLatency* self, const NimbleServerStepArrival* arrival,
+                                         StepId composedStepId, MonotonicTimeMs now);
+void nimbleServerStepLatencyAddMissed(NimbleServerStepLatency* self);
+void nimbleServerStepLatencySummarize(const NimbleServerStepLatency* self, NimbleServerStepLatencySummary* summary);
+
+#endif
@@ -0,0 +1,53 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_STEPS_POOL_H
+#define NIMBLE_SERVER_STEPS_POOL_H
+
+#include <clog/clog.h>
+#include <imprint/allocator.h>
+#include <nimble-server/circular_buffer.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/// Number of slots that are allocated together when the pool needs to grow
+#define NIMBLE_SERVER_STEPS_POOL_SLOTS_PER_SLAB (4)
+
+struct NimbleServerStepsPool;
+
+/// Step storage for one participant. The allocator hands out memory from the slot, so it can be given to
+/// nbsStepsInit().
+typedef struct NimbleServerStepsPoolSlot {
+    ImprintAllocator allocator; // must be first, the allocator functions cast back to the slot
+    struct NimbleServerStepsPool* pool;
+    uint8_t* octets;
+    size_t allocatedOctetCount;
+    uint8_t index;
+    bool isUsed;
+} NimbleServerStepsPoolSlot;
+
+/// Shared step storage for the participants in a game. Slots are borrowed when a participant joins and returned
+/// when it is destroyed. The memory for the slots is allocated a slab at a time, the first time that many
+/// participants are in the game at once.
+typedef struct NimbleServerStepsPool {
+    ImprintAllocator* slabAllocator;
+    NimbleServerStepsPoolSlot* slots;
+    size_t slotCapacity;
+    size_t slotOctetCount;
+    size_t slabbedSlotCount;
+    size_t usedSlotCount;
+    NimbleServerCircularBuffer freeSlots;
+    Clog log;
+} NimbleServerStepsPool;
+
+void nimbleServerStepsPoolInit(NimbleServerStepsPool* self, ImprintAllocator* allocator,
+                               ImprintAllocator* slabAllocator, size_t slotCapacity, size_t maxStepOctetCount,
+                               Clog log);
+NimbleServerStepsPoolSlot* nimbleServerStepsPoolAcquire(NimbleServerStepsPool* self);
+void nimbleServerStepsPoolRelease(NimbleServerStepsPool* self, NimbleServerStepsPoolSlot* slot);
+size_t nimbleServerStepsPoolAllocatedOctetCount(const NimbleServerStepsPool* self);
+
+#endif
@@ -0,0 +1,84 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_TRACE_H
+#define NIMBLE_SERVER_TRACE_H
+
+#include <monotonic-time/monotonic_time.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined NIMBLE_SERVER_TRACE_ENABLED
+#define NIMBLE_SERVER_TRACE_ENABLED (1)
+#endif
+
+/// Must be a power of two
+#define NIMBLE_SERVER_TRACE_EVENT_COUNT (4096)
+
+/// Trace dump layout, all values little endian:
+///   header (16 octets): magic "NIMBTRCE", uint32 version, uint32 event count
+///   events, oldest first (16 octets each): int64 timeMs, uint8 type, uint8 target, uint16 detail, uint32 value
+#define NIMBLE_SERVER_TRACE_VERSION (1)
+#define NIMBLE_SERVER_TRACE_HEADER_OCTET_COUNT (16)
+#define NIMBLE_SERVER_TRACE_EVENT_OCTET_COUNT (16)
+#define NIMBLE_SERVER_TRACE_MAX_DUMP_OCTET_COUNT                                                                      \
+    (NIMBLE_SERVER_TRACE_HEADER_OCTET_COUNT + NIMBLE_SERVER_TRACE_EVENT_COUNT * NIMBLE_SERVER_TRACE_EVENT_OCTET_COUNT)
+
+typedef enum NimbleServerTraceEventType {
+    NimbleServerTraceEventTypeDatagramIn,           // target: connection index, value: octet count
+    NimbleServerTraceEventTypeDatagramOut,          // target: connection index, value: octet count
+    NimbleServerTraceEventTypeStepComposed,         // detail: octet count, value: step id
+    NimbleServerTraceEventTypeForcedStep,           // target: participant id, detail: party id, value: step id
+    NimbleServerTraceEventTypePartyJoined,          // target: party id, detail: connection id, value: participant count
+    NimbleServerTraceEventTypePartyStateChanged,    // target: party id, detail: previous state, value: state
+    NimbleServerTraceEventTypeBlobChunkSent,        // target: connection index, detail: octet count, value: chunk id
+    NimbleServerTraceEventTypeUpdateQualityChanged, // detail: previous state, value: state
+    NimbleServerTraceEventTypeCount
+} NimbleServerTraceEventType;
+
+typedef struct NimbleServerTraceEvent {
+    MonotonicTimeMs timeMs;
+    uint8_t type;
+    uint8_t target;
+    uint16_t detail;
+    uint32_t value;
+} NimbleServerTraceEvent;
+
+/// Fixed size ring of the latest events. There is a single writer, the thread that updates the server, and recording
+/// never takes a lock or allocates. Old events are overwritten.
+/// Each event is published with a release store of writeCount, so a dump from another thread, e.g. a crash handler,
+/// only includes complete events. The oldest events in such a dump can still be overwritten while they are copied,
+/// if the writer records more events during the dump.
+typedef struct NimbleServerTrace {
+    NimbleServerTraceEvent events[NIMBLE_SERVER_TRACE_EVENT_COUNT];
+    volatile size_t writeCount;
+    MonotonicTimeMs now;
+} NimbleServerTrace;
+
+/// Reads events from a trace dump in memory
+typedef struct NimbleServerTraceReader {
+    const uint8_t* octets;
+    size_t eventCount;
+    size_t index;
+} NimbleServerTraceReader;
+
+void nimbleServerTraceInit(NimbleServerTrace* self);
+void nimbleServerTraceSetTime(NimbleServerTrace* self, MonotonicTimeMs now);
+void nimbleServerTraceAdd(NimbleServerTrace* self, NimbleServerTraceEventType type, uint8_t target, uint16_t detail,
+                          uint32_t value);
+int nimbleServerTraceDump(const NimbleServerTrace* self, uint8_t* target, size_t maxOctetCount);
+
+int nimbleServerTraceReaderInit(NimbleServerTraceReader* self, const uint8_t* octets, size_t octetCount);
+int nimbleServerTraceReaderRead(NimbleServerTraceReader* self, NimbleServerTraceEvent* event);
+const char* nimbleServerTraceEventTypeToString(NimbleServerTraceEventType type);
+
+#if NIMBLE_SERVER_TRACE_ENABLED
+#define NIMBLE_SERVER_TRACE(trace, type, target, detail, value)                                                       \
+    nimbleServerTraceAdd(trace, type, (uint8_t) (target), (uint16_t) (detail), (uint32_t) (value));
+#else
+#define NIMBLE_SERVER_TRACE(trace, type, target, detail, value)
+#endif
+
+#endif
@@ -12,9 +12,13 @@
 #include <imprint/tagged_allocator.h>
 #include <nimble-serialize/serialize.h>
 #include <nimble-serialize/version.h>
+#include <nimble-server/compact_steps.h>
 #include <nimble-server/game.h>
 #include <nimble-server/local_parties.h>
 #include <nimble-server/participants.h>
+#include <nimble-server/rate_limit.h>
+#include <nimble-server/redundancy.h>
+#include <nimble-server/round_trip_time.h>
 #include <nimble-steps/steps.h>
 #include <ordered-datagram/in_logic.h>
 #include <ordered-datagram/out_logic.h>
@@ -25,6 +29,8 @@
 
 struct FldOutStream;
 
+#define NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS 64
+
 typedef enum NimbleServerTransportConnectionPhase {
     NbTransportConnectionPhaseIdle,
     NbTransportConnectionPhaseWaitingForValidConnect,
@@ -33,34 +39,59 @@ typedef enum NimbleServerTransportConnectionPhase {
     NbTransportConnectionPhaseDisconnected
 } NimbleServerTransportConnectionPhase;
 
+/// Game state download for a transport connection. Only allocated while the client downloads the game state.
+typedef struct NimbleServerTransportConnectionDownload {
+    NimbleServerGameState gameState;
+    BlobStreamOut blobStreamOut;
+    BlobStreamLogicOut blobStreamLogicOut;
+    bool hasBlobStreamOut;
+} NimbleServerTransportConnectionDownload;
+
+/// The transport connection fields that are scanned over all the connections, as dense arrays indexed by the
+/// transport connection id. Refilling the rate limits every tick and looking up connect requests only touch these.
+typedef struct NimbleServerTransportConnectionsHot {
+    bool isUsed[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+    uint8_t transportIndex[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+    NimbleSerializeClientRequestId connectedFromConnectRequestId[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+    NimbleServerRateLimit rateLimits[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+} NimbleServerTransportConnectionsHot;
+
 typedef struct NimbleServerTransportConnection {
+    NimbleServerTransportConnectionsHot* hot; // the scanned fields are at index transportConnectionId
+    NimbleServerTransportConnectionPhase phase;
     uint8_t id;
     uint8_t transportConnectionId;
-    uint8_t transportIndex;
-    NimbleSerializeClientRequestId connectedFromConnectRequestId;
-    uint64_t secret;
     struct NimbleServerLocalParty* assignedParty;
+    bool isSpectator; // joined without participants, only receives the authoritative steps
     OrderedDatagramInLogic orderedDatagramInLogic;
     OrderedDatagramOutLogic orderedDatagramOutLogic;
+    NimbleServerStepEncoding stepEncoding; // for both authoritative step ranges and predicted step uploads
+    uint8_t noRangesToSendCounter;
+    bool useDebugStreams;
+    bool hasConnectRequest; // connected with a connect request, and not only by sending datagrams
+    uint64_t secret;
 
-    BlobStreamOut blobStreamOut;
-    BlobStreamLogicOut blobStreamLogicOut;
+    NimbleServerTransportConnectionDownload* download; // zero when no game state download has been requested
     BlobStreamTransferId nextBlobStreamOutChannel;
     uint8_t blobStreamOutClientRequestId;
-    ImprintAllocatorWithFree* blobStreamOutAllocator;
+    ImprintAllocatorWithFree* downloadAllocator;
+    size_t maxGameStateOctetCount;
+
+    NimbleServerRedundancy redundancy;
+    NimbleServerRoundTripTime roundTripTime;
     StatsInt stepsBehindStats;
     size_t debugCounter;
     Clog log;
-    bool isUsed;
-    bool useDebugStreams;
-    uint8_t noRangesToSendCounter;
-    NimbleServerTransportConnectionPhase phase;
-    NimbleServerGameState gameState;
 } NimbleServerTransportConnection;
 
-void transportConnectionInit(NimbleServerTransportConnection* self, ImprintAllocatorWithFree* blobStreamAllocator,
-                             size_t maxGameOctetSize, Clog log);
+void transportConnectionInit(NimbleServerTransportConnection* self, ImprintAllocatorWithFree* downloadAllocator,
+                             size_t maxGameOctetSize, const NimbleServerRateLimitSetup* rateLimitSetup,
+                             size_t maxStepRangeOctetCountPerReply, MonotonicTimeMs now, Clog log);
 void transportConnectionDisconnect(NimbleServerTransportConnection* self);
+bool transportConnectionIsUsed(const NimbleServerTransportConnection* self);
+NimbleServerRateLimit* transportConnectionRateLimit(NimbleServerTransportConnection* self);
+NimbleServerTransportConnectionDownload* transportConnectionPrepareDownload(NimbleServerTransportConnection* self);
+void transportConnectionFreeDownload(NimbleServerTransportConnection* self);
 void transportConnectionSetGameStateTickId(NimbleServerTransportConnection* self);
 int transportConnectionWriteHeader(NimbleServerTransportConnection* self, struct FldOutStream* outStream);
 void transportConnectionCommitHeader(NimbleServerTransportConnection* self);
@@ -8,9 +8,12 @@
 
 #include <monotonic-time/monotonic_time.h>
 #include <stats/stats.h>
+#include <stdbool.h>
 
 typedef enum NimbleServerUpdateQualityState {
     NimbleServerUpdateQualityStateWorking,
+    NimbleServerUpdateQualityStateDegradedShedding,
+    NimbleServerUpdateQualityStateDegradedLookAhead,
     NimbleServerUpdateQualityStateFailedTickTime,
     NimbleServerUpdateQualityStateFailedAverageTickTime
 } NimbleServerUpdateQualityState;
@@ -20,12 +23,15 @@ typedef struct NimbleServerUpdateQuality {
     StatsInt measuredDeltaTimeMsStat;
     size_t averageTickTimeFailedInARow;
     size_t deltaTickTimeFailedInARow;
+    size_t stableTicksInARow;
     size_t targetTimeMs;
     NimbleServerUpdateQualityState state;
 } NimbleServerUpdateQuality;
 
-void nimbleServerUpdateQualityInit(NimbleServerUpdateQuality* self, size_t targetTimeMs);
-void nimbleServerUpdateQualityReInit(NimbleServerUpdateQuality* self);
-int nimbleServerUpdateQualityTick(NimbleServerUpdateQuality* self);
+void nimbleServerUpdateQualityInit(NimbleServerUpdateQuality* self, size_t targetTimeMs, MonotonicTimeMs now);
+void nimbleServerUpdateQualityReInit(NimbleServerUpdateQuality* self, MonotonicTimeMs now);
+int nimbleServerUpdateQualityTick(NimbleServerUpdateQuality* self, MonotonicTimeMs now);
+bool nimbleServerUpdateQualityIsDegraded(const NimbleServerUpdateQuality* self);
+const char* nimbleServerUpdateQualityStateToString(NimbleServerUpdateQualityState state);
 
 #endif
@@ -0,0 +1,22 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_VARINT_H
+#define NIMBLE_SERVER_VARINT_H
+
+#include <stdint.h>
+
+struct FldOutStream;
+struct FldInStream;
+
+/// Seven bits per octet, least significant group first. The high bit is set if more octets follow.
+#define NIMBLE_SERVER_VARINT_MAX_OCTET_COUNT (5)
+
+int nimbleServerVarIntWrite(struct FldOutStream* outStream, uint32_t value);
+int nimbleServerVarIntRead(struct FldInStream* inStream, uint32_t* value);
+int nimbleServerVarIntWriteSigned(struct FldOutStream* outStream, int32_t value);
+int nimbleServerVarIntReadSigned(struct FldInStream* inStream, int32_t* value);
+
+#endif
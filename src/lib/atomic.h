@@ -0,0 +1,71 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_ATOMIC_H
+#define NIMBLE_SERVER_ATOMIC_H
+
+#include <stddef.h>
+
+/// Acquire loads and release stores of a size_t, and fences, for the few places where two threads share memory.
+/// The library is C99, so <stdatomic.h> can not be used.
+
+#if defined _MSC_VER
+#include <intrin.h>
+
+#if defined _M_ARM64 || defined _M_ARM
+#define NIMBLE_SERVER_ATOMIC_FENCE() __dmb(_ARM64_BARRIER_ISH)
+#else
+// Volatile accesses already have acquire and release semantics on x86 and x64
+#define NIMBLE_SERVER_ATOMIC_FENCE() _ReadWriteBarrier()
+#endif
+
+static inline size_t nimbleServerAtomicLoadAcquire(const volatile size_t* p)
+{
+    size_t value = *p;
+    NIMBLE_SERVER_ATOMIC_FENCE();
+    return value;
+}
+
+static inline void nimbleServerAtomicStoreRelease(volatile size_t* p, size_t value)
+{
+    NIMBLE_SERVER_ATOMIC_FENCE();
+    *p = value;
+}
+
+static inline void nimbleServerAtomicFenceAcquire(void)
+{
+    NIMBLE_SERVER_ATOMIC_FENCE();
+}
+
+static inline void nimbleServerAtomicFenceRelease(void)
+{
+    NIMBLE_SERVER_ATOMIC_FENCE();
+}
+
+#else
+
+static inline size_t nimbleServerAtomicLoadAcquire(const volatile size_t* p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void nimbleServerAtomicStoreRelease(volatile size_t* p, size_t value)
+{
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+static inline void nimbleServerAtomicFenceAcquire(void)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+static inline void nimbleServerAtomicFenceRelease(void)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+#endif
+
+#endif
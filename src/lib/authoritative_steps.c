@@ -4,26 +4,107 @@
  *--------------------------------------------------------------------------------------------------------*/
 
 #include "authoritative_steps.h"
+#include "log.h"
 #include <flood/in_stream.h>
 #include <nimble-serialize/server_out.h>
+#include <nimble-server/forced_step.h>
 #include <nimble-server/local_parties.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/participant.h>
 #include <nimble-server/participants.h>
+#include <nimble-server/step_latency.h>
+#include <nimble-server/trace.h>
 #include <nimble-server/transport_connection.h>
 #include <nimble-steps-serialize/types.h>
 
 #define NIMBLE_SERVER_LOGGING 1
 
+/// The step outcome of one participant in a composed authoritative step. The step latency is recorded after the
+/// participant loop, so composing only touches the hot participant data.
+typedef struct StepLatencyOutcome {
+    NimbleServerParticipant* participant;
+    NimbleServerLocalParty* party;
+    bool wasMissed;
+} StepLatencyOutcome;
+
+/// Composed steps contain at most one entry for each participant id
+#define NIMBLE_SERVER_MAX_STEP_LATENCY_OUTCOMES (256)
+
+typedef struct StepLatencyOutcomes {
+    StepLatencyOutcome outcomes[NIMBLE_SERVER_MAX_STEP_LATENCY_OUTCOMES];
+    size_t outcomeCount;
+} StepLatencyOutcomes;
+
+static void addStepLatencyOutcome(StepLatencyOutcomes* self, NimbleServerParticipant* participant, bool wasMissed)
+{
+    if (self->outcomeCount == NIMBLE_SERVER_MAX_STEP_LATENCY_OUTCOMES) {
+        return;
+    }
+    StepLatencyOutcome* outcome = &self->outcomes[self->outcomeCount++];
+    outcome->participant = participant;
+    outcome->party = participant->inParty;
+    outcome->wasMissed = wasMissed;
+}
+
+/// Measures how long the steps waited from arrival until they were used in the authoritative step, and counts the
+/// steps that were forced.
+/// @param self outcomes from composing the authoritative step
+/// @param lookingFor the stepId that was composed
+/// @param now current server time
+static void recordStepLatencyOutcomes(const StepLatencyOutcomes* self, StepId lookingFor, MonotonicTimeMs now)
+{
+    for (size_t i = 0; i < self->outcomeCount; ++i) {
+        const StepLatencyOutcome* outcome = &self->outcomes[i];
+        NimbleServerParticipantCold* participantCold = outcome->participant->cold;
+        if (outcome->wasMissed) {
+            nimbleServerStepLatencyAddMissed(&participantCold->stepLatency);
+            nimbleServerStepLatencyAddMissed(&outcome->party->cold->stepLatency);
+            continue;
+        }
+        NimbleServerStepArrival arrival;
+        if (!nimbleServerStepArrivalsFind(&participantCold->stepArrivals, lookingFor, &arrival)) {
+            continue;
+        }
+        nimbleServerStepLatencyAddCommitted(&participantCold->stepLatency, &arrival, lookingFor, now);
+        nimbleServerStepLatencyAddCommitted(&outcome->party->cold->stepLatency, &arrival, lookingFor, now);
+    }
+}
+
+/// Creates the step to use when a participant has not provided one in time, using the forced step strategy.
+/// @param game game with the forced step strategy
+/// @param participant participant that did not provide a step
+/// @param lookingFor the stepId that is composed
+/// @param target the forced step is written here
+/// @param maxTargetOctetCount size of target
+/// @return octet count of a normal step, or negative if an empty forced step should be used
+static int createForcedStep(const NimbleServerGame* game, NimbleServerParticipant* participant, StepId lookingFor,
+                            uint8_t* target, size_t maxTargetOctetCount)
+{
+    participant->forcedStepInRowCount++;
+
+    NimbleServerForcedStepContext context;
+    context.participantId = participant->id;
+    context.partyId = participant->inParty->id;
+    context.stepId = lookingFor;
+    context.forcedStepInRowCount = participant->forcedStepInRowCount;
+    context.lastStepOctets = participant->lastStepOctets;
+    context.lastStepOctetCount = participant->lastStepOctetCount;
+    context.hasLastStep = participant->hasLastStep;
+
+    return nimbleServerForcedStepCreate(game->forcedStepStrategy, &context, target, maxTargetOctetCount);
+}
+
 /// Composes one authoritative steps from the collection of participants.
-/// @param participants all the participants to combine steps from .
+/// @param game game with all the participants to combine steps from
 /// @param lookingFor the stepId to compose
 /// @param composeStepBuffer the buffer to use for composing.
 /// @param maxLength maximum size of the composeStepBuffer
+/// @param[out] latencyOutcomes the step outcome of each participant, for recording the step latency
 /// @return the number of octets written or negative on error
-static ssize_t composeOneAuthoritativeStep(NimbleServerParticipants* participants, StepId lookingFor,
-                                           uint8_t* composeStepBuffer, size_t maxLength)
+static ssize_t composeOneAuthoritativeStep(NimbleServerGame* game, StepId lookingFor, uint8_t* composeStepBuffer,
+                                           size_t maxLength, StepLatencyOutcomes* latencyOutcomes)
 {
+    NimbleServerParticipants* participants = &game->participants;
     FldOutStream composeStream;
     fldOutStreamInit(&composeStream, composeStepBuffer, maxLength);
     fldOutStreamWriteUInt8(&composeStream, (uint8_t) participants->participantCount);
@@ -48,16 +129,26 @@ static ssize_t composeOneAuthoritativeStep(NimbleServerParticipants* participant
             if (readStepOctetCount < 0) {
                 if (readStepOctetCount == NimbleStepErrCollectionIsEmpty) {
                     nimbleServerConnectionQualityAddedForcedSteps(&participant->inParty->quality, 1);
-                    CLOG_C_VERBOSE(&participant->log,
-                                   "no steps stored (party: %u). server is looking for %08X. using a forced step",
-                                   participant->inParty->id, lookingFor)
-                    stepType = NimbleSerializeStepTypeStepNotProvidedInTime;
-                    readStepOctetCount = 0;
+                    addStepLatencyOutcome(latencyOutcomes, participant, true);
+                    NIMBLE_SERVER_TRACE(game->trace, NimbleServerTraceEventTypeForcedStep, participant->id,
+                                        participant->inParty->id, lookingFor)
+                    NIMBLE_SERVER_LOG_C_VERBOSE(
+                        &participant->cold->log,
+                        "no steps stored (party: %u). server is looking for %08X. using a forced step",
+                        participant->inParty->id, lookingFor)
+                    readStepOctetCount = createForcedStep(game, participant, lookingFor, stepReadBuffer, 0xff);
+                    if (readStepOctetCount < 0) {
+                        stepType = NimbleSerializeStepTypeStepNotProvidedInTime;
+                        readStepOctetCount = 0;
+                    }
                 } else {
-                    CLOG_C_ERROR(&participant->log, "steps for participant is corrupt. error %d", readStepOctetCount)
+                    CLOG_C_ERROR(&participant->cold->log, "steps for participant is corrupt. error %d",
+                                 readStepOctetCount)
                 }
             } else {
                 nimbleServerConnectionQualityProvidedUsableStep(&participant->inParty->quality);
+                addStepLatencyOutcome(latencyOutcomes, participant, false);
+                nimbleServerParticipantSetLastStep(participant, stepReadBuffer, (size_t) readStepOctetCount);
             }
             readStepOctetCountToUse = tc_convert_uint8_t_from_ssize(readStepOctetCount);
         }
@@ -103,14 +194,15 @@ static ssize_t composeOneAuthoritativeStep(NimbleServerParticipants* participant
                                     tc_convert_uint8_t_from_ssize(readStepOctetCountToUse));
         }
 
-        CLOG_C_VERBOSE(&participant->log, "wrote authoritative step %08X (octetCount %d) (%s)",
-                       lookingFor, readStepOctetCountToUse, nimbleSerializeStepTypeToString(stepType))
+        NIMBLE_SERVER_LOG_C_VERBOSE(&participant->cold->log, "wrote authoritative step %08X (octetCount %d) (%s)",
+                                    lookingFor, readStepOctetCountToUse, nimbleSerializeStepTypeToString(stepType))
     }
     CLOG_ASSERT(foundParticipantCount == participants->participantCount,
                 "did not find the same amount of participants as in participantCount")
 
-    CLOG_C_VERBOSE(&participants->log, "authoritative step %08X done. participant count %zu, total octet count: %zu",
-                   lookingFor, foundParticipantCount, composeStream.pos)
+    NIMBLE_SERVER_LOG_C_VERBOSE(&participants->log,
+                                "authoritative step %08X done. participant count %zu, total octet count: %zu",
+                                lookingFor, foundParticipantCount, composeStream.pos)
 
     return (ssize_t) composeStream.pos;
 }
@@ -148,19 +240,21 @@ static size_t maxPredictedStepContributionForParticipants(NimbleServerParticipan
     return maxConnectionCanAdvanceStepCount;
 }
 
-static bool shouldComposeNewAuthoritativeStep(NimbleServerParticipants* participants, StepId lookingFor)
+static bool shouldComposeNewAuthoritativeStep(NimbleServerParticipants* participants, StepId lookingFor,
+                                              const NimbleServerGameTuning* tuning)
 {
     size_t connectionCountThatCouldNotContribute = 0;
     size_t maxCountStepAheadForSomeParticipant = maxPredictedStepContributionForParticipants(
         participants, lookingFor, &connectionCountThatCouldNotContribute);
 
-    bool shouldCompose = (maxCountStepAheadForSomeParticipant > 3 && connectionCountThatCouldNotContribute == 0) ||
-                         maxCountStepAheadForSomeParticipant > 5;
-    CLOG_C_VERBOSE(&participants->log,
-                   "available steps for composing:%zu (%08X-%08X) couldNotContribute:%zu willCompose:%d",
-                   maxCountStepAheadForSomeParticipant, lookingFor,
-                   (StepId) (lookingFor + maxCountStepAheadForSomeParticipant - 1),
-                   connectionCountThatCouldNotContribute, shouldCompose)
+    bool shouldCompose = (maxCountStepAheadForSomeParticipant > tuning->composeLookAheadStepCount &&
+                          connectionCountThatCouldNotContribute == 0) ||
+                         maxCountStepAheadForSomeParticipant > tuning->forcedComposeLookAheadStepCount;
+    NIMBLE_SERVER_LOG_C_VERBOSE(&participants->log,
+                                "available steps for composing:%zu (%08X-%08X) couldNotContribute:%zu willCompose:%d",
+                                maxCountStepAheadForSomeParticipant, lookingFor,
+                                (StepId) (lookingFor + maxCountStepAheadForSomeParticipant - 1),
+                                connectionCountThatCouldNotContribute, shouldCompose)
 
     return shouldCompose;
 }
@@ -177,9 +271,10 @@ static bool canAdvanceDueToDistanceFromLastState(NbsSteps* authoritativeSteps)
     return allowed;
 }
 
-static bool shouldAdvanceAuthoritative(NimbleServerParticipants* participants, NbsSteps* authoritativeSteps)
+static bool shouldAdvanceAuthoritative(NimbleServerParticipants* participants, NbsSteps* authoritativeSteps,
+                                       const NimbleServerGameTuning* tuning)
 {
-    return shouldComposeNewAuthoritativeStep(participants, authoritativeSteps->expectedWriteId) &&
+    return shouldComposeNewAuthoritativeStep(participants, authoritativeSteps->expectedWriteId, tuning) &&
            canAdvanceDueToDistanceFromLastState(authoritativeSteps);
 }
 
@@ -191,20 +286,23 @@ int nimbleServerComposeAuthoritativeSteps(NimbleServerGame* game)
     size_t writtenAuthoritativeSteps = 0;
     NbsSteps* authoritativeSteps = &game->authoritativeSteps;
 
-#if NIMBLE_SERVER_LOGGING && defined CLOG_LOG_ENABLED
+#if NIMBLE_SERVER_LOGGING && defined CLOG_LOG_ENABLED && NIMBLE_SERVER_LOG_VERBOSE_ENABLED
     StepId firstLookingFor = authoritativeSteps->expectedWriteId;
 #endif
 
-    while (shouldAdvanceAuthoritative(&game->participants, authoritativeSteps)) {
+    while (shouldAdvanceAuthoritative(&game->participants, authoritativeSteps, &game->tuning)) {
         StepId lookingFor = authoritativeSteps->expectedWriteId;
 
         uint8_t composeStepBuffer[1024];
-        ssize_t authoritativeStepOctetCount = composeOneAuthoritativeStep(&game->participants, lookingFor,
-                                                                          composeStepBuffer, 1024);
+        StepLatencyOutcomes latencyOutcomes;
+        latencyOutcomes.outcomeCount = 0;
+        ssize_t authoritativeStepOctetCount = composeOneAuthoritativeStep(game, lookingFor, composeStepBuffer, 1024,
+                                                                          &latencyOutcomes);
         if (authoritativeStepOctetCount <= 0) {
             CLOG_C_SOFT_ERROR(&game->log, "authoritative: couldn't compose a authoritative step")
             return 0;
         }
+        recordStepLatencyOutcomes(&latencyOutcomes, lookingFor, game->now);
 
         int octetsWritten = nbsStepsWrite(authoritativeSteps, lookingFor, composeStepBuffer,
                                           (size_t) authoritativeStepOctetCount);
@@ -213,13 +311,18 @@ int nimbleServerComposeAuthoritativeSteps(NimbleServerGame* game)
             return octetsWritten;
         }
 
+        NIMBLE_SERVER_TRACE(game->trace, NimbleServerTraceEventTypeStepComposed, 0, authoritativeStepOctetCount,
+                            lookingFor)
+
+        nimbleServerGameStepCommitted(game, lookingFor, composeStepBuffer, (size_t) authoritativeStepOctetCount);
+
         writtenAuthoritativeSteps++;
     }
 
-#if NIMBLE_SERVER_LOGGING && defined CLOG_LOG_ENABLED
+#if NIMBLE_SERVER_LOGGING && defined CLOG_LOG_ENABLED && NIMBLE_SERVER_LOG_VERBOSE_ENABLED
     if (writtenAuthoritativeSteps > 0) {
-        CLOG_C_VERBOSE(&game->log, "authoritative: written steps from %08X to %zX (%zX)", firstLookingFor,
-                       firstLookingFor + writtenAuthoritativeSteps - 1, writtenAuthoritativeSteps)
+        NIMBLE_SERVER_LOG_C_VERBOSE(&game->log, "authoritative: written steps from %08X to %zX (%zX)", firstLookingFor,
+                                    firstLookingFor + writtenAuthoritativeSteps - 1, writtenAuthoritativeSteps)
     }
 #endif
     return (int) writtenAuthoritativeSteps;
@@ -0,0 +1,215 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <datagram-transport/types.h>
+#include <nimble-server/capture.h>
+#include <nimble-server/errors.h>
+#include <tiny-libc/tiny_libc.h>
+
+static const uint8_t captureMagic[8] = {'N', 'I', 'M', 'B', 'C', 'A', 'P', 'T'};
+
+static void writeUInt16(uint8_t* target, uint16_t value)
+{
+    target[0] = (uint8_t) value;
+    target[1] = (uint8_t) (value >> 8);
+}
+
+static void writeUInt32(uint8_t* target, uint32_t value)
+{
+    writeUInt16(target, (uint16_t) value);
+    writeUInt16(target + 2, (uint16_t) (value >> 16));
+}
+
+static void writeUInt64(uint8_t* target, uint64_t value)
+{
+    writeUInt32(target, (uint32_t) value);
+    writeUInt32(target + 4, (uint32_t) (value >> 32));
+}
+
+static uint32_t readUInt32(const uint8_t* source)
+{
+    return (uint32_t) source[0] | ((uint32_t) source[1] << 8) | ((uint32_t) source[2] << 16) |
+           ((uint32_t) source[3] << 24);
+}
+
+static uint64_t readUInt64(const uint8_t* source)
+{
+    return (uint64_t) readUInt32(source) | ((uint64_t) readUInt32(source + 4) << 32);
+}
+
+static size_t paddedOctetCount(size_t octetCount)
+{
+    return (octetCount + 7U) & ~(size_t) 7U;
+}
+
+void nimbleServerCaptureInit(NimbleServerCapture* self)
+{
+    self->out.self = 0;
+    self->out.write = 0;
+    self->isEnabled = false;
+    self->recordCount = 0;
+    self->octetCount = 0;
+    self->failedWriteCount = 0;
+}
+
+/// Starts capturing by writing the file header to out
+/// @param self capture
+/// @param out where to append the capture log
+/// @return negative on error
+int nimbleServerCaptureStart(NimbleServerCapture* self, NimbleServerCaptureOut out)
+{
+    uint8_t header[NIMBLE_SERVER_CAPTURE_FILE_HEADER_OCTET_COUNT];
+
+    tc_memcpy_octets(header, captureMagic, sizeof(captureMagic));
+    writeUInt32(header + 8, NIMBLE_SERVER_CAPTURE_VERSION);
+    writeUInt32(header + 12, 0);
+
+    int err = out.write(out.self, header, sizeof(header));
+    if (err < 0) {
+        return err;
+    }
+
+    self->out = out;
+    self->isEnabled = true;
+    self->recordCount = 0;
+    self->octetCount = sizeof(header);
+    self->failedWriteCount = 0;
+
+    return 0;
+}
+
+void nimbleServerCaptureStop(NimbleServerCapture* self)
+{
+    self->isEnabled = false;
+}
+
+/// Appends a record to the capture log. Does nothing if the capture has not been started.
+/// @param self capture
+/// @param type type of record
+/// @param connectionIndex transport connection index, or zero if not applicable
+/// @param timeMs server time
+/// @param octets datagram octets
+/// @param octetCount octet count of octets
+/// @return negative on error
+int nimbleServerCaptureRecord(NimbleServerCapture* self, NimbleServerCaptureRecordType type, uint8_t connectionIndex,
+                              MonotonicTimeMs timeMs, const uint8_t* octets, size_t octetCount)
+{
+    if (!self->isEnabled) {
+        return 0;
+    }
+
+    if (octetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        self->failedWriteCount++;
+        return NimbleServerErrCapture;
+    }
+
+    // Assemble the whole record first, so a partially written record is never appended
+    uint8_t record[NIMBLE_SERVER_CAPTURE_RECORD_HEADER_OCTET_COUNT + DATAGRAM_TRANSPORT_MAX_SIZE + 8];
+
+    writeUInt32(record, (uint32_t) octetCount);
+    record[4] = (uint8_t) type;
+    record[5] = connectionIndex;
+    writeUInt16(record + 6, 0);
+    writeUInt64(record + 8, (uint64_t) timeMs);
+
+    uint8_t* payload = record + NIMBLE_SERVER_CAPTURE_RECORD_HEADER_OCTET_COUNT;
+    size_t paddedCount = paddedOctetCount(octetCount);
+    if (octetCount > 0) {
+        tc_memcpy_octets(payload, octets, octetCount);
+    }
+    for (size_t i = octetCount; i < paddedCount; ++i) {
+        payload[i] = 0;
+    }
+
+    size_t recordOctetCount = NIMBLE_SERVER_CAPTURE_RECORD_HEADER_OCTET_COUNT + paddedCount;
+    int err = self->out.write(self->out.self, record, recordOctetCount);
+    if (err < 0) {
+        self->failedWriteCount++;
+        return err;
+    }
+
+    self->recordCount++;
+    self->octetCount += recordOctetCount;
+
+    return 0;
+}
+
+/// Initializes a reader for a complete capture log in memory, e.g. a memory mapped file
+/// @param self reader
+/// @param octets capture log
+/// @param octetCount octet count of the capture log
+/// @return negative if it is not a supported capture log
+int nimbleServerCaptureReaderInit(NimbleServerCaptureReader* self, const uint8_t* octets, size_t octetCount)
+{
+    if (octetCount < NIMBLE_SERVER_CAPTURE_FILE_HEADER_OCTET_COUNT) {
+        return NimbleServerErrCapture;
+    }
+
+    for (size_t i = 0; i < sizeof(captureMagic); ++i) {
+        if (octets[i] != captureMagic[i]) {
+            return NimbleServerErrCapture;
+        }
+    }
+
+    if (readUInt32(octets + 8) != NIMBLE_SERVER_CAPTURE_VERSION) {
+        return NimbleServerErrCapture;
+    }
+
+    self->octets = octets;
+    self->octetCount = octetCount;
+    self->pos = NIMBLE_SERVER_CAPTURE_FILE_HEADER_OCTET_COUNT;
+
+    return 0;
+}
+
+/// Reads the next record. The record octets point into the capture log.
+/// A truncated last record, e.g. from a server that was killed, is treated as the end of the log.
+/// @param self reader
+/// @param[out] record the record that was read
+/// @return 1 if a record was read, 0 at the end of the log and negative on error
+int nimbleServerCaptureReaderRead(NimbleServerCaptureReader* self, NimbleServerCaptureRecord* record)
+{
+    size_t remaining = self->octetCount - self->pos;
+    if (remaining < NIMBLE_SERVER_CAPTURE_RECORD_HEADER_OCTET_COUNT) {
+        return 0;
+    }
+
+    const uint8_t* header = self->octets + self->pos;
+    size_t octetCount = readUInt32(header);
+    uint8_t type = header[4];
+
+    if (octetCount > DATAGRAM_TRANSPORT_MAX_SIZE || type > NimbleServerCaptureRecordTypeOut) {
+        return NimbleServerErrCapture;
+    }
+
+    size_t recordOctetCount = NIMBLE_SERVER_CAPTURE_RECORD_HEADER_OCTET_COUNT + paddedOctetCount(octetCount);
+    if (remaining < recordOctetCount) {
+        return 0;
+    }
+
+    record->type = (NimbleServerCaptureRecordType) type;
+    record->connectionIndex = header[5];
+    record->timeMs = (MonotonicTimeMs) readUInt64(header + 8);
+    record->octets = header + NIMBLE_SERVER_CAPTURE_RECORD_HEADER_OCTET_COUNT;
+    record->octetCount = octetCount;
+
+    self->pos += recordOctetCount;
+
+    return 1;
+}
+
+const char* nimbleServerCaptureRecordTypeToString(NimbleServerCaptureRecordType type)
+{
+    switch (type) {
+        case NimbleServerCaptureRecordTypeUpdate:
+            return "update";
+        case NimbleServerCaptureRecordTypeIn:
+            return "in";
+        case NimbleServerCaptureRecordTypeOut:
+            return "out";
+    }
+
+    return "unknown";
+}
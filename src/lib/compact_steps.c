@@ -0,0 +1,500 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
+#include <nimble-serialize/serialize.h>
+#include <nimble-server/compact_steps.h>
+#include <nimble-server/errors.h>
+
+/// A participant entry in a composed authoritative step, see composeOneAuthoritativeStep()
+/// The octets are kept as an offset into the composed step, so two parsed steps fit on the stack.
+typedef struct ComposedEntry {
+    uint8_t participantId;
+    uint8_t stepType;
+    uint8_t partyId;
+    uint8_t octetCount;
+    uint16_t octetsOffset;
+} ComposedEntry;
+
+typedef struct ComposedStep {
+    const uint8_t* octets;
+    ComposedEntry entries[NIMBLE_SERVER_COMPACT_STEPS_REPEAT_PREVIOUS];
+    size_t entryCount;
+} ComposedStep;
+
+static bool hasOctets(uint8_t stepType)
+{
+    return stepType == NimbleSerializeStepTypeNormal || stepType == NimbleSerializeStepTypeJoined;
+}
+
+static int parseComposedStep(const uint8_t* octets, size_t octetCount, ComposedStep* step)
+{
+    size_t pos = 0;
+    if (octetCount < 1 || octetCount > NIMBLE_SERVER_COMPACT_STEPS_MAX_STEP_OCTET_COUNT) {
+        return NimbleServerErrSerialize;
+    }
+    step->octets = octets;
+    uint8_t participantCount = octets[pos++];
+    if (participantCount == NIMBLE_SERVER_COMPACT_STEPS_REPEAT_PREVIOUS) {
+        return NimbleServerErrSerialize;
+    }
+
+    for (size_t i = 0; i < participantCount; ++i) {
+        ComposedEntry* entry = &step->entries[i];
+        if (pos >= octetCount) {
+            return NimbleServerErrSerialize;
+        }
+        uint8_t maskAndId = octets[pos++];
+        entry->participantId = maskAndId & 0x7f;
+        entry->stepType = NimbleSerializeStepTypeNormal;
+        entry->partyId = 0;
+        entry->octetsOffset = 0;
+        entry->octetCount = 0;
+        if (maskAndId & 0x80) {
+            if (pos >= octetCount) {
+                return NimbleServerErrSerialize;
+            }
+            entry->stepType = octets[pos++];
+            if (entry->stepType == NimbleSerializeStepTypeJoined) {
+                if (pos >= octetCount) {
+                    return NimbleServerErrSerialize;
+                }
+                entry->partyId = octets[pos++];
+            }
+        }
+        if (hasOctets(entry->stepType)) {
+            if (pos >= octetCount) {
+                return NimbleServerErrSerialize;
+            }
+            entry->octetCount = octets[pos++];
+            if (pos + entry->octetCount > octetCount) {
+                return NimbleServerErrSerialize;
+            }
+            entry->octetsOffset = (uint16_t) pos;
+            pos += entry->octetCount;
+        }
+    }
+
+    step->entryCount = participantCount;
+
+    return 0;
+}
+
+static const uint8_t* entryOctets(const ComposedStep* step, const ComposedEntry* entry)
+{
+    return &step->octets[entry->octetsOffset];
+}
+
+static const ComposedEntry* findEntry(const ComposedStep* step, uint8_t participantId)
+{
+    for (size_t i = 0; i < step->entryCount; ++i) {
+        if (step->entries[i].participantId == participantId) {
+            return &step->entries[i];
+        }
+    }
+
+    return 0;
+}
+
+static bool octetsAreEqual(const uint8_t* a, const uint8_t* b, size_t octetCount)
+{
+    for (size_t i = 0; i < octetCount; ++i) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool isSameAsPrevious(const ComposedStep* step, const ComposedEntry* entry, const ComposedStep* previousStep,
+                             const ComposedEntry* previous)
+{
+    return previous != 0 && entry->stepType == NimbleSerializeStepTypeNormal &&
+           previous->stepType == NimbleSerializeStepTypeNormal && entry->octetCount == previous->octetCount &&
+           octetsAreEqual(entryOctets(step, entry), entryOctets(previousStep, previous), entry->octetCount);
+}
+
+static int writeKindAndId(FldOutStream* outStream, uint8_t kind, uint8_t participantId)
+{
+    if (participantId < NIMBLE_SERVER_COMPACT_STEPS_ID_ESCAPE) {
+        return fldOutStreamWriteUInt8(outStream, kind | participantId);
+    }
+
+    int err = fldOutStreamWriteUInt8(outStream, kind | NIMBLE_SERVER_COMPACT_STEPS_ID_ESCAPE);
+    if (err < 0) {
+        return err;
+    }
+
+    return fldOutStreamWriteUInt8(outStream, participantId);
+}
+
+static int readKindAndId(FldInStream* inStream, uint8_t* kind, uint8_t* participantId)
+{
+    uint8_t kindAndId;
+    int err = fldInStreamReadUInt8(inStream, &kindAndId);
+    if (err < 0) {
+        return err;
+    }
+    *kind = kindAndId & NIMBLE_SERVER_COMPACT_STEPS_KIND_RUN;
+    *participantId = kindAndId & NIMBLE_SERVER_COMPACT_STEPS_ID_ESCAPE;
+    if (*participantId == NIMBLE_SERVER_COMPACT_STEPS_ID_ESCAPE) {
+        return fldInStreamReadUInt8(inStream, participantId);
+    }
+
+    return 0;
+}
+
+/// Counts the entries, starting at the first one, that can be written as a single run
+static size_t runLength(const ComposedEntry* entries, size_t entryCount)
+{
+    const ComposedEntry* first = &entries[0];
+    if (hasOctets(first->stepType)) {
+        return 1;
+    }
+
+    size_t count = 1;
+    while (count < entryCount && count < 0xff) {
+        const ComposedEntry* entry = &entries[count];
+        if (entry->stepType != first->stepType || entry->participantId != first->participantId + count) {
+            break;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+static int writeEntry(FldOutStream* outStream, const ComposedStep* step, const ComposedEntry* entry,
+                      const ComposedStep* previousStep)
+{
+    const ComposedEntry* previous = findEntry(previousStep, entry->participantId);
+    if (isSameAsPrevious(step, entry, previousStep, previous)) {
+        return writeKindAndId(outStream, NIMBLE_SERVER_COMPACT_STEPS_KIND_SAME_AS_PREVIOUS, entry->participantId);
+    }
+
+    int err;
+    if (entry->stepType == NimbleSerializeStepTypeNormal) {
+        err = writeKindAndId(outStream, NIMBLE_SERVER_COMPACT_STEPS_KIND_NORMAL, entry->participantId);
+    } else {
+        err = writeKindAndId(outStream, NIMBLE_SERVER_COMPACT_STEPS_KIND_SPECIAL, entry->participantId);
+        if (err < 0) {
+            return err;
+        }
+        err = fldOutStreamWriteUInt8(outStream, entry->stepType);
+        if (err < 0) {
+            return err;
+        }
+        if (entry->stepType == NimbleSerializeStepTypeJoined) {
+            err = fldOutStreamWriteUInt8(outStream, entry->partyId);
+        }
+    }
+    if (err < 0) {
+        return err;
+    }
+
+    if (!hasOctets(entry->stepType)) {
+        return 0;
+    }
+
+    err = fldOutStreamWriteUInt8(outStream, entry->octetCount);
+    if (err < 0) {
+        return err;
+    }
+
+    return fldOutStreamWriteOctets(outStream, entryOctets(step, entry), entry->octetCount);
+}
+
+static int writeRun(FldOutStream* outStream, const ComposedEntry* entry, size_t count)
+{
+    int err = writeKindAndId(outStream, NIMBLE_SERVER_COMPACT_STEPS_KIND_RUN, entry->participantId);
+    if (err < 0) {
+        return err;
+    }
+    err = fldOutStreamWriteUInt8(outStream, (uint8_t) count);
+    if (err < 0) {
+        return err;
+    }
+
+    return fldOutStreamWriteUInt8(outStream, entry->stepType);
+}
+
+/// Chooses the authoritative step encoding for a client
+/// @param nimbleVersion the nimble protocol version that the client reported in the connect request
+/// @return the compact encoding if the client can decode it
+NimbleServerStepEncoding nimbleServerCompactStepsEncodingForVersion(const NimbleSerializeVersion* nimbleVersion)
+{
+    if (nimbleVersion->major > NIMBLE_SERVER_COMPACT_STEPS_NIMBLE_VERSION_MAJOR ||
+        (nimbleVersion->major == NIMBLE_SERVER_COMPACT_STEPS_NIMBLE_VERSION_MAJOR &&
+         nimbleVersion->minor >= NIMBLE_SERVER_COMPACT_STEPS_NIMBLE_VERSION_MINOR)) {
+        return NimbleServerStepEncodingCompact;
+    }
+
+    return NimbleServerStepEncodingNormal;
+}
+
+/// Encodes a composed authoritative step, referring to the previous step where possible
+/// @param outStream stream to write the compact step to
+/// @param step the composed step
+/// @param octetCount octet count of step
+/// @param previousStep the composed step before it in the same range, or zero for the first step in a range
+/// @param previousOctetCount octet count of previousStep
+/// @return negative on error
+int nimbleServerCompactStepsEncode(FldOutStream* outStream, const uint8_t* step, size_t octetCount,
+                                   const uint8_t* previousStep, size_t previousOctetCount)
+{
+    if (previousStep != 0 && octetCount == previousOctetCount && octetsAreEqual(step, previousStep, octetCount)) {
+        return fldOutStreamWriteUInt8(outStream, NIMBLE_SERVER_COMPACT_STEPS_REPEAT_PREVIOUS);
+    }
+
+    ComposedStep current;
+    ComposedStep previous;
+
+    int err = parseComposedStep(step, octetCount, &current);
+    if (err < 0) {
+        return err;
+    }
+    previous.entryCount = 0;
+    if (previousStep != 0) {
+        err = parseComposedStep(previousStep, previousOctetCount, &previous);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    err = fldOutStreamWriteUInt8(outStream, (uint8_t) current.entryCount);
+    if (err < 0) {
+        return err;
+    }
+
+    for (size_t i = 0; i < current.entryCount;) {
+        const ComposedEntry* entry = &current.entries[i];
+        size_t count = runLength(entry, current.entryCount - i);
+        if (count > 1) {
+            err = writeRun(outStream, entry, count);
+        } else {
+            err = writeEntry(outStream, &current, entry, &previous);
+        }
+        if (err < 0) {
+            return err;
+        }
+        i += count;
+    }
+
+    return 0;
+}
+
+static int writeComposedEntry(FldOutStream* target, uint8_t participantId, uint8_t stepType)
+{
+    if (stepType == NimbleSerializeStepTypeNormal) {
+        return fldOutStreamWriteUInt8(target, participantId);
+    }
+
+    int err = fldOutStreamWriteUInt8(target, 0x80 | participantId);
+    if (err < 0) {
+        return err;
+    }
+
+    return fldOutStreamWriteUInt8(target, stepType);
+}
+
+static int copyOctets(FldInStream* inStream, FldOutStream* target)
+{
+    uint8_t octetCount;
+    int err = fldInStreamReadUInt8(inStream, &octetCount);
+    if (err < 0) {
+        return err;
+    }
+    uint8_t octets[0xff];
+    err = fldInStreamReadOctets(inStream, octets, octetCount);
+    if (err < 0) {
+        return err;
+    }
+    err = fldOutStreamWriteUInt8(target, octetCount);
+    if (err < 0) {
+        return err;
+    }
+
+    return fldOutStreamWriteOctets(target, octets, octetCount);
+}
+
+/// Decodes a compact step back to a composed authoritative step
+/// @param inStream stream to read the compact step from
+/// @param previousStep the decoded step before it in the same range, or zero for the first step in a range
+/// @param previousOctetCount octet count of previousStep
+/// @param target the composed step is written here
+/// @param maxTargetOctetCount size of target
+/// @return octet count of the composed step, or negative on error
+int nimbleServerCompactStepsDecode(FldInStream* inStream, const uint8_t* previousStep, size_t previousOctetCount,
+                                   uint8_t* target, size_t maxTargetOctetCount)
+{
+    uint8_t participantCount;
+    int err = fldInStreamReadUInt8(inStream, &participantCount);
+    if (err < 0) {
+        return err;
+    }
+
+    if (participantCount == NIMBLE_SERVER_COMPACT_STEPS_REPEAT_PREVIOUS) {
+        if (previousStep == 0 || previousOctetCount > maxTargetOctetCount) {
+            return NimbleServerErrSerialize;
+        }
+        for (size_t i = 0; i < previousOctetCount; ++i) {
+            target[i] = previousStep[i];
+        }
+        return (int) previousOctetCount;
+    }
+
+    ComposedStep previous;
+    previous.entryCount = 0;
+    if (previousStep != 0) {
+        err = parseComposedStep(previousStep, previousOctetCount, &previous);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    FldOutStream targetStream;
+    fldOutStreamInit(&targetStream, target, maxTargetOctetCount);
+    err = fldOutStreamWriteUInt8(&targetStream, participantCount);
+    if (err < 0) {
+        return err;
+    }
+
+    for (size_t i = 0; i < participantCount;) {
+        uint8_t kind;
+        uint8_t participantId;
+        err = readKindAndId(inStream, &kind, &participantId);
+        if (err < 0) {
+            return err;
+        }
+
+        size_t decodedEntryCount = 1;
+        switch (kind) {
+            case NIMBLE_SERVER_COMPACT_STEPS_KIND_NORMAL:
+                err = writeComposedEntry(&targetStream, participantId, NimbleSerializeStepTypeNormal);
+                if (err < 0) {
+                    return err;
+                }
+                err = copyOctets(inStream, &targetStream);
+                break;
+            case NIMBLE_SERVER_COMPACT_STEPS_KIND_SAME_AS_PREVIOUS: {
+                const ComposedEntry* previousEntry = findEntry(&previous, participantId);
+                if (previousEntry == 0 || previousEntry->stepType != NimbleSerializeStepTypeNormal) {
+                    return NimbleServerErrSerialize;
+                }
+                err = writeComposedEntry(&targetStream, participantId, NimbleSerializeStepTypeNormal);
+                if (err < 0) {
+                    return err;
+                }
+                err = fldOutStreamWriteUInt8(&targetStream, previousEntry->octetCount);
+                if (err < 0) {
+                    return err;
+                }
+                err = fldOutStreamWriteOctets(&targetStream, entryOctets(&previous, previousEntry),
+                                              previousEntry->octetCount);
+            } break;
+            case NIMBLE_SERVER_COMPACT_STEPS_KIND_SPECIAL: {
+                uint8_t stepType;
+                err = fldInStreamReadUInt8(inStream, &stepType);
+                if (err < 0) {
+                    return err;
+                }
+                err = writeComposedEntry(&targetStream, participantId, stepType);
+                if (err < 0) {
+                    return err;
+                }
+                if (stepType == NimbleSerializeStepTypeJoined) {
+                    uint8_t partyId;
+                    err = fldInStreamReadUInt8(inStream, &partyId);
+                    if (err < 0) {
+                        return err;
+                    }
+                    err = fldOutStreamWriteUInt8(&targetStream, partyId);
+                    if (err < 0) {
+                        return err;
+                    }
+                }
+                if (hasOctets(stepType)) {
+                    err = copyOctets(inStream, &targetStream);
+                }
+            } break;
+            default: {
+                uint8_t count;
+                uint8_t stepType;
+                err = fldInStreamReadUInt8(inStream, &count);
+                if (err < 0) {
+                    return err;
+                }
+                err = fldInStreamReadUInt8(inStream, &stepType);
+                if (err < 0) {
+                    return err;
+                }
+                if (count == 0 || i + count > participantCount || hasOctets(stepType)) {
+                    return NimbleServerErrSerialize;
+                }
+                for (size_t j = 0; j < count && err >= 0; ++j) {
+                    err = writeComposedEntry(&targetStream, (uint8_t) (participantId + j), stepType);
+                }
+                decodedEntryCount = count;
+            } break;
+        }
+        if (err < 0) {
+            return err;
+        }
+        i += decodedEntryCount;
+    }
+
+    return (int) targetStream.pos;
+}
+
+/// Writes a range of authoritative steps in the compact encoding
+/// @param outStream stream to write the range to
+/// @param authoritativeSteps steps to write, they are not consumed
+/// @param startId first step in the range
+/// @param stepCount number of steps in the range, at most 255
+/// @return negative on error, otherwise number of ranges written
+int nimbleServerCompactStepsWriteRange(FldOutStream* outStream, const NbsSteps* authoritativeSteps,
+                                       StepId startId, size_t stepCount)
+{
+    if (stepCount > 0xff) {
+        return NimbleServerErrSerialize;
+    }
+
+    int err = fldOutStreamWriteUInt32(outStream, startId);
+    if (err < 0) {
+        return err;
+    }
+    err = fldOutStreamWriteUInt8(outStream, (uint8_t) stepCount);
+    if (err < 0) {
+        return err;
+    }
+
+    uint8_t stepOctets[2][NIMBLE_SERVER_COMPACT_STEPS_MAX_STEP_OCTET_COUNT];
+    int previousOctetCount = 0;
+
+    for (size_t i = 0; i < stepCount; ++i) {
+        int index = nbsStepsGetIndexForStep(authoritativeSteps, (StepId) (startId + i));
+        if (index < 0) {
+            return index;
+        }
+        uint8_t* current = stepOctets[i % 2];
+        int octetCount = nbsStepsReadAtIndex(authoritativeSteps, index, current,
+                                             NIMBLE_SERVER_COMPACT_STEPS_MAX_STEP_OCTET_COUNT);
+        if (octetCount < 0) {
+            return octetCount;
+        }
+
+        const uint8_t* previous = i == 0 ? 0 : stepOctets[(i + 1) % 2];
+        err = nimbleServerCompactStepsEncode(outStream, current, (size_t) octetCount, previous,
+                                             (size_t) previousOctetCount);
+        if (err < 0) {
+            return err;
+        }
+        previousOctetCount = octetCount;
+    }
+
+    return 1;
+}
@@ -3,68 +3,51 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
-#include <clog/clog.h>
+#include <nimble-server/errors.h>
 #include <nimble-server/forced_step.h>
-#include <nimble-server/participant.h>
-#include <nimble-server/participant_connection.h>
-#include <nimble-steps-serialize/out_serialize.h>
+#include <tiny-libc/tiny_libc.h>
 
-static NimbleSerializeStepType forcedStateFromConnection(NimbleServerParticipantConnection* connection)
+/// Repeats the last received step, since predictions on the clients usually assume that the input is held.
+/// @param repeatLastStepCount maximum number of forced steps in a row that are repeated
+/// @param context the participant that did not provide a step in time
+/// @param target the repeated step is written here
+/// @param maxTargetOctetCount size of target
+/// @return octet count of the repeated step, or negative if an empty forced step should be used
+int nimbleServerForcedStepRepeatLast(size_t repeatLastStepCount, const NimbleServerForcedStepContext* context,
+                                     uint8_t* target, size_t maxTargetOctetCount)
 {
-    NimbleSerializeStepType state = NimbleSerializeStepTypeStepNotProvidedInTime;
-    if (connection->state == NimbleServerParticipantConnectionStateWaitingForReconnect) {
-        state = NimbleSerializeStepTypeWaitingForReJoin;
+    if (!context->hasLastStep || context->forcedStepInRowCount > repeatLastStepCount) {
+        return NimbleServerErrForcedStepNotProvided;
     }
 
-    return state;
-}
+    if (context->lastStepOctetCount > maxTargetOctetCount) {
+        return NimbleServerErrForcedStepNotProvided;
+    }
 
-/// Creates a forced step for a participant connection participants.
-/// Forced steps are used for a participant connection that is too much behind
-/// of other participant connections.
-/// @note currently all applications must support a zero octet length step as a zero, "empty" step.
-/// @todo option to copy the last received step and also support application-specific rules for forced steps.
-/// @param connection participant connection
-/// @param forcedStepsBuffer buffer to write forced step to
-/// @param maxCount maximum count of forced step buffer
-/// @return negative on error
-ssize_t nimbleServerCreateForcedStep(NimbleServerParticipantConnection* connection, uint8_t* forcedStepsBuffer,
-                                     size_t maxCount)
-{
-    NimbleStepsOutSerializeLocalParticipants participants;
+    tc_memcpy_octets(target, context->lastStepOctets, context->lastStepOctetCount);
 
-    NimbleSerializeStepType state = forcedStateFromConnection(connection);
-    participants.participantCount = connection->participantReferences.participantReferenceCount;
-    for (size_t i = 0; i < participants.participantCount; ++i) {
-        participants.participants[i]
-            .participantId =  connection->participantReferences.participantReferences[i]->id;
-        participants.participants[i].stepType = state;
-        participants.participants[i].payload = 0;
-        participants.participants[i].payloadCount = 0;
-    }
-    return nbsStepsOutSerializeStep(&participants, forcedStepsBuffer, maxCount);
+    return (int) context->lastStepOctetCount;
 }
 
-/// Insert forced steps for a participant connection
-/// @param foundParticipantConnection connection to insert forced step to
-/// @param stepCount number of forced steps to insert
-/// @return negative value on error.
-int nimbleServerInsertForcedSteps(NimbleServerParticipantConnection* foundParticipantConnection, size_t stepCount)
+/// Creates a forced step for a participant that is too much behind other participants.
+/// @note all applications must still support a zero octet length "not provided in time" step, it is used when the
+/// strategy does not create a step.
+/// @param self strategy, can be zero
+/// @param context the participant that did not provide a step in time
+/// @param target the forced step is written here
+/// @param maxTargetOctetCount size of target
+/// @return octet count of a normal step, or negative if an empty forced step should be used
+int nimbleServerForcedStepCreate(const NimbleServerForcedStepStrategy* self,
+                                 const NimbleServerForcedStepContext* context, uint8_t* target,
+                                 size_t maxTargetOctetCount)
 {
-    uint8_t forcedStepsBuffer[64];
-    StepId stepIdToWrite = foundParticipantConnection->steps.expectedWriteId;
-    ssize_t forcedStepOctetCount = nimbleServerCreateForcedStep(foundParticipantConnection, forcedStepsBuffer, 64);
-    if (forcedStepOctetCount < 0) {
-        return (int) forcedStepOctetCount;
+    if (self == 0) {
+        return NimbleServerErrForcedStepNotProvided;
     }
-    CLOG_VERBOSE("nimbleServer: insert zero input as forced steps (0)")
-    for (size_t i = 0; i < stepCount; ++i) {
-        int errorCode = nbsStepsWrite(&foundParticipantConnection->steps, stepIdToWrite, forcedStepsBuffer,
-                                      (size_t) forcedStepOctetCount);
-        if (errorCode < 0) {
-            return errorCode;
-        }
-        stepIdToWrite++;
+
+    if (self->fn != 0) {
+        return self->fn(self->self, context, target, maxTargetOctetCount);
     }
-    return 0;
+
+    return nimbleServerForcedStepRepeatLast(self->repeatLastStepCount, context, target, maxTargetOctetCount);
 }
@@ -5,20 +5,26 @@
 
 #include <imprint/allocator.h>
 #include <nimble-server/game.h>
+#include <nimble-server/spectator_steps.h>
 #include <nimble-steps-serialize/out_serialize.h>
 
 /// Initializes and allocated memory for a game.
 /// A Game holds information about the latest game state for joining, authoritative steps and accepted participants.
 /// @param self game
-/// @param allocator allocator
+/// @param allocator allocator for the authoritative steps and the participant collection
+/// @param participantStepsAllocator allocator for the step memory that participants borrow when they join
 /// @param maxSingleParticipantStepOctetCount maximum octet count for a single participant
 /// @param maxParticipantCount maximum number of participants in a game
 /// @param log target log
 void nimbleServerGameInit(NimbleServerGame* self, ImprintAllocator* allocator,
-                          size_t maxSingleParticipantStepOctetCount, size_t maxParticipantCount, Clog log)
+                          ImprintAllocator* participantStepsAllocator, size_t maxSingleParticipantStepOctetCount,
+                          size_t maxParticipantCount, Clog log)
 {
     self->log = log;
     self->debugIsFrozen = false;
+    self->maxSingleParticipantStepOctetCount = maxSingleParticipantStepOctetCount;
+    self->now = 0;
+    nimbleServerGameTuningInit(&self->tuning);
     size_t combinedStepOctetCount = nbsStepsOutSerializeCalculateCombinedSize(maxParticipantCount,
                                                                               maxSingleParticipantStepOctetCount);
     nbsStepsInit(&self->authoritativeSteps, allocator, combinedStepOctetCount, log);
@@ -26,10 +32,89 @@ void nimbleServerGameInit(NimbleServerGame* self, ImprintAllocator* allocator,
     tc_snprintf(self->participants.debugPrefix, sizeof(self->participants.debugPrefix), "%s/participants",
                 self->log.constantPrefix);
 
-    nimbleServerParticipantsInit(&self->participants, allocator, maxParticipantCount,
+    nimbleServerParticipantsInit(&self->participants, allocator, participantStepsAllocator, maxParticipantCount,
                                  maxSingleParticipantStepOctetCount, &self->log);
 }
 
+/// Prepares the game for a new session. The authoritative steps, the participants and the steps pool keep their
+/// memory, so reinitializing does not allocate.
+/// @param self game
+void nimbleServerGameReset(NimbleServerGame* self)
+{
+    self->debugIsFrozen = false;
+    self->now = 0;
+    nimbleServerGameTuningInit(&self->tuning);
+    nbsStepsReInit(&self->authoritativeSteps, 0);
+    nimbleServerParticipantsReset(&self->participants);
+}
+
+/// Sets the tuning to the values used when the server is working normally
+/// @param self tuning
+void nimbleServerGameTuningInit(NimbleServerGameTuning* self)
+{
+    self->maxRedundancyStepCount = 20;
+    self->composeLookAheadStepCount = 3;
+    self->forcedComposeLookAheadStepCount = 5;
+    self->maxBlobStreamEntriesPerSend = 4;
+    self->maxCatchUpStepCount = 120;
+    self->outputStats = true;
+}
+
+/// Reads journaled steps, that are older than the authoritative steps, into the catchUpSteps. Stops at the first
+/// step that is not in the journalSource, or when the steps read so far fill maxOctetCount.
+/// @param self game
+/// @param startStepId the first step to read
+/// @param maxOctetCount octets that the steps can use in the reply. The first step is always read.
+/// @return number of steps read, or negative on error
+int nimbleServerGameReadCatchUpSteps(NimbleServerGame* self, StepId startStepId, size_t maxOctetCount)
+{
+    if (self->journalSource.read == 0) {
+        return 0;
+    }
+
+    nbsStepsReInit(self->catchUpSteps, startStepId);
+
+    size_t stepCount = 0;
+    size_t totalOctetCount = 0;
+    StepId stepId = startStepId;
+    while (stepCount < self->tuning.maxCatchUpStepCount && stepId < self->authoritativeSteps.expectedReadId) {
+        const uint8_t* octets;
+        size_t octetCount;
+        if (self->journalSource.read(self->journalSource.self, stepId, &octets, &octetCount) != 1) {
+            break;
+        }
+        // Every step is serialized with at least an octet count in front of it
+        totalOctetCount += octetCount + 1U;
+        if (stepCount > 0 && totalOctetCount > maxOctetCount) {
+            break;
+        }
+        int err = nbsStepsWrite(self->catchUpSteps, stepId, octets, octetCount);
+        if (err < 0) {
+            return err;
+        }
+        stepCount++;
+        stepId++;
+    }
+
+    return (int) stepCount;
+}
+
+/// Hands a committed authoritative step to the in-process spectators and the journal
+/// @param self game
+/// @param stepId the id of the authoritative step
+/// @param octets the authoritative step
+/// @param octetCount octet count of the authoritative step
+void nimbleServerGameStepCommitted(NimbleServerGame* self, StepId stepId, const uint8_t* octets, size_t octetCount)
+{
+    if (self->spectatorSteps != 0) {
+        nimbleServerSpectatorStepsPublish(self->spectatorSteps, stepId, octets, octetCount);
+    }
+
+    if (self->journal != 0) {
+        nimbleServerJournalAppend(self->journal, stepId, octets, octetCount);
+    }
+}
+
 #if 0
 static void nimbleServerGameShowReport(NimbleServerGame* game, NimbleServerLocalParties* connections)
 {
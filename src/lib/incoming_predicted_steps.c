@@ -4,15 +4,19 @@
  *--------------------------------------------------------------------------------------------------------*/
 
 #include "incoming_predicted_steps.h"
+#include "log.h"
 #include <flood/in_stream.h>
 #include <inttypes.h>
 #include <nimble-server/errors.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/transport_connection.h>
+#include <nimble-server/varint.h>
 #include <nimble-steps-serialize/in_serialize.h>
 #include <nimble-steps-serialize/pending_in_serialize.h>
 
-/// Read pending steps from an inStream and move over ready steps to the incoming step buffer
+/// Read pending steps from an inStream and move over ready steps to the incoming step buffer.
+/// Only writes to the party, its participants and its transport connection, and only reads the game, so it can be
+/// called for different parties at the same time, see nimbleServerIngestBatchRun().
 /// @param foundGame game
 /// @param inStream stream to read steps from
 /// @param transportConnection stream comes from this transport connection
@@ -27,17 +31,15 @@ int nimbleServerHandleIncomingSteps(NimbleServerGame* foundGame, FldInStream* in
         return NimbleServerErrSerialize;
     }
     if (party->state == NimbleServerLocalPartyStateDissolved) {
-        party->warningCount++;
-        if (party->warningCount % 60 == 0) {
-            CLOG_C_NOTICE(&foundGame->log, "ignoring steps from party %u that is dissolved", party->id)
+        party->cold->warningCount++;
+        if (party->cold->warningCount % 60 == 0) {
+            CLOG_C_NOTICE(&party->cold->log, "ignoring steps from party %u that is dissolved", party->id)
         }
         return NimbleServerErrDatagramFromDisconnectedConnection;
     }
 
     StepId clientWaitingForStepId;
 
-    (void) foundGame;
-
     int errorCode = nbsPendingStepsInSerializeHeader(inStream, &clientWaitingForStepId);
     if (errorCode < 0) {
         CLOG_C_SOFT_ERROR(&transportConnection->log, "client step: couldn't in-serialize pending steps")
@@ -46,12 +48,132 @@ int nimbleServerHandleIncomingSteps(NimbleServerGame* foundGame, FldInStream* in
 
     *outClientWaitingForStepId = clientWaitingForStepId;
 
-    CLOG_C_VERBOSE(
-        &transportConnection->log,
-        "handleIncomingSteps: transport connection %d party: %hhu first predicted StepID %08X",
-        transportConnection->transportConnectionId, party->id, clientWaitingForStepId)
+    NIMBLE_SERVER_LOG_C_VERBOSE(
+                     &transportConnection->log,
+                     "handleIncomingSteps: transport connection %d party: %hhu first predicted StepID %08X",
+                     transportConnection->transportConnectionId, party->id, clientWaitingForStepId)
+
+    // The rate limit is charged once for all the steps in the datagram, so a datagram is either ingested for all
+    // participants or not at all
+    FldInStream countStream = *inStream;
+    int stepCountOrError = nimbleServerSkipIncomingSteps(&countStream, transportConnection);
+    if (stepCountOrError < 0) {
+        return stepCountOrError;
+    }
+
+    if (!nimbleServerRateLimitAllowPredictedSteps(transportConnectionRateLimit(transportConnection),
+                                                  (size_t) stepCountOrError)) {
+        NIMBLE_SERVER_LOG_C_VERBOSE(&transportConnection->log,
+                                    "over the predicted steps rate limit, dropping %d steps", stepCountOrError)
+        return NimbleServerErrRateLimited;
+    }
 
-    int addedStepsCountOrError = nimbleServerLocalPartyDeserializePredictedSteps(party, inStream);
+    int addedStepsCountOrError;
+    if (transportConnection->stepEncoding == NimbleServerStepEncodingCompact) {
+        addedStepsCountOrError = nimbleServerLocalPartyDeserializeCompactPredictedSteps(
+            party, inStream, clientWaitingForStepId, foundGame->maxSingleParticipantStepOctetCount,
+            foundGame->authoritativeSteps.expectedWriteId, foundGame->now);
+    } else {
+        addedStepsCountOrError = nimbleServerLocalPartyDeserializePredictedSteps(
+            party, inStream, foundGame->authoritativeSteps.expectedWriteId, foundGame->now);
+    }
 
     return addedStepsCountOrError;
 }
+
+/// Reads the octet count of a single predicted step, in the step encoding of the transport connection
+/// @param inStream stream to read from
+/// @param isCompact true if the steps are in the compact upload format
+/// @param[out] outOctetCount the octet count of the step
+/// @return negative on error
+static int readStepOctetCount(FldInStream* inStream, bool isCompact, uint32_t* outOctetCount)
+{
+    if (isCompact) {
+        return nimbleServerVarIntRead(inStream, outOctetCount);
+    }
+
+    uint8_t octetCount;
+    int err = fldInStreamReadUInt8(inStream, &octetCount);
+    *outOctetCount = octetCount;
+
+    return err;
+}
+
+/// Reads the predicted steps that follow the pending steps header without storing them, so the commands after
+/// them in the datagram can still be handled. Used for transport connections that have no party, e.g. spectators.
+/// @param inStream stream to read the predicted steps from
+/// @param transportConnection the steps were sent from this transport connection, selects the step encoding
+/// @return the number of steps for all participants, or negative on error
+int nimbleServerSkipIncomingSteps(FldInStream* inStream, const NimbleServerTransportConnection* transportConnection)
+{
+    bool isCompact = transportConnection->stepEncoding == NimbleServerStepEncodingCompact;
+    int err;
+    if (isCompact) {
+        int32_t deltaFromBaseStepId;
+        err = nimbleServerVarIntReadSigned(inStream, &deltaFromBaseStepId);
+    } else {
+        uint32_t lowestCommonStepId;
+        err = fldInStreamReadUInt32(inStream, &lowestCommonStepId);
+    }
+    if (err < 0) {
+        return err;
+    }
+
+    uint8_t participantCount;
+    err = fldInStreamReadUInt8(inStream, &participantCount);
+    if (err < 0) {
+        return err;
+    }
+
+    uint8_t stepOctets[NimbleStepMaxSingleStepOctetCount];
+    size_t totalStepCount = 0;
+
+    for (size_t participantIterator = 0; participantIterator < participantCount; ++participantIterator) {
+        uint8_t participantId;
+        err = fldInStreamReadUInt8(inStream, &participantId);
+        if (err < 0) {
+            return err;
+        }
+
+        uint32_t stepCount;
+        if (isCompact) {
+            uint32_t deltaFromCommonStepId;
+            err = nimbleServerVarIntRead(inStream, &deltaFromCommonStepId);
+            if (err < 0) {
+                return err;
+            }
+            err = nimbleServerVarIntRead(inStream, &stepCount);
+        } else {
+            uint8_t deltaFromCommonStepId;
+            uint8_t stepsThatFollow;
+            err = fldInStreamReadUInt8(inStream, &deltaFromCommonStepId);
+            if (err < 0) {
+                return err;
+            }
+            err = fldInStreamReadUInt8(inStream, &stepsThatFollow);
+            stepCount = stepsThatFollow;
+        }
+        if (err < 0) {
+            return err;
+        }
+
+        for (size_t i = 0; i < stepCount; ++i) {
+            uint32_t octetCount;
+            err = readStepOctetCount(inStream, isCompact, &octetCount);
+            if (err < 0) {
+                return err;
+            }
+            if (octetCount > sizeof(stepOctets)) {
+                CLOG_C_SOFT_ERROR(&transportConnection->log, "skipped step is too large %u", octetCount)
+                return NimbleServerErrSerialize;
+            }
+            err = fldInStreamReadOctets(inStream, stepOctets, octetCount);
+            if (err < 0) {
+                return err;
+            }
+        }
+        totalStepCount += stepCount;
+    }
+
+    return (int) totalStepCount;
+}
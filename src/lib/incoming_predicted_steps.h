@@ -20,5 +20,7 @@ struct FldInStream;
 int nimbleServerHandleIncomingSteps(struct NimbleServerGame* foundGame, struct FldInStream* inStream,
                                     struct NimbleServerTransportConnection* transportConnection,
                                     StepId* outClientWaitingForStepId);
+int nimbleServerSkipIncomingSteps(struct FldInStream* inStream,
+                                  const struct NimbleServerTransportConnection* transportConnection);
 
 #endif
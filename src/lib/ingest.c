@@ -0,0 +1,122 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "incoming_predicted_steps.h"
+#include <imprint/allocator.h>
+#include <nimble-server/game.h>
+#include <nimble-server/ingest.h>
+
+/// Allocates the datagram entries
+/// @param self batch
+/// @param allocator allocator for the entries
+void nimbleServerIngestBatchInit(NimbleServerIngestBatch* self, ImprintAllocator* allocator)
+{
+    self->entries = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerIngestEntry,
+                                             NIMBLE_SERVER_INGEST_MAX_DATAGRAM_COUNT);
+    self->entryCount = 0;
+    self->jobCount = 0;
+    self->game = 0;
+}
+
+/// Returns the entry that the next datagram should be received into. It is not part of the batch until
+/// nimbleServerIngestBatchCommit() is called, so it can be used for other datagrams as well.
+/// @param self batch
+/// @return the entry, or NULL if the batch is full
+NimbleServerIngestEntry* nimbleServerIngestBatchNext(NimbleServerIngestBatch* self)
+{
+    if (self->entryCount == NIMBLE_SERVER_INGEST_MAX_DATAGRAM_COUNT) {
+        return 0;
+    }
+
+    return &self->entries[self->entryCount];
+}
+
+/// Adds the entry from nimbleServerIngestBatchNext() to the batch
+/// @param self batch
+void nimbleServerIngestBatchCommit(NimbleServerIngestBatch* self)
+{
+    CLOG_ASSERT(self->entryCount < NIMBLE_SERVER_INGEST_MAX_DATAGRAM_COUNT, "ingest batch is full")
+    self->entryCount++;
+}
+
+/// Groups the entries by party. Each group keeps the arrival order of the datagrams.
+/// @param self batch
+static void groupByParty(NimbleServerIngestBatch* self)
+{
+    struct NimbleServerLocalParty* jobParties[NIMBLE_SERVER_INGEST_MAX_DATAGRAM_COUNT];
+    uint8_t entryJobs[NIMBLE_SERVER_INGEST_MAX_DATAGRAM_COUNT];
+    size_t jobEntryCounts[NIMBLE_SERVER_INGEST_MAX_DATAGRAM_COUNT];
+
+    self->jobCount = 0;
+    for (size_t i = 0; i < self->entryCount; ++i) {
+        size_t jobIndex = 0;
+        while (jobIndex < self->jobCount && jobParties[jobIndex] != self->entries[i].party) {
+            jobIndex++;
+        }
+        if (jobIndex == self->jobCount) {
+            jobParties[jobIndex] = self->entries[i].party;
+            jobEntryCounts[jobIndex] = 0;
+            self->jobCount++;
+        }
+        jobEntryCounts[jobIndex]++;
+        entryJobs[i] = (uint8_t) jobIndex;
+    }
+
+    size_t startIndex = 0;
+    for (size_t jobIndex = 0; jobIndex < self->jobCount; ++jobIndex) {
+        self->jobStartIndices[jobIndex] = startIndex;
+        startIndex += jobEntryCounts[jobIndex];
+        jobEntryCounts[jobIndex] = 0;
+    }
+    self->jobStartIndices[self->jobCount] = startIndex;
+
+    for (size_t i = 0; i < self->entryCount; ++i) {
+        size_t jobIndex = entryJobs[i];
+        self->jobEntryIndices[self->jobStartIndices[jobIndex] + jobEntryCounts[jobIndex]++] = (uint8_t) i;
+    }
+}
+
+/// Reads the predicted steps of all datagrams for one party. It only touches the party, its participants and its
+/// transport connection, so it can run at the same time as the jobs for the other parties.
+static void ingestPartyJob(void* context, size_t jobIndex)
+{
+    NimbleServerIngestBatch* self = (NimbleServerIngestBatch*) context;
+
+    for (size_t i = self->jobStartIndices[jobIndex]; i < self->jobStartIndices[jobIndex + 1]; ++i) {
+        NimbleServerIngestEntry* entry = &self->entries[self->jobEntryIndices[i]];
+        entry->result = nimbleServerHandleIncomingSteps(self->game, &entry->inStream, entry->transportConnection,
+                                                        &entry->clientWaitingForStepId);
+    }
+}
+
+/// Reads the predicted steps of all the datagrams in the batch into the participant step buffers, one job for each
+/// party. The result of each datagram is stored in the entry. Must not be called at the same time as anything that
+/// changes the game, since the jobs read it.
+/// @param self batch
+/// @param game game that the parties belong to
+/// @param workerPool runs the jobs, runs them on the calling thread if it has no parallelForFn
+void nimbleServerIngestBatchRun(NimbleServerIngestBatch* self, NimbleServerGame* game,
+                                const NimbleServerWorkerPool* workerPool)
+{
+    self->game = game;
+    groupByParty(self);
+
+    if (workerPool->parallelForFn == 0 || self->jobCount == 1) {
+        for (size_t jobIndex = 0; jobIndex < self->jobCount; ++jobIndex) {
+            ingestPartyJob(self, jobIndex);
+        }
+        return;
+    }
+
+    workerPool->parallelForFn(workerPool->self, self->jobCount, ingestPartyJob, self);
+}
+
+/// Removes all entries from the batch
+/// @param self batch
+void nimbleServerIngestBatchClear(NimbleServerIngestBatch* self)
+{
+    self->entryCount = 0;
+    self->jobCount = 0;
+}
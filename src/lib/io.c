@@ -0,0 +1,216 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "atomic.h"
+#include <imprint/allocator.h>
+#include <nimble-server/io.h>
+#include <nimble-server/server.h>
+#include <tiny-libc/tiny_libc.h>
+
+/// The ordered datagram sequence and at least one command
+#define NIMBLE_SERVER_IO_MIN_DATAGRAM_OCTET_COUNT (3)
+
+/// Initializes the ring and allocates the datagrams
+/// @param self ring
+/// @param allocator allocator for the datagrams
+/// @param capacity maximum number of datagrams in the ring, must be a power of two
+void nimbleServerDatagramRingInit(NimbleServerDatagramRing* self, ImprintAllocator* allocator, size_t capacity)
+{
+    CLOG_ASSERT(capacity > 0 && (capacity & (capacity - 1U)) == 0, "ring capacity must be a power of two %zu",
+                capacity)
+    self->datagrams = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerIoDatagram, capacity);
+    self->capacity = capacity;
+    self->writeIndex = 0;
+    self->readIndex = 0;
+}
+
+/// Returns the next datagram to write to. Must only be called from the producer thread.
+/// @param self ring
+/// @return the datagram, or NULL if the ring is full
+NimbleServerIoDatagram* nimbleServerDatagramRingWriteBegin(NimbleServerDatagramRing* self)
+{
+    size_t writeIndex = self->writeIndex;
+    size_t readIndex = nimbleServerAtomicLoadAcquire(&self->readIndex);
+    if (writeIndex - readIndex == self->capacity) {
+        return 0;
+    }
+
+    return &self->datagrams[writeIndex & (self->capacity - 1U)];
+}
+
+/// Makes the datagram from nimbleServerDatagramRingWriteBegin() visible to the consumer
+/// @param self ring
+void nimbleServerDatagramRingWriteCommit(NimbleServerDatagramRing* self)
+{
+    nimbleServerAtomicStoreRelease(&self->writeIndex, self->writeIndex + 1U);
+}
+
+/// Returns the oldest datagram in the ring. Must only be called from the consumer thread.
+/// @param self ring
+/// @return the datagram, or NULL if the ring is empty
+const NimbleServerIoDatagram* nimbleServerDatagramRingReadBegin(NimbleServerDatagramRing* self)
+{
+    size_t readIndex = self->readIndex;
+    size_t writeIndex = nimbleServerAtomicLoadAcquire(&self->writeIndex);
+    if (readIndex == writeIndex) {
+        return 0;
+    }
+
+    return &self->datagrams[readIndex & (self->capacity - 1U)];
+}
+
+/// Returns the datagram from nimbleServerDatagramRingReadBegin() to the producer
+/// @param self ring
+void nimbleServerDatagramRingReadCommit(NimbleServerDatagramRing* self)
+{
+    nimbleServerAtomicStoreRelease(&self->readIndex, self->readIndex + 1U);
+}
+
+/// Checks what can be checked without the connection state, which is owned by the tick thread
+static bool isValidDatagram(int connectionIndex, ssize_t octetCount)
+{
+    return connectionIndex >= 0 && connectionIndex < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS &&
+           octetCount >= NIMBLE_SERVER_IO_MIN_DATAGRAM_OCTET_COUNT;
+}
+
+/// Initializes the rings between the I/O thread and the thread that updates the server
+/// @param self io
+/// @param allocator allocator for the rings
+/// @param transport the transport that the I/O thread receives from and sends to
+/// @param ringCapacity maximum number of datagrams in each direction, must be a power of two
+/// @param log the log to use
+void nimbleServerIoInit(NimbleServerIo* self, ImprintAllocator* allocator, DatagramTransportMulti transport,
+                        size_t ringCapacity, Clog log)
+{
+    self->log = log;
+    self->transport = transport;
+    self->invalidDatagramCount = 0;
+    self->droppedInboundCount = 0;
+    self->droppedOutboundCount = 0;
+    nimbleServerDatagramRingInit(&self->inbound, allocator, ringCapacity);
+    nimbleServerDatagramRingInit(&self->outbound, allocator, ringCapacity);
+}
+
+/// Receives datagrams from the transport and pushes the valid ones to the inbound ring. Datagrams are still
+/// received, and dropped, when the ring is full, so the transport does not back up.
+/// Must only be called from the I/O thread.
+/// @param self io
+/// @return number of datagrams pushed to the inbound ring, or negative on error
+int nimbleServerIoReceive(NimbleServerIo* self)
+{
+    uint8_t discardBuffer[DATAGRAM_TRANSPORT_MAX_SIZE];
+    int pushedCount = 0;
+
+    // Yield after a full ring worth of datagrams, so the outbound ring can be sent in between
+    for (size_t i = 0; i < self->inbound.capacity; ++i) {
+        NimbleServerIoDatagram* datagram = nimbleServerDatagramRingWriteBegin(&self->inbound);
+        uint8_t* target = datagram != 0 ? datagram->octets : discardBuffer;
+
+        int connectionIndex;
+        ssize_t octetCount = self->transport.receiveFrom(self->transport.self, &connectionIndex, target,
+                                                         DATAGRAM_TRANSPORT_MAX_SIZE);
+        if (octetCount == 0) {
+            break;
+        }
+        if (octetCount < 0) {
+            return (int) octetCount;
+        }
+
+        if (!isValidDatagram(connectionIndex, octetCount)) {
+            self->invalidDatagramCount++;
+            continue;
+        }
+
+        if (datagram == 0) {
+            if ((self->droppedInboundCount++ % 60) == 0) {
+                CLOG_C_NOTICE(&self->log, "inbound ring is full, dropped %zu datagrams so far",
+                              self->droppedInboundCount)
+            }
+            continue;
+        }
+
+        datagram->connectionIndex = connectionIndex;
+        datagram->octetCount = (size_t) octetCount;
+        nimbleServerDatagramRingWriteCommit(&self->inbound);
+        pushedCount++;
+    }
+
+    return pushedCount;
+}
+
+/// Sends all datagrams in the outbound ring to the transport. Must only be called from the I/O thread.
+/// @param self io
+/// @return number of sent datagrams, or negative on error
+int nimbleServerIoSend(NimbleServerIo* self)
+{
+    int sentCount = 0;
+    const NimbleServerIoDatagram* datagram;
+    while ((datagram = nimbleServerDatagramRingReadBegin(&self->outbound)) != 0) {
+        int err = self->transport.sendTo(self->transport.self, datagram->connectionIndex, datagram->octets,
+                                         datagram->octetCount);
+        nimbleServerDatagramRingReadCommit(&self->outbound);
+        if (err < 0) {
+            return err;
+        }
+        sentCount++;
+    }
+
+    return sentCount;
+}
+
+static ssize_t tickReceiveFrom(void* self_, int* connectionIndex, uint8_t* data, size_t maxOctetCount)
+{
+    NimbleServerIo* self = (NimbleServerIo*) self_;
+    const NimbleServerIoDatagram* datagram = nimbleServerDatagramRingReadBegin(&self->inbound);
+    if (datagram == 0) {
+        return 0;
+    }
+
+    CLOG_ASSERT(datagram->octetCount <= maxOctetCount, "datagram does not fit %zu", datagram->octetCount)
+    *connectionIndex = datagram->connectionIndex;
+    size_t octetCount = datagram->octetCount;
+    tc_memcpy_octets(data, datagram->octets, octetCount);
+    nimbleServerDatagramRingReadCommit(&self->inbound);
+
+    return (ssize_t) octetCount;
+}
+
+static int tickSendTo(void* self_, int connectionIndex, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerIo* self = (NimbleServerIo*) self_;
+    if (octetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        return -1;
+    }
+
+    NimbleServerIoDatagram* datagram = nimbleServerDatagramRingWriteBegin(&self->outbound);
+    if (datagram == 0) {
+        // Same as a datagram lost on the way, the client asks again
+        if ((self->droppedOutboundCount++ % 60) == 0) {
+            CLOG_C_NOTICE(&self->log, "outbound ring is full, dropped %zu datagrams so far", self->droppedOutboundCount)
+        }
+        return 0;
+    }
+
+    datagram->connectionIndex = connectionIndex;
+    datagram->octetCount = octetCount;
+    tc_memcpy_octets(datagram->octets, data, octetCount);
+    nimbleServerDatagramRingWriteCommit(&self->outbound);
+
+    return 0;
+}
+
+/// Returns a transport that only reads from the inbound ring and writes to the outbound ring. It is used as the
+/// NimbleServerSetup::multiTransport, so nimbleServerUpdate() never makes a syscall.
+/// @param self io
+/// @return transport for the thread that updates the server
+DatagramTransportMulti nimbleServerIoTickTransport(NimbleServerIo* self)
+{
+    DatagramTransportMulti transport;
+    transport.self = self;
+    transport.receiveFrom = tickReceiveFrom;
+    transport.sendTo = tickSendTo;
+
+    return transport;
+}
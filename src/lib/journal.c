@@ -0,0 +1,456 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "atomic.h"
+#include <imprint/allocator.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/journal.h>
+#include <tiny-libc/tiny_libc.h>
+
+static const uint8_t journalMagic[8] = {'N', 'I', 'M', 'B', 'J', 'R', 'N', 'L'};
+
+static void writeUInt32(uint8_t* target, uint32_t value)
+{
+    target[0] = (uint8_t) value;
+    target[1] = (uint8_t) (value >> 8);
+    target[2] = (uint8_t) (value >> 16);
+    target[3] = (uint8_t) (value >> 24);
+}
+
+static uint32_t readUInt32(const uint8_t* source)
+{
+    return (uint32_t) source[0] | ((uint32_t) source[1] << 8) | ((uint32_t) source[2] << 16) |
+           ((uint32_t) source[3] << 24);
+}
+
+static size_t paddedOctetCount(size_t octetCount)
+{
+    return (octetCount + 7U) & ~(size_t) 7U;
+}
+
+/// Allocates the chunks. The journal does nothing until it is started.
+/// @param self journal
+/// @param allocator allocator for the chunks
+/// @param octetCount memory for steps that are waiting to be written, split into NIMBLE_SERVER_JOURNAL_CHUNK_COUNT
+/// chunks
+/// @param log the log to use
+void nimbleServerJournalInit(NimbleServerJournal* self, ImprintAllocator* allocator, size_t octetCount, Clog log)
+{
+    self->log = log;
+    self->chunkOctetCapacity = paddedOctetCount(octetCount / NIMBLE_SERVER_JOURNAL_CHUNK_COUNT);
+    uint8_t* octets = IMPRINT_ALLOC(allocator, self->chunkOctetCapacity * NIMBLE_SERVER_JOURNAL_CHUNK_COUNT,
+                                   "journal chunks");
+    for (size_t i = 0; i < NIMBLE_SERVER_JOURNAL_CHUNK_COUNT; ++i) {
+        self->chunks[i].octets = octets + i * self->chunkOctetCapacity;
+        self->chunks[i].octetCount = 0;
+    }
+    self->committedChunkCount = 0;
+    self->writtenChunkCount = 0;
+    self->out.self = 0;
+    self->out.write = 0;
+    self->isEnabled = false;
+    self->hasOpenChunk = false;
+    self->stepCount = 0;
+    self->droppedStepCount = 0;
+    self->failedWriteCount = 0;
+    self->hasFailedWrite = 0;
+}
+
+static NimbleServerJournalChunk* tickChunk(NimbleServerJournal* self)
+{
+    return &self->chunks[self->committedChunkCount & (NIMBLE_SERVER_JOURNAL_CHUNK_COUNT - 1U)];
+}
+
+/// Gets the chunk that the tick thread writes to, and opens it if needed
+/// @param self journal
+/// @return the chunk, or NULL if all chunks are waiting to be written
+static NimbleServerJournalChunk* openChunk(NimbleServerJournal* self)
+{
+    NimbleServerJournalChunk* chunk = tickChunk(self);
+    if (self->hasOpenChunk) {
+        return chunk;
+    }
+
+    size_t writtenChunkCount = nimbleServerAtomicLoadAcquire(&self->writtenChunkCount);
+    if (self->committedChunkCount - writtenChunkCount == NIMBLE_SERVER_JOURNAL_CHUNK_COUNT) {
+        return 0;
+    }
+
+    chunk->octetCount = 0;
+    self->hasOpenChunk = true;
+
+    return chunk;
+}
+
+/// Reserves octets in the open chunk, and hands over the chunk to nimbleServerJournalFlush() when it is full
+/// @param self journal
+/// @param octetCount octets to reserve, must fit in a chunk
+/// @return where to write the octets, or NULL if all chunks are waiting to be written
+static uint8_t* reserve(NimbleServerJournal* self, size_t octetCount)
+{
+    NimbleServerJournalChunk* chunk = openChunk(self);
+    if (chunk != 0 && chunk->octetCount + octetCount > self->chunkOctetCapacity) {
+        nimbleServerJournalCommit(self);
+        chunk = openChunk(self);
+    }
+    if (chunk == 0) {
+        return 0;
+    }
+
+    uint8_t* target = chunk->octets + chunk->octetCount;
+    chunk->octetCount += octetCount;
+
+    return target;
+}
+
+/// Starts a new segment. Must be called from the tick thread, and the previous segment must be flushed first.
+/// @param self journal
+/// @param out where to append the segment
+/// @return negative on error
+int nimbleServerJournalStart(NimbleServerJournal* self, NimbleServerJournalOut out)
+{
+    if (self->chunkOctetCapacity < NIMBLE_SERVER_JOURNAL_SEGMENT_HEADER_OCTET_COUNT || self->hasOpenChunk ||
+        nimbleServerAtomicLoadAcquire(&self->writtenChunkCount) != self->committedChunkCount) {
+        return NimbleServerErrJournal;
+    }
+
+    uint8_t* header = reserve(self, NIMBLE_SERVER_JOURNAL_SEGMENT_HEADER_OCTET_COUNT);
+    if (header == 0) {
+        return NimbleServerErrJournal;
+    }
+    tc_memcpy_octets(header, journalMagic, sizeof(journalMagic));
+    writeUInt32(header + 8, NIMBLE_SERVER_JOURNAL_VERSION);
+    writeUInt32(header + 12, 0);
+
+    self->out = out;
+
+    nimbleServerAtomicStoreRelease(&self->hasFailedWrite, 0);
+    self->isEnabled = true;
+    self->stepCount = 0;
+    self->droppedStepCount = 0;
+
+    return 0;
+}
+
+/// Stops appending steps and hands over the steps that are left to nimbleServerJournalFlush()
+/// @param self journal
+void nimbleServerJournalStop(NimbleServerJournal* self)
+{
+    nimbleServerJournalCommit(self);
+    self->isEnabled = false;
+}
+
+/// Appends a committed authoritative step. Must only be called from the tick thread. Does nothing if the journal
+/// has not been started.
+/// @param self journal
+/// @param stepId the id of the authoritative step
+/// @param octets the authoritative step
+/// @param octetCount octet count of the authoritative step
+/// @return negative if the step was dropped
+int nimbleServerJournalAppend(NimbleServerJournal* self, StepId stepId, const uint8_t* octets, size_t octetCount)
+{
+    if (!self->isEnabled) {
+        return 0;
+    }
+
+    if (nimbleServerAtomicLoadAcquire(&self->hasFailedWrite)) {
+        CLOG_C_NOTICE(&self->log, "journal segment is stopped after a failed write, step %08X is not journaled",
+                      stepId)
+        nimbleServerJournalStop(self);
+        return NimbleServerErrJournal;
+    }
+
+    size_t recordOctetCount = NIMBLE_SERVER_JOURNAL_RECORD_HEADER_OCTET_COUNT + paddedOctetCount(octetCount);
+    if (recordOctetCount > self->chunkOctetCapacity) {
+        CLOG_C_SOFT_ERROR(&self->log, "authoritative step %08X is too large for the journal %zu", stepId, octetCount)
+        self->droppedStepCount++;
+        return NimbleServerErrJournal;
+    }
+
+    uint8_t* record = reserve(self, recordOctetCount);
+    if (record == 0) {
+        if ((self->droppedStepCount++ % 60) == 0) {
+            CLOG_C_NOTICE(&self->log, "journal is not flushed fast enough, dropped %zu steps so far",
+                          self->droppedStepCount)
+        }
+        return NimbleServerErrJournal;
+    }
+
+    writeUInt32(record, stepId);
+    writeUInt32(record + 4, (uint32_t) octetCount);
+    uint8_t* payload = record + NIMBLE_SERVER_JOURNAL_RECORD_HEADER_OCTET_COUNT;
+    tc_memcpy_octets(payload, octets, octetCount);
+    for (size_t i = octetCount; i < paddedOctetCount(octetCount); ++i) {
+        payload[i] = 0;
+    }
+    self->stepCount++;
+
+    return 0;
+}
+
+/// Hands over the open chunk to nimbleServerJournalFlush(), even if it is not full, e.g. at the end of a match.
+/// Must only be called from the tick thread.
+/// @param self journal
+void nimbleServerJournalCommit(NimbleServerJournal* self)
+{
+    if (!self->hasOpenChunk) {
+        return;
+    }
+
+    NimbleServerJournalChunk* chunk = tickChunk(self);
+    if (chunk->octetCount == 0) {
+        return;
+    }
+
+    self->hasOpenChunk = false;
+    nimbleServerAtomicStoreRelease(&self->committedChunkCount, self->committedChunkCount + 1U);
+}
+
+/// Writes all handed over chunks to the journal out. Can be called from another thread than the tick thread, but
+/// only from one thread.
+/// After a failed write, the chunks are discarded instead of written, and the tick thread stops the segment on the
+/// next append. A new segment must be started to journal again.
+/// @param self journal
+/// @return number of written chunks, or negative if a write has failed in the segment
+int nimbleServerJournalFlush(NimbleServerJournal* self)
+{
+    int writtenCount = 0;
+    int result = 0;
+    size_t committedChunkCount = nimbleServerAtomicLoadAcquire(&self->committedChunkCount);
+    while (self->writtenChunkCount != committedChunkCount) {
+        const NimbleServerJournalChunk* chunk = &self->chunks[self->writtenChunkCount &
+                                                              (NIMBLE_SERVER_JOURNAL_CHUNK_COUNT - 1U)];
+        if (!self->hasFailedWrite) {
+            int err = self->out.write(self->out.self, chunk->octets, chunk->octetCount);
+            if (err < 0) {
+                CLOG_C_SOFT_ERROR(&self->log, "journal write failed %d, the segment is stopped", err)
+                self->failedWriteCount++;
+                result = err;
+                nimbleServerAtomicStoreRelease(&self->hasFailedWrite, 1U);
+            } else {
+                writtenCount++;
+            }
+        }
+        nimbleServerAtomicStoreRelease(&self->writtenChunkCount, self->writtenChunkCount + 1U);
+    }
+
+    if (self->hasFailedWrite) {
+        return result < 0 ? result : NimbleServerErrJournal;
+    }
+
+    return writtenCount;
+}
+
+/// Finds the next complete record
+/// @return the record octet count, zero at the end of the segment and negative on error
+static int nextRecord(const uint8_t* octets, size_t octetCount, size_t pos, StepId* outStepId)
+{
+    size_t remaining = octetCount - pos;
+    if (remaining < NIMBLE_SERVER_JOURNAL_RECORD_HEADER_OCTET_COUNT) {
+        return 0;
+    }
+
+    size_t stepOctetCount = readUInt32(octets + pos + 4);
+    if (stepOctetCount > remaining) {
+        return 0;
+    }
+    size_t recordOctetCount = NIMBLE_SERVER_JOURNAL_RECORD_HEADER_OCTET_COUNT + paddedOctetCount(stepOctetCount);
+    if (remaining < recordOctetCount) {
+        // A truncated last record, e.g. from a server that was killed, is the end of the segment
+        return 0;
+    }
+
+    *outStepId = readUInt32(octets + pos);
+
+    return (int) recordOctetCount;
+}
+
+static int checkSegmentHeader(const uint8_t* octets, size_t octetCount)
+{
+    if (octetCount < NIMBLE_SERVER_JOURNAL_SEGMENT_HEADER_OCTET_COUNT) {
+        return NimbleServerErrJournal;
+    }
+
+    for (size_t i = 0; i < sizeof(journalMagic); ++i) {
+        if (octets[i] != journalMagic[i]) {
+            return NimbleServerErrJournal;
+        }
+    }
+
+    if (readUInt32(octets + 8) != NIMBLE_SERVER_JOURNAL_VERSION) {
+        return NimbleServerErrJournal;
+    }
+
+    return 0;
+}
+
+/// Adds the complete records after the indexed ones to the index
+/// @param self reader
+/// @param octets the journal segment
+/// @param octetCount octet count of the journal segment
+/// @return number of added records, or negative if the step ids are not increasing or the index is full
+static int indexRecords(NimbleServerJournalReader* self, const uint8_t* octets, size_t octetCount)
+{
+    self->octets = octets;
+    self->octetCount = octetCount;
+
+    int addedCount = 0;
+    StepId stepId;
+    int recordOctetCount;
+    while ((recordOctetCount = nextRecord(octets, octetCount, self->indexedOctetCount, &stepId)) > 0) {
+        if (self->recordCount > 0 && stepId <= self->records[self->recordCount - 1].stepId) {
+            return NimbleServerErrJournal;
+        }
+        if (self->recordCount == self->recordCapacity) {
+            return NimbleServerErrJournal;
+        }
+        NimbleServerJournalRecordPosition* record = &self->records[self->recordCount++];
+        record->stepId = stepId;
+        record->pos = self->indexedOctetCount;
+        self->indexedOctetCount += (size_t) recordOctetCount;
+        addedCount++;
+    }
+
+    return addedCount;
+}
+
+/// Builds the step id index for a complete journal segment in memory, e.g. a memory mapped file.
+/// The index has one entry for each record, so step ids that are far apart do not make it larger.
+/// The octets are not copied and must be kept for as long as the reader is used.
+/// @param self reader
+/// @param allocator allocator for the index
+/// @param octets the journal segment
+/// @param octetCount octet count of the journal segment
+/// @return negative if it is not a supported journal segment
+int nimbleServerJournalReaderInit(NimbleServerJournalReader* self, ImprintAllocator* allocator,
+                                  const uint8_t* octets, size_t octetCount)
+{
+    int err = checkSegmentHeader(octets, octetCount);
+    if (err < 0) {
+        return err;
+    }
+
+    self->octets = octets;
+    self->octetCount = octetCount;
+    self->records = 0;
+    self->recordCount = 0;
+    self->recordCapacity = 0;
+    self->indexedOctetCount = NIMBLE_SERVER_JOURNAL_SEGMENT_HEADER_OCTET_COUNT;
+
+    // The first pass counts the records, so the index can be allocated
+    size_t recordCount = 0;
+    size_t pos = NIMBLE_SERVER_JOURNAL_SEGMENT_HEADER_OCTET_COUNT;
+    StepId stepId;
+    int recordOctetCount;
+    while ((recordOctetCount = nextRecord(octets, octetCount, pos, &stepId)) > 0) {
+        recordCount++;
+        pos += (size_t) recordOctetCount;
+    }
+
+    if (recordCount == 0) {
+        return 0;
+    }
+
+    self->records = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerJournalRecordPosition, recordCount);
+    self->recordCapacity = recordCount;
+
+    err = indexRecords(self, octets, octetCount);
+
+    return err < 0 ? err : 0;
+}
+
+/// Prepares an index for the segment that is currently being journaled, so the server can send the steps from it
+/// as soon as they are written. The segment is added with nimbleServerJournalReaderAppend().
+/// @param self reader
+/// @param allocator allocator for the index
+/// @param maxRecordCount maximum number of records in the segment, e.g. the steps in a match
+void nimbleServerJournalReaderInitLive(NimbleServerJournalReader* self, ImprintAllocator* allocator,
+                                       size_t maxRecordCount)
+{
+    self->octets = 0;
+    self->octetCount = 0;
+    self->records = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerJournalRecordPosition, maxRecordCount);
+    self->recordCount = 0;
+    self->recordCapacity = maxRecordCount;
+    self->indexedOctetCount = 0;
+}
+
+/// Indexes the records that have been written to a live segment since the last call. Only complete records are
+/// indexed, a partially written record is indexed in a later call. Must be called from the thread that reads from
+/// the reader, e.g. the tick thread after nimbleServerJournalFlush() has written more chunks.
+/// @param self reader
+/// @param octets the segment so far. It can move, e.g. when the file is mapped again, but the written octets must be
+/// the same
+/// @param octetCount octet count of the segment so far
+/// @return number of added records, or negative if it is not a supported journal segment or the index is full
+int nimbleServerJournalReaderAppend(NimbleServerJournalReader* self, const uint8_t* octets, size_t octetCount)
+{
+    if (octetCount < self->indexedOctetCount) {
+        return NimbleServerErrJournal;
+    }
+
+    if (self->indexedOctetCount == 0) {
+        if (octetCount < NIMBLE_SERVER_JOURNAL_SEGMENT_HEADER_OCTET_COUNT) {
+            return 0;
+        }
+        int err = checkSegmentHeader(octets, octetCount);
+        if (err < 0) {
+            return err;
+        }
+        self->indexedOctetCount = NIMBLE_SERVER_JOURNAL_SEGMENT_HEADER_OCTET_COUNT;
+    }
+
+    return indexRecords(self, octets, octetCount);
+}
+
+/// Looks up an authoritative step. The step octets point into the journal segment.
+/// @param self reader
+/// @param stepId the step id to look up
+/// @param[out] outOctets the authoritative step
+/// @param[out] outOctetCount octet count of the authoritative step
+/// @return 1 if the step was found, 0 if it is not in the segment
+int nimbleServerJournalReaderRead(const NimbleServerJournalReader* self, StepId stepId, const uint8_t** outOctets,
+                                  size_t* outOctetCount)
+{
+    size_t low = 0;
+    size_t high = self->recordCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2U;
+        if (self->records[middle].stepId < stepId) {
+            low = middle + 1U;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low == self->recordCount || self->records[low].stepId != stepId) {
+        return 0;
+    }
+
+    size_t pos = self->records[low].pos;
+    *outOctetCount = readUInt32(self->octets + pos + 4);
+    *outOctets = self->octets + pos + NIMBLE_SERVER_JOURNAL_RECORD_HEADER_OCTET_COUNT;
+
+    return 1;
+}
+
+static int readFromReader(void* self_, StepId stepId, const uint8_t** outOctets, size_t* outOctetCount)
+{
+    const NimbleServerJournalReader* self = (const NimbleServerJournalReader*) self_;
+
+    return nimbleServerJournalReaderRead(self, stepId, outOctets, outOctetCount);
+}
+
+/// Returns a source that reads from a single segment, for nimbleServerSetJournalSource()
+/// @param self reader
+/// @return source that reads from the reader
+NimbleServerJournalSource nimbleServerJournalReaderSource(NimbleServerJournalReader* self)
+{
+    NimbleServerJournalSource source;
+    source.self = self;
+    source.read = readFromReader;
+
+    return source;
+}
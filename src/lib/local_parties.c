@@ -23,6 +23,7 @@ void nimbleServerLocalPartiesInit(NimbleServerLocalParties* self, size_t maxCoun
 {
     self->partiesCount = 0;
     self->parties = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerLocalParty, maxCount);
+    self->partiesCold = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerLocalPartyCold, maxCount);
     self->capacityCount = maxCount;
     self->allocator = allocator;
     self->maxLocalPartyParticipantCount = maxLocalPartyParticipantCount;
@@ -30,17 +31,19 @@ void nimbleServerLocalPartiesInit(NimbleServerLocalParties* self, size_t maxCoun
     self->log = log;
 
     tc_mem_clear_type_n(self->parties, self->capacityCount);
+    tc_mem_clear_type_n(self->partiesCold, self->capacityCount);
 
     for (size_t i = 0; i < self->capacityCount; ++i) {
         NimbleServerLocalParty* party = &self->parties[i];
+        NimbleServerLocalPartyCold* cold = &self->partiesCold[i];
         uint8_t id = (uint8_t) i;
 
         Clog subLog;
-        tc_snprintf(party->debugPrefix, sizeof(party->debugPrefix), "%s/party/%u", self->log.constantPrefix, id);
-        subLog.constantPrefix = party->debugPrefix;
+        tc_snprintf(cold->debugPrefix, sizeof(cold->debugPrefix), "%s/party/%u", self->log.constantPrefix, id);
+        subLog.constantPrefix = cold->debugPrefix;
         subLog.config = log.config;
 
-        nimbleServerLocalPartyInit(party, id, subLog);
+        nimbleServerLocalPartyInit(party, cold, id, subLog);
     }
 }
 
@@ -128,7 +131,7 @@ static void addParty(NimbleServerLocalParties* self, NimbleServerLocalParty* par
     party->participantReferences.participantReferenceCount = localParticipantCount;
     // party->partySecret.value = secureRandomUInt64();
 
-    CLOG_C_DEBUG(&party->log, "party is ready. All participants have joined")
+    CLOG_C_DEBUG(&party->cold->log, "party is ready. All participants have joined")
 }
 
 /// Used in host migration to prepare a party and the participants in that party.
@@ -5,33 +5,39 @@
 
 #include "authoritative_steps.h"
 #include "incoming_predicted_steps.h"
+#include "log.h"
 #include "nimble-server/server.h"
 #include <flood/in_stream.h>
 #include <nimble-server/delayed_quality.h>
 #include <nimble-server/errors.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/participant.h>
+#include <nimble-server/varint.h>
 #include <nimble-steps-serialize/in_serialize.h>
 #include <nimble-steps-serialize/out_serialize.h>
 
 /// Initializes a party.
 /// @param self the party
+/// @param cold the cold data for the party, see NimbleServerLocalPartyCold
 /// @param id the id for the party
 /// @param log the log to use for logging
 /// Need to create Participants to the game before associating them to the connection.
-void nimbleServerLocalPartyInit(NimbleServerLocalParty* self, NimbleSerializeLocalPartyId id, Clog log)
+void nimbleServerLocalPartyInit(NimbleServerLocalParty* self, NimbleServerLocalPartyCold* cold,
+                                NimbleSerializeLocalPartyId id, Clog log)
 {
-    self->log = log;
-    CLOG_C_DEBUG(&self->log, "initialize local party")
+    self->cold = cold;
+    self->cold->log = log;
+    CLOG_C_DEBUG(&self->cold->log, "initialize local party")
 
     self->id = id;
     self->participantReferences.participantReferenceCount = 0;
     self->waitingForReconnectMaxTimer = 62 * 20;
     self->isUsed = false;
-    self->warningCount = 0;
+    self->cold->warningCount = 0;
 
     self->quality.log.config = log.config;
-    tc_snprintf(self->quality.debugPrefix, sizeof(self->quality.debugPrefix), "%s/quality", self->log.constantPrefix);
+    tc_snprintf(self->quality.debugPrefix, sizeof(self->quality.debugPrefix), "%s/quality",
+                self->cold->log.constantPrefix);
     self->quality.log.constantPrefix = self->quality.debugPrefix;
     nimbleServerConnectionQualityInit(&self->quality, self->quality.log);
     nimbleServerConnectionQualityDelayedInit(&self->delayedQuality, self->quality.log);
@@ -47,12 +53,13 @@ void nimbleServerLocalPartyReInit(NimbleServerLocalParty* self, NimbleServerTran
     self->state = NimbleServerLocalPartyStateNormal;
     nimbleServerConnectionQualityReInit(&self->quality);
     nimbleServerConnectionQualityDelayedReset(&self->delayedQuality);
-    statsIntInit(&self->incomingStepCountInBufferStats, 60);
+    statsIntInit(&self->cold->incomingStepCountInBufferStats, 60);
+    nimbleServerStepLatencyReset(&self->cold->stepLatency);
     // Expect that the client will add steps for the next authoritative step
     self->transportConnection = transportConnection;
     self->waitingForReconnectTimer = 0;
-    self->warningCount = 0;
-    self->warningAboutZeroAddedSteps = 0;
+    self->cold->warningCount = 0;
+    self->cold->warningAboutZeroAddedSteps = 0;
 }
 
 /// Resets and reuses the memory of a party
@@ -62,8 +69,8 @@ void nimbleServerLocalPartyReset(NimbleServerLocalParty* self)
     self->isUsed = false;
     self->participantReferences.participantReferenceCount = 0;
     self->waitingForReconnectTimer = 0;
-    self->warningCount = 0;
-    self->warningAboutZeroAddedSteps = 0;
+    self->cold->warningCount = 0;
+    self->cold->warningAboutZeroAddedSteps = 0;
     nimbleServerConnectionQualityReset(&self->quality);
     nimbleServerConnectionQualityDelayedReset(&self->delayedQuality);
 }
@@ -73,7 +80,8 @@ void nimbleServerLocalPartyReset(NimbleServerLocalParty* self)
 /// @param transportConnection The new transport connection through which the party is rejoining.
 void nimbleServerLocalPartyRejoin(NimbleServerLocalParty* self, NimbleServerTransportConnection* transportConnection)
 {
-    CLOG_C_DEBUG(&self->log, "rejoined from transport connection %hhu", transportConnection->transportConnectionId)
+    CLOG_C_DEBUG(&self->cold->log, "rejoined from transport connection %hhu",
+                 transportConnection->transportConnectionId)
     nimbleServerLocalPartyReInit(self, transportConnection);
 }
 
@@ -81,7 +89,7 @@ void nimbleServerLocalPartyRejoin(NimbleServerLocalParty* self, NimbleServerTran
 /// @param self Pointer to an instance of NimbleServerLocalParty.
 void nimbleServerLocalPartyDestroy(NimbleServerLocalParty* self)
 {
-    CLOG_C_DEBUG(&self->log, "dissolved the party")
+    CLOG_C_DEBUG(&self->cold->log, "dissolved the party")
     self->state = NimbleServerLocalPartyStateDissolved;
 }
 
@@ -89,7 +97,7 @@ void nimbleServerLocalPartyDestroy(NimbleServerLocalParty* self)
 /// @param self Pointer to an instance of NimbleServerLocalParty.
 static void setToWaitingForReJoin(NimbleServerLocalParty* self)
 {
-    CLOG_C_DEBUG(&self->log, "setting state to: waiting for rejoin")
+    CLOG_C_DEBUG(&self->cold->log, "setting state to: waiting for rejoin")
     self->state = NimbleServerLocalPartyStateWaitingForReJoin;
     self->waitingForReconnectTimer = 0;
 
@@ -111,7 +119,7 @@ static bool tickWaitingForReconnect(NimbleServerLocalParty* self)
         return true;
     }
 
-    CLOG_C_DEBUG(&self->log, "gave up on reconnect, waited %zu ticks. recommending the party to be dissolved",
+    CLOG_C_DEBUG(&self->cold->log, "gave up on reconnect, waited %zu ticks. recommending the party to be dissolved",
                  self->waitingForReconnectTimer)
 
     return false;
@@ -126,7 +134,7 @@ static void tickNormal(NimbleServerLocalParty* self)
     bool shouldKeep = nimbleServerConnectionQualityDelayedTick(&self->delayedQuality, &self->quality);
 
     if (!shouldKeep && self->state != NimbleServerLocalPartyStateWaitingForReJoin) {
-        CLOG_C_DEBUG(&self->log,
+        CLOG_C_DEBUG(&self->cold->log,
                      "connection quality recommended waiting for rejoin, so setting it to waiting for rejoin")
         setToWaitingForReJoin(self);
     }
@@ -166,62 +174,124 @@ bool nimbleServerLocalPartyHasParticipantId(const NimbleServerLocalParty* self,
     return false;
 }
 
-int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self, FldInStream* inStream)
+static void warnAboutDroppedSteps(NimbleServerLocalParty* self, NimbleServerParticipant* participant,
+                                  StepId firstStepId, size_t stepCount)
+{
+    size_t dropped = nbsStepsDropped(&participant->steps, firstStepId);
+    if (dropped > 0) {
+        if (dropped > 60U) {
+            CLOG_C_WARN(&self->cold->log, "client had a big gap in predicted steps %zu", dropped)
+            // return -3;
+        }
+        CLOG_C_WARN(&self->cold->log, "client step: dropped %zu steps. expected %08X, but got range from %08X to %08X",
+                    dropped, participant->steps.expectedWriteId, firstStepId,
+                    (StepId) (firstStepId + stepCount - 1))
+        // nimbleServerInsertForcedSteps(self, dropped);
+    }
+}
+
+/// Records when the steps that were added for a participant arrived. Called once after all the steps for the
+/// participant have been read, so the step loop only touches the participant steps.
+/// @param participant participant that the steps were added for
+/// @param firstAddedStepId the expected write id before the steps were read
+/// @param authoritativeStepId the authoritative step that is composed next
+/// @param now current server time
+static void addStepArrivals(NimbleServerParticipant* participant, StepId firstAddedStepId,
+                            StepId authoritativeStepId, MonotonicTimeMs now)
+{
+    for (StepId stepId = firstAddedStepId; stepId != participant->steps.expectedWriteId; ++stepId) {
+        nimbleServerStepArrivalsAdd(&participant->cold->stepArrivals, stepId, authoritativeStepId, now);
+    }
+}
+
+/// Updates the party after the predicted steps for one participant has been read
+/// @param self party
+/// @param participant participant that the steps were for
+/// @param firstStepId first step in the received range
+/// @param stepCount number of steps in the received range
+/// @param totalAddedStepsCount number of steps that were new
+/// @param totalOldStepsCount number of steps that the server already had
+static void receivedPredictedSteps(NimbleServerLocalParty* self, const NimbleServerParticipant* participant,
+                                   StepId firstStepId, size_t stepCount, size_t totalAddedStepsCount,
+                                   size_t totalOldStepsCount)
+{
+    if (totalAddedStepsCount == 0) {
+        if (totalOldStepsCount > 0) {
+            CLOG_C_NOTICE(&self->cold->log, "only received %zu old predicted steps from %08X-%08X", totalOldStepsCount,
+                          firstStepId, (StepId) (firstStepId + stepCount - 1))
+        }
+
+        if (self->cold->warningAboutZeroAddedSteps++ % 4 == 0) {
+            // CLOG_C_DEBUG(
+            //   &self->cold->log,
+            // "Got a packet with old predicted steps. range: %08X - %08X, but is waiting for %08X. (Not
+            // a " "problem unless it happens a lot)", firstStepId, lastStepId,
+            // self->steps.expectedWriteId)
+        }
+    }
+
+    if (totalAddedStepsCount > 0) {
+        nimbleServerConnectionQualityAddedStepsToBuffer(&self->quality, (size_t) totalAddedStepsCount);
+
+        StepId receivedUpToStepId = participant->steps.expectedWriteId - 1;
+        if (receivedUpToStepId > self->highestReceivedStepId) {
+            self->highestReceivedStepId = receivedUpToStepId;
+            self->stepsInBufferCount = participant->steps.stepsCount;
+        }
+    }
+}
+
+/// Reads predicted steps for the participants in the party and adds them to the participant step buffers
+/// @param self party
+/// @param inStream stream to read the predicted steps from
+/// @param authoritativeStepId the authoritative step that is composed next, recorded with the step arrival
+/// @param now current server time, recorded with the step arrival
+/// @return negative on error
+int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self, FldInStream* inStream,
+                                                    StepId authoritativeStepId, MonotonicTimeMs now)
 {
     uint32_t lowestCommonStepId;
     fldInStreamReadUInt32(inStream, &lowestCommonStepId);
 
-    CLOG_C_VERBOSE(&self->log, "lowest tickId: %08X", lowestCommonStepId)
+    NIMBLE_SERVER_LOG_C_VERBOSE(&self->cold->log, "lowest tickId: %08X", lowestCommonStepId)
 
     uint8_t participantCount;
     fldInStreamReadUInt8(inStream, &participantCount);
-    CLOG_C_VERBOSE(&self->log, "participant count %hhu", participantCount)
+    NIMBLE_SERVER_LOG_C_VERBOSE(&self->cold->log, "participant count %hhu", participantCount)
 
     for (size_t participantIterator = 0; participantIterator < participantCount; ++participantIterator) {
         uint8_t participantId;
 
         fldInStreamReadUInt8(inStream, &participantId);
-        if (participantId >= self->participantReferences.participantReferenceCount) {
-            CLOG_C_SOFT_ERROR(&self->log, "illegal participant index %hhu", participantCount)
-            return -4;
-        }
 
         uint8_t deltaTicksFromCommonStepId;
         fldInStreamReadUInt8(inStream, &deltaTicksFromCommonStepId);
 
         uint32_t firstTickIdInArray = lowestCommonStepId + deltaTicksFromCommonStepId;
-        CLOG_C_VERBOSE(&self->log, "first tickId in array: %08X (delta %hhu)", firstTickIdInArray,
-                       deltaTicksFromCommonStepId)
+        NIMBLE_SERVER_LOG_C_VERBOSE(&self->cold->log, "first tickId in array: %08X (delta %hhu)", firstTickIdInArray,
+                                    deltaTicksFromCommonStepId)
 
         NimbleServerParticipant* participant = nimbleParticipantReferencesFind(&self->participantReferences,
                                                                                participantId);
         if (participant == 0) {
-            CLOG_C_SOFT_ERROR(&self->log, "tried to insert participant not in the party")
+            CLOG_C_SOFT_ERROR(&self->cold->log, "tried to insert participant not in the party")
             return -2;
         }
 
         uint8_t stepsThatFollow;
         fldInStreamReadUInt8(inStream, &stepsThatFollow);
 
-        CLOG_EXECUTE(StepId lastStepId = (StepId) (firstTickIdInArray + stepsThatFollow - 1);)
-
-        CLOG_C_VERBOSE(&self->log, "handleIncomingSteps: incoming step range %08X - %08X (count:%hhu)",
-                       firstTickIdInArray, lastStepId, stepsThatFollow)
+        NIMBLE_SERVER_LOG_C_VERBOSE(&self->cold->log,
+                                    "handleIncomingSteps: incoming step range %08X - %08X (count:%hhu)",
+                                    firstTickIdInArray, (StepId) (firstTickIdInArray + stepsThatFollow - 1),
+                                    stepsThatFollow)
 
         // Drop old predicted steps if needed.
-        size_t dropped = nbsStepsDropped(&participant->steps, firstTickIdInArray);
-        if (dropped > 0) {
-            if (dropped > 60U) {
-                CLOG_C_WARN(&self->log, "client had a big gap in predicted steps %zu", dropped)
-                // return -3;
-            }
-            CLOG_C_WARN(&self->log, "client step: dropped %zu steps. expected %08X, but got range from %08X to %08X",
-                        dropped, participant->steps.expectedWriteId, firstTickIdInArray, lastStepId)
-            // nimbleServerInsertForcedSteps(self, dropped);
-        }
+        warnAboutDroppedSteps(self, participant, firstTickIdInArray, stepsThatFollow);
 
         size_t totalAddedStepsCount = 0;
         size_t totalOldStepsCount = 0;
+        StepId firstAddedStepId = participant->steps.expectedWriteId;
 
         for (size_t i = 0; i < stepsThatFollow; ++i) {
             StepId stepId = firstTickIdInArray + (StepId) i;
@@ -232,37 +302,123 @@ int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self
 
             int addedStepsCount = nimbleServerParticipantDeserializeSingleStep(participant, stepId, inStream);
             if (addedStepsCount < 0) {
-                CLOG_C_SOFT_ERROR(&self->log, "client step: couldn't in-serialize single step")
+                CLOG_C_SOFT_ERROR(&self->cold->log, "client step: couldn't in-serialize single step")
                 return addedStepsCount;
             }
 
             totalAddedStepsCount += (size_t) addedStepsCount;
         }
 
-        if (totalAddedStepsCount == 0) {
-            if (totalOldStepsCount > 0) {
-                CLOG_C_NOTICE(&self->log, "only received %zu old predicted steps from %08X-%08X", totalOldStepsCount,
-                              firstTickIdInArray, firstTickIdInArray + stepsThatFollow - 1)
+        addStepArrivals(participant, firstAddedStepId, authoritativeStepId, now);
+        receivedPredictedSteps(self, participant, firstTickIdInArray, stepsThatFollow, totalAddedStepsCount,
+                               totalOldStepsCount);
+    }
+
+    return 0;
+}
+
+/// Reads predicted steps in the compact upload format, see nimbleServerLocalPartyDeserializeCompactPredictedSteps in
+/// local_party.h.
+/// Steps that the server already has are skipped by their length, without being written to the step buffer. A step
+/// after the next expected step is refused, since the steps must be written in order.
+/// @param self party
+/// @param inStream stream to read the predicted steps from
+/// @param baseStepId the step id that the client reported that it is waiting for. step ids are relative to it.
+/// @param maxStepOctetCount the configured maximum octet count of a single participant step
+/// @param authoritativeStepId the authoritative step that is composed next, recorded with the step arrival
+/// @param now current server time, recorded with the step arrival
+/// @return negative on error
+int nimbleServerLocalPartyDeserializeCompactPredictedSteps(NimbleServerLocalParty* self, FldInStream* inStream,
+                                                           StepId baseStepId, size_t maxStepOctetCount,
+                                                           StepId authoritativeStepId, MonotonicTimeMs now)
+{
+    int32_t deltaFromBaseStepId;
+    int err = nimbleServerVarIntReadSigned(inStream, &deltaFromBaseStepId);
+    if (err < 0) {
+        return err;
+    }
+    StepId lowestCommonStepId = (StepId) (baseStepId + (uint32_t) deltaFromBaseStepId);
+
+    uint8_t participantCount;
+    err = fldInStreamReadUInt8(inStream, &participantCount);
+    if (err < 0) {
+        return err;
+    }
+
+    for (size_t participantIterator = 0; participantIterator < participantCount; ++participantIterator) {
+        uint8_t participantId;
+        uint32_t deltaFromCommonStepId;
+        uint32_t stepCount;
+        err = fldInStreamReadUInt8(inStream, &participantId);
+        if (err < 0) {
+            return err;
+        }
+        err = nimbleServerVarIntRead(inStream, &deltaFromCommonStepId);
+        if (err < 0) {
+            return err;
+        }
+        err = nimbleServerVarIntRead(inStream, &stepCount);
+        if (err < 0) {
+            return err;
+        }
+        StepId firstStepId = (StepId) (lowestCommonStepId + deltaFromCommonStepId);
+
+        NimbleServerParticipant* participant = nimbleParticipantReferencesFind(&self->participantReferences,
+                                                                               participantId);
+        if (participant == 0) {
+            CLOG_C_SOFT_ERROR(&self->cold->log, "tried to insert participant not in the party")
+            return -2;
+        }
+
+        warnAboutDroppedSteps(self, participant, firstStepId, stepCount);
+
+        size_t totalAddedStepsCount = 0;
+        size_t totalOldStepsCount = 0;
+        uint8_t stepOctets[NimbleStepMaxSingleStepOctetCount];
+        StepId firstAddedStepId = participant->steps.expectedWriteId;
+
+        for (size_t i = 0; i < stepCount; ++i) {
+            StepId stepId = (StepId) (firstStepId + i);
+            uint32_t octetCount;
+            err = nimbleServerVarIntRead(inStream, &octetCount);
+            if (err < 0) {
+                return err;
+            }
+            if (octetCount > maxStepOctetCount || octetCount > sizeof(stepOctets)) {
+                CLOG_C_SOFT_ERROR(&self->cold->log, "client step: too large step %u", octetCount)
+                return NimbleServerErrSerialize;
             }
 
-            if (self->warningAboutZeroAddedSteps++ % 4 == 0) {
-                // CLOG_C_DEBUG(
-                //   &self->log,
-                // "Got a packet with old predicted steps. range: %08X - %08X, but is waiting for %08X. (Not
-                // a " "problem unless it happens a lot)", firstStepId, lastStepId,
-                // self->steps.expectedWriteId)
+            if (stepId < participant->steps.expectedWriteId) {
+                totalOldStepsCount++;
+                err = nimbleServerParticipantSkipStepOctets(inStream, octetCount);
+                if (err < 0) {
+                    return err;
+                }
+                continue;
             }
-        }
 
-        if (totalAddedStepsCount > 0) {
-            nimbleServerConnectionQualityAddedStepsToBuffer(&self->quality, (size_t) totalAddedStepsCount);
+            if (stepId != participant->steps.expectedWriteId) {
+                CLOG_C_SOFT_ERROR(&self->cold->log,
+                                  "client step: couldn't in-serialize single step %08X, expected %08X", stepId,
+                                  participant->steps.expectedWriteId)
+                return NimbleServerErrSerialize;
+            }
 
-            StepId receivedUpToStepId = participant->steps.expectedWriteId - 1;
-            if (receivedUpToStepId > self->highestReceivedStepId) {
-                self->highestReceivedStepId = receivedUpToStepId;
-                self->stepsInBufferCount = participant->steps.stepsCount;
+            err = fldInStreamReadOctets(inStream, stepOctets, octetCount);
+            if (err < 0) {
+                return err;
+            }
+            err = nbsStepsWrite(&participant->steps, stepId, stepOctets, octetCount);
+            if (err < 0) {
+                CLOG_C_SOFT_ERROR(&self->cold->log, "client step: couldn't write step %08X", stepId)
+                return err;
             }
+            totalAddedStepsCount++;
         }
+
+        addStepArrivals(participant, firstAddedStepId, authoritativeStepId, now);
+        receivedPredictedSteps(self, participant, firstStepId, stepCount, totalAddedStepsCount, totalOldStepsCount);
     }
 
     return 0;
@@ -0,0 +1,44 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_LOG_H
+#define NIMBLE_SERVER_LOG_H
+
+#include <clog/clog.h>
+
+/// Compile time ceiling for the logging in the per datagram and per step code paths.
+/// Calls below the level are removed, including the evaluation of their arguments.
+#define NIMBLE_SERVER_LOG_LEVEL_VERBOSE (0)
+#define NIMBLE_SERVER_LOG_LEVEL_DEBUG (1)
+#define NIMBLE_SERVER_LOG_LEVEL_INFO (2)
+
+#if !defined NIMBLE_SERVER_LOG_LEVEL
+#if defined CONFIGURATION_DEBUG
+#define NIMBLE_SERVER_LOG_LEVEL NIMBLE_SERVER_LOG_LEVEL_VERBOSE
+#else
+#define NIMBLE_SERVER_LOG_LEVEL NIMBLE_SERVER_LOG_LEVEL_INFO
+#endif
+#endif
+
+#define NIMBLE_SERVER_LOG_VERBOSE_ENABLED (NIMBLE_SERVER_LOG_LEVEL <= NIMBLE_SERVER_LOG_LEVEL_VERBOSE)
+#define NIMBLE_SERVER_LOG_DEBUG_ENABLED (NIMBLE_SERVER_LOG_LEVEL <= NIMBLE_SERVER_LOG_LEVEL_DEBUG)
+
+#if NIMBLE_SERVER_LOG_VERBOSE_ENABLED
+#define NIMBLE_SERVER_LOG_C_VERBOSE(logger, ...) CLOG_C_VERBOSE(logger, __VA_ARGS__)
+#define NIMBLE_SERVER_LOG_VERBOSE(...) CLOG_VERBOSE(__VA_ARGS__)
+#define NIMBLE_SERVER_LOG_EXECUTE_VERBOSE(x) CLOG_EXECUTE(x)
+#else
+#define NIMBLE_SERVER_LOG_C_VERBOSE(logger, ...)
+#define NIMBLE_SERVER_LOG_VERBOSE(...)
+#define NIMBLE_SERVER_LOG_EXECUTE_VERBOSE(x)
+#endif
+
+#if NIMBLE_SERVER_LOG_DEBUG_ENABLED
+#define NIMBLE_SERVER_LOG_C_DEBUG(logger, ...) CLOG_C_DEBUG(logger, __VA_ARGS__)
+#else
+#define NIMBLE_SERVER_LOG_C_DEBUG(logger, ...)
+#endif
+
+#endif
@@ -0,0 +1,210 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <clog/clog.h>
+#include <nimble-server/memory.h>
+#include <stdint.h>
+#include <tiny-libc/tiny_libc.h>
+
+/// Keeps the allocations from the parent aligned
+#define NIMBLE_SERVER_MEMORY_HEADER_OCTET_COUNT (16U)
+
+static void usageAdd(NimbleServerMemoryUsage* self, size_t octetCount)
+{
+    self->octetCount += octetCount;
+    self->allocationCount++;
+    if (self->octetCount > self->highWaterOctetCount) {
+        self->highWaterOctetCount = self->octetCount;
+    }
+}
+
+static void usageRemove(NimbleServerMemoryUsage* self, size_t octetCount)
+{
+    CLOG_ASSERT(self->octetCount >= octetCount && self->allocationCount > 0, "memory usage is wrong")
+    self->octetCount -= octetCount;
+    self->allocationCount--;
+}
+
+static void memoryAdd(NimbleServerMemory* self, NimbleServerMemoryCategory category, size_t octetCount)
+{
+    usageAdd(&self->categories[category], octetCount);
+    usageAdd(&self->total, octetCount);
+}
+
+static void memoryRemove(NimbleServerMemory* self, NimbleServerMemoryCategory category, size_t octetCount)
+{
+    usageRemove(&self->categories[category], octetCount);
+    usageRemove(&self->total, octetCount);
+}
+
+/// Checks the budget, and counts the allocation as refused if it does not fit
+static bool reserve(NimbleServerMemory* self, NimbleServerMemoryCategory category, size_t octetCount,
+                    bool enforceBudget)
+{
+    if (enforceBudget && !nimbleServerMemoryHasRoom(self, octetCount)) {
+        self->refusedAllocationCount++;
+        CLOG_NOTICE("memory budget %zu would be exceeded by %zu octets for %s (%zu used)", self->budgetOctetCount,
+                    octetCount, nimbleServerMemoryCategoryToString(category), self->total.octetCount)
+        return false;
+    }
+
+    return true;
+}
+
+static void* trackedAlloc(void* self_, size_t size, const char* sourceFile, int line, const char* description)
+{
+    NimbleServerTrackedAllocator* self = (NimbleServerTrackedAllocator*) self_;
+    if (!reserve(self->memory, self->category, size, self->enforceBudget)) {
+        return 0;
+    }
+
+    void* p = self->parent->allocDebugFn(self->parent, size, sourceFile, line, description);
+    if (p != 0) {
+        memoryAdd(self->memory, self->category, size);
+    }
+
+    return p;
+}
+
+static void* trackedCalloc(void* self_, size_t size, const char* sourceFile, int line, const char* description)
+{
+    NimbleServerTrackedAllocator* self = (NimbleServerTrackedAllocator*) self_;
+    if (!reserve(self->memory, self->category, size, self->enforceBudget)) {
+        return 0;
+    }
+
+    void* p = self->parent->callocDebugFn(self->parent, size, sourceFile, line, description);
+    if (p != 0) {
+        memoryAdd(self->memory, self->category, size);
+    }
+
+    return p;
+}
+
+static void* trackedWithFreeAlloc(void* self_, size_t size, const char* sourceFile, int line,
+                                  const char* description)
+{
+    NimbleServerTrackedAllocatorWithFree* self = (NimbleServerTrackedAllocatorWithFree*) self_;
+    if (!reserve(self->memory, self->category, size, self->enforceBudget)) {
+        return 0;
+    }
+
+    ImprintAllocator* parent = &self->parent->allocator;
+    uint8_t* octets = parent->allocDebugFn(parent, NIMBLE_SERVER_MEMORY_HEADER_OCTET_COUNT + size, sourceFile, line,
+                                           description);
+    if (octets == 0) {
+        return 0;
+    }
+    tc_memcpy_octets(octets, &size, sizeof(size));
+    memoryAdd(self->memory, self->category, size);
+
+    return octets + NIMBLE_SERVER_MEMORY_HEADER_OCTET_COUNT;
+}
+
+static void* trackedWithFreeCalloc(void* self_, size_t size, const char* sourceFile, int line,
+                                   const char* description)
+{
+    uint8_t* octets = trackedWithFreeAlloc(self_, size, sourceFile, line, description);
+    if (octets != 0) {
+        tc_mem_clear(octets, size);
+    }
+
+    return octets;
+}
+
+static void trackedWithFreeFree(void* self_, void* p, const char* sourceFile, int line, const char* description)
+{
+    if (p == 0) {
+        return;
+    }
+
+    NimbleServerTrackedAllocatorWithFree* self = (NimbleServerTrackedAllocatorWithFree*) self_;
+    uint8_t* octets = (uint8_t*) p - NIMBLE_SERVER_MEMORY_HEADER_OCTET_COUNT;
+    size_t size;
+    tc_memcpy_octets(&size, octets, sizeof(size));
+    memoryRemove(self->memory, self->category, size);
+
+    self->parent->freeDebugFn(self->parent, octets, sourceFile, line, description);
+}
+
+/// Initializes the memory usage
+/// @param self memory
+/// @param budgetOctetCount maximum octet count for the allocators that enforce the budget. zero is no budget.
+void nimbleServerMemoryInit(NimbleServerMemory* self, size_t budgetOctetCount)
+{
+    tc_mem_clear_type(self);
+    self->budgetOctetCount = budgetOctetCount;
+}
+
+/// Checks if octetCount more octets can be allocated within the budget
+/// @param self memory
+/// @param octetCount octets to allocate
+/// @return true if there is no budget, or if the allocation fits
+bool nimbleServerMemoryHasRoom(const NimbleServerMemory* self, size_t octetCount)
+{
+    if (self->budgetOctetCount == 0) {
+        return true;
+    }
+
+    return self->total.octetCount <= self->budgetOctetCount &&
+           octetCount <= self->budgetOctetCount - self->total.octetCount;
+}
+
+const char* nimbleServerMemoryCategoryToString(NimbleServerMemoryCategory category)
+{
+    switch (category) {
+        case NimbleServerMemoryCategoryGame:
+            return "game";
+        case NimbleServerMemoryCategoryParticipantSteps:
+            return "participantSteps";
+        case NimbleServerMemoryCategoryLocalParties:
+            return "localParties";
+        case NimbleServerMemoryCategoryDownloads:
+            return "downloads";
+        case NimbleServerMemoryCategoryBlobStreams:
+            return "blobStreams";
+        case NimbleServerMemoryCategoryCount:
+            break;
+    }
+
+    return "unknown";
+}
+
+/// Initializes an allocator that records the allocations of the parent allocator
+/// @param self tracked allocator
+/// @param parent the allocator that allocates the memory
+/// @param memory the usage is recorded here
+/// @param category category for the allocations
+/// @param enforceBudget return NULL for allocations that would exceed the budget
+void nimbleServerTrackedAllocatorInit(NimbleServerTrackedAllocator* self, ImprintAllocator* parent,
+                                      NimbleServerMemory* memory, NimbleServerMemoryCategory category,
+                                      bool enforceBudget)
+{
+    self->allocator.allocDebugFn = trackedAlloc;
+    self->allocator.callocDebugFn = trackedCalloc;
+    self->parent = parent;
+    self->memory = memory;
+    self->category = category;
+    self->enforceBudget = enforceBudget;
+}
+
+/// Initializes an allocator that records the allocations and frees of the parent allocator
+/// @param self tracked allocator
+/// @param parent the allocator that allocates and frees the memory
+/// @param memory the usage is recorded here
+/// @param category category for the allocations
+/// @param enforceBudget return NULL for allocations that would exceed the budget
+void nimbleServerTrackedAllocatorWithFreeInit(NimbleServerTrackedAllocatorWithFree* self,
+                                              ImprintAllocatorWithFree* parent, NimbleServerMemory* memory,
+                                              NimbleServerMemoryCategory category, bool enforceBudget)
+{
+    self->allocator.allocator.allocDebugFn = trackedWithFreeAlloc;
+    self->allocator.allocator.callocDebugFn = trackedWithFreeCalloc;
+    self->allocator.freeDebugFn = trackedWithFreeFree;
+    self->parent = parent;
+    self->memory = memory;
+    self->category = category;
+    self->enforceBudget = enforceBudget;
+}
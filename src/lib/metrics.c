@@ -0,0 +1,438 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <nimble-server/errors.h>
+#include <nimble-server/metrics.h>
+#include <nimble-server/participant.h>
+#include <tiny-libc/tiny_libc.h>
+
+static void copyStatsInt(NimbleServerMetricsStatsInt* target, const StatsInt* source)
+{
+    target->average = source->avg;
+    target->min = source->min;
+    target->max = source->max;
+    target->isSet = source->avgIsSet;
+}
+
+static void snapshotParticipants(const NimbleServer* self, NimbleServerMetrics* metrics)
+{
+    metrics->participantMetricsCount = 0;
+    metrics->hasStepLatencyDriver = false;
+    metrics->stepLatencyDriverParticipantId = 0;
+    uint64_t lowestWaitTimeP50Ms = UINT64_MAX;
+
+    const NimbleServerParticipants* gameParticipants = &self->game.participants;
+    for (size_t i = 0; i < gameParticipants->participantCapacity; ++i) {
+        const NimbleServerParticipant* gameParticipant = &gameParticipants->participants[i];
+        if (!gameParticipant->isUsed ||
+            metrics->participantMetricsCount == NIMBLE_SERVER_METRICS_MAX_PARTICIPANT_COUNT) {
+            continue;
+        }
+        NimbleServerParticipantMetrics* participant = &metrics->participants[metrics->participantMetricsCount++];
+        participant->participantId = gameParticipant->id;
+        participant->partyId = gameParticipant->inParty != 0 ? gameParticipant->inParty->id : 0;
+        nimbleServerStepLatencySummarize(&gameParticipant->cold->stepLatency, &participant->stepLatency);
+
+        const NimbleServerStepLatencySummary* latency = &participant->stepLatency;
+        if (latency->committedCount > 0 && latency->waitTimeP50Ms < lowestWaitTimeP50Ms) {
+            lowestWaitTimeP50Ms = latency->waitTimeP50Ms;
+            metrics->hasStepLatencyDriver = true;
+            metrics->stepLatencyDriverParticipantId = participant->participantId;
+        }
+    }
+}
+
+/// Copies all the metrics of the server to a caller provided struct. Does not allocate.
+/// Must be called from the thread that updates the server.
+/// @param self server
+/// @param[out] metrics the snapshot
+void nimbleServerMetricsSnapshot(const NimbleServer* self, NimbleServerMetrics* metrics)
+{
+    metrics->timeMs = self->now;
+    metrics->authoritativeStepsPerSecond = self->authoritativeStepsPerSecondStat.avgIsSet
+                                               ? self->authoritativeStepsPerSecondStat.avg
+                                               : 0;
+    metrics->lastAuthoritativeStepId = self->game.authoritativeSteps.expectedWriteId - 1;
+    metrics->authoritativeStepCountInBuffer = self->game.authoritativeSteps.stepsCount;
+    metrics->participantCount = self->game.participants.participantCount;
+    metrics->updateQualityState = self->updateQuality.state;
+    copyStatsInt(&metrics->tickDeltaTimeMs, &self->updateQuality.measuredDeltaTimeMsStat);
+    metrics->traceEventCount = self->trace.writeCount;
+    metrics->memory = self->memory;
+    for (size_t i = 0; i < NimbleServerProfilerPhaseCount; ++i) {
+        metrics->phases[i] = self->profiler.phases[i];
+    }
+
+    metrics->connectionCount = 0;
+    for (size_t i = 0; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
+        if (!self->transportConnectionsHot.isUsed[i]) {
+            continue;
+        }
+        const NimbleServerTransportConnection* transportConnection = &self->transportConnections[i];
+        const NimbleServerRateLimit* rateLimit = &self->transportConnectionsHot.rateLimits[i];
+        NimbleServerConnectionMetrics* connection = &metrics->connections[metrics->connectionCount++];
+        connection->connectionId = transportConnection->transportConnectionId;
+        connection->phase = transportConnection->phase;
+        copyStatsInt(&connection->stepsBehind, &transportConnection->stepsBehindStats);
+        connection->droppedDatagramCount = rateLimit->droppedDatagramCount;
+        connection->droppedOctetCount = rateLimit->droppedOctetCount;
+        connection->droppedPredictedStepCount = rateLimit->droppedPredictedStepCount;
+
+        NimbleServerRoundTripTimeSummary roundTripTime;
+        nimbleServerRoundTripTimeSummarize(&transportConnection->roundTripTime, &roundTripTime);
+        connection->roundTripTimeMs = roundTripTime.smoothedMs;
+        connection->roundTripTimeVarianceMs = roundTripTime.varianceMs;
+        connection->pingJitterMs = roundTripTime.pingJitterMs;
+        connection->roundTripTimeSampleCount = roundTripTime.sampleCount;
+        connection->lossPermille = nimbleServerRedundancyLossPermille(&transportConnection->redundancy);
+        connection->lostDatagramCount = transportConnection->redundancy.lostDatagramCount;
+        connection->retransmitCount = transportConnection->redundancy.retransmitCount;
+    }
+
+    metrics->partyCount = 0;
+    for (size_t i = 0; i < self->localParties.capacityCount; ++i) {
+        const NimbleServerLocalParty* localParty = &self->localParties.parties[i];
+        if (!localParty->isUsed || metrics->partyCount == NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
+            continue;
+        }
+        NimbleServerPartyMetrics* party = &metrics->parties[metrics->partyCount++];
+        party->partyId = localParty->id;
+        party->hasConnection = localParty->transportConnection != 0;
+        party->connectionId = party->hasConnection ? localParty->transportConnection->transportConnectionId : 0;
+        party->state = localParty->state;
+        party->participantCount = localParty->participantReferences.participantReferenceCount;
+        copyStatsInt(&party->incomingStepCountInBuffer, &localParty->cold->incomingStepCountInBufferStats);
+        party->stepsInBufferCount = localParty->stepsInBufferCount;
+        party->forcedStepInRowCount = localParty->quality.forcedStepInRowCounter;
+        party->providedStepsInARowCount = localParty->quality.providedStepsInARow;
+        party->addedStepsToBufferCount = localParty->quality.addedStepsToBufferCounter;
+        party->waitingForReconnectTicks = localParty->waitingForReconnectTimer;
+        nimbleServerStepLatencySummarize(&localParty->cold->stepLatency, &party->stepLatency);
+    }
+
+    snapshotParticipants(self, metrics);
+}
+
+typedef struct PrometheusWriter {
+    char* target;
+    size_t maxOctetCount;
+    size_t pos;
+    bool isOverflowed;
+    const char* session;
+} PrometheusWriter;
+
+static void advance(PrometheusWriter* self, int writtenCount)
+{
+    if (writtenCount < 0 || (size_t) writtenCount >= self->maxOctetCount - self->pos) {
+        self->isOverflowed = true;
+        self->pos = self->maxOctetCount - 1;
+        return;
+    }
+
+    self->pos += (size_t) writtenCount;
+}
+
+#define PROMETHEUS_WRITE(writer, ...)                                                                                 \
+    advance(writer,                                                                                                    \
+            tc_snprintf((writer)->target + (writer)->pos, (writer)->maxOctetCount - (writer)->pos, __VA_ARGS__));
+
+static void writeHeader(PrometheusWriter* self, const char* name, const char* type, const char* help)
+{
+    PROMETHEUS_WRITE(self, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type)
+}
+
+static void writeValue(PrometheusWriter* self, const char* name, const char* type, const char* help, double value)
+{
+    writeHeader(self, name, type, help);
+    PROMETHEUS_WRITE(self, "%s{session=\"%s\"} %.17g\n", name, self->session, value)
+}
+
+static void writeStatsInt(PrometheusWriter* self, const char* name, const char* help,
+                          const NimbleServerMetricsStatsInt* stats)
+{
+    if (!stats->isSet) {
+        return;
+    }
+
+    writeHeader(self, name, "gauge", help);
+    PROMETHEUS_WRITE(self, "%s{session=\"%s\",stat=\"avg\"} %d\n", name, self->session, stats->average)
+    PROMETHEUS_WRITE(self, "%s{session=\"%s\",stat=\"min\"} %d\n", name, self->session, stats->min)
+    PROMETHEUS_WRITE(self, "%s{session=\"%s\",stat=\"max\"} %d\n", name, self->session, stats->max)
+}
+
+/// Writes a size_t field for every connection
+#define WRITE_CONNECTION_FIELD(writer, metrics, name, type, help, field)                                              \
+    writeHeader(writer, name, type, help);                                                                             \
+    for (size_t connectionIndex = 0; connectionIndex < (metrics)->connectionCount; ++connectionIndex) {                \
+        const NimbleServerConnectionMetrics* connection = &(metrics)->connections[connectionIndex];                  \
+        PROMETHEUS_WRITE(writer, "%s{session=\"%s\",connection=\"%u\"} %zu\n", name, (writer)->session,             \
+                         connection->connectionId, connection->field)                                                 \
+    }
+
+/// Writes a size_t field for every party
+#define WRITE_PARTY_FIELD(writer, metrics, name, type, help, field)                                                   \
+    writeHeader(writer, name, type, help);                                                                             \
+    for (size_t partyIndex = 0; partyIndex < (metrics)->partyCount; ++partyIndex) {                                    \
+        const NimbleServerPartyMetrics* party = &(metrics)->parties[partyIndex];                                      \
+        PROMETHEUS_WRITE(writer, "%s{session=\"%s\",party=\"%u\"} %zu\n", name, (writer)->session, party->partyId,   \
+                         party->field)                                                                                \
+    }
+
+static void writeConnectionStepsBehind(PrometheusWriter* self, const NimbleServerMetrics* metrics)
+{
+    const char* name = "nimble_server_connection_steps_behind";
+    writeHeader(self, name, "gauge", "authoritative steps that the client is behind the server");
+    for (size_t i = 0; i < metrics->connectionCount; ++i) {
+        const NimbleServerConnectionMetrics* connection = &metrics->connections[i];
+        const NimbleServerMetricsStatsInt* stats = &connection->stepsBehind;
+        if (!stats->isSet) {
+            continue;
+        }
+        PROMETHEUS_WRITE(self, "%s{session=\"%s\",connection=\"%u\",stat=\"avg\"} %d\n", name, self->session,
+                         connection->connectionId, stats->average)
+        PROMETHEUS_WRITE(self, "%s{session=\"%s\",connection=\"%u\",stat=\"max\"} %d\n", name, self->session,
+                         connection->connectionId, stats->max)
+    }
+}
+
+static void writePartyStates(PrometheusWriter* self, const NimbleServerMetrics* metrics)
+{
+    const char* name = "nimble_server_party_state";
+    writeHeader(self, name, "gauge", "0 normal, 1 waiting for rejoin, 2 dissolved");
+    for (size_t i = 0; i < metrics->partyCount; ++i) {
+        const NimbleServerPartyMetrics* party = &metrics->parties[i];
+        PROMETHEUS_WRITE(self, "%s{session=\"%s\",party=\"%u\"} %d\n", name, self->session, party->partyId,
+                         (int) party->state)
+    }
+}
+
+static void writePartyIncomingStepCountInBuffer(PrometheusWriter* self, const NimbleServerMetrics* metrics)
+{
+    const char* name = "nimble_server_party_incoming_steps_in_buffer";
+    writeHeader(self, name, "gauge", "predicted steps buffered for the party when the client sent more steps");
+    for (size_t i = 0; i < metrics->partyCount; ++i) {
+        const NimbleServerPartyMetrics* party = &metrics->parties[i];
+        const NimbleServerMetricsStatsInt* stats = &party->incomingStepCountInBuffer;
+        if (!stats->isSet) {
+            continue;
+        }
+        PROMETHEUS_WRITE(self, "%s{session=\"%s\",party=\"%u\",stat=\"avg\"} %d\n", name, self->session,
+                         party->partyId, stats->average)
+        PROMETHEUS_WRITE(self, "%s{session=\"%s\",party=\"%u\",stat=\"min\"} %d\n", name, self->session,
+                         party->partyId, stats->min)
+    }
+}
+
+static void writeStepLatencySeconds(PrometheusWriter* self, const char* name, const char* labelName,
+                                    unsigned labelValue, const NimbleServerStepLatencySummary* latency)
+{
+    if (latency->committedCount == 0) {
+        return;
+    }
+    PROMETHEUS_WRITE(self, "%s{session=\"%s\",%s=\"%u\",quantile=\"0.5\"} %.3f\n", name, self->session, labelName,
+                     labelValue, (double) latency->waitTimeP50Ms / 1e3)
+    PROMETHEUS_WRITE(self, "%s{session=\"%s\",%s=\"%u\",quantile=\"0.99\"} %.3f\n", name, self->session, labelName,
+                     labelValue, (double) latency->waitTimeP99Ms / 1e3)
+    PROMETHEUS_WRITE(self, "%s_count{session=\"%s\",%s=\"%u\"} %llu\n", name, self->session, labelName, labelValue,
+                     (unsigned long long) latency->committedCount)
+}
+
+static void writeStepLatencySteps(PrometheusWriter* self, const char* name, const char* labelName, unsigned labelValue,
+                                  const NimbleServerStepLatencySummary* latency)
+{
+    if (latency->committedCount == 0) {
+        return;
+    }
+    PROMETHEUS_WRITE(self, "%s{session=\"%s\",%s=\"%u\",stat=\"avg\"} %u\n", name, self->session, labelName,
+                     labelValue, latency->averageWaitStepCount)
+    PROMETHEUS_WRITE(self, "%s{session=\"%s\",%s=\"%u\",stat=\"min\"} %u\n", name, self->session, labelName,
+                     labelValue, latency->minWaitStepCount)
+    PROMETHEUS_WRITE(self, "%s{session=\"%s\",%s=\"%u\",stat=\"max\"} %u\n", name, self->session, labelName,
+                     labelValue, latency->maxWaitStepCount)
+}
+
+/// Writes the step wait of the parties and participants. All samples of a metric family must follow its header, so
+/// the _seconds and _steps families are written in separate loops.
+static void writeStepLatencies(PrometheusWriter* self, const NimbleServerMetrics* metrics)
+{
+    const char* secondsHelp = "time from predicted step arrival until it was composed";
+    const char* stepsHelp = "authoritative steps composed between predicted step arrival and it being composed";
+
+    const char* partySecondsName = "nimble_server_party_step_wait_seconds";
+    writeHeader(self, partySecondsName, "summary", secondsHelp);
+    for (size_t i = 0; i < metrics->partyCount; ++i) {
+        const NimbleServerPartyMetrics* party = &metrics->parties[i];
+        writeStepLatencySeconds(self, partySecondsName, "party", party->partyId, &party->stepLatency);
+    }
+
+    const char* partyStepsName = "nimble_server_party_step_wait_steps";
+    writeHeader(self, partyStepsName, "gauge", stepsHelp);
+    for (size_t i = 0; i < metrics->partyCount; ++i) {
+        const NimbleServerPartyMetrics* party = &metrics->parties[i];
+        writeStepLatencySteps(self, partyStepsName, "party", party->partyId, &party->stepLatency);
+    }
+
+    const char* participantSecondsName = "nimble_server_participant_step_wait_seconds";
+    writeHeader(self, participantSecondsName, "summary", secondsHelp);
+    for (size_t i = 0; i < metrics->participantMetricsCount; ++i) {
+        const NimbleServerParticipantMetrics* participant = &metrics->participants[i];
+        writeStepLatencySeconds(self, participantSecondsName, "participant", participant->participantId,
+                                &participant->stepLatency);
+    }
+
+    const char* participantStepsName = "nimble_server_participant_step_wait_steps";
+    writeHeader(self, participantStepsName, "gauge", stepsHelp);
+    for (size_t i = 0; i < metrics->participantMetricsCount; ++i) {
+        const NimbleServerParticipantMetrics* participant = &metrics->participants[i];
+        writeStepLatencySteps(self, participantStepsName, "participant", participant->participantId,
+                              &participant->stepLatency);
+    }
+
+    const char* missedName = "nimble_server_participant_missed_steps_total";
+    writeHeader(self, missedName, "counter", "authoritative steps where the predicted step had not arrived in time");
+    for (size_t i = 0; i < metrics->participantMetricsCount; ++i) {
+        const NimbleServerParticipantMetrics* participant = &metrics->participants[i];
+        PROMETHEUS_WRITE(self, "%s{session=\"%s\",participant=\"%u\",party=\"%u\"} %llu\n", missedName,
+                         self->session, participant->participantId, participant->partyId,
+                         (unsigned long long) participant->stepLatency.missedCount)
+    }
+
+    if (metrics->hasStepLatencyDriver) {
+        writeValue(self, "nimble_server_step_wait_driver_participant", "gauge",
+                   "participant with the shortest median step wait, the one composition is waiting for",
+                   metrics->stepLatencyDriverParticipantId);
+    }
+}
+
+static void writeMemory(PrometheusWriter* self, const NimbleServerMetrics* metrics)
+{
+    const NimbleServerMemory* memory = &metrics->memory;
+    const char* name = "nimble_server_memory_octets";
+    writeHeader(self, name, "gauge", "octets allocated by each subsystem");
+    for (size_t i = 0; i < NimbleServerMemoryCategoryCount; ++i) {
+        const char* category = nimbleServerMemoryCategoryToString((NimbleServerMemoryCategory) i);
+        PROMETHEUS_WRITE(self, "%s{session=\"%s\",category=\"%s\",stat=\"current\"} %zu\n", name, self->session,
+                         category, memory->categories[i].octetCount)
+        PROMETHEUS_WRITE(self, "%s{session=\"%s\",category=\"%s\",stat=\"max\"} %zu\n", name, self->session,
+                         category, memory->categories[i].highWaterOctetCount)
+    }
+    writeValue(self, "nimble_server_memory_total_octets", "gauge", "octets allocated by the server",
+               (double) memory->total.octetCount);
+    writeValue(self, "nimble_server_memory_budget_octets", "gauge", "memory budget, zero is no budget",
+               (double) memory->budgetOctetCount);
+    writeValue(self, "nimble_server_memory_refused_allocations_total", "counter",
+               "allocations refused because of the memory budget", (double) memory->refusedAllocationCount);
+}
+
+static void writePhases(PrometheusWriter* self, const NimbleServerMetrics* metrics)
+{
+    const char* name = "nimble_server_phase_seconds";
+    writeHeader(self, name, "summary", "time spent in each server phase");
+    for (size_t i = 0; i < NimbleServerProfilerPhaseCount; ++i) {
+        const NimbleServerProfilerHistogram* histogram = &metrics->phases[i];
+        if (histogram->count == 0) {
+            continue;
+        }
+        const char* phase = nimbleServerProfilerPhaseToString((NimbleServerProfilerPhase) i);
+        PROMETHEUS_WRITE(self, "%s{session=\"%s\",phase=\"%s\",quantile=\"0.5\"} %.9f\n", name, self->session, phase,
+                         (double) nimbleServerProfilerHistogramPercentile(histogram, 50) / 1e9)
+        PROMETHEUS_WRITE(self, "%s{session=\"%s\",phase=\"%s\",quantile=\"0.99\"} %.9f\n", name, self->session, phase,
+                         (double) nimbleServerProfilerHistogramPercentile(histogram, 99) / 1e9)
+        PROMETHEUS_WRITE(self, "%s_sum{session=\"%s\",phase=\"%s\"} %.9f\n", name, self->session, phase,
+                         (double) histogram->totalNs / 1e9)
+        PROMETHEUS_WRITE(self, "%s_count{session=\"%s\",phase=\"%s\"} %llu\n", name, self->session, phase,
+                         (unsigned long long) histogram->count)
+    }
+}
+
+/// Writes the metrics in the Prometheus text exposition format. Does not allocate.
+/// @param metrics snapshot to write
+/// @param session value of the session label that is added to all samples. Must not contain quotes or backslashes.
+/// @param target the text is written here, zero terminated
+/// @param maxOctetCount octet count of target
+/// @return the octet count of the text (excluding the zero terminator), or negative if target is too small
+int nimbleServerMetricsWritePrometheus(const NimbleServerMetrics* metrics, const char* session, char* target,
+                                       size_t maxOctetCount)
+{
+    if (maxOctetCount == 0) {
+        return NimbleServerErrMetrics;
+    }
+
+    PrometheusWriter writer = {
+        .target = target, .maxOctetCount = maxOctetCount, .pos = 0, .isOverflowed = false, .session = session};
+    PrometheusWriter* self = &writer;
+
+    writeValue(self, "nimble_server_authoritative_steps_per_second", "gauge",
+               "authoritative steps composed per second", metrics->authoritativeStepsPerSecond);
+    writeValue(self, "nimble_server_authoritative_step_id", "gauge", "last composed authoritative step id",
+               metrics->lastAuthoritativeStepId);
+    writeValue(self, "nimble_server_authoritative_steps_in_buffer", "gauge",
+               "authoritative steps kept for clients that are behind",
+               (double) metrics->authoritativeStepCountInBuffer);
+    writeValue(self, "nimble_server_participants", "gauge", "participants in the game",
+               (double) metrics->participantCount);
+    writeValue(self, "nimble_server_connections", "gauge", "transport connections in use",
+               (double) metrics->connectionCount);
+    writeValue(self, "nimble_server_parties", "gauge", "local parties in use", (double) metrics->partyCount);
+    writeValue(self, "nimble_server_update_quality_state", "gauge",
+               "0 working, 1 shedding, 2 look ahead, 3 failed tick time, 4 failed average tick time",
+               metrics->updateQualityState);
+    writeStatsInt(self, "nimble_server_tick_delta_milliseconds", "time between server updates",
+                  &metrics->tickDeltaTimeMs);
+    writeValue(self, "nimble_server_trace_events_total", "counter", "events recorded to the trace",
+               (double) metrics->traceEventCount);
+    writePhases(self, metrics);
+    writeMemory(self, metrics);
+
+    writeConnectionStepsBehind(self, metrics);
+    WRITE_CONNECTION_FIELD(self, metrics, "nimble_server_connection_dropped_datagrams_total", "counter",
+                           "datagrams dropped by the ingress rate limit", droppedDatagramCount)
+    WRITE_CONNECTION_FIELD(self, metrics, "nimble_server_connection_dropped_octets_total", "counter",
+                           "octets dropped by the ingress rate limit", droppedOctetCount)
+    WRITE_CONNECTION_FIELD(self, metrics, "nimble_server_connection_dropped_predicted_steps_total", "counter",
+                           "predicted steps dropped by the ingress rate limit", droppedPredictedStepCount)
+    WRITE_CONNECTION_FIELD(self, metrics, "nimble_server_connection_round_trip_time_milliseconds", "gauge",
+                           "smoothed time from sending an authoritative step until the client has received it",
+                           roundTripTimeMs)
+    WRITE_CONNECTION_FIELD(self, metrics, "nimble_server_connection_round_trip_time_variance_milliseconds", "gauge",
+                           "smoothed mean deviation of the round trip time", roundTripTimeVarianceMs)
+    WRITE_CONNECTION_FIELD(self, metrics, "nimble_server_connection_round_trip_time_samples_total", "counter",
+                           "authoritative step acknowledgements used for the round trip time", roundTripTimeSampleCount)
+    WRITE_CONNECTION_FIELD(self, metrics, "nimble_server_connection_ping_jitter_milliseconds", "gauge",
+                           "one way jitter estimated from the spacing of ping requests", pingJitterMs)
+    WRITE_CONNECTION_FIELD(self, metrics, "nimble_server_connection_loss_permille", "gauge",
+                           "smoothed loss of datagrams from the client, used to choose the step redundancy",
+                           lossPermille)
+    WRITE_CONNECTION_FIELD(self, metrics, "nimble_server_connection_lost_datagrams_total", "counter",
+                           "datagrams from the client that were skipped in the ordered datagram sequence",
+                           lostDatagramCount)
+    WRITE_CONNECTION_FIELD(self, metrics, "nimble_server_connection_step_retransmits_total", "counter",
+                           "steps that were resent because their acknowledgement took longer than the timeout",
+                           retransmitCount)
+
+    writePartyStates(self, metrics);
+    WRITE_PARTY_FIELD(self, metrics, "nimble_server_party_participants", "gauge", "participants in the party",
+                      participantCount)
+    writePartyIncomingStepCountInBuffer(self, metrics);
+    WRITE_PARTY_FIELD(self, metrics, "nimble_server_party_steps_in_buffer", "gauge",
+                      "predicted steps currently buffered for the party", stepsInBufferCount)
+    WRITE_PARTY_FIELD(self, metrics, "nimble_server_party_forced_steps_in_a_row", "gauge",
+                      "authoritative steps in a row where the party did not provide a step in time",
+                      forcedStepInRowCount)
+    WRITE_PARTY_FIELD(self, metrics, "nimble_server_party_provided_steps_in_a_row", "gauge",
+                      "authoritative steps in a row where the party provided a step in time", providedStepsInARowCount)
+    WRITE_PARTY_FIELD(self, metrics, "nimble_server_party_added_steps_total", "counter",
+                      "predicted steps added to the buffer of the party", addedStepsToBufferCount)
+    WRITE_PARTY_FIELD(self, metrics, "nimble_server_party_waiting_for_reconnect_ticks", "gauge",
+                      "ticks that the party has been waiting for a rejoin", waitingForReconnectTicks)
+
+    writeStepLatencies(self, metrics);
+
+    if (self->isOverflowed) {
+        return NimbleServerErrMetrics;
+    }
+
+    return (int) self->pos;
+}
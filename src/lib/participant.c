@@ -3,44 +3,83 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
+#include <flood/in_stream.h>
+#include <imprint/allocator.h>
+#include <nimble-server/errors.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/participant.h>
+#include <nimble-server/steps_pool.h>
 #include <nimble-steps-serialize/in_serialize.h>
+#include <tiny-libc/tiny_libc.h>
 
-/// Prepares, initializes and allocates memory for a participant
+/// Prepares and initializes a participant. The step memory is borrowed from the steps pool when the participant
+/// joins.
 /// @param self the participant to initialize
-/// @param setup the parameter for the participant (allocator and max step octet size).
+/// @param setup the parameter for the participant (steps pool and max step octet size).
 void nimbleServerParticipantInit(NimbleServerParticipant* self, NimbleServerParticipantSetup setup)
 {
-    self->log = setup.log;
+    self->cold = setup.cold;
+    self->cold->log = setup.log;
+    self->cold->stepsPool = setup.stepsPool;
+    self->cold->stepsSlot = 0;
     self->id = setup.id;
     self->isUsed = false;
     self->state = NimbleServerParticipantStateDestroyed;
-    nbsStepsInit(&self->steps, setup.connectionAllocator, setup.maxStepOctetSizeForOneParticipant, setup.log);
+    nimbleServerStepArrivalsReset(&self->cold->stepArrivals);
+    nimbleServerStepLatencyReset(&self->cold->stepLatency);
+    self->maxLastStepOctetCount = setup.maxStepOctetSizeForOneParticipant;
+    self->lastStepOctets = 0;
+    self->lastStepOctetCount = 0;
+    self->hasLastStep = false;
+    self->forcedStepInRowCount = 0;
 }
 
-/// ReInitializes the same allocated memory
+/// ReInitializes the participant, and borrows step memory from the steps pool
 /// @param self the participant to reinitialize
 /// @param party the party that the participant is assigned to. can not be NULL.
 /// @param currentAuthoritativeStepId the last composed authoritative step
-void nimbleServerParticipantReInit(NimbleServerParticipant* self, NimbleServerLocalParty* party,
-                                   StepId currentAuthoritativeStepId)
+/// @return negative on error
+int nimbleServerParticipantReInit(NimbleServerParticipant* self, NimbleServerLocalParty* party,
+                                  StepId currentAuthoritativeStepId)
 {
     CLOG_ASSERT(party != 0, "party must be valid")
+    if (self->cold->stepsSlot == 0) {
+        NimbleServerStepsPoolSlot* slot = nimbleServerStepsPoolAcquire(self->cold->stepsPool);
+        if (slot == 0) {
+            CLOG_C_NOTICE(&self->cold->log, "out of step memory")
+            return NimbleServerErrOutOfParticipantMemory;
+        }
+        self->cold->stepsSlot = slot;
+        nbsStepsInit(&self->steps, &slot->allocator, self->maxLastStepOctetCount, self->cold->log);
+        self->lastStepOctets = IMPRINT_ALLOC_TYPE_COUNT(&slot->allocator, uint8_t, self->maxLastStepOctetCount);
+    }
     nbsStepsReInit(&self->steps, currentAuthoritativeStepId);
+    nimbleServerStepArrivalsReset(&self->cold->stepArrivals);
+    nimbleServerStepLatencyReset(&self->cold->stepLatency);
+    self->lastStepOctetCount = 0;
+    self->hasLastStep = false;
+    self->forcedStepInRowCount = 0;
     self->inParty = party;
     self->isUsed = true;
     self->state = NimbleServerParticipantStateJustJoined;
+
+    return 0;
 }
 
-/// Destroys the participant (marks the memory as not used)
+/// Destroys the participant (marks the memory as not used) and returns the step memory to the steps pool
 /// @param self participant to mark as not used.
 void nimbleServerParticipantDestroy(NimbleServerParticipant* self)
 {
     self->isUsed = false;
     self->inParty = 0;
-    self->localIndex = 0;
+    self->cold->localIndex = 0;
     self->state = NimbleServerParticipantStateDestroyed;
+    if (self->cold->stepsSlot != 0) {
+        nimbleServerStepsPoolRelease(self->cold->stepsPool, self->cold->stepsSlot);
+        self->cold->stepsSlot = 0;
+        self->lastStepOctets = 0;
+        self->hasLastStep = false;
+    }
 }
 
 /// Marking the participant as leaving
@@ -50,8 +89,58 @@ void nimbleServerParticipantMarkAsLeaving(NimbleServerParticipant* self)
     self->state = NimbleServerParticipantStateLeaving;
 }
 
+/// Remembers the last step that the participant provided in time, so it can be used for forced steps
+/// @param self participant
+/// @param octets step octets
+/// @param octetCount octet count of the step
+void nimbleServerParticipantSetLastStep(NimbleServerParticipant* self, const uint8_t* octets, size_t octetCount)
+{
+    self->forcedStepInRowCount = 0;
+    if (octetCount > self->maxLastStepOctetCount) {
+        self->hasLastStep = false;
+        return;
+    }
+    tc_memcpy_octets(self->lastStepOctets, octets, octetCount);
+    self->lastStepOctetCount = octetCount;
+    self->hasLastStep = true;
+}
+
+/// Skips the octets of a serialized step without reading them
+/// @param inStream stream to skip in
+/// @param octetCount octet count of the step
+/// @return negative on error
+int nimbleServerParticipantSkipStepOctets(FldInStream* inStream, size_t octetCount)
+{
+    if (octetCount > inStream->size - inStream->pos) {
+        return NimbleServerErrSerialize;
+    }
+    inStream->p += octetCount;
+    inStream->pos += octetCount;
+
+    return 0;
+}
+
+/// Reads a single predicted step and adds it to the participant steps. Steps that have already been received are
+/// skipped by their length, without being deserialized.
+/// @param self participant
+/// @param stepId the step id of the serialized step
+/// @param inStream stream to read the step from
+/// @return number of added steps, or negative on error
 int nimbleServerParticipantDeserializeSingleStep(NimbleServerParticipant* self, StepId stepId,
                                                  struct FldInStream* inStream)
 {
+    if (stepId < self->steps.expectedWriteId) {
+        uint8_t octetCount;
+        int err = fldInStreamReadUInt8(inStream, &octetCount);
+        if (err < 0) {
+            return err;
+        }
+        err = nimbleServerParticipantSkipStepOctets(inStream, octetCount);
+        if (err < 0) {
+            return err;
+        }
+        return 0;
+    }
+
     return nbsStepsInSerializeSinglePredictedStep(inStream, stepId, &self->steps);
 }
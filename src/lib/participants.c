@@ -9,12 +9,14 @@
 #include <nimble-server/participant.h>
 #include <nimble-server/participants.h>
 
-/// Initializes and allocates memory the participant collection
+/// Initializes and allocates memory the participant collection. The step memory is allocated when participants join.
 /// @param self participants collection
 /// @param allocator allocator to pre-alloc the collection
+/// @param stepsAllocator allocator for the step memory, allocated when the participants join
 /// @param maxCount maximum number of participants to pre-alloc
-void nimbleServerParticipantsInit(NimbleServerParticipants* self, ImprintAllocator* allocator, size_t maxCount,
-                                  size_t maxStepOctetSize, Clog* log)
+void nimbleServerParticipantsInit(NimbleServerParticipants* self, ImprintAllocator* allocator,
+                                  ImprintAllocator* stepsAllocator, size_t maxCount, size_t maxStepOctetSize,
+                                  Clog* log)
 {
     CLOG_ASSERT(maxCount > 0, "must allocate at least one participant")
     self->log = *log;
@@ -23,9 +25,11 @@ void nimbleServerParticipantsInit(NimbleServerParticipants* self, ImprintAllocat
 
     self->participantCapacity = maxCount;
     self->participants = IMPRINT_CALLOC_TYPE_COUNT(allocator, NimbleServerParticipant, maxCount);
+    self->participantsCold = IMPRINT_CALLOC_TYPE_COUNT(allocator, NimbleServerParticipantCold, maxCount);
     self->participantCount = 0;
 
     nimbleServerCircularBufferInit(&self->freeList);
+    nimbleServerStepsPoolInit(&self->stepsPool, allocator, stepsAllocator, maxCount, maxStepOctetSize, self->log);
 
     CLOG_ASSERT(maxCount < NIMBLE_SERVER_CIRCULAR_BUFFER_SIZE,
                 "maxCount must be less than NIMBLE_SERVER_CIRCULAR_BUFFER_SIZE")
@@ -36,17 +40,18 @@ void nimbleServerParticipantsInit(NimbleServerParticipants* self, ImprintAllocat
     CLOG_C_DEBUG(&self->log, "allocating %zu participants as capacity", maxCount)
     for (uint8_t i = 0; i < maxCount; ++i) {
         NimbleServerParticipant* participant = &self->participants[i];
+        NimbleServerParticipantCold* cold = &self->participantsCold[i];
 
         CLOG_C_DEBUG(&self->log, "preparing participant %hhu", i)
         NimbleServerParticipantSetup setup = {
             .id = i,
+            .cold = cold,
+            .stepsPool = &self->stepsPool,
             .maxStepOctetSizeForOneParticipant = maxStepOctetSize,
-            .connectionAllocator = allocator,
         };
 
-        tc_snprintf(participant->debugPrefix, sizeof(participant->debugPrefix), "%s/%u", self->log.constantPrefix,
-                    setup.id);
-        setup.log.constantPrefix = participant->debugPrefix;
+        tc_snprintf(cold->debugPrefix, sizeof(cold->debugPrefix), "%s/%u", self->log.constantPrefix, setup.id);
+        setup.log.constantPrefix = cold->debugPrefix;
         setup.log.config = self->log.config;
 
         nimbleServerParticipantInit(participant, setup);
@@ -55,6 +60,19 @@ void nimbleServerParticipantsInit(NimbleServerParticipants* self, ImprintAllocat
     CLOG_ASSERT(self->participants[0].isUsed == false, "CALLOC did not work")
 }
 
+/// Destroys all the participants. Their step memory is returned to the steps pool, and is reused when participants
+/// join again.
+/// @param self participants collection
+void nimbleServerParticipantsReset(NimbleServerParticipants* self)
+{
+    nimbleServerCircularBufferInit(&self->freeList);
+    for (size_t i = 0; i < self->participantCapacity; ++i) {
+        nimbleServerParticipantDestroy(&self->participants[i]);
+        nimbleServerCircularBufferWrite(&self->freeList, (uint8_t) i);
+    }
+    self->participantCount = 0;
+}
+
 /// Marks the participant as not used anymore
 /// @param self participants collection
 /// @param participantId the participant to mark as not used anymore (destroyed).
@@ -99,9 +117,12 @@ int nimbleServerParticipantsPrepare(NimbleServerParticipants* self, NimbleSerial
         CLOG_SOFT_ERROR("could not prepare for host migration, participant already used")
         return -2;
     }
-    nimbleServerParticipantReInit(participant, party, currentAuthoritativeStepId);
+    int err = nimbleServerParticipantReInit(participant, party, currentAuthoritativeStepId);
+    if (err < 0) {
+        return err;
+    }
 
-    participant->localIndex = 0;
+    participant->cold->localIndex = 0;
     participant->isUsed = true;
     participant->state = NimbleServerParticipantStateWaitingForRejoin;
     participant->id = participantId;
@@ -156,10 +177,14 @@ int nimbleServerParticipantsJoin(NimbleServerParticipants* self,
         CLOG_ERROR("internal error, participant is already used, even if the index came from the free list")
     }
 
-    nimbleServerParticipantReInit(participant, party, expectedStepId);
+    int err = nimbleServerParticipantReInit(participant, party, expectedStepId);
+    if (err < 0) {
+        nimbleServerCircularBufferWrite(&self->freeList, participantId);
+        return err;
+    }
 
     const NimbleSerializeJoinGameRequestPlayer* localPlayer = &localPlayers[joinIndex];
-    participant->localIndex = localPlayer->localIndex;
+    participant->cold->localIndex = localPlayer->localIndex;
     participant->isUsed = true;
     participant->state = NimbleServerParticipantStateJustJoined;
     participant->id = participantId;
@@ -0,0 +1,209 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if defined TORNADO_OS_WINDOWS
+#include <windows.h>
+#else
+#if !defined _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include <time.h>
+#endif
+
+#include <nimble-server/profiler.h>
+
+/// Finds the histogram bucket for a duration.
+/// The first four buckets are exact, after that each power of two is divided into four buckets.
+/// @param ns duration in nanoseconds
+/// @return bucket index
+static size_t bucketIndexFromNs(uint64_t ns)
+{
+    if (ns < 4) {
+        return (size_t) ns;
+    }
+
+    size_t highestBit = 0;
+    for (uint64_t v = ns; v > 1; v >>= 1) {
+        highestBit++;
+    }
+
+    size_t subBucket = (size_t) (ns >> (highestBit - 2)) & 3U;
+    size_t index = (highestBit - 1) * 4 + subBucket;
+    if (index >= NIMBLE_SERVER_PROFILER_HISTOGRAM_BUCKET_COUNT) {
+        index = NIMBLE_SERVER_PROFILER_HISTOGRAM_BUCKET_COUNT - 1;
+    }
+
+    return index;
+}
+
+/// Returns the highest duration that is stored in a bucket
+/// @param index bucket index
+/// @return duration in nanoseconds
+static uint64_t bucketUpperBoundNs(size_t index)
+{
+    if (index < 4) {
+        return index;
+    }
+
+    size_t highestBit = index / 4 + 1;
+    uint64_t subBucket = index % 4;
+    uint64_t lowerBound = (4U + subBucket) << (highestBit - 2);
+
+    return lowerBound + ((uint64_t) 1U << (highestBit - 2)) - 1;
+}
+
+void nimbleServerProfilerHistogramReset(NimbleServerProfilerHistogram* self)
+{
+    for (size_t i = 0; i < NIMBLE_SERVER_PROFILER_HISTOGRAM_BUCKET_COUNT; ++i) {
+        self->buckets[i] = 0;
+    }
+    self->count = 0;
+    self->totalNs = 0;
+    self->maxNs = 0;
+}
+
+void nimbleServerProfilerHistogramAdd(NimbleServerProfilerHistogram* self, uint64_t ns)
+{
+    self->buckets[bucketIndexFromNs(ns)]++;
+    self->count++;
+    self->totalNs += ns;
+    if (ns > self->maxNs) {
+        self->maxNs = ns;
+    }
+}
+
+/// Calculates an approximate percentile. The result is the upper bound of the bucket, but never more than the max.
+/// @param self histogram
+/// @param percent percentile to calculate (0-100)
+/// @return duration in nanoseconds
+uint64_t nimbleServerProfilerHistogramPercentile(const NimbleServerProfilerHistogram* self, size_t percent)
+{
+    if (self->count == 0) {
+        return 0;
+    }
+
+    uint64_t wantedCount = (self->count * percent + 99U) / 100U;
+    if (wantedCount == 0) {
+        wantedCount = 1;
+    }
+
+    uint64_t accumulatedCount = 0;
+    for (size_t i = 0; i < NIMBLE_SERVER_PROFILER_HISTOGRAM_BUCKET_COUNT; ++i) {
+        accumulatedCount += self->buckets[i];
+        if (accumulatedCount >= wantedCount) {
+            uint64_t upperBound = bucketUpperBoundNs(i);
+            return upperBound < self->maxNs ? upperBound : self->maxNs;
+        }
+    }
+
+    return self->maxNs;
+}
+
+/// Initializes the profiler. It is enabled by default.
+/// @param self profiler
+void nimbleServerProfilerInit(NimbleServerProfiler* self)
+{
+    self->isEnabled = true;
+    nimbleServerProfilerReset(self);
+}
+
+/// Clears all the measurements
+/// @param self profiler
+void nimbleServerProfilerReset(NimbleServerProfiler* self)
+{
+    for (size_t i = 0; i < NimbleServerProfilerPhaseCount; ++i) {
+        nimbleServerProfilerHistogramReset(&self->phases[i]);
+    }
+}
+
+/// High resolution monotonic time, only intended for measuring durations.
+/// @return nanoseconds from an unspecified starting point
+NimbleServerProfilerTime nimbleServerProfilerNowNs(void)
+{
+#if defined TORNADO_OS_WINDOWS
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (NimbleServerProfilerTime) ((double) counter.QuadPart * 1000000000.0 / (double) frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (NimbleServerProfilerTime) now.tv_sec * 1000000000U + (NimbleServerProfilerTime) now.tv_nsec;
+#endif
+}
+
+/// Adds the time since startedAt to the histogram for the phase
+/// @param self profiler
+/// @param phase the phase that was measured
+/// @param startedAt the time returned from nimbleServerProfilerNowNs() when the phase started
+void nimbleServerProfilerAdd(NimbleServerProfiler* self, NimbleServerProfilerPhase phase,
+                             NimbleServerProfilerTime startedAt)
+{
+    if (!self->isEnabled) {
+        return;
+    }
+
+    NimbleServerProfilerTime now = nimbleServerProfilerNowNs();
+    nimbleServerProfilerHistogramAdd(&self->phases[phase], now - startedAt);
+}
+
+/// Summarizes the measurements for a phase
+/// @param self profiler
+/// @param phase phase to summarize
+/// @param[out] summary count, average, p50, p99 and max for the phase
+void nimbleServerProfilerSummarize(const NimbleServerProfiler* self, NimbleServerProfilerPhase phase,
+                                   NimbleServerProfilerSummary* summary)
+{
+    const NimbleServerProfilerHistogram* histogram = &self->phases[phase];
+
+    summary->count = histogram->count;
+    summary->averageNs = histogram->count == 0 ? 0 : histogram->totalNs / histogram->count;
+    summary->p50Ns = nimbleServerProfilerHistogramPercentile(histogram, 50);
+    summary->p99Ns = nimbleServerProfilerHistogramPercentile(histogram, 99);
+    summary->maxNs = histogram->maxNs;
+}
+
+const char* nimbleServerProfilerPhaseToString(NimbleServerProfilerPhase phase)
+{
+    switch (phase) {
+        case NimbleServerProfilerPhaseUpdate:
+            return "update";
+        case NimbleServerProfilerPhaseTickParties:
+            return "tickParties";
+        case NimbleServerProfilerPhaseTransportDrain:
+            return "transportDrain";
+        case NimbleServerProfilerPhaseFeed:
+            return "feed";
+        case NimbleServerProfilerPhaseCmdConnect:
+            return "cmdConnect";
+        case NimbleServerProfilerPhaseCmdPing:
+            return "cmdPing";
+        case NimbleServerProfilerPhaseCmdGameStep:
+            return "cmdGameStep";
+        case NimbleServerProfilerPhaseCmdJoinGame:
+            return "cmdJoinGame";
+        case NimbleServerProfilerPhaseCmdDownloadGameState:
+            return "cmdDownloadGameState";
+        case NimbleServerProfilerPhaseCmdBlobStream:
+            return "cmdBlobStream";
+        case NimbleServerProfilerPhaseIngest:
+            return "ingest";
+        case NimbleServerProfilerPhaseCompose:
+            return "compose";
+        case NimbleServerProfilerPhaseSerializeRanges:
+            return "serializeRanges";
+        case NimbleServerProfilerPhaseBlobStreamSend:
+            return "blobStreamSend";
+        case NimbleServerProfilerPhaseStateSerializeCallback:
+            return "stateSerializeCallback";
+        case NimbleServerProfilerPhaseCount:
+            break;
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,139 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <nimble-server/rate_limit.h>
+
+/// The bucket can hold this many milliseconds worth of tokens, which is the maximum burst allowed.
+#define NIMBLE_SERVER_RATE_LIMIT_BURST_MS (250)
+
+/// Initializes a token bucket. The bucket starts out full.
+/// @param self token bucket
+/// @param tokensPerSecond refill rate. Zero disables the bucket, it will then always allow consumption.
+/// @param burstTokenCount maximum number of tokens the bucket can hold
+void nimbleServerTokenBucketInit(NimbleServerTokenBucket* self, size_t tokensPerSecond, size_t burstTokenCount)
+{
+    self->tokensPerSecond = tokensPerSecond;
+    self->capacityMilliTokens = (uint64_t) burstTokenCount * 1000U;
+    self->milliTokens = self->capacityMilliTokens;
+}
+
+/// Adds tokens for the elapsed time, up to the capacity of the bucket
+/// @param self token bucket
+/// @param elapsedMs milliseconds since the last refill
+void nimbleServerTokenBucketRefill(NimbleServerTokenBucket* self, size_t elapsedMs)
+{
+    if (self->tokensPerSecond == 0) {
+        return;
+    }
+
+    uint64_t added = (uint64_t) elapsedMs * self->tokensPerSecond;
+    uint64_t available = self->capacityMilliTokens - self->milliTokens;
+    self->milliTokens += added > available ? available : added;
+}
+
+/// Checks if the bucket has enough tokens, without consuming them
+/// @param self token bucket
+/// @param tokenCount number of tokens
+/// @return true if tokenCount tokens can be consumed
+bool nimbleServerTokenBucketHasTokens(const NimbleServerTokenBucket* self, size_t tokenCount)
+{
+    if (self->tokensPerSecond == 0) {
+        return true;
+    }
+
+    return self->milliTokens >= (uint64_t) tokenCount * 1000U;
+}
+
+/// Tries to consume tokens from the bucket
+/// @param self token bucket
+/// @param tokenCount number of tokens to consume
+/// @return true if the tokens were consumed, false if there were not enough tokens
+bool nimbleServerTokenBucketConsume(NimbleServerTokenBucket* self, size_t tokenCount)
+{
+    if (!nimbleServerTokenBucketHasTokens(self, tokenCount)) {
+        return false;
+    }
+
+    if (self->tokensPerSecond != 0) {
+        self->milliTokens -= (uint64_t) tokenCount * 1000U;
+    }
+
+    return true;
+}
+
+static size_t burstFromRate(size_t tokensPerSecond, size_t minimumBurst)
+{
+    size_t burst = tokensPerSecond * NIMBLE_SERVER_RATE_LIMIT_BURST_MS / 1000U;
+    return burst < minimumBurst ? minimumBurst : burst;
+}
+
+/// Initializes the ingress rate limit for a transport connection
+/// @param self rate limit
+/// @param setup the limits to use
+/// @param now current time
+void nimbleServerRateLimitInit(NimbleServerRateLimit* self, const NimbleServerRateLimitSetup* setup,
+                               MonotonicTimeMs now)
+{
+    nimbleServerTokenBucketInit(&self->datagrams, setup->datagramsPerSecond,
+                                burstFromRate(setup->datagramsPerSecond, 1));
+    // A single datagram must always be able to fit in the octet bucket
+    nimbleServerTokenBucketInit(&self->octets, setup->octetsPerSecond, burstFromRate(setup->octetsPerSecond, 1500));
+    nimbleServerTokenBucketInit(&self->predictedSteps, setup->predictedStepsPerSecond,
+                                burstFromRate(setup->predictedStepsPerSecond, 255));
+    self->lastRefillTimeMs = now;
+    self->droppedDatagramCount = 0;
+    self->droppedOctetCount = 0;
+    self->droppedPredictedStepCount = 0;
+}
+
+/// Refills all the buckets with the time that has passed since the last refill
+/// @param self rate limit
+/// @param now current time
+void nimbleServerRateLimitRefill(NimbleServerRateLimit* self, MonotonicTimeMs now)
+{
+    if (now <= self->lastRefillTimeMs) {
+        return;
+    }
+
+    size_t elapsedMs = (size_t) (now - self->lastRefillTimeMs);
+    self->lastRefillTimeMs = now;
+
+    nimbleServerTokenBucketRefill(&self->datagrams, elapsedMs);
+    nimbleServerTokenBucketRefill(&self->octets, elapsedMs);
+    nimbleServerTokenBucketRefill(&self->predictedSteps, elapsedMs);
+}
+
+/// Checks if an incoming datagram is within the limits, and consumes the tokens if it is.
+/// @param self rate limit
+/// @param octetCount the octet count of the datagram
+/// @return false if the datagram should be dropped
+bool nimbleServerRateLimitAllowDatagram(NimbleServerRateLimit* self, size_t octetCount)
+{
+    if (!nimbleServerTokenBucketHasTokens(&self->datagrams, 1) ||
+        !nimbleServerTokenBucketHasTokens(&self->octets, octetCount)) {
+        self->droppedDatagramCount++;
+        self->droppedOctetCount += octetCount;
+        return false;
+    }
+
+    nimbleServerTokenBucketConsume(&self->datagrams, 1);
+    nimbleServerTokenBucketConsume(&self->octets, octetCount);
+
+    return true;
+}
+
+/// Checks if incoming predicted steps are within the limits, and consumes the tokens if they are.
+/// @param self rate limit
+/// @param stepCount number of predicted steps that are about to be deserialized
+/// @return false if the steps should be dropped
+bool nimbleServerRateLimitAllowPredictedSteps(NimbleServerRateLimit* self, size_t stepCount)
+{
+    if (!nimbleServerTokenBucketConsume(&self->predictedSteps, stepCount)) {
+        self->droppedPredictedStepCount += stepCount;
+        return false;
+    }
+
+    return true;
+}
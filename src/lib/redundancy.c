@@ -0,0 +1,77 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <nimble-server/redundancy.h>
+
+/// Initializes the redundancy with no observed loss
+/// @param self redundancy
+/// @param maxOctetCountPerReply maximum octets of authoritative steps in each reply. zero for no limit except the
+/// datagram size.
+void nimbleServerRedundancyInit(NimbleServerRedundancy* self, size_t maxOctetCountPerReply)
+{
+    self->lossPermilleTimesSixteen = 0;
+    self->receivedDatagramCount = 0;
+    self->lostDatagramCount = 0;
+    self->retransmitCount = 0;
+    self->maxOctetCountPerReply = maxOctetCountPerReply;
+}
+
+/// Moves the smoothed loss 1/16 towards the sample
+/// @param self redundancy
+/// @param samplePermille 1000 for a lost datagram, 0 for a received one
+static void addLossSample(NimbleServerRedundancy* self, uint32_t samplePermille)
+{
+    int64_t loss = (int64_t) self->lossPermilleTimesSixteen + samplePermille -
+                   (int64_t) ((self->lossPermilleTimesSixteen + 8U) >> 4);
+    self->lossPermilleTimesSixteen = loss < 0 ? 0 : (uint32_t) loss;
+}
+
+/// Updates the smoothed loss when a datagram is received
+/// @param self redundancy
+/// @param lostDatagramCount number of datagrams that were skipped in the ordered datagram sequence
+void nimbleServerRedundancyDatagramReceived(NimbleServerRedundancy* self, size_t lostDatagramCount)
+{
+    self->receivedDatagramCount++;
+    self->lostDatagramCount += lostDatagramCount;
+
+    // Each lost datagram is a sample, but a long burst only counts as 16, since that already saturates the average
+    size_t lostSampleCount = lostDatagramCount < 16U ? lostDatagramCount : 16U;
+    for (size_t i = 0; i < lostSampleCount; ++i) {
+        addLossSample(self, 1000U);
+    }
+
+    addLossSample(self, 0U);
+}
+
+/// Gets the smoothed loss
+/// @param self redundancy
+/// @return loss in permille
+uint32_t nimbleServerRedundancyLossPermille(const NimbleServerRedundancy* self)
+{
+    return self->lossPermilleTimesSixteen >> 4;
+}
+
+/// Calculates how many already sent steps to resend in each reply. Grows linearly with the loss, so bursts of lost
+/// replies are covered on lossy links, while clean links only get a minimum.
+/// @param self redundancy
+/// @param maxRedundancyStepCount the maximum, set from the game tuning
+/// @return number of already sent steps to resend
+size_t nimbleServerRedundancyStepCount(const NimbleServerRedundancy* self, size_t maxRedundancyStepCount)
+{
+    if (maxRedundancyStepCount <= NIMBLE_SERVER_REDUNDANCY_MIN_STEP_COUNT) {
+        return maxRedundancyStepCount;
+    }
+
+    uint32_t lossPermille = nimbleServerRedundancyLossPermille(self);
+    if (lossPermille >= NIMBLE_SERVER_REDUNDANCY_MAX_LOSS_PERMILLE) {
+        return maxRedundancyStepCount;
+    }
+
+    size_t range = maxRedundancyStepCount - NIMBLE_SERVER_REDUNDANCY_MIN_STEP_COUNT;
+
+    return NIMBLE_SERVER_REDUNDANCY_MIN_STEP_COUNT +
+           (range * lossPermille + NIMBLE_SERVER_REDUNDANCY_MAX_LOSS_PERMILLE - 1U) /
+               NIMBLE_SERVER_REDUNDANCY_MAX_LOSS_PERMILLE;
+}
@@ -0,0 +1,187 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <imprint/allocator.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/relay.h>
+#include <nimble-server/req_step.h>
+#include <nimble-server/server.h>
+#include <nimble-server/spectator_steps.h>
+
+/// Allocates the game state copy
+/// @param self relay
+/// @param allocator allocator for the game state and the step scratch
+/// @param maxGameStateOctetCount maximum octet count of the upstream game state
+/// @param maxStepOctetCount maximum octet count of an authoritative step
+void nimbleServerRelayInit(NimbleServerRelay* self, ImprintAllocator* allocator, size_t maxGameStateOctetCount,
+                           size_t maxStepOctetCount)
+{
+    nimbleServerGameStateInit(&self->gameState, allocator, maxGameStateOctetCount);
+    self->hasGameState = false;
+    self->stepOctets = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t, maxStepOctetCount);
+    self->maxStepOctetCount = maxStepOctetCount;
+}
+
+/// Forgets the game state, e.g. when the relay server is reinitialized
+/// @param self relay
+void nimbleServerRelayReset(NimbleServerRelay* self)
+{
+    self->hasGameState = false;
+    self->gameState.octetCount = 0;
+    self->gameState.stepId = 0;
+}
+
+/// Gets the game state copy, the relay version of NimbleServerSerializeStateFn
+/// @param self relay
+/// @param[out] target the game state
+void nimbleServerRelaySerializedGameState(const NimbleServerRelay* self, NimbleServerSerializedGameState* target)
+{
+    target->gameState = self->gameState.state;
+    target->gameStateOctetCount = self->gameState.octetCount;
+    target->stepId = self->gameState.stepId;
+    target->hash = 0;
+}
+
+/// Sets the game state that was downloaded from the upstream server. The authoritative steps are kept if they follow
+/// the game state, otherwise the relay starts over from the game state.
+/// The game state must be refreshed as often as the upstream server refreshes its own, since the spectators can
+/// only catch up from a game state that is within the authoritative steps that the relay has.
+/// @param self relay server
+/// @param stepId the step id of the game state
+/// @param gameState the game state
+/// @param gameStateOctetCount octet count of the game state
+/// @return negative on error
+int nimbleServerRelaySetGameState(NimbleServer* self, StepId stepId, const uint8_t* gameState,
+                                  size_t gameStateOctetCount)
+{
+    CLOG_ASSERT(self->setup.isRelay, "server is not a relay")
+    NimbleServerRelay* relay = &self->relay;
+
+    int err = nimbleServerGameStateSet(&relay->gameState, stepId, gameState, gameStateOctetCount, &self->log);
+    if (err <= 0) {
+        return err;
+    }
+
+    NbsSteps* steps = &self->game.authoritativeSteps;
+    bool stepsFollowGameState = relay->hasGameState && stepId >= steps->expectedReadId &&
+                                stepId <= steps->expectedWriteId;
+    relay->hasGameState = true;
+    if (!stepsFollowGameState) {
+        CLOG_C_DEBUG(&self->log, "relay starts over from game state %08X", stepId)
+        nbsStepsReInit(steps, stepId);
+        if (self->game.spectatorSteps != 0) {
+            nimbleServerSpectatorStepsReset(self->game.spectatorSteps);
+        }
+    }
+
+    return 0;
+}
+
+/// Adds an authoritative step that was received from the upstream server. The steps must be added in order.
+/// @param self relay server
+/// @param stepId the step id
+/// @param octets the authoritative step
+/// @param octetCount octet count of the authoritative step
+/// @return 1 if the step was added, 0 if the relay already had it, NimbleServerErrRelayNotSynchronized if steps
+/// are missing and the relay needs a newer game state
+int nimbleServerRelayAddAuthoritativeStep(NimbleServer* self, StepId stepId, const uint8_t* octets, size_t octetCount)
+{
+    CLOG_ASSERT(self->setup.isRelay, "server is not a relay")
+    if (!self->relay.hasGameState) {
+        return NimbleServerErrRelayNotSynchronized;
+    }
+
+    NbsSteps* steps = &self->game.authoritativeSteps;
+    if (stepId < steps->expectedWriteId) {
+        return 0;
+    }
+    if (stepId != steps->expectedWriteId) {
+        CLOG_C_NOTICE(&self->log, "relay is missing steps. expected %08X but received %08X", steps->expectedWriteId,
+                      stepId)
+        return NimbleServerErrRelayNotSynchronized;
+    }
+
+    int err = nimbleServerReqGameStepDiscardOldAuthoritativeSteps(&self->game);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nbsStepsWrite(steps, stepId, octets, octetCount);
+    if (err < 0) {
+        return err;
+    }
+
+    statsIntPerSecondAdd(&self->authoritativeStepsPerSecondStat, 1);
+    nimbleServerGameStepCommitted(&self->game, stepId, octets, octetCount);
+
+    return 1;
+}
+
+/// Adds the steps that an in-process upstream server, or relay, has published since the last pull.
+/// Relays in the same process can be chained into a tree by pulling from nimbleServerSpectatorSteps() of the server
+/// above.
+/// @param self relay server
+/// @param upstream the steps published by the upstream server
+/// @return number of added steps, NimbleServerErrRelayNotSynchronized if the upstream no longer has the steps that
+/// the relay needs
+int nimbleServerRelayPull(NimbleServer* self, const NimbleServerSpectatorSteps* upstream)
+{
+    StepId latestStepId;
+    if (!self->relay.hasGameState || !nimbleServerSpectatorStepsLatest(upstream, &latestStepId)) {
+        return 0;
+    }
+
+    int addedCount = 0;
+    for (StepId stepId = self->game.authoritativeSteps.expectedWriteId; stepId <= latestStepId; ++stepId) {
+        int octetCount = nimbleServerSpectatorStepsRead(upstream, stepId, self->relay.stepOctets,
+                                                        self->relay.maxStepOctetCount);
+        if (octetCount < 0) {
+            CLOG_C_NOTICE(&self->log, "relay could not pull step %08X from upstream (latest %08X)", stepId,
+                          latestStepId)
+            return octetCount == NimbleServerErrSpectatorStepNotAvailable ? NimbleServerErrRelayNotSynchronized
+                                                                          : octetCount;
+        }
+
+        int err = nimbleServerRelayAddAuthoritativeStep(self, stepId, self->relay.stepOctets, (size_t) octetCount);
+        if (err < 0) {
+            return err;
+        }
+        addedCount++;
+    }
+
+    return addedCount;
+}
+
+/// Takes the game state of an in-process upstream server, or relay, if it is newer than the one the relay has.
+/// Called as often as the upstream refreshes its game state, so the game state follows the steps down the relay
+/// chain that nimbleServerRelayPull() builds.
+/// @param self relay server
+/// @param upstream the server or relay above in the chain
+/// @return 1 if the game state was taken, 0 if the upstream has no newer game state, negative on error
+int nimbleServerRelayPullGameState(NimbleServer* self, NimbleServer* upstream)
+{
+    NimbleServerSerializedGameState upstreamGameState;
+    if (upstream->setup.isRelay) {
+        if (!upstream->relay.hasGameState) {
+            return 0;
+        }
+        nimbleServerRelaySerializedGameState(&upstream->relay, &upstreamGameState);
+    } else {
+        upstream->callbackObject.vtbl->authoritativeStateSerializeFn(upstream->callbackObject.self,
+                                                                     &upstreamGameState);
+    }
+
+    if (self->relay.hasGameState && upstreamGameState.stepId <= self->relay.gameState.stepId) {
+        return 0;
+    }
+
+    int err = nimbleServerRelaySetGameState(self, upstreamGameState.stepId, upstreamGameState.gameState,
+                                            upstreamGameState.gameStateOctetCount);
+    if (err < 0) {
+        return err;
+    }
+
+    return 1;
+}
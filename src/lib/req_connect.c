@@ -20,14 +20,14 @@
 static NimbleServerTransportConnection*
 findExistingConnectionRequest(NimbleServer* self, uint8_t transportConnectionIndex, NimbleSerializeClientRequestId connectionRequestId)
 {
+    const NimbleServerTransportConnectionsHot* hot = &self->transportConnectionsHot;
     for (size_t i = 0; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
-        NimbleServerTransportConnection* connection = &self->transportConnections[i];
-        if (!connection->isUsed) {
+        if (!hot->isUsed[i]) {
             continue;
         }
-        if (connection->transportIndex == transportConnectionIndex &&
-            connection->connectedFromConnectRequestId == connectionRequestId) {
-            return connection;
+        if (hot->transportIndex[i] == transportConnectionIndex &&
+            hot->connectedFromConnectRequestId[i] == connectionRequestId) {
+            return &self->transportConnections[i];
         }
     }
     return 0;
@@ -52,28 +52,33 @@ int nimbleServerReqConnect(NimbleServer* self, uint8_t transportConnectionIndex,
                                                                                          connectOptions.clientRequestId);
     if (!transportConnection) {
         CLOG_C_DEBUG(&self->log, "request for a new connection")
-        if (nimbleServerCircularBufferIsEmpty(&self->freeTransportConnectionList)) {
-            CLOG_C_NOTICE(&self->log, "no free transport connection")
-            return NimbleServerErrSerialize;
+        // Datagrams are looked up by their transport index, so the connection must be the one for that index
+        transportConnection = &self->transportConnections[transportConnectionIndex];
+        if (transportConnectionIsUsed(transportConnection) && transportConnection->hasConnectRequest) {
+            CLOG_C_NOTICE(&self->log, "transport connection %hhu is already connected with client request id %02X",
+                          transportConnectionIndex,
+                          self->transportConnectionsHot.connectedFromConnectRequestId[transportConnectionIndex])
+            return NimbleServerErrTransportConnectionInUse;
         }
 
-        uint8_t freeTransportIndex = nimbleServerCircularBufferRead(&self->freeTransportConnectionList);
-        transportConnection = &self->transportConnections[freeTransportIndex];
-        if (transportConnection->isUsed) {
-            CLOG_C_ERROR(&self->log, "the transport index from free list was not free")
-            // return -2;
-        }
-
-        transportConnection->isUsed = true;
-        transportConnection->transportIndex = transportConnectionIndex;
-        transportConnection->connectedFromConnectRequestId = connectOptions.clientRequestId;
+        self->transportConnectionsHot.isUsed[transportConnectionIndex] = true;
+        self->transportConnectionsHot.transportIndex[transportConnectionIndex] = transportConnectionIndex;
+        self->transportConnectionsHot.connectedFromConnectRequestId[transportConnectionIndex] =
+            connectOptions.clientRequestId;
         transportConnection->secret = secureRandomUInt64();
+        transportConnection->id = transportConnectionIndex;
+
+        transportConnectionInit(transportConnection, &self->downloadAllocator.allocator,
+                                self->setup.maxGameStateOctetCount, &self->setup.ingressRateLimit,
+                                self->setup.maxStepRangeOctetCountPerReply, self->now, self->log);
+        // The init resets these, so they are set after it
         transportConnection->useDebugStreams = connectOptions.useDebugStreams;
         transportConnection->phase = NbTransportConnectionPhaseConnected;
-        transportConnection->id = freeTransportIndex;
-
-        transportConnectionInit(transportConnection, self->blobAllocator, self->setup.maxGameStateOctetCount,
-                                self->log);
+        transportConnection->hasConnectRequest = true;
+        if (self->setup.useCompactStepEncoding) {
+            transportConnection->stepEncoding =
+                nimbleServerCompactStepsEncodingForVersion(&connectOptions.nimbleVersion);
+        }
 
     } else {
         CLOG_C_DEBUG(&self->log, "return existing connection with client request id %02X", connectOptions.clientRequestId)
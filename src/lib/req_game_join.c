@@ -15,6 +15,7 @@
 #include <nimble-server/participant.h>
 #include <nimble-server/req_join_game.h>
 #include <nimble-server/server.h>
+#include <nimble-server/trace.h>
 
 static int joinLocalParty(NimbleServerLocalParties* parties, NimbleServerParticipants* gameParticipants,
                           NimbleServerTransportConnection* transportConnection,
@@ -83,6 +84,46 @@ static int nimbleServerReadAndJoinParticipants(NimbleServerLocalParties* parties
     return 0;
 }
 
+/// A join request without participants makes the transport connection a spectator. A spectator receives the
+/// authoritative steps and can download the game state, but has no party, so it does not use a participant slot or
+/// affect the composition.
+/// @param self server
+/// @param transportConnection transport connection that wants to spectate
+/// @param request the join request
+/// @param outStream writes reply to out stream
+/// @return negative on error
+static int joinAsSpectator(NimbleServer* self, NimbleServerTransportConnection* transportConnection,
+                           const NimbleSerializeJoinGameRequest* request, FldOutStream* outStream)
+{
+    if (transportConnection->assignedParty != 0) {
+        CLOG_C_NOTICE(&self->log, "transport connection %hhu already has a party and can not spectate",
+                      transportConnection->transportConnectionId)
+        return NimbleServerErrSerialize;
+    }
+
+    if (!transportConnection->isSpectator) {
+        if (self->spectatorCount >= self->setup.maxSpectatorCount) {
+            CLOG_C_NOTICE(&self->log, "no room for more spectators (%zu)", self->spectatorCount)
+            nimbleSerializeServerOutJoinGameOutOfParticipantSlotsResponse(outStream, request->requestId, &self->log);
+            return NimbleServerErrSessionFull;
+        }
+        transportConnection->isSpectator = true;
+        self->spectatorCount++;
+    }
+
+    NimbleSerializeJoinGameResponse gameResponse;
+    gameResponse.requestId = request->requestId;
+    gameResponse.partyAndSessionSecret.partyId = NIMBLE_SERVER_SPECTATOR_PARTY_ID;
+    gameResponse.partyAndSessionSecret.sessionSecret = self->sessionSecret;
+    gameResponse.participantCount = 0;
+
+    CLOG_C_DEBUG(&self->log, "transport connection %hhu joined as spectator (%zu spectators)",
+                 transportConnection->transportConnectionId, self->spectatorCount)
+    nimbleSerializeServerOutJoinGameResponse(outStream, &gameResponse, &self->log);
+
+    return 0;
+}
+
 /// Handles a join request from the client
 /// @param self server
 /// @param transportConnection transport connection that wants to join
@@ -99,6 +140,21 @@ int nimbleServerReqGameJoin(NimbleServer* self, NimbleServerTransportConnection*
         return err;
     }
 
+    if (request.playerCount == 0) {
+        return joinAsSpectator(self, transportConnection, &request, outStream);
+    }
+
+    if (self->setup.isRelay) {
+        CLOG_C_NOTICE(&self->log, "a relay only accepts spectators")
+        nimbleSerializeServerOutJoinGameOutOfParticipantSlotsResponse(outStream, request.requestId, &self->log);
+        return NimbleServerErrSessionFull;
+    }
+
+    if (transportConnection->isSpectator) {
+        transportConnection->isSpectator = false;
+        self->spectatorCount--;
+    }
+
     NimbleServerLocalParty* party;
     int errorCode = nimbleServerReadAndJoinParticipants(&self->localParties, &self->game.participants,
                                                         transportConnection, &request,
@@ -111,6 +167,9 @@ int nimbleServerReqGameJoin(NimbleServer* self, NimbleServerTransportConnection*
     party->waitingForReconnectMaxTimer = self->setup.maxWaitingForReconnectTicks;
 
     transportConnection->assignedParty = party;
+    NIMBLE_SERVER_TRACE(&self->trace, NimbleServerTraceEventTypePartyJoined, party->id,
+                        transportConnection->transportConnectionId,
+                        party->participantReferences.participantReferenceCount)
 
     NimbleSerializeJoinGameResponse gameResponse;
     gameResponse.requestId = request.requestId;
@@ -119,8 +178,8 @@ int nimbleServerReqGameJoin(NimbleServer* self, NimbleServerTransportConnection*
     for (size_t i = 0; i < party->participantReferences.participantReferenceCount; ++i) {
         const NimbleServerParticipant* sourceParticipant = party->participantReferences.participantReferences[i];
         participants[i].participantId = sourceParticipant->id;
-        participants[i].localIndex = sourceParticipant->localIndex;
-        CLOG_VERBOSE("joined localIndex %zu with ID: %hhu", sourceParticipant->localIndex, sourceParticipant->id)
+        participants[i].localIndex = sourceParticipant->cold->localIndex;
+        CLOG_VERBOSE("joined localIndex %zu with ID: %hhu", sourceParticipant->cold->localIndex, sourceParticipant->id)
     }
 
     gameResponse.partyAndSessionSecret.partyId = party->id;
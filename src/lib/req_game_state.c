@@ -9,6 +9,7 @@
 #include <inttypes.h>
 #include <nimble-serialize/commands.h>
 #include <nimble-serialize/server_out.h>
+#include <nimble-server/errors.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/req_download_game_state.h>
 #include <nimble-server/req_download_game_state_ack.h>
@@ -23,37 +24,57 @@ int nimbleServerReqDownloadGameState(NimbleServer* self, NimbleServerTransportCo
     fldInStreamReadUInt8(inStream, &downloadClientRequestId);
     CLOG_ASSERT(downloadClientRequestId != 0, "download client request can not be zero")
 
-    if (downloadClientRequestId == transportConnection->blobStreamOutClientRequestId) {
+    NimbleServerTransportConnectionDownload* download = transportConnection->download;
+    if (download != 0 && downloadClientRequestId == transportConnection->blobStreamOutClientRequestId) {
         CLOG_C_VERBOSE(&transportConnection->log,
                        "already sent download game state response. resending same information again. connection %d, "
                        "requestId %02X with blobStreamChannel %02X",
                        transportConnection->transportConnectionId, transportConnection->blobStreamOutClientRequestId,
-                       transportConnection->blobStreamLogicOut.transferId)
+                       download->blobStreamLogicOut.transferId)
 
     } else {
+        if (self->setup.isRelay && !self->relay.hasGameState) {
+            return NimbleServerErrRelayNotSynchronized;
+        }
+
+        download = transportConnectionPrepareDownload(transportConnection);
+        if (download == 0) {
+            CLOG_C_SOFT_ERROR(&transportConnection->log, "could not allocate game state download")
+            return NimbleServerErrOutOfDownloadMemory;
+        }
+
         /// Fetch state and copy it to the transport connection
         /// Initialize the outgoing blob stream with the state
         {
             NimbleServerSerializedGameState serializedGameState;
 
-            self->callbackObject.vtbl->authoritativeStateSerializeFn(self->callbackObject.self, &serializedGameState);
+            if (self->setup.isRelay) {
+                nimbleServerRelaySerializedGameState(&self->relay, &serializedGameState);
+            } else {
+                NIMBLE_SERVER_PROFILER_BEGIN(callbackStartedAt)
+                self->callbackObject.vtbl->authoritativeStateSerializeFn(self->callbackObject.self,
+                                                                         &serializedGameState);
+                NIMBLE_SERVER_PROFILER_END(&self->profiler, NimbleServerProfilerPhaseStateSerializeCallback,
+                                           callbackStartedAt)
+            }
 
             CLOG_C_VERBOSE(&self->log, "download game state request stepId:%04X octetSize:%zu, hash:%08" PRIX64,
                            serializedGameState.stepId, serializedGameState.gameStateOctetCount,
                            serializedGameState.hash)
 
-            nimbleServerGameStateSet(&transportConnection->gameState, serializedGameState.stepId,
+            nimbleServerGameStateSet(&download->gameState, serializedGameState.stepId,
                                      serializedGameState.gameState, serializedGameState.gameStateOctetCount,
                                      &transportConnection->log);
         }
 
         {
-            const NimbleServerGameState* copiedGameState = &transportConnection->gameState;
+            const NimbleServerGameState* copiedGameState = &download->gameState;
 
-            blobStreamOutInit(&transportConnection->blobStreamOut, self->pageAllocator,
-                              transportConnection->blobStreamOutAllocator, copiedGameState->state,
+            blobStreamOutInit(&download->blobStreamOut, &self->blobStreamPageAllocator.allocator,
+                              &self->blobStreamAllocator.allocator, copiedGameState->state,
                               copiedGameState->octetCount, BLOB_STREAM_CHUNK_SIZE, transportConnection->log);
-            blobStreamLogicOutInit(&transportConnection->blobStreamLogicOut, &transportConnection->blobStreamOut,
+            download->hasBlobStreamOut = true;
+            blobStreamLogicOutInit(&download->blobStreamLogicOut, &download->blobStreamOut,
                                    transportConnection->nextBlobStreamOutChannel);
 
             ++transportConnection->nextBlobStreamOutChannel;
@@ -64,13 +85,13 @@ int nimbleServerReqDownloadGameState(NimbleServer* self, NimbleServerTransportCo
                 &transportConnection->log,
                 "start download state for connection %d, requestId %02X with blobStreamChannel %02X octetCount:%zu",
                 transportConnection->transportConnectionId, transportConnection->blobStreamOutClientRequestId,
-                transportConnection->blobStreamLogicOut.transferId, copiedGameState->octetCount)
+                download->blobStreamLogicOut.transferId, copiedGameState->octetCount)
         }
     }
 
     // No matter if it is a resend or first time response, send out the information we have
     // in the transport connection
-    const NimbleServerGameState* latestState = &transportConnection->gameState;
+    const NimbleServerGameState* latestState = &download->gameState;
 
     SerializeGameState outGameState;
     outGameState.stepId = latestState->stepId;
@@ -86,14 +107,14 @@ int nimbleServerReqDownloadGameState(NimbleServer* self, NimbleServerTransportCo
 
         int err = nimbleSerializeServerOutGameStateResponse(
             &outStream, outGameState, transportConnection->blobStreamOutClientRequestId,
-            transportConnection->blobStreamLogicOut.transferId, &transportConnection->log);
+            download->blobStreamLogicOut.transferId, &transportConnection->log);
         if (err < 0) {
             return err;
         }
 
         // Start transfer should be in the same datagram as the game state response
         nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdServerOutBlobStream, &transportConnection->log);
-        err = blobStreamLogicOutStartTransfer(&transportConnection->blobStreamLogicOut, &outStream);
+        err = blobStreamLogicOutStartTransfer(&download->blobStreamLogicOut, &outStream);
         if (err < 0) {
             return err;
         }
@@ -102,5 +123,11 @@ int nimbleServerReqDownloadGameState(NimbleServer* self, NimbleServerTransportCo
         transportOut->send(transportOut->self, outStream.octets, outStream.pos);
     }
 
-    return nimbleServerSendBlobStream(transportConnection, transportOut);
+    NIMBLE_SERVER_PROFILER_BEGIN(sendStartedAt)
+    int sendResult = nimbleServerSendBlobStream(transportConnection, transportOut,
+                                                self->game.tuning.maxBlobStreamEntriesPerSend, self->now,
+                                                &self->trace);
+    NIMBLE_SERVER_PROFILER_END(&self->profiler, NimbleServerProfilerPhaseBlobStreamSend, sendStartedAt)
+
+    return sendResult;
 }
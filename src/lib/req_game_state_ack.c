@@ -3,6 +3,7 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
+#include "log.h"
 #include "send_authoritative_steps.h"
 #include <blob-stream/blob_stream_logic_out.h>
 #include <datagram-transport/transport.h>
@@ -13,21 +14,23 @@
 #include <nimble-serialize/serialize.h>
 #include <nimble-server/errors.h>
 #include <nimble-server/local_party.h>
+#include <nimble-server/profiler.h>
 #include <nimble-server/req_download_game_state_ack.h>
 #include <nimble-server/server.h>
+#include <nimble-server/trace.h>
 
 /// Handles a download state progress ack from the client
 /// @param transportConnection transportConnection
 /// @param foundGame the game to send
+/// @param profiler profiler to add blob stream send timings to
 /// @param inStream stream to read game state ack from
 /// @param transportOut the transport to send reply to
 /// @return negative on error
 int nimbleServerReqBlobStream(NimbleServerGame* foundGame,
-                                        NimbleServerTransportConnection* transportConnection, FldInStream* inStream,
+                                        NimbleServerTransportConnection* transportConnection,
+                                        NimbleServerProfiler* profiler, FldInStream* inStream,
                                         DatagramTransportOut* transportOut)
 {
-    (void) foundGame;
-
     // CLOG_INFO("nimbleServerReqJoinGameStateAck %04X vs %04X", channelId,
     // party->blobStreamOutChannel)
 
@@ -37,13 +40,27 @@ int nimbleServerReqBlobStream(NimbleServerGame* foundGame,
     //   return errorCode;
     // }
 
-    int receiveResult = blobStreamLogicOutReceive(&transportConnection->blobStreamLogicOut, inStream);
+    if (transportConnection->download == 0) {
+        CLOG_C_SOFT_ERROR(&transportConnection->log, "received blob stream ack, but no download was requested")
+        return NimbleServerErrSerialize;
+    }
+
+    int receiveResult = blobStreamLogicOutReceive(&transportConnection->download->blobStreamLogicOut, inStream);
     if (receiveResult < 0) {
         CLOG_SOFT_ERROR("nimbleServerReqJoinGameStateAck: could not receive blobStreamLogicOut")
         return receiveResult;
     }
 
-    return nimbleServerSendBlobStream(transportConnection, transportOut);
+    NIMBLE_SERVER_PROFILER_BEGIN(sendStartedAt)
+    int sendResult = nimbleServerSendBlobStream(transportConnection, transportOut,
+                                                foundGame->tuning.maxBlobStreamEntriesPerSend, foundGame->now,
+                                                foundGame->trace);
+    NIMBLE_SERVER_PROFILER_END(profiler, NimbleServerProfilerPhaseBlobStreamSend, sendStartedAt)
+#if !NIMBLE_SERVER_PROFILER_ENABLED
+    (void) profiler;
+#endif
+
+    return sendResult;
 }
 
 /*
@@ -58,12 +75,13 @@ int sendAuthoritativeSteps() {
         return error;
     }
 
-    CLOG_C_VERBOSE(&transportConnection->log,
-                   "download of game state is probably done, send a few authoritative steps as well from %08X",
-                   transportConnection->gameState.stepId)
+    NIMBLE_SERVER_LOG_C_VERBOSE(
+        &transportConnection->log,
+        "download of game state is probably done, send a few authoritative steps as well from %08X",
+        transportConnection->download->gameState.stepId)
 
     ssize_t err = nimbleServerSendStepRanges(&stream, transportConnection, foundGame,
-                                             transportConnection->gameState.stepId, 0);
+                                             transportConnection->download->gameState.stepId, 0);
     if (err < 0) {
         CLOG_C_SOFT_ERROR(&transportConnection->log, "could not send ranges")
         return (int) err;
@@ -80,12 +98,28 @@ int sendAuthoritativeSteps() {
 }
 */
 
-int nimbleServerSendBlobStream(NimbleServerTransportConnection* transportConnection, DatagramTransportOut* transportOut)
+/// Sends the next chunks of the outgoing blob stream
+/// @param transportConnection transport connection
+/// @param transportOut the transport to send the chunks to
+/// @param maxEntryCount maximum number of chunks to send (at most four)
+/// @param now current server time, used for the chunk resend timing
+/// @param trace trace to record the sent chunks to
+/// @return negative on error
+int nimbleServerSendBlobStream(NimbleServerTransportConnection* transportConnection, DatagramTransportOut* transportOut,
+                               size_t maxEntryCount, MonotonicTimeMs now, NimbleServerTrace* trace)
 {
-    MonotonicTimeMs now = monotonicTimeMsNow();
-    const BlobStreamOutEntry* entries[4];
+#define NIMBLE_SERVER_MAX_BLOB_STREAM_ENTRIES (4)
+    const BlobStreamOutEntry* entries[NIMBLE_SERVER_MAX_BLOB_STREAM_ENTRIES];
+    if (maxEntryCount > NIMBLE_SERVER_MAX_BLOB_STREAM_ENTRIES) {
+        maxEntryCount = NIMBLE_SERVER_MAX_BLOB_STREAM_ENTRIES;
+    }
+
+    NimbleServerTransportConnectionDownload* download = transportConnection->download;
+    if (download == 0) {
+        return NimbleServerErrSerialize;
+    }
 
-    int entriesFound = blobStreamLogicOutPrepareSend(&transportConnection->blobStreamLogicOut, now, entries, 4);
+    int entriesFound = blobStreamLogicOutPrepareSend(&download->blobStreamLogicOut, now, entries, maxEntryCount);
     static uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
     FldOutStream stream;
 
@@ -102,7 +136,7 @@ int nimbleServerSendBlobStream(NimbleServerTransportConnection* transportConnect
         // Signals that it is a blob stream command that follows
         nimbleSerializeWriteCommand(&stream, NimbleSerializeCmdServerOutBlobStream, &transportConnection->log);
 
-        blobStreamLogicOutSendEntry(&stream, entry, transportConnection->blobStreamLogicOut.transferId);
+        blobStreamLogicOutSendEntry(&stream, entry, download->blobStreamLogicOut.transferId);
 
         transportConnectionCommitHeader(transportConnection);
 
@@ -115,9 +149,14 @@ int nimbleServerSendBlobStream(NimbleServerTransportConnection* transportConnect
         }
 
         transportOut->send(transportOut->self, stream.octets, stream.pos);
+        NIMBLE_SERVER_TRACE(trace, NimbleServerTraceEventTypeBlobChunkSent, transportConnection->transportConnectionId,
+                            stream.pos, entry->chunkId)
     }
+#if !NIMBLE_SERVER_TRACE_ENABLED
+    (void) trace;
+#endif
 
-    if (!blobStreamLogicOutIsAllSent(&transportConnection->blobStreamLogicOut)) {
+    if (!blobStreamLogicOutIsAllSent(&download->blobStreamLogicOut)) {
         return 0;
     }
 
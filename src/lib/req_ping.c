@@ -10,8 +10,17 @@
 #include <nimble-serialize/server_in.h>
 #include <nimble-serialize/server_out.h>
 #include <nimble-server/errors.h>
+#include <nimble-server/transport_connection.h>
 
-int nimbleServerReqPing(FldInStream* inStream, FldOutStream* outStream, Clog* log)
+/// Echoes the client time in a ping request back to the client, and uses the client time to estimate the jitter.
+/// @param transportConnection connection that sent the ping
+/// @param now current server time
+/// @param inStream stream to read the ping request from
+/// @param outStream stream to write the pong response to
+/// @param log log to use
+/// @return negative on error
+int nimbleServerReqPing(NimbleServerTransportConnection* transportConnection, MonotonicTimeMs now,
+                        FldInStream* inStream, FldOutStream* outStream, Clog* log)
 {
     NimbleSerializePingRequest pingRequest;
     int serializeErr = nimbleSerializeServerInPingRequest(inStream, &pingRequest);
@@ -19,6 +28,8 @@ int nimbleServerReqPing(FldInStream* inStream, FldOutStream* outStream, Clog* lo
         return NimbleServerErrSerialize;
     }
 
+    nimbleServerRoundTripTimePingReceived(&transportConnection->roundTripTime, pingRequest.clientTime, now);
+
     NimbleSerializePongResponse connectResponse;
     connectResponse.clientTime = pingRequest.clientTime;
 
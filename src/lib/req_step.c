@@ -5,40 +5,104 @@
 
 #include "authoritative_steps.h"
 #include "incoming_predicted_steps.h"
+#include "log.h"
 #include "nimble-server/server.h"
 #include "send_authoritative_steps.h"
 #include "transport_connection_stats.h"
 #include <flood/in_stream.h>
 #include <inttypes.h>
+#include <nimble-server/errors.h>
 #include <nimble-server/local_party.h>
+#include <nimble-server/profiler.h>
 #include <nimble-server/req_step.h>
+#include <nimble-steps-serialize/pending_in_serialize.h>
 
-static int discardAuthoritativeStepsIfBufferGettingFull(NimbleServerGame* foundGame)
+/// Discards the oldest authoritative steps if the buffer is getting full, so there is room for the steps that are
+/// composed next
+/// @param foundGame game
+/// @return negative on error
+int nimbleServerReqGameStepDiscardOldAuthoritativeSteps(NimbleServerGame* foundGame)
 {
     size_t authoritativeStepCount = foundGame->authoritativeSteps.stepsCount;
     size_t maxCapacity = NBS_WINDOW_SIZE / 3;
 
     if (authoritativeStepCount > maxCapacity) {
         size_t authoritativeToDrop = authoritativeStepCount - maxCapacity;
-        CLOG_C_VERBOSE(&foundGame->log, "discarding %zu old authoritative steps due to buffer getting full",
-                       authoritativeToDrop)
+        NIMBLE_SERVER_LOG_C_VERBOSE(&foundGame->log,
+                                    "discarding %zu old authoritative steps due to buffer getting full",
+                                    authoritativeToDrop)
         int err = nbsStepsDiscardCount(&foundGame->authoritativeSteps, authoritativeToDrop);
         if (err < 0) {
             return err;
         }
-        CLOG_C_VERBOSE(&foundGame->log, "oldest step after discard is %04X with count %zu",
-                       foundGame->authoritativeSteps.expectedReadId, foundGame->authoritativeSteps.stepsCount)
+        NIMBLE_SERVER_LOG_C_VERBOSE(&foundGame->log, "oldest step after discard is %04X with count %zu",
+                                    foundGame->authoritativeSteps.expectedReadId,
+                                    foundGame->authoritativeSteps.stepsCount)
     }
 
     return 0;
 }
 
+/// Composes the authoritative steps from the predicted steps that has been received so far
+/// @param foundGame game
+/// @param authoritativeStepsPerSecondStat stats to update
+/// @param profiler profiler to add the composition timing to
+/// @return number of composed steps, or negative on error
+int nimbleServerReqGameStepCompose(NimbleServerGame* foundGame, StatsIntPerSecond* authoritativeStepsPerSecondStat,
+                                   NimbleServerProfiler* profiler)
+{
+    if (foundGame->debugIsFrozen) {
+        return 0;
+    }
+
+    NIMBLE_SERVER_PROFILER_BEGIN(composeStartedAt)
+    int advanceCount = nimbleServerComposeAuthoritativeSteps(foundGame);
+    NIMBLE_SERVER_PROFILER_END(profiler, NimbleServerProfilerPhaseCompose, composeStartedAt)
+    if (advanceCount < 0) {
+        return advanceCount;
+    }
+
+    statsIntPerSecondAdd(authoritativeStepsPerSecondStat, advanceCount);
+
+#if !NIMBLE_SERVER_PROFILER_ENABLED
+    (void) profiler;
+#endif
+
+    return advanceCount;
+}
+
+/// Writes the authoritative steps that the client requires, after its predicted steps has been read
+/// @param foundGame game
+/// @param transportConnection transport connection that provided the steps
+/// @param profiler profiler to add the range serialization timing to
+/// @param clientWaitingForStepId the authoritative step that the client is waiting for
+/// @param outStream out stream for reply
+/// @return negative on error
+int nimbleServerReqGameStepReply(NimbleServerGame* foundGame, NimbleServerTransportConnection* transportConnection,
+                                 NimbleServerProfiler* profiler, StepId clientWaitingForStepId,
+                                 FldOutStream* outStream)
+{
+    nimbleServerTransportConnectionUpdateStats(transportConnection, foundGame, clientWaitingForStepId);
+
+    NIMBLE_SERVER_PROFILER_BEGIN(serializeStartedAt)
+    ssize_t rangesOrError = nimbleServerSendStepRanges(outStream, transportConnection, foundGame,
+                                                       clientWaitingForStepId);
+    NIMBLE_SERVER_PROFILER_END(profiler, NimbleServerProfilerPhaseSerializeRanges, serializeStartedAt)
+
+#if !NIMBLE_SERVER_PROFILER_ENABLED
+    (void) profiler;
+#endif
+
+    return (int) rangesOrError;
+}
+
 static int readIncomingStepsAndCreateAuthoritativeSteps(NimbleServerGame* foundGame, FldInStream* inStream,
                                                         NimbleServerTransportConnection* transportConnection,
                                                         StatsIntPerSecond* authoritativeStepsPerSecondStat,
+                                                        NimbleServerProfiler* profiler,
                                                         StepId* outClientWaitingForStepId)
 {
-    int discardErr = discardAuthoritativeStepsIfBufferGettingFull(foundGame);
+    int discardErr = nimbleServerReqGameStepDiscardOldAuthoritativeSteps(foundGame);
     if (discardErr < 0) {
         return discardErr;
     }
@@ -49,17 +113,7 @@ static int readIncomingStepsAndCreateAuthoritativeSteps(NimbleServerGame* foundG
         return receivedCount;
     }
 
-    int advanceCount = 0;
-    if (!foundGame->debugIsFrozen) {
-        advanceCount = nimbleServerComposeAuthoritativeSteps(foundGame);
-        if (advanceCount < 0) {
-            return advanceCount;
-        }
-
-        statsIntPerSecondAdd(authoritativeStepsPerSecondStat, advanceCount);
-    }
-
-    return advanceCount;
+    return nimbleServerReqGameStepCompose(foundGame, authoritativeStepsPerSecondStat, profiler);
 }
 
 /// Handles a request from the client to insert predicted inputs into the authoritative step buffer
@@ -67,17 +121,18 @@ static int readIncomingStepsAndCreateAuthoritativeSteps(NimbleServerGame* foundG
 /// @param foundGame game
 /// @param transportConnection transport connection that provides the steps
 /// @param authoritativeStepsPerSecondStat stats to update
+/// @param profiler profiler to add composition and range serialization timings to
 /// @param inStream stream to read from
 /// @param outStream out stream for reply
 /// @return negative on error
 int nimbleServerReqGameStep(NimbleServerGame* foundGame, NimbleServerTransportConnection* transportConnection,
-                            StatsIntPerSecond* authoritativeStepsPerSecondStat, FldInStream* inStream,
-                            FldOutStream* outStream)
+                            StatsIntPerSecond* authoritativeStepsPerSecondStat, NimbleServerProfiler* profiler,
+                            FldInStream* inStream, FldOutStream* outStream)
 {
     StepId clientWaitingForStepId;
 
     int errorCode = readIncomingStepsAndCreateAuthoritativeSteps(foundGame, inStream, transportConnection,
-                                                                 authoritativeStepsPerSecondStat,
+                                                                 authoritativeStepsPerSecondStat, profiler,
                                                                  &clientWaitingForStepId);
     if (errorCode < 0) {
         if (!nimbleServerIsErrorExternal(errorCode)) {
@@ -86,7 +141,32 @@ int nimbleServerReqGameStep(NimbleServerGame* foundGame, NimbleServerTransportCo
         return errorCode;
     }
 
-    nimbleServerTransportConnectionUpdateStats(transportConnection, foundGame, clientWaitingForStepId);
+    return nimbleServerReqGameStepReply(foundGame, transportConnection, profiler, clientWaitingForStepId, outStream);
+}
+
+/// Handles a step request from a spectator. A spectator has no participants, so only the step that the client is
+/// waiting for is used, and it does not compose any authoritative steps.
+/// @param foundGame game
+/// @param transportConnection the spectator transport connection
+/// @param profiler profiler to add the range serialization timing to
+/// @param inStream stream to read from
+/// @param outStream out stream for reply
+/// @return negative on error
+int nimbleServerReqSpectatorGameStep(NimbleServerGame* foundGame, NimbleServerTransportConnection* transportConnection,
+                                     NimbleServerProfiler* profiler, FldInStream* inStream, FldOutStream* outStream)
+{
+    StepId clientWaitingForStepId;
+    int err = nbsPendingStepsInSerializeHeader(inStream, &clientWaitingForStepId);
+    if (err < 0) {
+        return NimbleServerErrSerialize;
+    }
+
+    // Predicted steps from a spectator are read past, but not used
+    err = nimbleServerSkipIncomingSteps(inStream, transportConnection);
+    if (err < 0) {
+        CLOG_C_SOFT_ERROR(&transportConnection->log, "spectator step: couldn't read past the predicted steps")
+        return err;
+    }
 
-    return (int) nimbleServerSendStepRanges(outStream, transportConnection, foundGame, clientWaitingForStepId);
+    return nimbleServerReqGameStepReply(foundGame, transportConnection, profiler, clientWaitingForStepId, outStream);
 }
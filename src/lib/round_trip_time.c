@@ -0,0 +1,197 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <nimble-server/round_trip_time.h>
+
+/// Initializes the estimator, it has no samples until the first step has been acknowledged
+/// @param self round trip time
+void nimbleServerRoundTripTimeInit(NimbleServerRoundTripTime* self)
+{
+    for (size_t i = 0; i < NIMBLE_SERVER_ROUND_TRIP_TIME_SENT_STEP_WINDOW; ++i) {
+        self->sentSteps[i].isSet = false;
+    }
+    self->highestSentStepId = 0;
+    self->hasSentSteps = false;
+    self->highestSampledStepId = 0;
+    self->smoothedMsTimesEight = 0;
+    self->varianceMsTimesFour = 0;
+    self->latestMs = 0;
+    self->minMs = UINT32_MAX;
+    self->sampleCount = 0;
+    self->hasPing = false;
+    self->lastPingClientTime = 0;
+    self->lastPingArrivalMs = 0;
+    self->pingJitterMsTimesSixteen = 0;
+}
+
+/// Adds a round trip time sample. The smoothed value and the variance are kept scaled, so integer math does not lose
+/// precision (Jacobson/Karels).
+/// @param self round trip time
+/// @param roundTripTimeMs measured round trip time
+void nimbleServerRoundTripTimeAddSample(NimbleServerRoundTripTime* self, uint32_t roundTripTimeMs)
+{
+    self->latestMs = roundTripTimeMs;
+    if (roundTripTimeMs < self->minMs) {
+        self->minMs = roundTripTimeMs;
+    }
+
+    if (self->sampleCount++ == 0) {
+        self->smoothedMsTimesEight = roundTripTimeMs * 8U;
+        self->varianceMsTimesFour = roundTripTimeMs * 2U;
+        return;
+    }
+
+    int64_t error = (int64_t) roundTripTimeMs - (int64_t) (self->smoothedMsTimesEight >> 3);
+    int64_t smoothed = (int64_t) self->smoothedMsTimesEight + error;
+    self->smoothedMsTimesEight = smoothed < 0 ? 0 : (uint32_t) smoothed;
+
+    if (error < 0) {
+        error = -error;
+    }
+    int64_t variance = (int64_t) self->varianceMsTimesFour + error - (int64_t) (self->varianceMsTimesFour >> 2);
+    self->varianceMsTimesFour = variance < 0 ? 0 : (uint32_t) variance;
+}
+
+/// Remembers when authoritative steps were sent for the first time. Steps that are resent as redundancy keep their
+/// first send time, so a late acknowledgement is never mistaken for a short round trip.
+/// @param self round trip time
+/// @param firstStepId first step in the sent range
+/// @param stepCount number of steps in the sent range
+/// @param now current server time
+void nimbleServerRoundTripTimeStepsSent(NimbleServerRoundTripTime* self, StepId firstStepId, size_t stepCount,
+                                        MonotonicTimeMs now)
+{
+    if (stepCount == 0) {
+        return;
+    }
+
+    StepId lastStepId = (StepId) (firstStepId + stepCount - 1U);
+    StepId stepId = firstStepId;
+    if (self->hasSentSteps) {
+        if (lastStepId <= self->highestSentStepId) {
+            return;
+        }
+        if (stepId <= self->highestSentStepId) {
+            stepId = self->highestSentStepId + 1U;
+        }
+    }
+    if (lastStepId - stepId >= NIMBLE_SERVER_ROUND_TRIP_TIME_SENT_STEP_WINDOW) {
+        stepId = lastStepId - (NIMBLE_SERVER_ROUND_TRIP_TIME_SENT_STEP_WINDOW - 1U);
+    }
+
+    for (; stepId <= lastStepId; ++stepId) {
+        NimbleServerSentStep* sentStep = &self->sentSteps[stepId % NIMBLE_SERVER_ROUND_TRIP_TIME_SENT_STEP_WINDOW];
+        sentStep->stepId = stepId;
+        sentStep->sentAtMs = now;
+        sentStep->isSet = true;
+    }
+
+    self->highestSentStepId = lastStepId;
+    self->hasSentSteps = true;
+}
+
+/// Samples the round trip time when the client reports that it has received new authoritative steps.
+/// Each step is only sampled once.
+/// @param self round trip time
+/// @param waitingForStepId the client has received all the steps before this one
+/// @param now current server time
+void nimbleServerRoundTripTimeStepsAcknowledged(NimbleServerRoundTripTime* self, StepId waitingForStepId,
+                                                MonotonicTimeMs now)
+{
+    if (waitingForStepId == 0) {
+        return;
+    }
+
+    StepId acknowledgedStepId = waitingForStepId - 1U;
+    if (self->sampleCount > 0 && acknowledgedStepId <= self->highestSampledStepId) {
+        return;
+    }
+
+    const NimbleServerSentStep* sentStep =
+        &self->sentSteps[acknowledgedStepId % NIMBLE_SERVER_ROUND_TRIP_TIME_SENT_STEP_WINDOW];
+    if (!sentStep->isSet || sentStep->stepId != acknowledgedStepId || now < sentStep->sentAtMs) {
+        return;
+    }
+
+    self->highestSampledStepId = acknowledgedStepId;
+    nimbleServerRoundTripTimeAddSample(self, (uint32_t) (now - sentStep->sentAtMs));
+}
+
+/// Updates the one way jitter from the difference in spacing between the client send times and the server receive
+/// times of two pings.
+/// @param self round trip time
+/// @param clientTime client time in the ping request, in milliseconds
+/// @param now current server time
+void nimbleServerRoundTripTimePingReceived(NimbleServerRoundTripTime* self, uint64_t clientTime,
+                                           MonotonicTimeMs now)
+{
+    if (self->hasPing) {
+        // Reordered or duplicated ping
+        if (clientTime <= self->lastPingClientTime) {
+            return;
+        }
+        int64_t difference = (int64_t) (now - self->lastPingArrivalMs) -
+                             (int64_t) (clientTime - self->lastPingClientTime);
+        if (difference < 0) {
+            difference = -difference;
+        }
+        int64_t jitter = (int64_t) self->pingJitterMsTimesSixteen + difference -
+                         (int64_t) ((self->pingJitterMsTimesSixteen + 8U) >> 4);
+        self->pingJitterMsTimesSixteen = jitter < 0 ? 0 : (uint32_t) jitter;
+    }
+
+    self->hasPing = true;
+    self->lastPingClientTime = clientTime;
+    self->lastPingArrivalMs = now;
+}
+
+/// Calculates how long to wait for a reply before considering it lost, the same way as a TCP retransmission timeout.
+/// @param self round trip time
+/// @param fallbackMs returned if there are no samples yet
+/// @return smoothed round trip time plus four times the variance
+uint32_t nimbleServerRoundTripTimeTimeoutMs(const NimbleServerRoundTripTime* self, uint32_t fallbackMs)
+{
+    if (self->sampleCount == 0) {
+        return fallbackMs;
+    }
+
+    uint32_t varianceTerm = self->varianceMsTimesFour > 0 ? self->varianceMsTimesFour : 1U;
+
+    return (self->smoothedMsTimesEight >> 3) + varianceTerm;
+}
+
+/// Checks if a step has been sent recently enough that an acknowledgement can still be on its way
+/// @param self round trip time
+/// @param stepId step to check
+/// @param now current server time
+/// @return false if the step has not been sent, is probably lost, or if there are no round trip time samples yet
+bool nimbleServerRoundTripTimeIsStepInFlight(const NimbleServerRoundTripTime* self, StepId stepId,
+                                             MonotonicTimeMs now)
+{
+    if (self->sampleCount == 0) {
+        return false;
+    }
+
+    const NimbleServerSentStep* sentStep = &self->sentSteps[stepId % NIMBLE_SERVER_ROUND_TRIP_TIME_SENT_STEP_WINDOW];
+    if (!sentStep->isSet || sentStep->stepId != stepId) {
+        return false;
+    }
+
+    return now - sentStep->sentAtMs < (MonotonicTimeMs) nimbleServerRoundTripTimeTimeoutMs(self, 0);
+}
+
+/// Summarizes the estimator in milliseconds
+/// @param self round trip time
+/// @param[out] summary smoothed round trip time, variance, latest and min samples and ping jitter
+void nimbleServerRoundTripTimeSummarize(const NimbleServerRoundTripTime* self,
+                                        NimbleServerRoundTripTimeSummary* summary)
+{
+    summary->smoothedMs = self->smoothedMsTimesEight >> 3;
+    summary->varianceMs = self->varianceMsTimesFour >> 2;
+    summary->latestMs = self->latestMs;
+    summary->minMs = self->sampleCount > 0 ? self->minMs : 0;
+    summary->pingJitterMs = self->pingJitterMsTimesSixteen >> 4;
+    summary->sampleCount = self->sampleCount;
+}
@@ -3,13 +3,115 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
+#include "log.h"
 #include "send_authoritative_steps.h"
 
+#include <datagram-transport/types.h>
+#include <flood/out_stream.h>
 #include <nimble-serialize/server_out.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/transport_connection.h>
 #include <nimble-steps-serialize/pending_out_serialize.h>
 
+/// Moves the start of the range past already sent steps that are still in flight, but keeps as many of them as the
+/// observed loss calls for. If the step that the client is waiting for is probably lost, everything is resent.
+/// @param transportConnection transport connection that wants the steps
+/// @param foundGame the game to send steps from
+/// @param startTickId the step the client is waiting for
+/// @param[out] outIsRetransmit set to true if the sent steps from startTickId are resent because they are probably lost
+/// @return the first step to send
+static StepId skipStepsInFlight(const NimbleServerTransportConnection* transportConnection,
+                                const NimbleServerGame* foundGame, StepId startTickId, bool* outIsRetransmit)
+{
+    const NimbleServerRoundTripTime* roundTripTime = &transportConnection->roundTripTime;
+    if (!roundTripTime->hasSentSteps || startTickId > roundTripTime->highestSentStepId ||
+        roundTripTime->sampleCount == 0) {
+        return startTickId;
+    }
+
+    if (!nimbleServerRoundTripTimeIsStepInFlight(roundTripTime, startTickId, foundGame->now)) {
+        *outIsRetransmit = true;
+        return startTickId;
+    }
+
+    size_t redundancyStepCount = nimbleServerRedundancyStepCount(&transportConnection->redundancy,
+                                                                 foundGame->tuning.maxRedundancyStepCount);
+    StepId firstUnsentStepId = roundTripTime->highestSentStepId + 1U;
+    if (firstUnsentStepId - startTickId <= redundancyStepCount) {
+        return startTickId;
+    }
+
+    return (StepId) (firstUnsentStepId - redundancyStepCount);
+}
+
+/// Serializes the range, and shrinks it until it fits in maxOctetCount. Already sent steps are removed first, then
+/// the newest steps, which are sent in the next reply instead.
+/// @param outStream stream to write the range to
+/// @param authoritativeSteps steps to serialize
+/// @param range range to serialize, updated to the range that fit
+/// @param firstUnsentStepId first step in the range that has not been sent before
+/// @param maxOctetCount maximum octets to write
+/// @return negative on error, otherwise number of ranges sent
+static ssize_t serializeRangeWithinOctetCount(FldOutStream* outStream, const NbsSteps* authoritativeSteps,
+                                              NbsPendingRange* range, StepId firstUnsentStepId, size_t maxOctetCount,
+                                              NimbleServerStepEncoding stepEncoding)
+{
+    uint8_t rangeOctets[DATAGRAM_TRANSPORT_MAX_SIZE];
+    if (maxOctetCount > sizeof(rangeOctets)) {
+        maxOctetCount = sizeof(rangeOctets);
+    }
+
+    while (true) {
+        FldOutStream rangeStream;
+        fldOutStreamInit(&rangeStream, rangeOctets, maxOctetCount);
+        ssize_t rangeCountOrError;
+        if (stepEncoding == NimbleServerStepEncodingCompact) {
+            rangeCountOrError = nimbleServerCompactStepsWriteRange(&rangeStream, authoritativeSteps, range->startId,
+                                                                   range->count);
+        } else {
+            rangeCountOrError = nbsPendingStepsSerializeOutRanges(&rangeStream, authoritativeSteps, range, 1);
+        }
+        if (rangeCountOrError >= 0) {
+            int writeErr = fldOutStreamWriteOctets(outStream, rangeOctets, rangeStream.pos);
+            if (writeErr < 0) {
+                return writeErr;
+            }
+            return rangeCountOrError;
+        }
+
+        if (range->count <= 1) {
+            return rangeCountOrError;
+        }
+
+        if (range->startId < firstUnsentStepId) {
+            size_t dropCount = (firstUnsentStepId - range->startId + 1U) / 2U;
+            if (dropCount >= range->count) {
+                dropCount = range->count - 1U;
+            }
+            range->startId += (StepId) dropCount;
+            range->count -= dropCount;
+        } else {
+            range->count /= 2U;
+        }
+    }
+}
+
+/// Calculates the octets that the step range can use in the reply
+/// @param outStream stream that the reply is written to
+/// @param transportConnection transport connection that wants the steps
+/// @return maximum octet count of the range
+static size_t maxRangeOctetCount(const FldOutStream* outStream,
+                                 const NimbleServerTransportConnection* transportConnection)
+{
+    size_t maxOctetCount = outStream->size - outStream->pos;
+    size_t maxOctetCountPerReply = transportConnection->redundancy.maxOctetCountPerReply;
+    if (maxOctetCountPerReply != 0 && maxOctetCountPerReply < maxOctetCount) {
+        maxOctetCount = maxOctetCountPerReply;
+    }
+
+    return maxOctetCount;
+}
+
 /// Send authoritative steps to a transport connection using a client provided receiveMask.
 /// @param outStream stream to send step ranges to
 /// @param transportConnection transport connection that wants the steps
@@ -27,26 +129,52 @@ ssize_t nimbleServerSendStepRanges(FldOutStream* outStream, NimbleServerTranspor
         startTickId = foundGame->authoritativeSteps.expectedWriteId - 1;
     }
 
-    if (startTickId < foundGame->authoritativeSteps.expectedReadId) {
-        CLOG_C_VERBOSE(&transportConnection->log,
-                       "client wants to get authoritative %08X, but we only can provide the earliest %08X", startTickId,
-                       foundGame->authoritativeSteps.expectedReadId)
-        startTickId = foundGame->authoritativeSteps.expectedReadId;
+    const NbsSteps* steps = &foundGame->authoritativeSteps;
+    size_t maxStepCountToSend = foundGame->tuning.maxRedundancyStepCount;
+    bool hasSkippedStepsInFlight = false;
+    bool isRetransmit = false;
+
+    if (startTickId < steps->expectedReadId && foundGame->journalSource.read != 0) {
+        // The client is catching up, so it gets as many journaled steps as fit, instead of a few redundant ones
+        startTickId = skipStepsInFlight(transportConnection, foundGame, startTickId, &isRetransmit);
+        hasSkippedStepsInFlight = true;
+        if (startTickId < steps->expectedReadId) {
+            // Only the steps that can fit in the reply are read
+            int catchUpStepCount = nimbleServerGameReadCatchUpSteps(
+                foundGame, startTickId, maxRangeOctetCount(outStream, transportConnection));
+            if (catchUpStepCount < 0) {
+                return catchUpStepCount;
+            }
+            if (catchUpStepCount > 0) {
+                steps = foundGame->catchUpSteps;
+                maxStepCountToSend = (size_t) catchUpStepCount;
+            }
+        }
+    }
+
+    if (startTickId < steps->expectedReadId) {
+        NIMBLE_SERVER_LOG_C_VERBOSE(&transportConnection->log,
+                                    "client wants to get authoritative %08X, but we only can provide the earliest %08X",
+                                    startTickId, steps->expectedReadId)
+        startTickId = steps->expectedReadId;
     }
 
     // CLOG_INFO("client waiting for %0lX, game authoritative stepId is at %0lX", clientWaitingForStepId,
     //        foundGame->authoritativeSteps.expectedWriteId);
 
-    size_t authStepCountToSend = foundGame->authoritativeSteps.expectedWriteId - startTickId;
-    const size_t maxRedundancyStepCount = 20;
-    if (authStepCountToSend > maxRedundancyStepCount) {
-        authStepCountToSend = maxRedundancyStepCount;
+    if (!hasSkippedStepsInFlight) {
+        startTickId = skipStepsInFlight(transportConnection, foundGame, startTickId, &isRetransmit);
+    }
+
+    size_t authStepCountToSend = steps->expectedWriteId - startTickId;
+    if (authStepCountToSend > maxStepCountToSend) {
+        authStepCountToSend = maxStepCountToSend;
     }
     range.startId = startTickId;
     range.count = authStepCountToSend;
 
-    CLOG_C_VERBOSE(&transportConnection->log, "send auth range %08X-%08zX, %zu", range.startId,
-                   range.startId + authStepCountToSend - 1, range.count)
+    NIMBLE_SERVER_LOG_C_VERBOSE(&transportConnection->log, "send auth range %08X-%08zX, %zu", range.startId,
+                                range.startId + authStepCountToSend - 1, range.count)
 
     if (authStepCountToSend == 0) {
         transportConnection->noRangesToSendCounter++;
@@ -80,8 +208,9 @@ ssize_t nimbleServerSendStepRanges(FldOutStream* outStream, NimbleServerTranspor
             authoritativeTickDelta = (int8_t) tickDelta;
         }
     }
-    CLOG_C_VERBOSE(&transportConnection->log, "send auth header tick_id:%08X tick-delta: %hhd, buffer-size:%zu",
-                   lastReceivedStepFromClient, authoritativeTickDelta, bufferStepCount)
+    NIMBLE_SERVER_LOG_C_VERBOSE(&transportConnection->log,
+                                "send auth header tick_id:%08X tick-delta: %hhd, buffer-size:%zu",
+                                lastReceivedStepFromClient, authoritativeTickDelta, bufferStepCount)
 
     int serializeErr = nimbleSerializeServerOutStepHeader(outStream, lastReceivedStepFromClient, bufferStepCount,
                                                           authoritativeTickDelta, &transportConnection->log);
@@ -89,5 +218,26 @@ ssize_t nimbleServerSendStepRanges(FldOutStream* outStream, NimbleServerTranspor
         return serializeErr;
     }
 
-    return nbsPendingStepsSerializeOutRanges(outStream, &foundGame->authoritativeSteps, &range, 1);
+    StepId firstUnsentStepId = transportConnection->roundTripTime.hasSentSteps
+                                   ? transportConnection->roundTripTime.highestSentStepId + 1U
+                                   : range.startId;
+    ssize_t rangeCountOrError = serializeRangeWithinOctetCount(
+        outStream, steps, &range, firstUnsentStepId, maxRangeOctetCount(outStream, transportConnection),
+        transportConnection->stepEncoding);
+    if (rangeCountOrError < 0) {
+        return rangeCountOrError;
+    }
+
+    if (isRetransmit && range.startId < firstUnsentStepId) {
+        size_t resentStepCount = firstUnsentStepId - range.startId;
+        if (resentStepCount > range.count) {
+            resentStepCount = range.count;
+        }
+        transportConnection->redundancy.retransmitCount += resentStepCount;
+    }
+
+    nimbleServerRoundTripTimeStepsSent(&transportConnection->roundTripTime, range.startId, range.count,
+                                       foundGame->now);
+
+    return rangeCountOrError;
 }
@@ -3,6 +3,7 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
+#include "log.h"
 #include <clog/clog.h>
 #include <datagram-transport/transport.h>
 #include <datagram-transport/types.h>
@@ -13,6 +14,7 @@
 #include <nimble-serialize/debug.h>
 #include <nimble-server/errors.h>
 #include <nimble-server/game.h>
+#include <nimble-server/ingest.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/participant.h>
 #include <nimble-server/req_connect.h>
@@ -21,6 +23,9 @@
 #include <nimble-server/req_join_game.h>
 #include <nimble-server/req_ping.h>
 #include <nimble-server/req_step.h>
+#include <nimble-server/trace.h>
+#include <nimble-steps-serialize/out_serialize.h>
+#include <tiny-libc/tiny_libc.h>
 
 /// Clean up participant references
 /// @param participantReferences the participant references that should be removed.
@@ -46,7 +51,6 @@ static void destroyParty(NimbleServerLocalParties* parties, NimbleServerLocalPar
 
 static void disconnectTransportConnection(NimbleServer* self, NimbleServerTransportConnection* transportConnection)
 {
-    nimbleServerCircularBufferWrite(&self->freeTransportConnectionList, (uint8_t) transportConnection->id);
     transportConnectionDisconnect(transportConnection);
 }
 
@@ -61,6 +65,7 @@ static void tickParties(NimbleServer* self)
             continue;
         }
 
+        NimbleServerLocalPartyState previousState = party->state;
         bool isWorking = nimbleServerLocalPartyTick(party);
         if (!isWorking) {
             destroyParty(&self->localParties, party);
@@ -70,6 +75,58 @@ static void tickParties(NimbleServer* self)
                 disconnectTransportConnection(self, party->transportConnection);
             }
         }
+
+        if (party->state != previousState) {
+            NIMBLE_SERVER_TRACE(&self->trace, NimbleServerTraceEventTypePartyStateChanged, party->id, previousState,
+                                party->state)
+        }
+    }
+}
+
+/// Refills the ingress rate limits for all transport connections that are in use.
+/// @param self Pointer to an instance of NimbleServer.
+/// @param now current local server time
+static void refillRateLimits(NimbleServer* self, MonotonicTimeMs now)
+{
+    NimbleServerTransportConnectionsHot* hot = &self->transportConnectionsHot;
+    for (size_t i = 0; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
+        if (!hot->isUsed[i]) {
+            continue;
+        }
+        nimbleServerRateLimitRefill(&hot->rateLimits[i], now);
+    }
+}
+
+/// Sets the game tuning for the update quality state and notifies the application about the change.
+/// @param self Pointer to an instance of NimbleServer.
+/// @param previousState the update quality state before the change
+static void onUpdateQualityChanged(NimbleServer* self, NimbleServerUpdateQualityState previousState)
+{
+    NimbleServerUpdateQualityState state = self->updateQuality.state;
+    NimbleServerGameTuning* tuning = &self->game.tuning;
+
+    CLOG_C_NOTICE(&self->log, "update quality changed from '%s' to '%s'",
+                  nimbleServerUpdateQualityStateToString(previousState), nimbleServerUpdateQualityStateToString(state))
+
+    nimbleServerGameTuningInit(tuning);
+
+    if (nimbleServerUpdateQualityIsDegraded(&self->updateQuality)) {
+        // Stage one: shed work that is not needed for the authoritative steps to reach the clients
+        tuning->maxBlobStreamEntriesPerSend = 1;
+        tuning->maxRedundancyStepCount = 8;
+        tuning->outputStats = false;
+    }
+
+    if (state == NimbleServerUpdateQualityStateDegradedLookAhead) {
+        // Stage two: allow the incoming step buffers to absorb the uneven tick times before composing
+        tuning->composeLookAheadStepCount *= 2;
+        tuning->forcedComposeLookAheadStepCount *= 2;
+    }
+
+    NIMBLE_SERVER_TRACE(&self->trace, NimbleServerTraceEventTypeUpdateQualityChanged, 0, previousState, state)
+
+    if (self->callbackObject.vtbl != 0 && self->callbackObject.vtbl->updateQualityChangedFn != 0) {
+        self->callbackObject.vtbl->updateQualityChangedFn(self->callbackObject.self, previousState, state);
     }
 }
 
@@ -80,23 +137,43 @@ static void tickParties(NimbleServer* self)
 /// @return negative one error
 int nimbleServerUpdate(NimbleServer* self, MonotonicTimeMs now)
 {
-    int qualityError = nimbleServerUpdateQualityTick(&self->updateQuality);
+    nimbleServerCaptureRecord(&self->capture, NimbleServerCaptureRecordTypeUpdate, 0, now, 0, 0);
+    nimbleServerTraceSetTime(&self->trace, now);
+
+    NimbleServerUpdateQualityState previousQualityState = self->updateQuality.state;
+    int qualityError = nimbleServerUpdateQualityTick(&self->updateQuality, now);
+    if (self->updateQuality.state != previousQualityState) {
+        onUpdateQualityChanged(self, previousQualityState);
+    }
     if (qualityError < 0) {
         CLOG_C_SOFT_ERROR(&self->log, "quality error %d", qualityError)
         return qualityError;
     }
 
+    self->now = now;
+    self->game.now = now;
+
+    NIMBLE_SERVER_PROFILER_BEGIN(updateStartedAt)
+
+    NIMBLE_SERVER_PROFILER_BEGIN(tickPartiesStartedAt)
     tickParties(self);
+    NIMBLE_SERVER_PROFILER_END(&self->profiler, NimbleServerProfilerPhaseTickParties, tickPartiesStartedAt)
+
+    refillRateLimits(self, now);
 
+    NIMBLE_SERVER_PROFILER_BEGIN(drainStartedAt)
     nimbleServerReadFromMultiTransport(self);
+    NIMBLE_SERVER_PROFILER_END(&self->profiler, NimbleServerProfilerPhaseTransportDrain, drainStartedAt)
 
     statsIntPerSecondUpdate(&self->authoritativeStepsPerSecondStat, now);
 
     self->statsCounter++;
-    if ((self->statsCounter % 3000) == 0) {
+    if ((self->statsCounter % 3000) == 0 && self->game.tuning.outputStats) {
         statsIntPerSecondDebugOutput(&self->authoritativeStepsPerSecondStat, &self->log, "composedSteps", "steps/s");
     }
 
+    NIMBLE_SERVER_PROFILER_END(&self->profiler, NimbleServerProfilerPhaseUpdate, updateStartedAt)
+
     return 0;
 }
 
@@ -109,40 +186,30 @@ int nimbleServerUpdate(NimbleServer* self, MonotonicTimeMs now)
 bool nimbleServerIsErrorExternal(int err)
 {
     return err == NimbleServerErrSerialize || err == NimbleServerErrSessionFull ||
-           err == NimbleServerErrDatagramFromDisconnectedConnection || err == NimbleServerErrOutOfParticipantMemory;
+           err == NimbleServerErrDatagramFromDisconnectedConnection || err == NimbleServerErrOutOfParticipantMemory ||
+           err == NimbleServerErrRateLimited || err == NimbleServerErrOutOfDownloadMemory ||
+           err == NimbleServerErrRelayNotSynchronized || err == NimbleServerErrTransportConnectionInUse;
 }
 
-/// Handle an incoming request from a client identified by the connectionIndex
-/// It uses the NimbleServerResponse to send datagrams back to the client
-/// @param self server
-/// @param transportIndex transport connection index that we received datagram from
-/// @param data datagram payload
-/// @param len octet count of data
-/// @param response info on how to make a response
-/// @return negative on error
-int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t* data, size_t len,
-                     NimbleServerResponse* response)
-{
-#if CONFIGURATION_DEBUG || true
-    {
-        char temp[256];
-        CLOG_C_VERBOSE(&self->log, "feed: octetCount: %zu\n%s", len, hexifyFormat(temp, 256, data, len))
-    }
-#endif
-
-    FldInStream inStream;
-    fldInStreamInit(&inStream, data, len);
-    inStream.readDebugInfo = true;
-
 #define ESTIMATED_TRANSPORT_SPECIFIC_OVERHEAD (32)
 #define MAX_SEND_OCTET_SIZE (DATAGRAM_TRANSPORT_MAX_SIZE - ESTIMATED_TRANSPORT_SPECIFIC_OVERHEAD)
 
+/// Checks the transport connection and the rate limit, and reads the ordered datagram header
+/// @param self server
+/// @param transportIndex transport connection index that we received the datagram from
+/// @param inStream the received datagram
+/// @param[out] outTransportConnection the transport connection for the transportIndex
+/// @return negative on error
+static int feedPrelude(NimbleServer* self, uint8_t transportIndex, FldInStream* inStream,
+                       NimbleServerTransportConnection** outTransportConnection)
+{
     if (transportIndex >= NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
         CLOG_C_SOFT_ERROR(&self->log, "illegal connection index : %u", transportIndex)
         return NimbleServerErrSerialize;
     }
 
     NimbleServerTransportConnection* transportConnection = &self->transportConnections[transportIndex];
+    NimbleServerTransportConnectionsHot* hot = &self->transportConnectionsHot;
 
     /* TODO:
     if (!transportConnection->isUsed) {
@@ -156,40 +223,113 @@ int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t*
     }
      */
 
-    if (!transportConnection->isUsed) {
-        transportConnection->isUsed = true;
-        transportConnection->transportIndex = transportIndex;
-        transportConnection->connectedFromConnectRequestId = 0; // TODO: connectOptions.nonce;
+    if (!hot->isUsed[transportIndex]) {
+        hot->isUsed[transportIndex] = true;
+        hot->transportIndex[transportIndex] = transportIndex;
+        hot->connectedFromConnectRequestId[transportIndex] = 0; // TODO: connectOptions.nonce;
         transportConnection->secret = 0;                        // TODO: secureRandomUInt64();
         transportConnection->useDebugStreams = false;           // TODO: connectOptions.useDebugStreams;
         transportConnection->phase = NbTransportConnectionPhaseConnected;
         transportConnection->id = transportIndex;
 
-        transportConnectionInit(transportConnection, self->blobAllocator, self->setup.maxGameStateOctetCount,
-                                self->log);
+        transportConnectionInit(transportConnection, &self->downloadAllocator.allocator,
+                                self->setup.maxGameStateOctetCount, &self->setup.ingressRateLimit,
+                                self->setup.maxStepRangeOctetCountPerReply, self->now, self->log);
     }
 
-    if (transportConnection->transportIndex != transportIndex) {
-        CLOG_C_VERBOSE(&self->log, "we received a datagram from wrong transport index. Expected %hhu but received %hhu",
-                       transportConnection->transportIndex, transportIndex)
+    if (hot->transportIndex[transportIndex] != transportIndex) {
+        NIMBLE_SERVER_LOG_C_VERBOSE(
+            &self->log, "we received a datagram from wrong transport index. Expected %hhu but received %hhu",
+            hot->transportIndex[transportIndex], transportIndex)
         return NimbleServerErrSerialize;
     }
 
-    int error = orderedDatagramInLogicReceive(&transportConnection->orderedDatagramInLogic, &inStream);
+    NimbleServerRateLimit* rateLimit = &hot->rateLimits[transportIndex];
+    if (!nimbleServerRateLimitAllowDatagram(rateLimit, inStream->size)) {
+        if ((rateLimit->droppedDatagramCount % 60) == 1) {
+            CLOG_C_NOTICE(&self->log, "connection %hhu is over its ingress rate limit. dropped %zu datagrams so far",
+                          transportIndex, rateLimit->droppedDatagramCount)
+        }
+        // The ordered sequence is still advanced, otherwise the datagrams that the server drops itself are counted
+        // as loss from the client, which raises the step redundancy of the replies
+        (void) orderedDatagramInLogicReceive(&transportConnection->orderedDatagramInLogic, inStream);
+        return NimbleServerErrRateLimited;
+    }
+
+    bool hadReceivedDatagram = transportConnection->orderedDatagramInLogic.hasReceivedInitialDatagram;
+    uint16_t previousSequence = transportConnection->orderedDatagramInLogic.receivedSequence;
+    int error = orderedDatagramInLogicReceive(&transportConnection->orderedDatagramInLogic, inStream);
     if (error < 0) {
-        CLOG_C_VERBOSE(&self->log, "we received an out of order datagram, discarding")
+        NIMBLE_SERVER_LOG_C_VERBOSE(&self->log, "we received an out of order datagram, discarding")
         return NimbleServerErrSerialize;
     }
+    if (hadReceivedDatagram) {
+        uint16_t skippedSequenceCount = (uint16_t) (transportConnection->orderedDatagramInLogic.receivedSequence -
+                                                    previousSequence - 1U);
+        nimbleServerRedundancyDatagramReceived(&transportConnection->redundancy, skippedSequenceCount);
+    }
 
-    while (inStream.pos != inStream.size) {
+    *outTransportConnection = transportConnection;
+
+    return 0;
+}
+
+/// Commits the ordered datagram header and sends the reply
+/// @param self server
+/// @param transportConnection transport connection to reply to
+/// @param outStream the reply, including the ordered datagram header
+/// @param response info on how to make a response
+/// @return negative on error
+static int sendReply(NimbleServer* self, NimbleServerTransportConnection* transportConnection,
+                     const FldOutStream* outStream, NimbleServerResponse* response)
+{
+    if (outStream->pos <= 4) {
+        CLOG_C_WARN(&self->log, "no reply to send")
+        return NimbleServerErrSerialize;
+    }
+
+    transportConnectionCommitHeader(transportConnection);
+    if (outStream->pos > datagramTransportMaxSize) {
+        CLOG_C_SOFT_ERROR(&self->log, "trying to send datagram that has too many octets: %zu out of %zu. Discarding it",
+                          outStream->pos, datagramTransportMaxSize)
+        return NimbleServerErrSerialize;
+    }
+#if NIMBLE_SERVER_LOG_VERBOSE_ENABLED
+    {
+        char temp[256];
+        CLOG_C_VERBOSE(&self->log, "server sends:\n%s", hexifyFormat(temp, 256, outStream->octets, outStream->pos))
+    }
+#endif
+
+    response->transportOut->send(response->transportOut->self, outStream->octets, outStream->pos);
+
+    return 0;
+}
+
+/// Handles the commands that follow the ordered datagram header
+/// @param self server
+/// @param transportIndex transport connection index that we received the datagram from
+/// @param transportConnection transport connection for the transportIndex
+/// @param inStream stream to read the commands from
+/// @param response info on how to make a response
+/// @return negative on error
+static int feedCommands(NimbleServer* self, uint8_t transportIndex,
+                        NimbleServerTransportConnection* transportConnection, FldInStream* inStream,
+                        NimbleServerResponse* response)
+{
+    while (inStream->pos != inStream->size) {
         uint8_t cmd;
-        fldInStreamReadUInt8(&inStream, &cmd);
+        fldInStreamReadUInt8(inStream, &cmd);
 
-        CLOG_C_VERBOSE(&self->log, "received cmd: %s (connection: %d)", nimbleSerializeCmdToString(cmd), transportIndex)
+        NIMBLE_SERVER_LOG_C_VERBOSE(&self->log, "received cmd: %s (connection: %d)", nimbleSerializeCmdToString(cmd),
+                                    transportIndex)
 
         if (cmd == NimbleSerializeCmdClientOutBlobStream) {
             // Special case, blob streams can send multiple datagrams as reply
-            int err = nimbleServerReqBlobStream(&self->game, transportConnection, &inStream, response->transportOut);
+            NIMBLE_SERVER_PROFILER_BEGIN(blobStreamStartedAt)
+            int err = nimbleServerReqBlobStream(&self->game, transportConnection, &self->profiler, inStream,
+                                                response->transportOut);
+            NIMBLE_SERVER_PROFILER_END(&self->profiler, NimbleServerProfilerPhaseCmdBlobStream, blobStreamStartedAt)
             if (err < 0) {
                 return err;
             }
@@ -207,27 +347,44 @@ int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t*
         }
 
         int result;
+        NimbleServerProfilerPhase commandPhase;
+        NIMBLE_SERVER_PROFILER_BEGIN(commandStartedAt)
         switch (cmd) {
             case NimbleSerializeCmdConnectRequest:
-                result = nimbleServerReqConnect(self, transportIndex, &inStream, &outStream);
+                commandPhase = NimbleServerProfilerPhaseCmdConnect;
+                result = nimbleServerReqConnect(self, transportIndex, inStream, &outStream);
                 break;
             case NimbleSerializeCmdPingRequest:
-                result = nimbleServerReqPing(&inStream, &outStream, &self->log);
+                commandPhase = NimbleServerProfilerPhaseCmdPing;
+                result = nimbleServerReqPing(transportConnection, self->now, inStream, &outStream, &self->log);
                 break;
             case NimbleSerializeCmdGameStep:
+                commandPhase = NimbleServerProfilerPhaseCmdGameStep;
+                if (transportConnection->isSpectator) {
+                    result = nimbleServerReqSpectatorGameStep(&self->game, transportConnection, &self->profiler,
+                                                              inStream, &outStream);
+                    break;
+                }
                 result = nimbleServerReqGameStep(&self->game, transportConnection,
-                                                 &self->authoritativeStepsPerSecondStat, &inStream, &outStream);
+                                                 &self->authoritativeStepsPerSecondStat, &self->profiler, inStream,
+                                                 &outStream);
                 break;
             case NimbleSerializeCmdJoinGameRequest:
-                result = nimbleServerReqGameJoin(self, transportConnection, &inStream, &outStream);
+                commandPhase = NimbleServerProfilerPhaseCmdJoinGame;
+                result = nimbleServerReqGameJoin(self, transportConnection, inStream, &outStream);
                 break;
             case NimbleSerializeCmdDownloadGameStateRequest:
-                result = nimbleServerReqDownloadGameState(self, transportConnection, &inStream, response->transportOut);
+                commandPhase = NimbleServerProfilerPhaseCmdDownloadGameState;
+                result = nimbleServerReqDownloadGameState(self, transportConnection, inStream, response->transportOut);
                 break;
             default:
-                CLOG_SOFT_ERROR("nimbleServerFeed: unknown command %02X", data[0])
+                CLOG_SOFT_ERROR("nimbleServerFeed: unknown command %02X", cmd)
                 return 0;
         }
+        NIMBLE_SERVER_PROFILER_END(&self->profiler, commandPhase, commandStartedAt)
+#if !NIMBLE_SERVER_PROFILER_ENABLED
+        (void) commandPhase;
+#endif
         if (result < 0) {
             if (!nimbleServerIsErrorExternal(result)) {
                 CLOG_C_SOFT_ERROR(&self->log, "error %d encountered for cmd: %s", result,
@@ -238,30 +395,133 @@ int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t*
             return result;
         }
         if (cmd != NimbleSerializeCmdDownloadGameStateRequest) {
-            if (outStream.pos <= 4) {
-                CLOG_C_WARN(&self->log, "no reply to send")
-                return NimbleServerErrSerialize;
-            }
-
-            transportConnectionCommitHeader(transportConnection);
-            if (outStream.pos > datagramTransportMaxSize) {
-                CLOG_C_SOFT_ERROR(&self->log,
-                                  "trying to send datagram that has too many octets: %zu out of %zu. Discarding it",
-                                  outStream.pos, datagramTransportMaxSize)
-                return NimbleServerErrSerialize;
-            }
-            {
-                char temp[256];
-                CLOG_C_VERBOSE(&self->log, "server sends:\n%s", hexifyFormat(temp, 256, buf, outStream.pos))
+            err = sendReply(self, transportConnection, &outStream, response);
+            if (err < 0) {
+                return err;
             }
-
-            response->transportOut->send(response->transportOut->self, buf, outStream.pos);
         }
     }
 
     return 0;
 }
 
+static int feed(NimbleServer* self, uint8_t transportIndex, const uint8_t* data, size_t len,
+                NimbleServerResponse* response)
+{
+#if NIMBLE_SERVER_LOG_VERBOSE_ENABLED
+    {
+        char temp[256];
+        CLOG_C_VERBOSE(&self->log, "feed: octetCount: %zu\n%s", len, hexifyFormat(temp, 256, data, len))
+    }
+#endif
+
+    FldInStream inStream;
+    fldInStreamInit(&inStream, data, len);
+    inStream.readDebugInfo = true;
+
+    NimbleServerTransportConnection* transportConnection;
+    int err = feedPrelude(self, transportIndex, &inStream, &transportConnection);
+    if (err < 0) {
+        return err;
+    }
+
+    return feedCommands(self, transportIndex, transportConnection, &inStream, response);
+}
+
+typedef struct RecordingResponse {
+    NimbleServer* server;
+    uint8_t transportIndex;
+    DatagramTransportOut* transportOut;
+    DatagramTransportOut recordingTransportOut;
+    NimbleServerResponse response;
+} RecordingResponse;
+
+static int sendAndRecord(void* _self, const uint8_t* data, size_t octetCount)
+{
+    RecordingResponse* self = (RecordingResponse*) _self;
+
+    NIMBLE_SERVER_TRACE(&self->server->trace, NimbleServerTraceEventTypeDatagramOut, self->transportIndex, 0,
+                        octetCount)
+    if (self->server->capture.isEnabled) {
+        nimbleServerCaptureRecord(&self->server->capture, NimbleServerCaptureRecordTypeOut, self->transportIndex,
+                                  self->server->now, data, octetCount);
+    }
+
+    return self->transportOut->send(self->transportOut->self, data, octetCount);
+}
+
+/// Records the received datagram to the trace, and appends it to the capture log if capture is enabled
+static void recordDatagramIn(NimbleServer* self, uint8_t transportIndex, const uint8_t* data, size_t len)
+{
+    NIMBLE_SERVER_TRACE(&self->trace, NimbleServerTraceEventTypeDatagramIn, transportIndex, 0, len)
+    if (self->capture.isEnabled) {
+        nimbleServerCaptureRecord(&self->capture, NimbleServerCaptureRecordTypeIn, transportIndex, self->now, data,
+                                  len);
+    }
+}
+
+/// Wraps the response, so the datagrams that are sent are recorded in the same way as the received ones
+/// @return the response to use instead
+static NimbleServerResponse* recordingResponseInit(RecordingResponse* self, NimbleServer* server,
+                                                   uint8_t transportIndex, DatagramTransportOut* transportOut)
+{
+    self->server = server;
+    self->transportIndex = transportIndex;
+    self->transportOut = transportOut;
+    self->recordingTransportOut.self = self;
+    self->recordingTransportOut.send = sendAndRecord;
+    self->response.transportOut = &self->recordingTransportOut;
+
+    return &self->response;
+}
+
+/// Handle an incoming request from a client identified by the connectionIndex
+/// It uses the NimbleServerResponse to send datagrams back to the client
+/// The datagram and the datagrams sent back are recorded to the trace, and appended to the capture log if capture
+/// is enabled.
+/// @param self server
+/// @param transportIndex transport connection index that we received datagram from
+/// @param data datagram payload
+/// @param len octet count of data
+/// @param response info on how to make a response
+/// @return negative on error
+int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t* data, size_t len,
+                     NimbleServerResponse* response)
+{
+    recordDatagramIn(self, transportIndex, data, len);
+
+    RecordingResponse recordingResponse;
+    NimbleServerResponse* recordedResponse = recordingResponseInit(&recordingResponse, self, transportIndex,
+                                                                   response->transportOut);
+
+    NIMBLE_SERVER_PROFILER_BEGIN(feedStartedAt)
+    int result = feed(self, transportIndex, data, len, recordedResponse);
+    NIMBLE_SERVER_PROFILER_END(&self->profiler, NimbleServerProfilerPhaseFeed, feedStartedAt)
+
+    return result;
+}
+
+/// Wraps the page and blob allocators, so the memory of each subsystem is recorded. Only the step memory for joining
+/// participants and the game state downloads are refused when the budget is exceeded, since they can fail cleanly.
+/// @param self server
+/// @param budgetOctetCount memory budget, zero is no budget
+static void initMemory(NimbleServer* self, size_t budgetOctetCount)
+{
+    nimbleServerMemoryInit(&self->memory, budgetOctetCount);
+    nimbleServerTrackedAllocatorInit(&self->gameAllocator, self->pageAllocator, &self->memory,
+                                     NimbleServerMemoryCategoryGame, false);
+    nimbleServerTrackedAllocatorInit(&self->participantStepsAllocator, self->pageAllocator, &self->memory,
+                                     NimbleServerMemoryCategoryParticipantSteps, true);
+    nimbleServerTrackedAllocatorInit(&self->localPartiesAllocator, self->pageAllocator, &self->memory,
+                                     NimbleServerMemoryCategoryLocalParties, false);
+    nimbleServerTrackedAllocatorInit(&self->blobStreamPageAllocator, self->pageAllocator, &self->memory,
+                                     NimbleServerMemoryCategoryBlobStreams, false);
+    nimbleServerTrackedAllocatorWithFreeInit(&self->downloadAllocator, self->blobAllocator, &self->memory,
+                                             NimbleServerMemoryCategoryDownloads, true);
+    nimbleServerTrackedAllocatorWithFreeInit(&self->blobStreamAllocator, self->blobAllocator, &self->memory,
+                                             NimbleServerMemoryCategoryBlobStreams, false);
+}
+
 /// Initialize nimble server
 /// @param self server
 /// @param setup the initial server values
@@ -293,30 +553,70 @@ int nimbleServerInit(NimbleServer* self, NimbleServerSetup setup)
         // return -1;
     }
 
-    nimbleServerLocalPartiesInit(&self->localParties, setup.maxConnectionCount, setup.memory,
-                                 setup.maxParticipantCountForEachConnection, setup.maxSingleParticipantStepOctetCount,
-                                 setup.log);
     self->pageAllocator = setup.memory;
     self->blobAllocator = setup.blobAllocator;
+    initMemory(self, setup.memoryBudgetOctetCount);
+
+    if (setup.workerPool.parallelForFn != 0) {
+        nimbleServerIngestBatchInit(&self->ingestBatch, &self->gameAllocator.allocator);
+    } else {
+        tc_mem_clear_type(&self->ingestBatch);
+    }
+
+    nimbleServerLocalPartiesInit(&self->localParties, setup.maxConnectionCount, &self->localPartiesAllocator.allocator,
+                                 setup.maxParticipantCountForEachConnection, setup.maxSingleParticipantStepOctetCount,
+                                 setup.log);
+    nimbleServerGameInit(&self->game, &self->gameAllocator.allocator, &self->participantStepsAllocator.allocator,
+                         setup.maxSingleParticipantStepOctetCount, setup.maxParticipantCount, setup.log);
     self->applicationVersion = setup.applicationVersion;
     self->callbackObject = setup.callbackObject;
     self->setup = setup;
 
-    self->transportConnections[0].assignedParty = 0;
-    self->transportConnections[0].transportConnectionId = (uint8_t) 0;
-    self->transportConnections[0].isUsed = false;
-
-    nimbleServerCircularBufferInit(&self->freeTransportConnectionList);
-    for (size_t i = 1; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
+    for (size_t i = 0; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
+        self->transportConnections[i].hot = &self->transportConnectionsHot;
         self->transportConnections[i].assignedParty = 0;
         self->transportConnections[i].transportConnectionId = (uint8_t) i;
-        self->transportConnections[i].isUsed = false;
-        nimbleServerCircularBufferWrite(&self->freeTransportConnectionList, (uint8_t) i);
+        self->transportConnectionsHot.isUsed[i] = false;
+        self->transportConnections[i].hasConnectRequest = false;
+        self->transportConnections[i].download = 0;
     }
 
     statsIntPerSecondInit(&self->authoritativeStepsPerSecondStat, setup.now, 1000);
+    self->now = setup.now;
+
+    nimbleServerUpdateQualityInit(&self->updateQuality, self->setup.targetTickTimeMs, setup.now);
+    nimbleServerProfilerInit(&self->profiler);
+    nimbleServerCaptureInit(&self->capture);
+    nimbleServerTraceInit(&self->trace);
+    nimbleServerTraceSetTime(&self->trace, setup.now);
+    self->game.trace = &self->trace;
+    self->game.forcedStepStrategy = &self->setup.forcedStepStrategy;
+    self->game.now = setup.now;
+
+    size_t maxAuthoritativeStepOctetCount = nbsStepsOutSerializeCalculateCombinedSize(
+        setup.maxParticipantCount, setup.maxSingleParticipantStepOctetCount);
+
+    self->spectatorCount = 0;
+    self->game.spectatorSteps = 0;
+    if (setup.spectatorStepCapacity > 0) {
+        nimbleServerSpectatorStepsInit(&self->spectatorSteps, &self->gameAllocator.allocator,
+                                       setup.spectatorStepCapacity, maxAuthoritativeStepOctetCount, setup.log);
+        self->game.spectatorSteps = &self->spectatorSteps;
+    }
 
-    nimbleServerUpdateQualityInit(&self->updateQuality, self->setup.targetTickTimeMs);
+    self->game.journal = 0;
+    if (setup.journalOctetCount > 0) {
+        nimbleServerJournalInit(&self->journal, &self->gameAllocator.allocator, setup.journalOctetCount, setup.log);
+        self->game.journal = &self->journal;
+    }
+    self->game.journalSource.self = 0;
+    self->game.journalSource.read = 0;
+    self->game.catchUpSteps = 0;
+
+    if (setup.isRelay) {
+        nimbleServerRelayInit(&self->relay, &self->gameAllocator.allocator, setup.maxGameStateOctetCount,
+                              maxAuthoritativeStepOctetCount);
+    }
 
     return 0;
 }
@@ -386,13 +686,28 @@ int nimbleServerHostMigration(NimbleServer* self, NimbleSerializeLocalPartyInfo
 /// @return negative on error
 int nimbleServerReInitWithGame(NimbleServer* self, StepId stepId, MonotonicTimeMs now)
 {
-    nimbleServerGameInit(&self->game, self->pageAllocator, self->setup.maxSingleParticipantStepOctetCount,
-                         self->setup.maxParticipantCount, self->log);
+    nimbleServerGameReset(&self->game);
 
     nbsStepsReInit(&self->game.authoritativeSteps, stepId);
     statsIntPerSecondInit(&self->authoritativeStepsPerSecondStat, now, 1000);
+    self->now = now;
+    self->game.now = now;
+    nimbleServerTraceSetTime(&self->trace, now);
     nimbleServerLocalPartiesReset(&self->localParties);
-    nimbleServerUpdateQualityReInit(&self->updateQuality);
+    nimbleServerUpdateQualityReInit(&self->updateQuality, now);
+    if (self->game.spectatorSteps != 0) {
+        nimbleServerSpectatorStepsReset(self->game.spectatorSteps);
+    }
+    if (self->game.journal != 0 && self->game.journal->isEnabled) {
+        // The step ids start over, so they must go into a new segment
+        CLOG_C_NOTICE(&self->log, "journal segment is stopped since the game is reinitialized")
+        nimbleServerJournalStop(self->game.journal);
+    }
+    // The journaled steps belong to the previous game
+    self->game.journalSource.read = 0;
+    if (self->setup.isRelay) {
+        nimbleServerRelayReset(&self->relay);
+    }
     self->statsCounter = 0;
     return 0;
 }
@@ -403,39 +718,78 @@ int nimbleServerReInitWithGame(NimbleServer* self, StepId stepId, MonotonicTimeM
 /// @return negative on error
 int nimbleServerConnectionConnected(NimbleServer* self, uint8_t connectionIndex)
 {
-    NimbleServerTransportConnection* transportConnection = &self->transportConnections[connectionIndex];
-    if (transportConnection->isUsed) {
+    if (self->transportConnectionsHot.isUsed[connectionIndex]) {
         CLOG_C_SOFT_ERROR(&self->log, "connection %d already connected", connectionIndex)
         return -44;
     }
 
     CLOG_C_DEBUG(&self->log, "connection %d connected", connectionIndex)
 
-    transportConnection->isUsed = true;
+    self->transportConnectionsHot.isUsed[connectionIndex] = true;
 
     return 0;
 }
 
 /// Notify the server that a connection has been disconnected on the transport layer.
+/// The transport connection is freed, so a new client can connect on the same transport connection index.
 /// @param self server
 /// @param connectionIndex transport connection index that disconnected
 /// @return negative on error
 int nimbleServerConnectionDisconnected(NimbleServer* self, uint8_t connectionIndex)
 {
-    NimbleServerLocalParty* foundConnection = nimbleServerLocalPartiesFindParty(&self->localParties, connectionIndex);
-    if (!foundConnection) {
-        return -2;
+    if (connectionIndex >= NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
+        return NimbleServerErrUnknownConnection;
     }
 
-    if (!foundConnection->isUsed) {
-        return -4;
+    NimbleServerTransportConnection* transportConnection = &self->transportConnections[connectionIndex];
+    if (transportConnection->isSpectator) {
+        transportConnection->isSpectator = false;
+        transportConnection->orderedDatagramInLogic.hasReceivedInitialDatagram = false;
+        disconnectTransportConnection(self, transportConnection);
+        self->spectatorCount--;
+        return 0;
     }
 
-    foundConnection->id = 0xff;
-    foundConnection->isUsed = false;
+    NimbleServerLocalParty* party = transportConnection->assignedParty;
+    if (party == 0 || !party->isUsed || party->transportConnection != transportConnection) {
+        if (!transportConnectionIsUsed(transportConnection)) {
+            return NimbleServerErrUnknownConnection;
+        }
+        // Connected, but never joined with any participants, or the party has already been dissolved
+        transportConnection->assignedParty = 0;
+        disconnectTransportConnection(self, transportConnection);
+        return 0;
+    }
+
+    party->id = 0xff;
+    party->isUsed = false;
 
-    NimbleServerTransportConnection* transportConnection = &self->transportConnections[connectionIndex];
     transportConnection->orderedDatagramInLogic.hasReceivedInitialDatagram = false;
+    transportConnection->assignedParty = 0;
+    disconnectTransportConnection(self, transportConnection);
+
+    return 0;
+}
+
+/// Gets the estimated round trip time for a connection, e.g. to size windows and timeouts from the network conditions
+/// @param self server
+/// @param connectionIndex transport connection index
+/// @param[out] summary round trip time, variance and jitter. sampleCount is zero until a step has been acknowledged.
+/// @return negative if the connection is not in use
+int nimbleServerConnectionRoundTripTime(const NimbleServer* self, uint8_t connectionIndex,
+                                        NimbleServerRoundTripTimeSummary* summary)
+{
+    if (connectionIndex >= NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
+        return NimbleServerErrUnknownConnection;
+    }
+
+    if (!self->transportConnectionsHot.isUsed[connectionIndex]) {
+        return NimbleServerErrUnknownConnection;
+    }
+
+    const NimbleServerTransportConnection* transportConnection = &self->transportConnections[connectionIndex];
+
+    nimbleServerRoundTripTimeSummarize(&transportConnection->roundTripTime, summary);
 
     return 0;
 }
@@ -456,13 +810,167 @@ typedef struct ReplyOnlyToConnection {
 static int sendOnlyToSpecifiedTransport(void* _self, const uint8_t* data, size_t octetCount)
 {
     ReplyOnlyToConnection* self = (ReplyOnlyToConnection*) _self;
-    CLOG_EXECUTE(char temp[256]);
-    CLOG_VERBOSE("send_to_transport %zu:\n%s", octetCount, hexifyFormat(temp, 256, data, octetCount))
+#if NIMBLE_SERVER_LOG_VERBOSE_ENABLED
+    {
+        char temp[256];
+        CLOG_VERBOSE("send_to_transport %zu:\n%s", octetCount, hexifyFormat(temp, 256, data, octetCount))
+    }
+#endif
 
     return self->multiTransport.sendTo(self->multiTransport.self, self->connectionIndex, data, octetCount);
 }
 
+/// Sends the reply for a datagram in the ingest batch, after the predicted steps has been read and the
+/// authoritative steps has been composed. Any commands after the predicted steps are handled as usual.
+/// @param self server
+/// @param entry datagram in the ingest batch
+/// @param response info on how to make a response
+/// @return negative on error
+static int replyToIngestedSteps(NimbleServer* self, NimbleServerIngestEntry* entry, NimbleServerResponse* response)
+{
+    NimbleServerTransportConnection* transportConnection = entry->transportConnection;
+    if (entry->result < 0) {
+        if (!nimbleServerIsErrorExternal(entry->result)) {
+            CLOG_C_SOFT_ERROR(&transportConnection->log, "problem handling incoming step:%d", entry->result)
+        }
+        return entry->result;
+    }
+
+    static uint8_t buf[MAX_SEND_OCTET_SIZE];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+    outStream.writeDebugInfo = false;
+
+    int err = transportConnectionWriteHeader(transportConnection, &outStream);
+    if (err < 0) {
+        return err;
+    }
+
+    NIMBLE_SERVER_PROFILER_BEGIN(commandStartedAt)
+    int result = nimbleServerReqGameStepReply(&self->game, transportConnection, &self->profiler,
+                                              entry->clientWaitingForStepId, &outStream);
+    NIMBLE_SERVER_PROFILER_END(&self->profiler, NimbleServerProfilerPhaseCmdGameStep, commandStartedAt)
+    if (result < 0) {
+        return result;
+    }
+
+    err = sendReply(self, transportConnection, &outStream, response);
+    if (err < 0) {
+        return err;
+    }
+
+    return feedCommands(self, entry->transportIndex, transportConnection, &entry->inStream, response);
+}
+
+/// Reads the predicted steps from all datagrams in the ingest batch, using the worker pool, and composes the
+/// authoritative steps once. The replies are then sent in arrival order.
+/// @param self server
+/// @return negative if there was an internal error. External errors only affect the datagram that caused them.
+static int flushIngestBatch(NimbleServer* self)
+{
+    NimbleServerIngestBatch* batch = &self->ingestBatch;
+    if (batch->entryCount == 0) {
+        return 0;
+    }
+
+    int result = nimbleServerReqGameStepDiscardOldAuthoritativeSteps(&self->game);
+    if (result >= 0) {
+        NIMBLE_SERVER_PROFILER_BEGIN(ingestStartedAt)
+        nimbleServerIngestBatchRun(batch, &self->game, &self->setup.workerPool);
+        NIMBLE_SERVER_PROFILER_END(&self->profiler, NimbleServerProfilerPhaseIngest, ingestStartedAt)
+        result = nimbleServerReqGameStepCompose(&self->game, &self->authoritativeStepsPerSecondStat, &self->profiler);
+    }
+    if (result < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "problem composing the ingested steps:%d", result)
+        nimbleServerIngestBatchClear(batch);
+        return result;
+    }
+
+    int firstInternalError = 0;
+    for (size_t i = 0; i < batch->entryCount; ++i) {
+        NimbleServerIngestEntry* entry = &batch->entries[i];
+
+        ReplyOnlyToConnection replyOnlyToConnection;
+        replyOnlyToConnection.multiTransport = self->multiTransport;
+        replyOnlyToConnection.connectionIndex = entry->transportIndex;
+
+        DatagramTransportOut responseTransport;
+        responseTransport.self = &replyOnlyToConnection;
+        responseTransport.send = sendOnlyToSpecifiedTransport;
+
+        RecordingResponse recordingResponse;
+        NimbleServerResponse* response = recordingResponseInit(&recordingResponse, self, entry->transportIndex,
+                                                               &responseTransport);
+
+        int err = replyToIngestedSteps(self, entry, response);
+        if (err < 0 && !nimbleServerIsErrorExternal(err) && firstInternalError == 0) {
+            firstInternalError = err;
+        }
+    }
+
+    nimbleServerIngestBatchClear(batch);
+
+    return firstInternalError;
+}
+
+/// Checks if the datagram starts with predicted steps from a party, so it can be added to the ingest batch
+static bool startsWithPredictedSteps(const FldInStream* inStream,
+                                     const NimbleServerTransportConnection* transportConnection)
+{
+    return inStream->pos < inStream->size && inStream->octets[inStream->pos] == NimbleSerializeCmdGameStep &&
+           transportConnection->assignedParty != 0;
+}
+
+/// Same as nimbleServerFeed(), except that a datagram that starts with predicted steps is added to the ingest batch.
+/// The batch is flushed before any other datagram is handled, so the commands from each connection are still
+/// handled in arrival order.
+/// @param self server
+/// @param entry the entry from the ingest batch that the datagram was received into
+/// @param transportIndex transport connection index that we received datagram from
+/// @param len octet count of the datagram
+/// @param response info on how to make a response
+/// @return negative on error
+static int feedOrAddToIngestBatch(NimbleServer* self, NimbleServerIngestEntry* entry, uint8_t transportIndex,
+                                  size_t len, NimbleServerResponse* response)
+{
+    recordDatagramIn(self, transportIndex, entry->octets, len);
+
+    RecordingResponse recordingResponse;
+    NimbleServerResponse* recordedResponse = recordingResponseInit(&recordingResponse, self, transportIndex,
+                                                                   response->transportOut);
+
+    NIMBLE_SERVER_PROFILER_BEGIN(feedStartedAt)
+    FldInStream* inStream = &entry->inStream;
+    fldInStreamInit(inStream, entry->octets, len);
+    inStream->readDebugInfo = true;
+
+    NimbleServerTransportConnection* transportConnection;
+    int result = feedPrelude(self, transportIndex, inStream, &transportConnection);
+    if (result >= 0) {
+        if (startsWithPredictedSteps(inStream, transportConnection)) {
+            uint8_t cmd;
+            fldInStreamReadUInt8(inStream, &cmd);
+            entry->transportConnection = transportConnection;
+            entry->party = transportConnection->assignedParty;
+            entry->transportIndex = transportIndex;
+            entry->result = 0;
+            nimbleServerIngestBatchCommit(&self->ingestBatch);
+        } else {
+            int flushErr = flushIngestBatch(self);
+            result = feedCommands(self, transportIndex, transportConnection, inStream, recordedResponse);
+            if (result >= 0) {
+                result = flushErr;
+            }
+        }
+    }
+    NIMBLE_SERVER_PROFILER_END(&self->profiler, NimbleServerProfilerPhaseFeed, feedStartedAt)
+
+    return result;
+}
+
 /// Read all datagrams from the multi-transport
+/// If the setup has a worker pool, the predicted steps from the datagrams are read in parallel, one job for each
+/// party, and the authoritative steps are composed once for each batch of datagrams instead of once per datagram.
 /// @param self server
 int nimbleServerReadFromMultiTransport(NimbleServer* self)
 {
@@ -474,20 +982,35 @@ int nimbleServerReadFromMultiTransport(NimbleServer* self)
 
     DatagramTransportOut responseTransport;
 
-    const int maximumNumberOfDatagramsPerTick = 64;
+    const size_t maximumNumberOfDatagramsPerTick = NIMBLE_SERVER_INGEST_MAX_DATAGRAM_COUNT;
+    // Rate limited datagrams are cheap to discard, so they have their own, larger, budget. Otherwise a single
+    // misbehaving connection could use up the budget for everyone else.
+    const size_t maximumNumberOfRateLimitedDatagramsPerTick = 256;
+    size_t rateLimitedCount = 0;
+    bool useIngestBatch = self->ingestBatch.entries != 0;
+    int result = 0;
+
+    for (size_t i = 0; i < maximumNumberOfDatagramsPerTick;) {
+        NimbleServerIngestEntry* entry = 0;
+        uint8_t* target = datagram;
+        if (useIngestBatch) {
+            entry = nimbleServerIngestBatchNext(&self->ingestBatch);
+            CLOG_ASSERT(entry != 0, "ingest batch can hold all the datagrams of a tick")
+            target = entry->octets;
+        }
 
-    for (size_t i = 0; i < maximumNumberOfDatagramsPerTick; ++i) {
         ssize_t octetCountReceived = self->multiTransport.receiveFrom(self->multiTransport.self, &connectionId,
-                                                                      datagram, sizeof(datagram));
+                                                                      target, sizeof(datagram));
         if (octetCountReceived == 0) {
             if (i > 10) {
                 CLOG_C_NOTICE(&self->log, "high number of datagrams in one tick: %zu", i)
             }
-            return 0;
+            break;
         }
 
         if (octetCountReceived < 0) {
-            return (int) octetCountReceived;
+            result = (int) octetCountReceived;
+            break;
         }
 
         CLOG_ASSERT((size_t) octetCountReceived <= sizeof(datagram), "datagram memory overwrite %zu",
@@ -500,15 +1023,70 @@ int nimbleServerReadFromMultiTransport(NimbleServer* self)
         NimbleServerResponse response;
         response.transportOut = &responseTransport;
 
-        int errorCode = nimbleServerFeed(self, (uint8_t) connectionId, datagram, (size_t) octetCountReceived,
+        int errorCode;
+        if (useIngestBatch) {
+            errorCode = feedOrAddToIngestBatch(self, entry, (uint8_t) connectionId, (size_t) octetCountReceived,
+                                               &response);
+        } else {
+            errorCode = nimbleServerFeed(self, (uint8_t) connectionId, datagram, (size_t) octetCountReceived,
                                          &response);
+        }
+        if (errorCode == NimbleServerErrRateLimited) {
+            if (++rateLimitedCount >= maximumNumberOfRateLimitedDatagramsPerTick) {
+                CLOG_C_NOTICE(&self->log, "too many rate limited datagrams in one tick: %zu", rateLimitedCount)
+                break;
+            }
+            continue;
+        }
+        ++i;
         if (errorCode < 0) {
             if (!nimbleServerIsErrorExternal(errorCode)) {
                 CLOG_C_SOFT_ERROR(&self->log, "error on feed %d", errorCode)
             }
-            return errorCode;
+            result = errorCode;
+            break;
         }
     }
 
-    return 0;
+    if (useIngestBatch) {
+        int flushErr = flushIngestBatch(self);
+        if (result >= 0) {
+            result = flushErr;
+        }
+    }
+
+    return result;
+}
+
+/// Returns the memory that the server has allocated, for each subsystem
+/// @param self server
+/// @return memory usage
+const NimbleServerMemory* nimbleServerMemory(const NimbleServer* self)
+{
+    return &self->memory;
+}
+
+/// Returns the latest composed authoritative steps, for in-process spectators on any thread
+/// @param self server
+/// @return the spectator steps, or NULL if the setup has no spectatorStepCapacity
+const NimbleServerSpectatorSteps* nimbleServerSpectatorSteps(const NimbleServer* self)
+{
+    return self->game.spectatorSteps;
+}
+
+/// Sets the journaled steps that are sent to clients that are waiting for steps older than the authoritative steps
+/// in memory, so they can catch up by simulating the steps instead of downloading a new game state.
+/// Must be set again after nimbleServerReInitWithGame(), since the step ids start over.
+/// @param self server
+/// @param source the journaled steps of the current game, e.g. nimbleServerJournalReaderSource()
+void nimbleServerSetJournalSource(NimbleServer* self, NimbleServerJournalSource source)
+{
+    if (self->game.catchUpSteps == 0) {
+        size_t maxAuthoritativeStepOctetCount = nbsStepsOutSerializeCalculateCombinedSize(
+            self->setup.maxParticipantCount, self->setup.maxSingleParticipantStepOctetCount);
+        nbsStepsInit(&self->catchUpSteps, &self->gameAllocator.allocator, maxAuthoritativeStepOctetCount, self->log);
+        self->game.catchUpSteps = &self->catchUpSteps;
+    }
+
+    self->game.journalSource = source;
 }
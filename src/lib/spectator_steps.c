@@ -0,0 +1,147 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "atomic.h"
+#include <imprint/allocator.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/spectator_steps.h>
+#include <tiny-libc/tiny_libc.h>
+
+/// Allocates the slots for the published steps
+/// @param self spectator steps
+/// @param allocator allocator for the slots
+/// @param capacity number of steps that are kept, must be a power of two
+/// @param maxStepOctetCount maximum octet count of a composed authoritative step
+/// @param log the log to use
+void nimbleServerSpectatorStepsInit(NimbleServerSpectatorSteps* self, ImprintAllocator* allocator, size_t capacity,
+                                    size_t maxStepOctetCount, Clog log)
+{
+    CLOG_ASSERT(capacity > 0 && (capacity & (capacity - 1U)) == 0, "spectator step capacity must be a power of two %zu",
+                capacity)
+    self->log = log;
+    self->capacity = capacity;
+    self->maxStepOctetCount = maxStepOctetCount;
+    self->slots = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerSpectatorStepSlot, capacity);
+    uint8_t* octets = IMPRINT_ALLOC(allocator, capacity * maxStepOctetCount, "spectator steps");
+    for (size_t i = 0; i < capacity; ++i) {
+        NimbleServerSpectatorStepSlot* slot = &self->slots[i];
+        slot->sequence = 0;
+        slot->hasStep = false;
+        slot->stepId = 0;
+        slot->octetCount = 0;
+        slot->octets = octets + i * maxStepOctetCount;
+    }
+    self->publishedCount = 0;
+    self->lastPublishedStepId = 0;
+}
+
+static void beginWrite(NimbleServerSpectatorStepSlot* slot)
+{
+    slot->sequence = slot->sequence + 1U;
+    // The odd sequence must be visible before any of the slot is changed
+    nimbleServerAtomicFenceRelease();
+}
+
+static void endWrite(NimbleServerSpectatorStepSlot* slot)
+{
+    nimbleServerAtomicStoreRelease(&slot->sequence, slot->sequence + 1U);
+}
+
+/// Removes all the steps, e.g. when the game is reinitialized and the step ids start over.
+/// Must only be called from the thread that updates the server.
+/// @param self spectator steps
+void nimbleServerSpectatorStepsReset(NimbleServerSpectatorSteps* self)
+{
+    for (size_t i = 0; i < self->capacity; ++i) {
+        NimbleServerSpectatorStepSlot* slot = &self->slots[i];
+        if (!slot->hasStep) {
+            continue;
+        }
+        beginWrite(slot);
+        slot->hasStep = false;
+        endWrite(slot);
+    }
+    nimbleServerAtomicStoreRelease(&self->publishedCount, 0);
+}
+
+/// Publishes a composed authoritative step, replacing the oldest one.
+/// Must only be called from the thread that updates the server.
+/// @param self spectator steps
+/// @param stepId the id of the composed step
+/// @param octets the composed step
+/// @param octetCount octet count of the composed step
+void nimbleServerSpectatorStepsPublish(NimbleServerSpectatorSteps* self, StepId stepId, const uint8_t* octets,
+                                       size_t octetCount)
+{
+    if (octetCount > self->maxStepOctetCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "authoritative step %08X is too large for spectators %zu", stepId, octetCount)
+        return;
+    }
+
+    NimbleServerSpectatorStepSlot* slot = &self->slots[stepId & (self->capacity - 1U)];
+    beginWrite(slot);
+    slot->hasStep = true;
+    slot->stepId = stepId;
+    slot->octetCount = octetCount;
+    tc_memcpy_octets(slot->octets, octets, octetCount);
+    endWrite(slot);
+
+    self->lastPublishedStepId = stepId;
+    nimbleServerAtomicStoreRelease(&self->publishedCount, self->publishedCount + 1U);
+}
+
+/// Copies a published step. Can be called from any thread, and never blocks the thread that updates the server.
+/// @param self spectator steps
+/// @param stepId the id of the step to read
+/// @param target where to copy the step
+/// @param maxTargetOctetCount size of the target
+/// @return the octet count of the step, NimbleServerErrSpectatorStepNotAvailable if the step is not composed yet or
+/// has been replaced by a newer step, or NimbleServerErrSerialize if the target is too small.
+int nimbleServerSpectatorStepsRead(const NimbleServerSpectatorSteps* self, StepId stepId, uint8_t* target,
+                                   size_t maxTargetOctetCount)
+{
+    const NimbleServerSpectatorStepSlot* slot = &self->slots[stepId & (self->capacity - 1U)];
+
+    size_t sequenceBefore = nimbleServerAtomicLoadAcquire(&slot->sequence);
+    if ((sequenceBefore & 1U) != 0) {
+        // Only happens when the slot is replaced with a newer step
+        return NimbleServerErrSpectatorStepNotAvailable;
+    }
+
+    bool hasStep = slot->hasStep;
+    StepId slotStepId = slot->stepId;
+    size_t octetCount = slot->octetCount;
+    if (!hasStep || slotStepId != stepId || octetCount > self->maxStepOctetCount) {
+        return NimbleServerErrSpectatorStepNotAvailable;
+    }
+    if (octetCount > maxTargetOctetCount) {
+        return NimbleServerErrSerialize;
+    }
+
+    tc_memcpy_octets(target, slot->octets, octetCount);
+
+    // The copy must be done before the sequence is checked again
+    nimbleServerAtomicFenceAcquire();
+    if (slot->sequence != sequenceBefore) {
+        return NimbleServerErrSpectatorStepNotAvailable;
+    }
+
+    return (int) octetCount;
+}
+
+/// Gets the latest published step. Can be called from any thread.
+/// @param self spectator steps
+/// @param[out] outStepId the latest step id
+/// @return false if no step has been published
+bool nimbleServerSpectatorStepsLatest(const NimbleServerSpectatorSteps* self, StepId* outStepId)
+{
+    if (nimbleServerAtomicLoadAcquire(&self->publishedCount) == 0) {
+        return false;
+    }
+
+    *outStepId = (StepId) self->lastPublishedStepId;
+
+    return true;
+}
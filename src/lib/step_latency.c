@@ -0,0 +1,113 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <nimble-server/step_latency.h>
+
+#define NIMBLE_SERVER_NS_PER_MS (1000000U)
+
+/// Forgets all the recorded arrivals
+/// @param self arrivals
+void nimbleServerStepArrivalsReset(NimbleServerStepArrivals* self)
+{
+    for (size_t i = 0; i < NIMBLE_SERVER_STEP_ARRIVAL_WINDOW; ++i) {
+        self->arrivals[i].isSet = false;
+    }
+}
+
+/// Records that a predicted step was received
+/// @param self arrivals
+/// @param stepId the predicted step that was received
+/// @param authoritativeStepId the authoritative step that is composed next
+/// @param now current server time
+void nimbleServerStepArrivalsAdd(NimbleServerStepArrivals* self, StepId stepId, StepId authoritativeStepId,
+                                 MonotonicTimeMs now)
+{
+    NimbleServerStepArrival* arrival = &self->arrivals[stepId % NIMBLE_SERVER_STEP_ARRIVAL_WINDOW];
+    arrival->stepId = stepId;
+    arrival->authoritativeStepId = authoritativeStepId;
+    arrival->timeMs = now;
+    arrival->isSet = true;
+}
+
+/// Finds the arrival for a step
+/// @param self arrivals
+/// @param stepId the predicted step to look for
+/// @param[out] outArrival the arrival, if found
+/// @return false if the arrival was not recorded or has been overwritten
+bool nimbleServerStepArrivalsFind(const NimbleServerStepArrivals* self, StepId stepId,
+                                  NimbleServerStepArrival* outArrival)
+{
+    const NimbleServerStepArrival* arrival = &self->arrivals[stepId % NIMBLE_SERVER_STEP_ARRIVAL_WINDOW];
+    if (!arrival->isSet || arrival->stepId != stepId) {
+        return false;
+    }
+
+    *outArrival = *arrival;
+
+    return true;
+}
+
+/// Clears all the measurements
+/// @param self latency
+void nimbleServerStepLatencyReset(NimbleServerStepLatency* self)
+{
+    nimbleServerProfilerHistogramReset(&self->waitTime);
+    self->totalWaitStepCount = 0;
+    self->minWaitStepCount = UINT32_MAX;
+    self->maxWaitStepCount = 0;
+    self->committedCount = 0;
+    self->missedCount = 0;
+}
+
+/// Adds a predicted step that was used when composing an authoritative step
+/// @param self latency
+/// @param arrival when the step arrived
+/// @param composedStepId the authoritative step that was composed
+/// @param now current server time
+void nimbleServerStepLatencyAddCommitted(NimbleServerStepLatency* self, const NimbleServerStepArrival* arrival,
+                                         StepId composedStepId, MonotonicTimeMs now)
+{
+    uint32_t waitStepCount = composedStepId >= arrival->authoritativeStepId
+                                 ? (uint32_t) (composedStepId - arrival->authoritativeStepId)
+                                 : 0U;
+    MonotonicTimeMs waitMs = now >= arrival->timeMs ? now - arrival->timeMs : 0;
+
+    nimbleServerProfilerHistogramAdd(&self->waitTime, (uint64_t) waitMs * NIMBLE_SERVER_NS_PER_MS);
+    self->totalWaitStepCount += waitStepCount;
+    if (waitStepCount < self->minWaitStepCount) {
+        self->minWaitStepCount = waitStepCount;
+    }
+    if (waitStepCount > self->maxWaitStepCount) {
+        self->maxWaitStepCount = waitStepCount;
+    }
+    self->committedCount++;
+}
+
+/// Adds a step that had not arrived in time, and was forced
+/// @param self latency
+void nimbleServerStepLatencyAddMissed(NimbleServerStepLatency* self)
+{
+    self->missedCount++;
+}
+
+/// Summarizes the measurements
+/// @param self latency
+/// @param[out] summary counts, wait time percentiles in milliseconds and wait in steps
+void nimbleServerStepLatencySummarize(const NimbleServerStepLatency* self, NimbleServerStepLatencySummary* summary)
+{
+    summary->committedCount = self->committedCount;
+    summary->missedCount = self->missedCount;
+    summary->waitTimeP50Ms = nimbleServerProfilerHistogramPercentile(&self->waitTime, 50) / NIMBLE_SERVER_NS_PER_MS;
+    summary->waitTimeP99Ms = nimbleServerProfilerHistogramPercentile(&self->waitTime, 99) / NIMBLE_SERVER_NS_PER_MS;
+    if (self->committedCount == 0) {
+        summary->averageWaitStepCount = 0;
+        summary->minWaitStepCount = 0;
+        summary->maxWaitStepCount = 0;
+        return;
+    }
+    summary->averageWaitStepCount = (uint32_t) (self->totalWaitStepCount / self->committedCount);
+    summary->minWaitStepCount = self->minWaitStepCount;
+    summary->maxWaitStepCount = self->maxWaitStepCount;
+}
@@ -0,0 +1,155 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <nimble-server/steps_pool.h>
+#include <nimble-steps/steps.h>
+#include <tiny-libc/tiny_libc.h>
+
+#define NIMBLE_SERVER_STEPS_POOL_ALIGNMENT (8U)
+
+static size_t alignOctetCount(size_t octetCount)
+{
+    return (octetCount + NIMBLE_SERVER_STEPS_POOL_ALIGNMENT - 1U) & ~(size_t) (NIMBLE_SERVER_STEPS_POOL_ALIGNMENT - 1U);
+}
+
+static void* slotAlloc(void* self_, size_t size, const char* sourceFile, int line, const char* description)
+{
+    (void) sourceFile;
+    (void) line;
+
+    NimbleServerStepsPoolSlot* self = (NimbleServerStepsPoolSlot*) self_;
+    size_t alignedSize = alignOctetCount(size);
+    if (self->allocatedOctetCount + alignedSize > self->pool->slotOctetCount) {
+        CLOG_C_ERROR(&self->pool->log, "steps pool slot %hhu is out of memory for '%s' (%zu octets, %zu/%zu used)",
+                     self->index, description, size, self->allocatedOctetCount, self->pool->slotOctetCount)
+        return 0;
+    }
+
+    uint8_t* octets = self->octets + self->allocatedOctetCount;
+    self->allocatedOctetCount += alignedSize;
+
+    return octets;
+}
+
+static void* slotCalloc(void* self_, size_t size, const char* sourceFile, int line, const char* description)
+{
+    uint8_t* octets = slotAlloc(self_, size, sourceFile, line, description);
+    if (octets == 0) {
+        return 0;
+    }
+    tc_mem_clear(octets, size);
+
+    return octets;
+}
+
+/// Allocates memory for the next slab of slots and adds them to the free slots
+/// @param self steps pool
+/// @return negative if all slots already have memory, or if the allocation failed
+static int addSlab(NimbleServerStepsPool* self)
+{
+    size_t slotCount = self->slotCapacity - self->slabbedSlotCount;
+    if (slotCount == 0) {
+        return -1;
+    }
+    if (slotCount > NIMBLE_SERVER_STEPS_POOL_SLOTS_PER_SLAB) {
+        slotCount = NIMBLE_SERVER_STEPS_POOL_SLOTS_PER_SLAB;
+    }
+
+    uint8_t* slabOctets = IMPRINT_ALLOC(self->slabAllocator, slotCount * self->slotOctetCount, "steps pool slab");
+    if (slabOctets == 0) {
+        return -2;
+    }
+
+    CLOG_C_DEBUG(&self->log, "allocating %zu step slots (%zu octets), %zu/%zu slots have memory", slotCount,
+                 slotCount * self->slotOctetCount, self->slabbedSlotCount + slotCount, self->slotCapacity)
+
+    for (size_t i = 0; i < slotCount; ++i) {
+        NimbleServerStepsPoolSlot* slot = &self->slots[self->slabbedSlotCount];
+        slot->octets = slabOctets + i * self->slotOctetCount;
+        nimbleServerCircularBufferWrite(&self->freeSlots, slot->index);
+        self->slabbedSlotCount++;
+    }
+
+    return 0;
+}
+
+/// Initializes the pool. No step memory is allocated until the slots are acquired.
+/// @param self steps pool
+/// @param allocator allocator for the slot descriptions
+/// @param slabAllocator allocator for the slabs. It may return NULL, e.g. when a memory budget is exceeded.
+/// @param slotCapacity maximum number of slots, usually the maximum participant count
+/// @param maxStepOctetCount maximum octet count for a single step
+/// @param log the log to use
+void nimbleServerStepsPoolInit(NimbleServerStepsPool* self, ImprintAllocator* allocator,
+                               ImprintAllocator* slabAllocator, size_t slotCapacity, size_t maxStepOctetCount,
+                               Clog log)
+{
+    CLOG_ASSERT(slotCapacity < NIMBLE_SERVER_CIRCULAR_BUFFER_SIZE,
+                "slotCapacity must be less than NIMBLE_SERVER_CIRCULAR_BUFFER_SIZE")
+    self->log = log;
+    self->slabAllocator = slabAllocator;
+    self->slotCapacity = slotCapacity;
+    // The step window that nbsStepsInit() allocates, and the last step that is kept for forced steps
+    self->slotOctetCount = alignOctetCount(NBS_WINDOW_SIZE * maxStepOctetCount) + alignOctetCount(maxStepOctetCount);
+    self->slabbedSlotCount = 0;
+    self->usedSlotCount = 0;
+    self->slots = IMPRINT_CALLOC_TYPE_COUNT(allocator, NimbleServerStepsPoolSlot, slotCapacity);
+    nimbleServerCircularBufferInit(&self->freeSlots);
+
+    for (size_t i = 0; i < slotCapacity; ++i) {
+        NimbleServerStepsPoolSlot* slot = &self->slots[i];
+        slot->allocator.allocDebugFn = slotAlloc;
+        slot->allocator.callocDebugFn = slotCalloc;
+        slot->pool = self;
+        slot->octets = 0;
+        slot->allocatedOctetCount = 0;
+        slot->index = (uint8_t) i;
+        slot->isUsed = false;
+    }
+}
+
+/// Borrows a slot from the pool. A new slab is allocated if there is no free slot with memory.
+/// @param self steps pool
+/// @return the slot, or NULL if all slots are used
+NimbleServerStepsPoolSlot* nimbleServerStepsPoolAcquire(NimbleServerStepsPool* self)
+{
+    if (nimbleServerCircularBufferIsEmpty(&self->freeSlots)) {
+        int err = addSlab(self);
+        if (err < 0) {
+            CLOG_C_NOTICE(&self->log, "no free step slots (%zu used)", self->usedSlotCount)
+            return 0;
+        }
+    }
+
+    uint8_t slotIndex = nimbleServerCircularBufferRead(&self->freeSlots);
+    NimbleServerStepsPoolSlot* slot = &self->slots[slotIndex];
+    CLOG_ASSERT(!slot->isUsed, "slot from the free list is already used")
+    slot->isUsed = true;
+    slot->allocatedOctetCount = 0;
+    self->usedSlotCount++;
+
+    return slot;
+}
+
+/// Returns a slot to the pool. The memory is kept for the next participant.
+/// @param self steps pool
+/// @param slot slot to return
+void nimbleServerStepsPoolRelease(NimbleServerStepsPool* self, NimbleServerStepsPoolSlot* slot)
+{
+    CLOG_ASSERT(slot->isUsed, "released a slot that was not used")
+    CLOG_ASSERT(self->usedSlotCount > 0, "used slot count is wrong")
+    slot->isUsed = false;
+    slot->allocatedOctetCount = 0;
+    self->usedSlotCount--;
+    nimbleServerCircularBufferWrite(&self->freeSlots, slot->index);
+}
+
+/// Returns the number of octets that has been allocated for slabs
+/// @param self steps pool
+/// @return octet count
+size_t nimbleServerStepsPoolAllocatedOctetCount(const NimbleServerStepsPool* self)
+{
+    return self->slabbedSlotCount * self->slotOctetCount;
+}
@@ -0,0 +1,199 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "atomic.h"
+#include <nimble-server/errors.h>
+#include <nimble-server/trace.h>
+#include <tiny-libc/tiny_libc.h>
+
+static const uint8_t traceMagic[8] = {'N', 'I', 'M', 'B', 'T', 'R', 'C', 'E'};
+
+static void writeUInt16(uint8_t* target, uint16_t value)
+{
+    target[0] = (uint8_t) value;
+    target[1] = (uint8_t) (value >> 8);
+}
+
+static void writeUInt32(uint8_t* target, uint32_t value)
+{
+    writeUInt16(target, (uint16_t) value);
+    writeUInt16(target + 2, (uint16_t) (value >> 16));
+}
+
+static void writeUInt64(uint8_t* target, uint64_t value)
+{
+    writeUInt32(target, (uint32_t) value);
+    writeUInt32(target + 4, (uint32_t) (value >> 32));
+}
+
+static uint16_t readUInt16(const uint8_t* source)
+{
+    return (uint16_t) (source[0] | (source[1] << 8));
+}
+
+static uint32_t readUInt32(const uint8_t* source)
+{
+    return (uint32_t) readUInt16(source) | ((uint32_t) readUInt16(source + 2) << 16);
+}
+
+static uint64_t readUInt64(const uint8_t* source)
+{
+    return (uint64_t) readUInt32(source) | ((uint64_t) readUInt32(source + 4) << 32);
+}
+
+void nimbleServerTraceInit(NimbleServerTrace* self)
+{
+    self->writeCount = 0;
+    self->now = 0;
+}
+
+/// Sets the time that the following events are stamped with
+/// @param self trace
+/// @param now current server time
+void nimbleServerTraceSetTime(NimbleServerTrace* self, MonotonicTimeMs now)
+{
+    self->now = now;
+}
+
+/// Records an event, overwriting the oldest one if the ring is full.
+/// @param self trace
+/// @param type type of event
+/// @param target connection index, party id or participant id, depending on the type
+/// @param detail type specific detail
+/// @param value type specific value
+void nimbleServerTraceAdd(NimbleServerTrace* self, NimbleServerTraceEventType type, uint8_t target, uint16_t detail,
+                          uint32_t value)
+{
+    // Only this thread writes the writeCount, so it can be read without an acquire
+    size_t writeCount = self->writeCount;
+    NimbleServerTraceEvent* event = &self->events[writeCount & (NIMBLE_SERVER_TRACE_EVENT_COUNT - 1)];
+
+    event->timeMs = self->now;
+    event->type = (uint8_t) type;
+    event->target = target;
+    event->detail = detail;
+    event->value = value;
+
+    // Only counted after the event is complete, so a dump never includes a half written event as the newest
+    nimbleServerAtomicStoreRelease(&self->writeCount, writeCount + 1U);
+}
+
+/// Writes the events in the ring, oldest first, to target.
+/// Does not allocate or lock, so it can be called from a crash handler or another thread than the writer.
+/// @param self trace
+/// @param target where to write the dump. NIMBLE_SERVER_TRACE_MAX_DUMP_OCTET_COUNT is always enough.
+/// @param maxOctetCount octet count of target
+/// @return the number of octets written or negative on error
+int nimbleServerTraceDump(const NimbleServerTrace* self, uint8_t* target, size_t maxOctetCount)
+{
+    size_t writeCount = nimbleServerAtomicLoadAcquire(&self->writeCount);
+    size_t eventCount = writeCount < NIMBLE_SERVER_TRACE_EVENT_COUNT ? writeCount : NIMBLE_SERVER_TRACE_EVENT_COUNT;
+    size_t octetCount = NIMBLE_SERVER_TRACE_HEADER_OCTET_COUNT + eventCount * NIMBLE_SERVER_TRACE_EVENT_OCTET_COUNT;
+    if (octetCount > maxOctetCount) {
+        return NimbleServerErrTrace;
+    }
+
+    tc_memcpy_octets(target, traceMagic, sizeof(traceMagic));
+    writeUInt32(target + 8, NIMBLE_SERVER_TRACE_VERSION);
+    writeUInt32(target + 12, (uint32_t) eventCount);
+
+    uint8_t* eventTarget = target + NIMBLE_SERVER_TRACE_HEADER_OCTET_COUNT;
+    for (size_t i = writeCount - eventCount; i < writeCount; ++i) {
+        const NimbleServerTraceEvent* event = &self->events[i & (NIMBLE_SERVER_TRACE_EVENT_COUNT - 1)];
+        writeUInt64(eventTarget, (uint64_t) event->timeMs);
+        eventTarget[8] = event->type;
+        eventTarget[9] = event->target;
+        writeUInt16(eventTarget + 10, event->detail);
+        writeUInt32(eventTarget + 12, event->value);
+        eventTarget += NIMBLE_SERVER_TRACE_EVENT_OCTET_COUNT;
+    }
+
+    return (int) octetCount;
+}
+
+/// Initializes a reader for a complete trace dump in memory
+/// @param self reader
+/// @param octets trace dump
+/// @param octetCount octet count of the trace dump
+/// @return negative if it is not a supported trace dump
+int nimbleServerTraceReaderInit(NimbleServerTraceReader* self, const uint8_t* octets, size_t octetCount)
+{
+    if (octetCount < NIMBLE_SERVER_TRACE_HEADER_OCTET_COUNT) {
+        return NimbleServerErrTrace;
+    }
+
+    for (size_t i = 0; i < sizeof(traceMagic); ++i) {
+        if (octets[i] != traceMagic[i]) {
+            return NimbleServerErrTrace;
+        }
+    }
+
+    if (readUInt32(octets + 8) != NIMBLE_SERVER_TRACE_VERSION) {
+        return NimbleServerErrTrace;
+    }
+
+    size_t eventCount = readUInt32(octets + 12);
+    if (eventCount > (octetCount - NIMBLE_SERVER_TRACE_HEADER_OCTET_COUNT) / NIMBLE_SERVER_TRACE_EVENT_OCTET_COUNT) {
+        return NimbleServerErrTrace;
+    }
+
+    self->octets = octets + NIMBLE_SERVER_TRACE_HEADER_OCTET_COUNT;
+    self->eventCount = eventCount;
+    self->index = 0;
+
+    return 0;
+}
+
+/// Reads the next event
+/// @param self reader
+/// @param[out] event the event that was read
+/// @return 1 if an event was read, 0 at the end of the dump and negative on error
+int nimbleServerTraceReaderRead(NimbleServerTraceReader* self, NimbleServerTraceEvent* event)
+{
+    if (self->index >= self->eventCount) {
+        return 0;
+    }
+
+    const uint8_t* source = self->octets + self->index * NIMBLE_SERVER_TRACE_EVENT_OCTET_COUNT;
+    if (source[8] >= NimbleServerTraceEventTypeCount) {
+        return NimbleServerErrTrace;
+    }
+
+    event->timeMs = (MonotonicTimeMs) readUInt64(source);
+    event->type = source[8];
+    event->target = source[9];
+    event->detail = readUInt16(source + 10);
+    event->value = readUInt32(source + 12);
+
+    self->index++;
+
+    return 1;
+}
+
+const char* nimbleServerTraceEventTypeToString(NimbleServerTraceEventType type)
+{
+    switch (type) {
+        case NimbleServerTraceEventTypeDatagramIn:
+            return "datagram in";
+        case NimbleServerTraceEventTypeDatagramOut:
+            return "datagram out";
+        case NimbleServerTraceEventTypeStepComposed:
+            return "step composed";
+        case NimbleServerTraceEventTypeForcedStep:
+            return "forced step";
+        case NimbleServerTraceEventTypePartyJoined:
+            return "party joined";
+        case NimbleServerTraceEventTypePartyStateChanged:
+            return "party state";
+        case NimbleServerTraceEventTypeBlobChunkSent:
+            return "blob chunk sent";
+        case NimbleServerTraceEventTypeUpdateQualityChanged:
+            return "update quality";
+        case NimbleServerTraceEventTypeCount:
+            break;
+    }
+
+    return "unknown";
+}
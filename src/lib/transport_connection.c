@@ -3,41 +3,123 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
+#include <imprint/allocator.h>
 #include <nimble-server/transport_connection.h>
 
 /// Initializes a transport connection
 /// Holds information for a specified connection in the transport
 /// @param self transport connection
-/// @param blobStreamAllocator allocator for the blob stream
+/// @param downloadAllocator allocator for the game state download, it is only allocated when requested. It may return
+/// NULL, e.g. when a memory budget is exceeded.
+/// @param maxGameStateOctetSize maximum octet count of a game state download
+/// @param rateLimitSetup ingress limits for the connection
+/// @param maxStepRangeOctetCountPerReply maximum octets of authoritative steps in each reply, zero for no limit
+/// @param now current time
 /// @param log target logging
-void transportConnectionInit(NimbleServerTransportConnection* self, ImprintAllocatorWithFree* blobStreamAllocator,
-                             size_t maxGameStateOctetSize, Clog log)
+void transportConnectionInit(NimbleServerTransportConnection* self, ImprintAllocatorWithFree* downloadAllocator,
+                             size_t maxGameStateOctetSize, const NimbleServerRateLimitSetup* rateLimitSetup,
+                             size_t maxStepRangeOctetCountPerReply, MonotonicTimeMs now, Clog log)
 {
+    transportConnectionFreeDownload(self);
     self->log = log;
 
     orderedDatagramOutLogicInit(&self->orderedDatagramOutLogic);
     orderedDatagramInLogicInit(&self->orderedDatagramInLogic);
-    CLOG_C_DEBUG(&self->log, "transport connection allocating for maxGameState: %zu", maxGameStateOctetSize)
-    nimbleServerGameStateInit(&self->gameState, &blobStreamAllocator->allocator, maxGameStateOctetSize);
 
     self->nextBlobStreamOutChannel = 127;
-    self->blobStreamOutAllocator = blobStreamAllocator;
+    self->downloadAllocator = downloadAllocator;
+    self->maxGameStateOctetCount = maxGameStateOctetSize;
     self->debugCounter = 0;
-    self->isUsed = true;
+    self->hot->isUsed[self->transportConnectionId] = true;
+    self->isSpectator = false;
     self->noRangesToSendCounter = 0;
     self->phase = NbTransportConnectionPhaseIdle;
     self->blobStreamOutClientRequestId = 0;
     self->useDebugStreams = true;
+    self->hasConnectRequest = false;
 
     statsIntInit(&self->stepsBehindStats, 60);
+    nimbleServerRateLimitInit(transportConnectionRateLimit(self), rateLimitSetup, now);
+    nimbleServerRoundTripTimeInit(&self->roundTripTime);
+    nimbleServerRedundancyInit(&self->redundancy, maxStepRangeOctetCountPerReply);
+    self->stepEncoding = NimbleServerStepEncodingNormal;
 }
 
 void transportConnectionDisconnect(NimbleServerTransportConnection* self)
 {
     CLOG_C_DEBUG(&self->log, "disconnecting transport connection %hhu", self->id)
-    self->isUsed = false;
+    transportConnectionFreeDownload(self);
+    self->hot->isUsed[self->transportConnectionId] = false;
+    self->hasConnectRequest = false;
     self->phase = NbTransportConnectionPhaseDisconnected;
 }
+
+/// Checks if the transport connection is in use
+/// @param self transport connection
+/// @return true if the connection is in use
+bool transportConnectionIsUsed(const NimbleServerTransportConnection* self)
+{
+    return self->hot->isUsed[self->transportConnectionId];
+}
+
+/// Gets the ingress rate limit of the transport connection
+/// @param self transport connection
+/// @return the rate limit, in the dense rate limit array of the server
+NimbleServerRateLimit* transportConnectionRateLimit(NimbleServerTransportConnection* self)
+{
+    return &self->hot->rateLimits[self->transportConnectionId];
+}
+
+/// Prepares a new game state download. The download state is allocated the first time, and the blob stream of a
+/// previous download is destroyed.
+/// @param self transport connection
+/// @return the download state, or zero if it could not be allocated
+NimbleServerTransportConnectionDownload* transportConnectionPrepareDownload(NimbleServerTransportConnection* self)
+{
+    NimbleServerTransportConnectionDownload* download = self->download;
+    if (download == 0) {
+        CLOG_C_DEBUG(&self->log, "transport connection allocating download for maxGameState: %zu",
+                     self->maxGameStateOctetCount)
+        download = IMPRINT_ALLOC_TYPE(&self->downloadAllocator->allocator,
+                                      NimbleServerTransportConnectionDownload);
+        if (download == 0) {
+            return 0;
+        }
+        nimbleServerGameStateInit(&download->gameState, &self->downloadAllocator->allocator,
+                                  self->maxGameStateOctetCount);
+        if (download->gameState.state == 0) {
+            IMPRINT_FREE(self->downloadAllocator, download);
+            return 0;
+        }
+        download->hasBlobStreamOut = false;
+        self->download = download;
+    }
+
+    if (download->hasBlobStreamOut) {
+        blobStreamOutDestroy(&download->blobStreamOut);
+        download->hasBlobStreamOut = false;
+    }
+
+    return download;
+}
+
+/// Frees the game state download, if any
+/// @param self transport connection
+void transportConnectionFreeDownload(NimbleServerTransportConnection* self)
+{
+    NimbleServerTransportConnectionDownload* download = self->download;
+    if (download == 0) {
+        return;
+    }
+
+    if (download->hasBlobStreamOut) {
+        blobStreamOutDestroy(&download->blobStreamOut);
+    }
+    IMPRINT_FREE(self->downloadAllocator, download->gameState.state);
+    IMPRINT_FREE(self->downloadAllocator, download);
+    self->download = 0;
+    self->blobStreamOutClientRequestId = 0;
+}
 /// sets the latest authoritative state tick id
 /// @param self transport connection
 void transportConnectionSetGameStateTickId(NimbleServerTransportConnection* self)
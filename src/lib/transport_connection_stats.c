@@ -16,12 +16,18 @@ static void showStats(NimbleServerTransportConnection* transportConnection)
 
     if (party) {
         tc_snprintf(debug, DEBUG_COUNT, "server: conn %u step count in incoming buffer", party->id);
-        statsIntDebug(&party->incomingStepCountInBufferStats, &transportConnection->log, debug, "steps");
+        statsIntDebug(&party->cold->incomingStepCountInBufferStats, &transportConnection->log, debug, "steps");
     }
 
     tc_snprintf(debug, DEBUG_COUNT, "server: conn %d steps behind authoritative (latency)",
                 transportConnection->transportConnectionId);
     statsIntDebug(&transportConnection->stepsBehindStats, &transportConnection->log, debug, "steps");
+
+    NimbleServerRoundTripTimeSummary roundTripTime;
+    nimbleServerRoundTripTimeSummarize(&transportConnection->roundTripTime, &roundTripTime);
+    CLOG_C_INFO(&transportConnection->log, "server: conn %d round trip time %u ms (variance %u ms, ping jitter %u ms)",
+                transportConnection->transportConnectionId, roundTripTime.smoothedMs, roundTripTime.varianceMs,
+                roundTripTime.pingJitterMs)
 }
 
 /// Update stats for the transport connection.
@@ -33,13 +39,16 @@ void nimbleServerTransportConnectionUpdateStats(NimbleServerTransportConnection*
 {
     NimbleServerLocalParty* party = transportConnection->assignedParty;
     if (party != 0) {
-        statsIntAdd(&party->incomingStepCountInBufferStats, (int) party->stepsInBufferCount);
+        statsIntAdd(&party->cold->incomingStepCountInBufferStats, (int) party->stepsInBufferCount);
     }
 
+    nimbleServerRoundTripTimeStepsAcknowledged(&transportConnection->roundTripTime, clientWaitingForStepId,
+                                               foundGame->now);
+
     size_t stepsBehindForClient = foundGame->authoritativeSteps.expectedWriteId - clientWaitingForStepId;
     statsIntAdd(&transportConnection->stepsBehindStats, (int) stepsBehindForClient);
 
-    if ((transportConnection->debugCounter++ % 3000) == 0) {
+    if ((transportConnection->debugCounter++ % 3000) == 0 && foundGame->tuning.outputStats) {
         showStats(transportConnection);
     }
 }
@@ -6,28 +6,88 @@
 #include <nimble-server/update_quality.h>
 #include <clog/clog.h>
 
-void nimbleServerUpdateQualityInit(NimbleServerUpdateQuality* self, size_t targetTimeMs)
+/// Initializes the update quality
+/// @param self update quality
+/// @param targetTimeMs the tick time that the server should keep up with
+/// @param now current server time
+void nimbleServerUpdateQualityInit(NimbleServerUpdateQuality* self, size_t targetTimeMs, MonotonicTimeMs now)
 {
     self->targetTimeMs = targetTimeMs;
-    nimbleServerUpdateQualityReInit(self);
+    nimbleServerUpdateQualityReInit(self, now);
 }
 
-void nimbleServerUpdateQualityReInit(NimbleServerUpdateQuality* self)
+static void resetMeasurements(NimbleServerUpdateQuality* self)
 {
     statsIntInit(&self->measuredDeltaTimeMsStat, 10);
     self->deltaTickTimeFailedInARow = 0;
     self->averageTickTimeFailedInARow = 0;
-    self->lastTimeMs = monotonicTimeMsNow();
+    self->stableTicksInARow = 0;
+}
+
+/// Resets the measurements and goes back to the working state
+/// @param self update quality
+/// @param now current server time
+void nimbleServerUpdateQualityReInit(NimbleServerUpdateQuality* self, MonotonicTimeMs now)
+{
+    resetMeasurements(self);
+    self->lastTimeMs = now;
     self->state = NimbleServerUpdateQualityStateWorking;
 }
 
-int nimbleServerUpdateQualityTick(NimbleServerUpdateQuality* self)
+/// Moves to the next, more degraded, state. If there is no degraded state left to try, it moves to a failed state.
+/// @param self update quality
+/// @param failedState the failed state to use if there are no more degraded states left
+/// @return negative if the server should be stopped
+static int degrade(NimbleServerUpdateQuality* self, NimbleServerUpdateQualityState failedState)
 {
-    if (self->state != NimbleServerUpdateQualityStateWorking) {
-        return -1;
+    resetMeasurements(self);
+
+    switch (self->state) {
+        case NimbleServerUpdateQualityStateWorking:
+            CLOG_NOTICE("failed to update host with a stable tick rate. shedding non-critical work.")
+            self->state = NimbleServerUpdateQualityStateDegradedShedding;
+            return 0;
+        case NimbleServerUpdateQualityStateDegradedShedding:
+            CLOG_NOTICE("failed to update host with a stable tick rate. raising composition look-ahead.")
+            self->state = NimbleServerUpdateQualityStateDegradedLookAhead;
+            return 0;
+        default:
+            CLOG_NOTICE("failed to update host with a stable tick rate, even when degraded. stopping server.")
+            self->state = failedState;
+            return -1;
     }
+}
 
-    MonotonicTimeMs now = monotonicTimeMsNow();
+/// Moves back to a less degraded state after the tick rate has been stable for a while.
+/// @param self update quality
+static void recover(NimbleServerUpdateQuality* self)
+{
+    self->stableTicksInARow = 0;
+
+    switch (self->state) {
+        case NimbleServerUpdateQualityStateDegradedLookAhead:
+            CLOG_NOTICE("tick rate is stable again, lowering composition look-ahead")
+            self->state = NimbleServerUpdateQualityStateDegradedShedding;
+            break;
+        case NimbleServerUpdateQualityStateDegradedShedding:
+            CLOG_NOTICE("tick rate is stable again, resuming non-critical work")
+            self->state = NimbleServerUpdateQualityStateWorking;
+            break;
+        default:
+            break;
+    }
+}
+
+/// Measures the time since the previous tick, and degrades or recovers the state
+/// @param self update quality
+/// @param now current server time, the same time that is passed to nimbleServerUpdate()
+/// @return negative if the server should be stopped
+int nimbleServerUpdateQualityTick(NimbleServerUpdateQuality* self, MonotonicTimeMs now)
+{
+    if (self->state == NimbleServerUpdateQualityStateFailedTickTime ||
+        self->state == NimbleServerUpdateQualityStateFailedAverageTickTime) {
+        return -1;
+    }
 
     CLOG_ASSERT(now >= self->lastTimeMs, "monotonic time is going backwards")
 
@@ -37,8 +97,11 @@ int nimbleServerUpdateQualityTick(NimbleServerUpdateQuality* self)
 
     self->lastTimeMs = now;
 
+    bool isStable = true;
+
     if (delta > self->targetTimeMs) {
         self->deltaTickTimeFailedInARow++;
+        isStable = false;
     } else {
         self->deltaTickTimeFailedInARow = 0;
     }
@@ -46,6 +109,7 @@ int nimbleServerUpdateQualityTick(NimbleServerUpdateQuality* self)
     if (self->measuredDeltaTimeMsStat.avgIsSet) {
         if (self->measuredDeltaTimeMsStat.avg > (int)self->targetTimeMs) {
             self->averageTickTimeFailedInARow++;
+            isStable = false;
         } else {
             self->averageTickTimeFailedInARow = 0;
         }
@@ -53,18 +117,54 @@ int nimbleServerUpdateQualityTick(NimbleServerUpdateQuality* self)
 
     const size_t FailedTickThreshold = 60;
     const size_t AverageThreshold = 50;
+    const size_t RecoverThreshold = 300;
 
     if (self->deltaTickTimeFailedInARow > FailedTickThreshold) {
-        self->state = NimbleServerUpdateQualityStateFailedTickTime;
-        CLOG_NOTICE("failed to update host with a stable tick rate. stopping server.")
-        return -1;
+        return degrade(self, NimbleServerUpdateQualityStateFailedTickTime);
     } else if (self->averageTickTimeFailedInARow > AverageThreshold) {
-        self->state = NimbleServerUpdateQualityStateFailedAverageTickTime;
-        CLOG_NOTICE("failed to update host with a stable average tick rate. stopping server.")
-        return -1;
+        return degrade(self, NimbleServerUpdateQualityStateFailedAverageTickTime);
+    }
+
+    if (isStable) {
+        self->stableTicksInARow++;
+        if (self->stableTicksInARow > RecoverThreshold) {
+            recover(self);
+        }
+    } else {
+        self->stableTicksInARow = 0;
     }
 
     //CLOG_VERBOSE("quality : tickFailed: %zu, avgFailed: %zu, avg: %d delta: %zu", self->deltaTickTimeFailedInARow, self->averageTickTimeFailedInARow, self->measuredDeltaTimeMsStat.avg, delta)
 
     return 0;
 }
+
+/// Checks if the server is currently shedding work or running with a raised composition look-ahead.
+/// @param self update quality
+/// @return true if in one of the degraded states
+bool nimbleServerUpdateQualityIsDegraded(const NimbleServerUpdateQuality* self)
+{
+    return self->state == NimbleServerUpdateQualityStateDegradedShedding ||
+           self->state == NimbleServerUpdateQualityStateDegradedLookAhead;
+}
+
+/// Returns a short description of the state, for logging
+/// @param state the state
+/// @return the description
+const char* nimbleServerUpdateQualityStateToString(NimbleServerUpdateQualityState state)
+{
+    switch (state) {
+        case NimbleServerUpdateQualityStateWorking:
+            return "working";
+        case NimbleServerUpdateQualityStateDegradedShedding:
+            return "degraded (shedding)";
+        case NimbleServerUpdateQualityStateDegradedLookAhead:
+            return "degraded (look-ahead)";
+        case NimbleServerUpdateQualityStateFailedTickTime:
+            return "failed (tick time)";
+        case NimbleServerUpdateQualityStateFailedAverageTickTime:
+            return "failed (average tick time)";
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,77 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/varint.h>
+
+/// Writes an unsigned value, using one octet for values below 128
+/// @param outStream stream to write to
+/// @param value value to write
+/// @return negative on error
+int nimbleServerVarIntWrite(FldOutStream* outStream, uint32_t value)
+{
+    while (value >= 0x80) {
+        int err = fldOutStreamWriteUInt8(outStream, (uint8_t) (value | 0x80));
+        if (err < 0) {
+            return err;
+        }
+        value >>= 7;
+    }
+
+    return fldOutStreamWriteUInt8(outStream, (uint8_t) value);
+}
+
+/// Reads an unsigned value
+/// @param inStream stream to read from
+/// @param[out] value the read value
+/// @return negative on error
+int nimbleServerVarIntRead(FldInStream* inStream, uint32_t* value)
+{
+    uint32_t result = 0;
+    for (uint8_t i = 0; i < NIMBLE_SERVER_VARINT_MAX_OCTET_COUNT; ++i) {
+        uint8_t octet;
+        int err = fldInStreamReadUInt8(inStream, &octet);
+        if (err < 0) {
+            return err;
+        }
+        result |= (uint32_t) (octet & 0x7f) << (7U * i);
+        if ((octet & 0x80) == 0) {
+            *value = result;
+            return 0;
+        }
+    }
+
+    return NimbleServerErrSerialize;
+}
+
+/// Writes a signed value, zigzag encoded so small negative values also use one octet
+/// @param outStream stream to write to
+/// @param value value to write
+/// @return negative on error
+int nimbleServerVarIntWriteSigned(FldOutStream* outStream, int32_t value)
+{
+    uint32_t zigzag = value < 0 ? ((uint32_t) -(value + 1) << 1) | 1U : (uint32_t) value << 1;
+
+    return nimbleServerVarIntWrite(outStream, zigzag);
+}
+
+/// Reads a zigzag encoded signed value
+/// @param inStream stream to read from
+/// @param[out] value the read value
+/// @return negative on error
+int nimbleServerVarIntReadSigned(FldInStream* inStream, int32_t* value)
+{
+    uint32_t zigzag;
+    int err = nimbleServerVarIntRead(inStream, &zigzag);
+    if (err < 0) {
+        return err;
+    }
+
+    *value = (zigzag & 1U) ? -(int32_t) (zigzag >> 1) - 1 : (int32_t) (zigzag >> 1);
+
+    return 0;
+}
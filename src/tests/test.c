@@ -3,10 +3,49 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
+#include "authoritative_steps.h"
+#include "send_authoritative_steps.h"
 #include "utest.h"
+#include <blob-stream/blob_stream_in.h>
+#include <blob-stream/blob_stream_logic_in.h>
+#include <datagram-transport/types.h>
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
 #include <imprint/default_setup.h>
+#include <nimble-serialize/client_out.h>
+#include <nimble-serialize/commands.h>
+#include <nimble-serialize/server_out.h>
+#include <nimble-server/capture.h>
+#include <nimble-server/compact_steps.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/forced_step.h>
+#include <nimble-server/ingest.h>
+#include <nimble-server/io.h>
+#include <nimble-server/journal.h>
+#include <nimble-server/local_parties.h>
 #include <nimble-server/local_party.h>
+#include <nimble-server/memory.h>
+#include <nimble-server/metrics.h>
+#include <nimble-server/participant.h>
+#include <nimble-server/profiler.h>
+#include <nimble-server/rate_limit.h>
+#include <nimble-server/redundancy.h>
+#include <nimble-server/relay.h>
+#include <nimble-server/round_trip_time.h>
 #include <nimble-server/server.h>
+#include <nimble-server/spectator_steps.h>
+#include <nimble-server/step_latency.h>
+#include <nimble-server/steps_pool.h>
+#include <nimble-server/trace.h>
+#include <nimble-server/transport_connection.h>
+#include <nimble-server/update_quality.h>
+#include <nimble-server/varint.h>
+#include <nimble-steps-serialize/pending_out_serialize.h>
+#include <string.h>
+
+#if !defined _WIN32
+#include <pthread.h>
+#endif
 
 UTEST(NimbleSteps, verifyHostMigration)
 {
@@ -71,3 +110,2081 @@ UTEST(NimbleSteps, verifyHostMigration)
         const NimbleServerLocalParty* party = &server.localParties.parties[i];
     }
 }
+
+UTEST(NimbleServer, verifyRateLimit)
+{
+    NimbleServerRateLimitSetup rateLimitSetup = {
+        .datagramsPerSecond = 40, .octetsPerSecond = 0, .predictedStepsPerSecond = 0};
+    NimbleServerRateLimit rateLimit;
+    nimbleServerRateLimitInit(&rateLimit, &rateLimitSetup, 0);
+
+    // A quarter of a second of burst is allowed
+    for (size_t i = 0; i < 10; ++i) {
+        ASSERT_TRUE(nimbleServerRateLimitAllowDatagram(&rateLimit, 1200));
+    }
+    ASSERT_FALSE(nimbleServerRateLimitAllowDatagram(&rateLimit, 1200));
+    ASSERT_EQ(1u, rateLimit.droppedDatagramCount);
+
+    // Disabled limits should always allow
+    ASSERT_TRUE(nimbleServerRateLimitAllowPredictedSteps(&rateLimit, 255));
+
+    nimbleServerRateLimitRefill(&rateLimit, 50);
+    ASSERT_TRUE(nimbleServerRateLimitAllowDatagram(&rateLimit, 1200));
+    ASSERT_TRUE(nimbleServerRateLimitAllowDatagram(&rateLimit, 1200));
+    ASSERT_FALSE(nimbleServerRateLimitAllowDatagram(&rateLimit, 1200));
+}
+
+static int tickUpdateQualityUntilStateChanges(NimbleServerUpdateQuality* quality, MonotonicTimeMs* now,
+                                              MonotonicTimeMs deltaMs, size_t maxTickCount)
+{
+    NimbleServerUpdateQualityState startState = quality->state;
+    for (size_t i = 0; i < maxTickCount; ++i) {
+        *now += deltaMs;
+        int result = nimbleServerUpdateQualityTick(quality, *now);
+        if (result < 0 || quality->state != startState) {
+            return result;
+        }
+    }
+    return 1;
+}
+
+UTEST(NimbleServer, verifyUpdateQualityDegradesAndRecoversInStages)
+{
+    MonotonicTimeMs now = 1000;
+    NimbleServerUpdateQuality quality;
+    nimbleServerUpdateQualityInit(&quality, 16, now);
+
+    ASSERT_EQ(1, tickUpdateQualityUntilStateChanges(&quality, &now, 16, 400));
+    ASSERT_EQ(NimbleServerUpdateQualityStateWorking, quality.state);
+
+    ASSERT_EQ(0, tickUpdateQualityUntilStateChanges(&quality, &now, 40, 100));
+    ASSERT_EQ(NimbleServerUpdateQualityStateDegradedShedding, quality.state);
+    ASSERT_TRUE(nimbleServerUpdateQualityIsDegraded(&quality));
+
+    ASSERT_EQ(0, tickUpdateQualityUntilStateChanges(&quality, &now, 40, 100));
+    ASSERT_EQ(NimbleServerUpdateQualityStateDegradedLookAhead, quality.state);
+
+    // A stable tick rate recovers one stage at a time
+    ASSERT_EQ(0, tickUpdateQualityUntilStateChanges(&quality, &now, 10, 400));
+    ASSERT_EQ(NimbleServerUpdateQualityStateDegradedShedding, quality.state);
+
+    ASSERT_EQ(0, tickUpdateQualityUntilStateChanges(&quality, &now, 40, 100));
+    ASSERT_EQ(NimbleServerUpdateQualityStateDegradedLookAhead, quality.state);
+
+    // No degraded stage is left to try
+    ASSERT_EQ(-1, tickUpdateQualityUntilStateChanges(&quality, &now, 40, 100));
+    ASSERT_FALSE(nimbleServerUpdateQualityIsDegraded(&quality));
+    ASSERT_EQ(-1, nimbleServerUpdateQualityTick(&quality, now + 16));
+
+    nimbleServerUpdateQualityReInit(&quality, now);
+    ASSERT_EQ(NimbleServerUpdateQualityStateWorking, quality.state);
+}
+
+UTEST(NimbleServer, verifyProfilerHistogram)
+{
+    NimbleServerProfilerHistogram histogram;
+    nimbleServerProfilerHistogramReset(&histogram);
+
+    for (uint64_t i = 1; i <= 100; ++i) {
+        nimbleServerProfilerHistogramAdd(&histogram, i * 1000);
+    }
+
+    ASSERT_EQ(100u, histogram.count);
+    ASSERT_EQ(100000u, histogram.maxNs);
+
+    // Buckets have a relative error of at most 25%
+    uint64_t p50 = nimbleServerProfilerHistogramPercentile(&histogram, 50);
+    ASSERT_TRUE(p50 >= 50000u && p50 <= 62500u);
+    ASSERT_EQ(100000u, nimbleServerProfilerHistogramPercentile(&histogram, 99));
+}
+
+typedef struct CaptureBuffer {
+    uint8_t octets[256];
+    size_t octetCount;
+} CaptureBuffer;
+
+static int writeToCaptureBuffer(void* self_, const uint8_t* octets, size_t octetCount)
+{
+    CaptureBuffer* self = (CaptureBuffer*) self_;
+    if (self->octetCount + octetCount > sizeof(self->octets)) {
+        return -1;
+    }
+    for (size_t i = 0; i < octetCount; ++i) {
+        self->octets[self->octetCount++] = octets[i];
+    }
+    return 0;
+}
+
+UTEST(NimbleServer, verifyCaptureRoundTrip)
+{
+    CaptureBuffer buffer;
+    buffer.octetCount = 0;
+
+    NimbleServerCapture capture;
+    nimbleServerCaptureInit(&capture);
+    NimbleServerCaptureOut out = {.self = &buffer, .write = writeToCaptureBuffer};
+    ASSERT_EQ(0, nimbleServerCaptureStart(&capture, out));
+
+    const uint8_t datagram[] = {0x01, 0x02, 0x03};
+    ASSERT_EQ(0, nimbleServerCaptureRecord(&capture, NimbleServerCaptureRecordTypeUpdate, 0, 16, 0, 0));
+    ASSERT_EQ(0, nimbleServerCaptureRecord(&capture, NimbleServerCaptureRecordTypeIn, 7, 16, datagram, 3));
+    size_t octetCountRemainder = buffer.octetCount % 8;
+    ASSERT_EQ((size_t) 0, octetCountRemainder);
+
+    NimbleServerCaptureReader reader;
+    ASSERT_EQ(0, nimbleServerCaptureReaderInit(&reader, buffer.octets, buffer.octetCount));
+
+    NimbleServerCaptureRecord record;
+    ASSERT_EQ(1, nimbleServerCaptureReaderRead(&reader, &record));
+    ASSERT_EQ(NimbleServerCaptureRecordTypeUpdate, record.type);
+    ASSERT_EQ(16, record.timeMs);
+
+    ASSERT_EQ(1, nimbleServerCaptureReaderRead(&reader, &record));
+    ASSERT_EQ(NimbleServerCaptureRecordTypeIn, record.type);
+    ASSERT_EQ(7, record.connectionIndex);
+    ASSERT_EQ(3u, record.octetCount);
+    ASSERT_EQ(0x03, record.octets[2]);
+
+    ASSERT_EQ(0, nimbleServerCaptureReaderRead(&reader, &record));
+}
+
+UTEST(NimbleServer, verifyTraceRingDump)
+{
+    static NimbleServerTrace trace;
+    nimbleServerTraceInit(&trace);
+
+    for (size_t i = 0; i < NIMBLE_SERVER_TRACE_EVENT_COUNT + 2; ++i) {
+        nimbleServerTraceSetTime(&trace, (MonotonicTimeMs) i);
+        nimbleServerTraceAdd(&trace, NimbleServerTraceEventTypeStepComposed, 0, 12, (uint32_t) i);
+    }
+
+    static uint8_t dump[NIMBLE_SERVER_TRACE_MAX_DUMP_OCTET_COUNT];
+    ASSERT_EQ(NIMBLE_SERVER_TRACE_MAX_DUMP_OCTET_COUNT, nimbleServerTraceDump(&trace, dump, sizeof(dump)));
+
+    NimbleServerTraceReader reader;
+    ASSERT_EQ(0, nimbleServerTraceReaderInit(&reader, dump, sizeof(dump)));
+
+    NimbleServerTraceEvent event;
+    ASSERT_EQ(1, nimbleServerTraceReaderRead(&reader, &event));
+    ASSERT_EQ(NimbleServerTraceEventTypeStepComposed, event.type);
+    ASSERT_EQ(2u, event.value);
+    ASSERT_EQ(2, event.timeMs);
+    ASSERT_EQ(12, event.detail);
+
+    for (size_t i = 1; i < NIMBLE_SERVER_TRACE_EVENT_COUNT; ++i) {
+        ASSERT_EQ(1, nimbleServerTraceReaderRead(&reader, &event));
+    }
+    ASSERT_EQ((uint32_t) NIMBLE_SERVER_TRACE_EVENT_COUNT + 1, event.value);
+    ASSERT_EQ(0, nimbleServerTraceReaderRead(&reader, &event));
+}
+
+/// Server setup that the tests share, the tests set the fields that they exercise on the returned setup
+/// @param imprintSetup memory for the server
+/// @param maxParticipantCount maximum number of participants in the game
+/// @param maxSpectatorCount maximum number of spectators, zero for none
+/// @return server setup
+static NimbleServerSetup testServerSetup(ImprintDefaultSetup* imprintSetup, size_t maxParticipantCount,
+                                         size_t maxSpectatorCount)
+{
+    NimbleServerSetup setup = {.memory = &imprintSetup->tagAllocator.info,
+                               .blobAllocator = &imprintSetup->slabAllocator.info,
+                               .maxConnectionCount = 16,
+                               .maxParticipantCount = maxParticipantCount,
+                               .maxSingleParticipantStepOctetCount = 8,
+                               .maxParticipantCountForEachConnection = 1,
+                               .maxGameStateOctetCount = 32,
+                               .targetTickTimeMs = 16,
+                               .maxSpectatorCount = maxSpectatorCount,
+                               .log.config = &g_clog,
+                               .log.constantPrefix = "server"};
+    return setup;
+}
+
+/// Initializes the server and starts a game
+/// @param server server to initialize
+/// @param setup server setup
+/// @param stepId first authoritative step of the game
+/// @param now current time
+/// @return negative on error
+static int initTestServer(NimbleServer* server, NimbleServerSetup setup, StepId stepId, MonotonicTimeMs now)
+{
+    int err = nimbleServerInit(server, setup);
+    if (err < 0) {
+        return err;
+    }
+
+    return nimbleServerReInitWithGame(server, stepId, now);
+}
+
+UTEST(NimbleServer, verifyPrometheusMetrics)
+{
+    static NimbleServerMetrics metrics;
+    metrics.authoritativeStepsPerSecond = 62;
+    metrics.partyCount = 1;
+    metrics.parties[0].partyId = 3;
+    metrics.parties[0].forcedStepInRowCount = 7;
+    metrics.parties[0].stepLatency.committedCount = 4;
+    metrics.parties[0].stepLatency.maxWaitStepCount = 2;
+
+    static char text[16 * 1024];
+    int octetCount = nimbleServerMetricsWritePrometheus(&metrics, "match", text, sizeof(text));
+    ASSERT_GT(octetCount, 0);
+    ASSERT_TRUE(strstr(text, "nimble_server_authoritative_steps_per_second{session=\"match\"} 62\n") != 0);
+    ASSERT_TRUE(strstr(text, "nimble_server_party_forced_steps_in_a_row{session=\"match\",party=\"3\"} 7\n") != 0);
+
+    // Every sample of a metric family follows its own header
+    const char* secondsCount = strstr(text,
+                                      "nimble_server_party_step_wait_seconds_count{session=\"match\",party=\"3\"} 4\n");
+    const char* stepsHeader = strstr(text, "# TYPE nimble_server_party_step_wait_steps gauge\n");
+    const char* stepsMax =
+        strstr(text, "nimble_server_party_step_wait_steps{session=\"match\",party=\"3\",stat=\"max\"} 2\n");
+    ASSERT_TRUE(secondsCount != 0 && stepsHeader != 0 && stepsMax != 0);
+    ASSERT_TRUE(secondsCount < stepsHeader);
+    ASSERT_TRUE(stepsHeader < stepsMax);
+    ASSERT_TRUE(strstr(stepsHeader, "nimble_server_party_step_wait_seconds") == 0);
+
+    ASSERT_LT(nimbleServerMetricsWritePrometheus(&metrics, "match", text, 64), 0);
+
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, 4, 0);
+    NimbleServer server;
+    ASSERT_EQ(0, initTestServer(&server, setup, 0x40, 2000));
+
+    nimbleServerMetricsSnapshot(&server, &metrics);
+    ASSERT_EQ(2000, metrics.timeMs);
+    ASSERT_EQ(0x3FU, metrics.lastAuthoritativeStepId);
+    ASSERT_EQ(0U, metrics.connectionCount);
+    ASSERT_EQ(0U, metrics.partyCount);
+    ASSERT_EQ(0U, metrics.participantMetricsCount);
+    ASSERT_LT(0U, metrics.memory.total.octetCount);
+
+    octetCount = nimbleServerMetricsWritePrometheus(&metrics, "match", text, sizeof(text));
+    ASSERT_GT(octetCount, 0);
+    ASSERT_TRUE(strstr(text, "nimble_server_authoritative_step_id{session=\"match\"} 63\n") != 0);
+    ASSERT_TRUE(strstr(text, "nimble_server_party_forced_steps_in_a_row{session=\"match\",party=") == 0);
+}
+
+UTEST(NimbleServer, verifyStepArrivalToCommitLatency)
+{
+    NimbleServerStepArrivals arrivals;
+    nimbleServerStepArrivalsReset(&arrivals);
+    nimbleServerStepArrivalsAdd(&arrivals, 0x120, 0x11C, 1000);
+
+    NimbleServerStepArrival arrival;
+    ASSERT_FALSE(nimbleServerStepArrivalsFind(&arrivals, 0x120 + NIMBLE_SERVER_STEP_ARRIVAL_WINDOW, &arrival));
+    ASSERT_TRUE(nimbleServerStepArrivalsFind(&arrivals, 0x120, &arrival));
+
+    NimbleServerStepLatency latency;
+    nimbleServerStepLatencyReset(&latency);
+    nimbleServerStepLatencyAddCommitted(&latency, &arrival, 0x120, 1064);
+    nimbleServerStepLatencyAddMissed(&latency);
+
+    NimbleServerStepLatencySummary summary;
+    nimbleServerStepLatencySummarize(&latency, &summary);
+    ASSERT_EQ(1u, summary.committedCount);
+    ASSERT_EQ(1u, summary.missedCount);
+    ASSERT_EQ(4u, summary.minWaitStepCount);
+    ASSERT_EQ(4u, summary.maxWaitStepCount);
+    ASSERT_EQ(64u, summary.waitTimeP50Ms);
+}
+
+UTEST(NimbleServer, verifyRoundTripTimeFromStepAcknowledgements)
+{
+    NimbleServerRoundTripTime roundTripTime;
+    nimbleServerRoundTripTimeInit(&roundTripTime);
+    ASSERT_EQ(500u, nimbleServerRoundTripTimeTimeoutMs(&roundTripTime, 500));
+
+    nimbleServerRoundTripTimeStepsSent(&roundTripTime, 0x40, 2, 1000);
+    // Redundant resends must keep the first send time
+    nimbleServerRoundTripTimeStepsSent(&roundTripTime, 0x40, 3, 1016);
+    nimbleServerRoundTripTimeStepsAcknowledged(&roundTripTime, 0x42, 1080);
+    nimbleServerRoundTripTimeStepsAcknowledged(&roundTripTime, 0x42, 1200);
+
+    NimbleServerRoundTripTimeSummary summary;
+    nimbleServerRoundTripTimeSummarize(&roundTripTime, &summary);
+    ASSERT_EQ(1u, summary.sampleCount);
+    ASSERT_EQ(80u, summary.smoothedMs);
+    ASSERT_EQ(40u, summary.varianceMs);
+    ASSERT_EQ(80u + 4u * 40u, nimbleServerRoundTripTimeTimeoutMs(&roundTripTime, 500));
+
+    nimbleServerRoundTripTimeStepsAcknowledged(&roundTripTime, 0x43, 1056);
+    nimbleServerRoundTripTimeSummarize(&roundTripTime, &summary);
+    ASSERT_EQ(2u, summary.sampleCount);
+    ASSERT_EQ(40u, summary.latestMs);
+    ASSERT_EQ(75u, summary.smoothedMs);
+}
+
+UTEST(NimbleServer, verifyRedundancyFollowsLoss)
+{
+    NimbleServerRedundancy redundancy;
+    nimbleServerRedundancyInit(&redundancy, 0);
+    for (size_t i = 0; i < 64; ++i) {
+        nimbleServerRedundancyDatagramReceived(&redundancy, 0);
+    }
+    ASSERT_EQ((size_t) NIMBLE_SERVER_REDUNDANCY_MIN_STEP_COUNT, nimbleServerRedundancyStepCount(&redundancy, 20));
+
+    for (size_t i = 0; i < 64; ++i) {
+        nimbleServerRedundancyDatagramReceived(&redundancy, i % 2);
+    }
+    ASSERT_GE(nimbleServerRedundancyLossPermille(&redundancy), 300u);
+    ASSERT_EQ(20u, nimbleServerRedundancyStepCount(&redundancy, 20));
+    ASSERT_EQ(128u, redundancy.receivedDatagramCount);
+
+    // A burst of loss is capped to 16 samples, and the received datagram is still a sample after it
+    NimbleServerRedundancy burst;
+    nimbleServerRedundancyInit(&burst, 0);
+    nimbleServerRedundancyDatagramReceived(&burst, 40);
+    ASSERT_EQ(603u, nimbleServerRedundancyLossPermille(&burst));
+    ASSERT_EQ(40u, burst.lostDatagramCount);
+}
+
+static int initStepRangeServer(NimbleServer* server, ImprintDefaultSetup* imprintSetup, StepId firstStepId,
+                               size_t stepCount)
+{
+    NimbleServerSetup setup = testServerSetup(imprintSetup, 4, 0);
+    int err = initTestServer(server, setup, firstStepId, 1000);
+    if (err < 0) {
+        return err;
+    }
+
+    for (StepId stepId = firstStepId; stepId < firstStepId + stepCount; ++stepId) {
+        uint8_t step[8] = {(uint8_t) stepId, 0xca, 0xfe};
+        err = nbsStepsWrite(&server->game.authoritativeSteps, stepId, step, sizeof(step));
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static NimbleServerTransportConnection* initStepRangeConnection(NimbleServer* server, size_t index,
+                                                                size_t maxStepRangeOctetCountPerReply)
+{
+    NimbleServerTransportConnection* transportConnection = &server->transportConnections[index];
+    transportConnectionInit(transportConnection, &server->downloadAllocator.allocator, 32,
+                            &server->setup.ingressRateLimit, maxStepRangeOctetCountPerReply, server->now,
+                            server->log);
+    return transportConnection;
+}
+
+static size_t stepHeaderOctetCount(void)
+{
+    uint8_t octets[32];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    Clog log = {.config = &g_clog, .constantPrefix = "header"};
+    nimbleSerializeServerOutStepHeader(&outStream, 0, 0, 0, &log);
+    return outStream.pos;
+}
+
+UTEST(NimbleServer, verifyStepRangeReplyIsCappedAndSkipsStepsInFlight)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+    ASSERT_EQ(0, initStepRangeServer(&server, &imprintSetup, 100, 30));
+    ASSERT_EQ(20u, server.game.tuning.maxRedundancyStepCount);
+
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+
+    // The range is shrunk until it fits in maxStepRangeOctetCountPerReply
+    NimbleServerTransportConnection* capped = initStepRangeConnection(&server, 1, 40);
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_LE(0, nimbleServerSendStepRanges(&outStream, capped, &server.game, 100));
+    ASSERT_LE(outStream.pos - stepHeaderOctetCount(), 40u);
+    ASSERT_LT(capped->roundTripTime.highestSentStepId, 100u + 19u);
+
+    NimbleServerTransportConnection* transportConnection = initStepRangeConnection(&server, 0, 0);
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_LE(0, nimbleServerSendStepRanges(&outStream, transportConnection, &server.game, 100));
+    ASSERT_EQ(119u, transportConnection->roundTripTime.highestSentStepId);
+    ASSERT_LT(40u, outStream.pos - stepHeaderOctetCount());
+
+    // Round trip time of 50 ms, so the steps are in flight for 150 ms
+    nimbleServerRoundTripTimeStepsAcknowledged(&transportConnection->roundTripTime, 101, 1050);
+    ASSERT_EQ(150u, nimbleServerRoundTripTimeTimeoutMs(&transportConnection->roundTripTime, 0));
+
+    // Step 101 is still in flight, so only the minimum redundancy of the sent steps is resent
+    server.game.now = 1060;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_LE(0, nimbleServerSendStepRanges(&outStream, transportConnection, &server.game, 101));
+    size_t inFlightOctetCount = outStream.pos;
+    ASSERT_EQ(129u, transportConnection->roundTripTime.highestSentStepId);
+    ASSERT_EQ(0u, transportConnection->redundancy.retransmitCount);
+
+    // Step 101 is probably lost, so everything from it is resent, up to maxRedundancyStepCount steps
+    server.game.now = 1300;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_LE(0, nimbleServerSendStepRanges(&outStream, transportConnection, &server.game, 101));
+    ASSERT_EQ(20u, transportConnection->redundancy.retransmitCount);
+    ASSERT_LT(inFlightOctetCount, outStream.pos);
+}
+
+UTEST(NimbleServer, verifyStepRangeFarBehindTheSentStepsIsShrunkWithoutWrapping)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+    ASSERT_EQ(0, initStepRangeServer(&server, &imprintSetup, 100, 30));
+
+    // All steps are sent, and the client still waits for the first one, so the range starts far behind the first
+    // unsent step and the already sent steps to drop are more than the steps that are left in the range
+    NimbleServerTransportConnection* transportConnection = initStepRangeConnection(&server, 0, 40);
+    nimbleServerRoundTripTimeStepsSent(&transportConnection->roundTripTime, 100, 30, server.game.now);
+
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_LE(0, nimbleServerSendStepRanges(&outStream, transportConnection, &server.game, 100));
+    ASSERT_LE(outStream.pos - stepHeaderOctetCount(), 40u);
+    ASSERT_LT(stepHeaderOctetCount(), outStream.pos);
+    ASSERT_EQ(129u, transportConnection->roundTripTime.highestSentStepId);
+}
+
+UTEST(NimbleServer, verifyCompactStepsRoundTrip)
+{
+    // Participant 1 and 2 have normal steps, 5 and 6 have forced steps, 70 needs the id escape
+    const uint8_t previous[] = {4, 1, 2, 0xAA, 0xBB, 2, 1, 0x11, 0x85, 1, 0x86, 1};
+    const uint8_t step[] = {6, 1, 2, 0xAA, 0xBB, 2, 1, 0x12, 0x85, 1, 0x86, 1, 0x87, 1, 0xC6, 3, 9, 1, 0x42};
+
+    uint8_t octets[256];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_EQ(0, nimbleServerCompactStepsEncode(&outStream, previous, sizeof(previous), 0, 0));
+    size_t stepStart = outStream.pos;
+    ASSERT_EQ(0, nimbleServerCompactStepsEncode(&outStream, step, sizeof(step), previous, sizeof(previous)));
+    ASSERT_LT(outStream.pos - stepStart, sizeof(step));
+    size_t repeatStart = outStream.pos;
+    ASSERT_EQ(0, nimbleServerCompactStepsEncode(&outStream, step, sizeof(step), step, sizeof(step)));
+    ASSERT_EQ(1u, outStream.pos - repeatStart);
+
+    FldInStream inStream;
+    fldInStreamInit(&inStream, octets, outStream.pos);
+    uint8_t decodedPrevious[64];
+    uint8_t decoded[64];
+    uint8_t decodedRepeat[64];
+    int previousOctetCount = nimbleServerCompactStepsDecode(&inStream, 0, 0, decodedPrevious, sizeof(decodedPrevious));
+    ASSERT_EQ((int) sizeof(previous), previousOctetCount);
+    ASSERT_EQ(0, memcmp(previous, decodedPrevious, sizeof(previous)));
+    int octetCount = nimbleServerCompactStepsDecode(&inStream, decodedPrevious, (size_t) previousOctetCount, decoded,
+                                                    sizeof(decoded));
+    ASSERT_EQ((int) sizeof(step), octetCount);
+    ASSERT_EQ(0, memcmp(step, decoded, sizeof(step)));
+    ASSERT_EQ((int) sizeof(step), nimbleServerCompactStepsDecode(&inStream, decoded, (size_t) octetCount,
+                                                                 decodedRepeat, sizeof(decodedRepeat)));
+    ASSERT_EQ(0, memcmp(step, decodedRepeat, sizeof(step)));
+    ASSERT_EQ(outStream.pos, inStream.pos);
+}
+
+UTEST(NimbleServer, verifyCompactStepsSaveOctetsOnComposedSteps)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, 8, 0);
+    setup.maxSingleParticipantStepOctetCount = 4;
+    NimbleServer server;
+    ASSERT_EQ(0, initTestServer(&server, setup, 100, 0));
+
+    NimbleServerParticipant* participants[8];
+    for (size_t i = 0; i < 8; ++i) {
+        NimbleSerializeJoinGameRequestPlayer player = {.localIndex = 0};
+        NimbleServerLocalParty* party;
+        ASSERT_EQ(0, nimbleServerLocalPartiesCreate(&server.localParties, &server.game.participants,
+                                                    &server.transportConnections[i], &player, 100, 1, &party));
+        participants[i] = party->participantReferences.participantReferences[0];
+    }
+
+    // Each participant holds its input for eight steps, and a different participant changes input on each step
+    for (StepId stepId = 100; stepId < 124; ++stepId) {
+        for (size_t i = 0; i < 8; ++i) {
+            uint8_t step[4] = {(uint8_t) ((stepId + i) / 8), 0x00, 0x10, (uint8_t) i};
+            ASSERT_LE(0, nbsStepsWrite(&participants[i]->steps, stepId, step, sizeof(step)));
+        }
+    }
+    ASSERT_LT(16, nimbleServerComposeAuthoritativeSteps(&server.game));
+
+    // Skips the first composed step, where all the participants joined
+    NbsPendingRange range = {.startId = 101, .count = 16};
+    uint8_t normalOctets[2048];
+    FldOutStream normalStream;
+    fldOutStreamInit(&normalStream, normalOctets, sizeof(normalOctets));
+    ASSERT_LE(0, nbsPendingStepsSerializeOutRanges(&normalStream, &server.game.authoritativeSteps, &range, 1));
+
+    uint8_t compactOctets[2048];
+    FldOutStream compactStream;
+    fldOutStreamInit(&compactStream, compactOctets, sizeof(compactOctets));
+    ASSERT_EQ(1, nimbleServerCompactStepsWriteRange(&compactStream, &server.game.authoritativeSteps, 101, 16));
+
+    size_t savedPercent = 100U - compactStream.pos * 100U / normalStream.pos;
+    ASSERT_GE(savedPercent, 50U);
+    ASSERT_LE(savedPercent, 80U);
+}
+
+static void writeCompactPredictedSteps(FldOutStream* outStream, uint8_t participantId, StepId firstStepId,
+                                       size_t stepCount, size_t stepOctetCount)
+{
+    nimbleServerVarIntWriteSigned(outStream, -2);
+    fldOutStreamWriteUInt8(outStream, 1);
+    fldOutStreamWriteUInt8(outStream, participantId);
+    nimbleServerVarIntWrite(outStream, firstStepId - 100);
+    nimbleServerVarIntWrite(outStream, (uint32_t) stepCount);
+    for (size_t i = 0; i < stepCount; ++i) {
+        nimbleServerVarIntWrite(outStream, (uint32_t) stepOctetCount);
+        for (size_t j = 0; j < stepOctetCount; ++j) {
+            fldOutStreamWriteUInt8(outStream, (uint8_t) (firstStepId + i));
+        }
+    }
+}
+
+UTEST(NimbleServer, verifyCompactPredictedStepsRoundTrip)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+    ASSERT_EQ(0, initStepRangeServer(&server, &imprintSetup, 100, 0));
+    ASSERT_EQ(8u, server.game.maxSingleParticipantStepOctetCount);
+
+    NimbleServerTransportConnection* transportConnection = initStepRangeConnection(&server, 0, 0);
+    NimbleSerializeJoinGameRequestPlayer player = {.localIndex = 0};
+    NimbleServerLocalParty* party;
+    ASSERT_EQ(0, nimbleServerLocalPartiesCreate(&server.localParties, &server.game.participants,
+                                                transportConnection, &player, 100, 1, &party));
+    NimbleServerParticipant* participant = party->participantReferences.participantReferences[0];
+
+    // The client is waiting for step 102, and the steps start two steps before it
+    uint8_t octets[256];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    writeCompactPredictedSteps(&outStream, participant->id, 100, 3, 8);
+
+    FldInStream inStream;
+    fldInStreamInit(&inStream, octets, outStream.pos);
+    ASSERT_EQ(0, nimbleServerLocalPartyDeserializeCompactPredictedSteps(party, &inStream, 102, 8, 100, 0));
+    ASSERT_EQ(outStream.pos, inStream.pos);
+    ASSERT_EQ(103u, participant->steps.expectedWriteId);
+    ASSERT_EQ(102u, party->highestReceivedStepId);
+
+    uint8_t step[8];
+    int index = nbsStepsGetIndexForStep(&participant->steps, 101);
+    ASSERT_LE(0, index);
+    ASSERT_EQ(8, nbsStepsReadAtIndex(&participant->steps, index, step, sizeof(step)));
+    ASSERT_EQ(101, step[0]);
+    ASSERT_EQ(101, step[7]);
+
+    // Resent steps are skipped by their length
+    fldInStreamInit(&inStream, octets, outStream.pos);
+    ASSERT_EQ(0, nimbleServerLocalPartyDeserializeCompactPredictedSteps(party, &inStream, 102, 8, 100, 0));
+    ASSERT_EQ(outStream.pos, inStream.pos);
+    ASSERT_EQ(103u, participant->steps.expectedWriteId);
+
+    // Steps larger than the configured maximum are refused
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    writeCompactPredictedSteps(&outStream, participant->id, 103, 1, 9);
+    fldInStreamInit(&inStream, octets, outStream.pos);
+    ASSERT_EQ(NimbleServerErrSerialize,
+              nimbleServerLocalPartyDeserializeCompactPredictedSteps(party, &inStream, 102, 8, 100, 0));
+
+    // Steps after a gap are refused, the same as in the normal step encoding
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    writeCompactPredictedSteps(&outStream, participant->id, 105, 2, 8);
+    fldInStreamInit(&inStream, octets, outStream.pos);
+    ASSERT_EQ(NimbleServerErrSerialize,
+              nimbleServerLocalPartyDeserializeCompactPredictedSteps(party, &inStream, 102, 8, 100, 0));
+    ASSERT_EQ(103u, participant->steps.expectedWriteId);
+
+    // A datagram that ends after the participant id is refused
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    writeCompactPredictedSteps(&outStream, participant->id, 103, 1, 8);
+    fldInStreamInit(&inStream, octets, 3);
+    ASSERT_LT(nimbleServerLocalPartyDeserializeCompactPredictedSteps(party, &inStream, 102, 8, 100, 0), 0);
+    ASSERT_EQ(103u, participant->steps.expectedWriteId);
+}
+
+static int forcedStepHalfInput(void* self, const NimbleServerForcedStepContext* context, uint8_t* target,
+                               size_t maxTargetOctetCount)
+{
+    (void) self;
+    if (!context->hasLastStep || context->lastStepOctetCount > maxTargetOctetCount) {
+        return -1;
+    }
+    for (size_t i = 0; i < context->lastStepOctetCount; ++i) {
+        target[i] = context->lastStepOctets[i] / 2;
+    }
+    return (int) context->lastStepOctetCount;
+}
+
+UTEST(NimbleServer, verifyForcedStepStrategy)
+{
+    const uint8_t lastStep[] = {0x10, 0x22};
+    NimbleServerForcedStepContext context = {.participantId = 3,
+                                             .partyId = 1,
+                                             .stepId = 0x100,
+                                             .forcedStepInRowCount = 1,
+                                             .lastStepOctets = lastStep,
+                                             .lastStepOctetCount = sizeof(lastStep),
+                                             .hasLastStep = true};
+    uint8_t target[8];
+
+    NimbleServerForcedStepStrategy zeroed = {0};
+    ASSERT_LT(nimbleServerForcedStepCreate(&zeroed, &context, target, sizeof(target)), 0);
+
+    NimbleServerForcedStepStrategy repeat = {.repeatLastStepCount = 2};
+    ASSERT_EQ(2, nimbleServerForcedStepCreate(&repeat, &context, target, sizeof(target)));
+    ASSERT_EQ(0, memcmp(lastStep, target, sizeof(lastStep)));
+    context.forcedStepInRowCount = 3;
+    ASSERT_LT(nimbleServerForcedStepCreate(&repeat, &context, target, sizeof(target)), 0);
+
+    NimbleServerForcedStepStrategy custom = {.fn = forcedStepHalfInput};
+    ASSERT_EQ(2, nimbleServerForcedStepCreate(&custom, &context, target, sizeof(target)));
+    ASSERT_EQ(0x11, target[1]);
+}
+
+UTEST(NimbleServer, verifyVarIntRoundTrip)
+{
+    const int32_t signedValues[] = {0, -1, 1, -64, 63, 64, -65, INT32_MAX, INT32_MIN};
+    uint8_t octets[64];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_EQ(0, nimbleServerVarIntWrite(&outStream, 127));
+    ASSERT_EQ(1u, outStream.pos);
+    ASSERT_EQ(0, nimbleServerVarIntWrite(&outStream, UINT32_MAX));
+    ASSERT_EQ(1u + NIMBLE_SERVER_VARINT_MAX_OCTET_COUNT, outStream.pos);
+    for (size_t i = 0; i < sizeof(signedValues) / sizeof(signedValues[0]); ++i) {
+        ASSERT_EQ(0, nimbleServerVarIntWriteSigned(&outStream, signedValues[i]));
+    }
+
+    FldInStream inStream;
+    fldInStreamInit(&inStream, octets, outStream.pos);
+    uint32_t value;
+    ASSERT_EQ(0, nimbleServerVarIntRead(&inStream, &value));
+    ASSERT_EQ(127u, value);
+    ASSERT_EQ(0, nimbleServerVarIntRead(&inStream, &value));
+    ASSERT_EQ(UINT32_MAX, value);
+    for (size_t i = 0; i < sizeof(signedValues) / sizeof(signedValues[0]); ++i) {
+        int32_t signedValue;
+        ASSERT_EQ(0, nimbleServerVarIntReadSigned(&inStream, &signedValue));
+        ASSERT_EQ(signedValues[i], signedValue);
+    }
+    ASSERT_EQ(outStream.pos, inStream.pos);
+}
+
+UTEST(NimbleServer, verifyAlreadyReceivedStepIsSkipped)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    Clog log = {.config = &g_clog, .constantPrefix = "pool"};
+    NimbleServerStepsPool stepsPool;
+    ImprintAllocator* allocator = &imprintSetup.tagAllocator.info;
+    nimbleServerStepsPoolInit(&stepsPool, allocator, allocator, 1, 20, log);
+
+    NimbleServerParticipantCold cold;
+    NimbleServerParticipantSetup setup = {.id = 1,
+                                          .cold = &cold,
+                                          .stepsPool = &stepsPool,
+                                          .maxStepOctetSizeForOneParticipant = 20,
+                                          .log.config = &g_clog,
+                                          .log.constantPrefix = "participant"};
+    NimbleServerParticipant participant;
+    nimbleServerParticipantInit(&participant, setup);
+    NimbleServerLocalParty party;
+    ASSERT_EQ(0, nimbleServerParticipantReInit(&participant, &party, 10));
+
+    const uint8_t octets[] = {2, 0x10, 0x11, 2, 0x20, 0x21, 1, 0x30};
+    FldInStream inStream;
+    fldInStreamInit(&inStream, octets, sizeof(octets));
+    ASSERT_GT(nimbleServerParticipantDeserializeSingleStep(&participant, 10, &inStream), 0);
+    ASSERT_EQ(11u, participant.steps.expectedWriteId);
+
+    // The resent step 10 is skipped by its length
+    ASSERT_EQ(0, nimbleServerParticipantDeserializeSingleStep(&participant, 10, &inStream));
+    ASSERT_EQ(6u, inStream.pos);
+    ASSERT_GT(nimbleServerParticipantDeserializeSingleStep(&participant, 11, &inStream), 0);
+    ASSERT_EQ(sizeof(octets), inStream.pos);
+}
+
+UTEST(NimbleServer, verifyStepsPoolGrowsWithUse)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    Clog log = {.config = &g_clog, .constantPrefix = "pool"};
+    NimbleServerStepsPool stepsPool;
+    ImprintAllocator* allocator = &imprintSetup.tagAllocator.info;
+    nimbleServerStepsPoolInit(&stepsPool, allocator, allocator, 6, 8, log);
+    ASSERT_EQ(0u, nimbleServerStepsPoolAllocatedOctetCount(&stepsPool));
+
+    NimbleServerStepsPoolSlot* slots[6];
+    slots[0] = nimbleServerStepsPoolAcquire(&stepsPool);
+    ASSERT_EQ(NIMBLE_SERVER_STEPS_POOL_SLOTS_PER_SLAB * stepsPool.slotOctetCount,
+              nimbleServerStepsPoolAllocatedOctetCount(&stepsPool));
+    for (size_t i = 1; i < 6; ++i) {
+        slots[i] = nimbleServerStepsPoolAcquire(&stepsPool);
+        ASSERT_TRUE(slots[i] != 0);
+    }
+    ASSERT_TRUE(nimbleServerStepsPoolAcquire(&stepsPool) == 0);
+    ASSERT_EQ(6 * stepsPool.slotOctetCount, nimbleServerStepsPoolAllocatedOctetCount(&stepsPool));
+
+    // A returned slot is reused without allocating more memory
+    nimbleServerStepsPoolRelease(&stepsPool, slots[2]);
+    ASSERT_TRUE(nimbleServerStepsPoolAcquire(&stepsPool) == slots[2]);
+    ASSERT_EQ(6 * stepsPool.slotOctetCount, nimbleServerStepsPoolAllocatedOctetCount(&stepsPool));
+}
+
+UTEST(NimbleServer, verifyMemoryBudgetRefusesAllocation)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    NimbleServerMemory memory;
+    nimbleServerMemoryInit(&memory, 1000);
+    NimbleServerTrackedAllocator untracked;
+    nimbleServerTrackedAllocatorInit(&untracked, &imprintSetup.tagAllocator.info, &memory,
+                                     NimbleServerMemoryCategoryGame, false);
+    NimbleServerTrackedAllocator budgeted;
+    nimbleServerTrackedAllocatorInit(&budgeted, &imprintSetup.tagAllocator.info, &memory,
+                                     NimbleServerMemoryCategoryParticipantSteps, true);
+
+    ASSERT_TRUE(IMPRINT_ALLOC(&untracked.allocator, 600, "game") != 0);
+    ASSERT_TRUE(IMPRINT_ALLOC(&budgeted.allocator, 600, "steps") == 0);
+    ASSERT_EQ(1u, memory.refusedAllocationCount);
+    ASSERT_TRUE(IMPRINT_ALLOC(&budgeted.allocator, 400, "steps") != 0);
+
+    ASSERT_EQ(600u, memory.categories[NimbleServerMemoryCategoryGame].octetCount);
+    ASSERT_EQ(400u, memory.categories[NimbleServerMemoryCategoryParticipantSteps].highWaterOctetCount);
+    ASSERT_EQ(1000u, memory.total.octetCount);
+}
+
+UTEST(NimbleServer, verifyReInitWithGameReusesMemory)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+    ASSERT_EQ(0, initStepRangeServer(&server, &imprintSetup, 100, 0));
+    NimbleSerializeJoinGameRequestPlayer player = {.localIndex = 0};
+    NimbleServerLocalParty* party;
+    ASSERT_EQ(0, nimbleServerLocalPartiesCreate(&server.localParties, &server.game.participants,
+                                                &server.transportConnections[0], &player, 100, 1, &party));
+
+    // The budget only has room for the memory that the first game uses
+    server.memory.budgetOctetCount = server.memory.total.octetCount;
+
+    for (size_t i = 0; i < 16; ++i) {
+        ASSERT_EQ(0, nimbleServerReInitWithGame(&server, (StepId) (200 + i), 1000));
+        ASSERT_EQ(0u, server.game.participants.participantCount);
+        ASSERT_EQ(0, nimbleServerLocalPartiesCreate(&server.localParties, &server.game.participants,
+                                                    &server.transportConnections[0], &player, (StepId) (200 + i), 1,
+                                                    &party));
+        ASSERT_EQ(server.memory.budgetOctetCount, server.memory.total.octetCount);
+    }
+    ASSERT_EQ(0u, server.memory.refusedAllocationCount);
+    ASSERT_EQ(1u, server.game.participants.stepsPool.usedSlotCount);
+}
+
+UTEST(NimbleServer, verifyDatagramRingWrapsAround)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    NimbleServerDatagramRing ring;
+    nimbleServerDatagramRingInit(&ring, &imprintSetup.tagAllocator.info, 4);
+    ASSERT_TRUE(nimbleServerDatagramRingReadBegin(&ring) == 0);
+
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 4; ++i) {
+            NimbleServerIoDatagram* datagram = nimbleServerDatagramRingWriteBegin(&ring);
+            ASSERT_TRUE(datagram != 0);
+            datagram->connectionIndex = round * 4 + i;
+            nimbleServerDatagramRingWriteCommit(&ring);
+        }
+        ASSERT_TRUE(nimbleServerDatagramRingWriteBegin(&ring) == 0);
+
+        for (int i = 0; i < 4; ++i) {
+            const NimbleServerIoDatagram* datagram = nimbleServerDatagramRingReadBegin(&ring);
+            ASSERT_TRUE(datagram != 0);
+            ASSERT_EQ(round * 4 + i, datagram->connectionIndex);
+            nimbleServerDatagramRingReadCommit(&ring);
+        }
+        ASSERT_TRUE(nimbleServerDatagramRingReadBegin(&ring) == 0);
+    }
+}
+
+typedef struct TestWorkerPool {
+    size_t jobCount;
+} TestWorkerPool;
+
+static void testParallelForInReverse(void* self_, size_t jobCount, NimbleServerJobFn jobFn, void* context)
+{
+    TestWorkerPool* self = (TestWorkerPool*) self_;
+    self->jobCount = jobCount;
+    for (size_t i = jobCount; i > 0; --i) {
+        jobFn(context, i - 1);
+    }
+}
+
+#if !defined _WIN32
+
+/// Transport for the I/O thread. Returns connect requests from one connection index each, and counts the sends.
+typedef struct ScriptedTransport {
+    size_t connectRequestCount;
+    size_t receivedCount;
+    size_t sentCount;
+    int sentToConnectionIndices[16];
+} ScriptedTransport;
+
+static ssize_t scriptedReceiveFrom(void* self_, int* connectionIndex, uint8_t* data, size_t maxOctetCount)
+{
+    ScriptedTransport* self = (ScriptedTransport*) self_;
+    if (self->receivedCount == self->connectRequestCount) {
+        return 0;
+    }
+
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, data, maxOctetCount);
+    OrderedDatagramOutLogic orderedDatagramOut;
+    orderedDatagramOutLogicInit(&orderedDatagramOut);
+    orderedDatagramOutLogicPrepare(&orderedDatagramOut, &outStream);
+
+    NimbleSerializeConnectRequest connectRequest;
+    memset(&connectRequest, 0, sizeof(connectRequest));
+    connectRequest.clientRequestId = (NimbleSerializeClientRequestId) (self->receivedCount + 1);
+    Clog log = {.config = &g_clog, .constantPrefix = "scripted"};
+    nimbleSerializeClientOutConnectRequest(&outStream, &connectRequest, &log);
+
+    *connectionIndex = (int) self->receivedCount++;
+
+    return (ssize_t) outStream.pos;
+}
+
+static int scriptedSendTo(void* self_, int connectionIndex, const uint8_t* data, size_t octetCount)
+{
+    (void) data;
+    (void) octetCount;
+    ScriptedTransport* self = (ScriptedTransport*) self_;
+    self->sentToConnectionIndices[self->sentCount++ % 16] = connectionIndex;
+
+    return 0;
+}
+
+/// Receives until the scripted transport has no more datagrams
+static void* ioThreadReceive(void* self_)
+{
+    NimbleServerIo* io = (NimbleServerIo*) self_;
+    ScriptedTransport* transport = (ScriptedTransport*) io->transport.self;
+    while (transport->receivedCount < transport->connectRequestCount) {
+        nimbleServerIoReceive(io);
+    }
+
+    return 0;
+}
+
+static void* ioThreadSend(void* self_)
+{
+    nimbleServerIoSend((NimbleServerIo*) self_);
+
+    return 0;
+}
+
+static void runOnIoThread(void* (*fn)(void*), NimbleServerIo* io)
+{
+    pthread_t thread;
+    pthread_create(&thread, 0, fn, io);
+    pthread_join(thread, 0);
+}
+
+UTEST(NimbleServer, verifyIoThreadDropsWhenRingsAreFull)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    ScriptedTransport scriptedTransport;
+    memset(&scriptedTransport, 0, sizeof(scriptedTransport));
+    scriptedTransport.connectRequestCount = 8;
+    DatagramTransportMulti ioTransport;
+    ioTransport.self = &scriptedTransport;
+    ioTransport.receiveFrom = scriptedReceiveFrom;
+    ioTransport.sendTo = scriptedSendTo;
+
+    NimbleServerIo io;
+    Clog ioLog = {.config = &g_clog, .constantPrefix = "io"};
+    nimbleServerIoInit(&io, &imprintSetup.tagAllocator.info, ioTransport, 4, ioLog);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, 4, 0);
+    setup.multiTransport = nimbleServerIoTickTransport(&io);
+    NimbleServer server;
+    ASSERT_EQ(0, initTestServer(&server, setup, 100, 0));
+
+    // The server has not ticked, so only the first four connect requests fit in the inbound ring
+    runOnIoThread(ioThreadReceive, &io);
+    ASSERT_EQ(8u, scriptedTransport.receivedCount);
+    ASSERT_EQ(4u, io.droppedInboundCount);
+
+    // The four connect responses fill the outbound ring
+    ASSERT_EQ(0, nimbleServerReadFromMultiTransport(&server));
+    ASSERT_EQ(0u, io.droppedOutboundCount);
+    for (uint8_t i = 0; i < 4; ++i) {
+        ASSERT_TRUE(server.transportConnectionsHot.isUsed[i]);
+    }
+    ASSERT_FALSE(server.transportConnectionsHot.isUsed[4]);
+
+    // Connections 8 to 11 are read, but the I/O thread has not sent anything, so their responses are dropped
+    scriptedTransport.connectRequestCount = 12;
+    runOnIoThread(ioThreadReceive, &io);
+    ASSERT_EQ(4u, io.droppedInboundCount);
+    ASSERT_EQ(0, nimbleServerReadFromMultiTransport(&server));
+    ASSERT_EQ(4u, io.droppedOutboundCount);
+    ASSERT_TRUE(server.transportConnectionsHot.isUsed[8]);
+
+    runOnIoThread(ioThreadSend, &io);
+    ASSERT_EQ(4u, scriptedTransport.sentCount);
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_EQ(i, scriptedTransport.sentToConnectionIndices[i]);
+    }
+}
+
+#endif
+
+UTEST(NimbleServer, verifyIngestBatchGroupsByParty)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    NimbleServerIngestBatch batch;
+    nimbleServerIngestBatchInit(&batch, &imprintSetup.tagAllocator.info);
+
+    // Only the party pointers are used for grouping. Without an assigned party the steps are never read.
+    NimbleServerLocalParty parties[2];
+    NimbleServerTransportConnection transportConnection;
+    transportConnection.assignedParty = 0;
+    const size_t partyForEntry[] = {0, 1, 0, 0, 1};
+
+    for (size_t i = 0; i < sizeof(partyForEntry) / sizeof(partyForEntry[0]); ++i) {
+        NimbleServerIngestEntry* entry = nimbleServerIngestBatchNext(&batch);
+        ASSERT_TRUE(entry != 0);
+        entry->party = &parties[partyForEntry[i]];
+        entry->transportConnection = &transportConnection;
+        entry->result = 0;
+        nimbleServerIngestBatchCommit(&batch);
+    }
+
+    TestWorkerPool testPool;
+    NimbleServerWorkerPool workerPool;
+    workerPool.self = &testPool;
+    workerPool.parallelForFn = testParallelForInReverse;
+    nimbleServerIngestBatchRun(&batch, 0, &workerPool);
+
+    ASSERT_EQ(2U, testPool.jobCount);
+    const uint8_t expectedEntryIndices[] = {0, 2, 3, 1, 4};
+    for (size_t i = 0; i < sizeof(expectedEntryIndices); ++i) {
+        ASSERT_EQ(expectedEntryIndices[i], batch.jobEntryIndices[i]);
+        ASSERT_EQ(NimbleServerErrSerialize, batch.entries[i].result);
+    }
+
+    nimbleServerIngestBatchClear(&batch);
+    ASSERT_TRUE(nimbleServerIngestBatchNext(&batch) == &batch.entries[0]);
+}
+
+/// Transport that returns queued datagrams and keeps the sent ones
+typedef struct TestDatagramTransport {
+    NimbleServerIoDatagram received[4];
+    size_t receivedCount;
+    size_t readCount;
+    NimbleServerIoDatagram sent[4];
+    size_t sentCount;
+} TestDatagramTransport;
+
+static ssize_t testDatagramReceiveFrom(void* self_, int* connectionIndex, uint8_t* data, size_t maxOctetCount)
+{
+    TestDatagramTransport* self = (TestDatagramTransport*) self_;
+    if (self->readCount == self->receivedCount) {
+        return 0;
+    }
+
+    const NimbleServerIoDatagram* datagram = &self->received[self->readCount++];
+    if (datagram->octetCount > maxOctetCount) {
+        return -1;
+    }
+    *connectionIndex = datagram->connectionIndex;
+    memcpy(data, datagram->octets, datagram->octetCount);
+
+    return (ssize_t) datagram->octetCount;
+}
+
+static int testDatagramSendTo(void* self_, int connectionIndex, const uint8_t* data, size_t octetCount)
+{
+    TestDatagramTransport* self = (TestDatagramTransport*) self_;
+    if (self->sentCount == sizeof(self->sent) / sizeof(self->sent[0])) {
+        return -1;
+    }
+
+    NimbleServerIoDatagram* datagram = &self->sent[self->sentCount++];
+    datagram->connectionIndex = connectionIndex;
+    datagram->octetCount = octetCount;
+    memcpy(datagram->octets, data, octetCount);
+
+    return 0;
+}
+
+/// Writes a datagram with predicted steps for a single participant
+static void writePredictedStepsDatagram(NimbleServerIoDatagram* datagram, OrderedDatagramOutLogic* orderedDatagramOut,
+                                        int connectionIndex, uint8_t participantId, StepId firstStepId,
+                                        size_t stepCount)
+{
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, datagram->octets, sizeof(datagram->octets));
+    orderedDatagramOutLogicPrepare(orderedDatagramOut, &outStream);
+
+    Clog log = {.config = &g_clog, .constantPrefix = "client"};
+    nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdGameStep, &log);
+    nbsPendingStepsSerializeOutHeader(&outStream, 100);
+    fldOutStreamWriteUInt32(&outStream, firstStepId);
+    fldOutStreamWriteUInt8(&outStream, 1);
+    fldOutStreamWriteUInt8(&outStream, participantId);
+    fldOutStreamWriteUInt8(&outStream, 0);
+    fldOutStreamWriteUInt8(&outStream, (uint8_t) stepCount);
+    for (size_t i = 0; i < stepCount; ++i) {
+        uint8_t step[8] = {(uint8_t) (firstStepId + i), participantId, 0xca, 0xfe};
+        fldOutStreamWriteUInt8(&outStream, sizeof(step));
+        fldOutStreamWriteOctets(&outStream, step, sizeof(step));
+    }
+    orderedDatagramOutLogicCommit(orderedDatagramOut);
+
+    datagram->connectionIndex = connectionIndex;
+    datagram->octetCount = outStream.pos;
+}
+
+static int initIngestServer(NimbleServer* server, ImprintDefaultSetup* imprintSetup, TestDatagramTransport* transport,
+                            NimbleServerWorkerPool workerPool)
+{
+    DatagramTransportMulti multiTransport;
+    multiTransport.self = transport;
+    multiTransport.receiveFrom = testDatagramReceiveFrom;
+    multiTransport.sendTo = testDatagramSendTo;
+
+    NimbleServerSetup setup = testServerSetup(imprintSetup, 4, 0);
+    setup.multiTransport = multiTransport;
+    setup.workerPool = workerPool;
+    int err = initTestServer(server, setup, 100, 1000);
+    if (err < 0) {
+        return err;
+    }
+
+    NimbleSerializeJoinGameRequestPlayer player = {.localIndex = 0};
+    for (size_t i = 0; i < 2; ++i) {
+        NimbleServerTransportConnection* transportConnection = initStepRangeConnection(server, i, 0);
+        NimbleServerLocalParty* party;
+        err = nimbleServerLocalPartiesCreate(&server->localParties, &server->game.participants, transportConnection,
+                                             &player, 100, 1, &party);
+        if (err < 0) {
+            return err;
+        }
+        transportConnection->assignedParty = party;
+    }
+
+    return 0;
+}
+
+UTEST(NimbleServer, verifyIngestWithWorkerPoolMatchesSerialIngest)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerWorkerPool noWorkerPool = {.parallelForFn = 0, .self = 0};
+    TestDatagramTransport serialTransport;
+    NimbleServer serialServer;
+    ASSERT_EQ(0, initIngestServer(&serialServer, &imprintSetup, &serialTransport, noWorkerPool));
+
+    TestWorkerPool testPool;
+    NimbleServerWorkerPool workerPool = {.parallelForFn = testParallelForInReverse, .self = &testPool};
+    TestDatagramTransport batchTransport;
+    NimbleServer batchServer;
+    ASSERT_EQ(0, initIngestServer(&batchServer, &imprintSetup, &batchTransport, workerPool));
+
+    uint8_t participantIds[2];
+    for (size_t i = 0; i < 2; ++i) {
+        participantIds[i] =
+            serialServer.transportConnections[i].assignedParty->participantReferences.participantReferences[0]->id;
+        ASSERT_EQ(participantIds[i], batchServer.transportConnections[i].assignedParty->participantReferences
+                                         .participantReferences[0]->id);
+    }
+
+    OrderedDatagramOutLogic orderedDatagramOuts[2];
+    orderedDatagramOutLogicInit(&orderedDatagramOuts[0]);
+    orderedDatagramOutLogicInit(&orderedDatagramOuts[1]);
+
+    // Four predicted steps from each party every tick, which composes without forced steps in both paths
+    for (StepId tick = 0; tick < 4; ++tick) {
+        TestDatagramTransport* transports[2] = {&serialTransport, &batchTransport};
+        NimbleServerIoDatagram datagrams[2];
+        for (int i = 0; i < 2; ++i) {
+            writePredictedStepsDatagram(&datagrams[i], &orderedDatagramOuts[i], i, participantIds[i],
+                                        100 + tick * 4, 4);
+        }
+        for (size_t t = 0; t < 2; ++t) {
+            memcpy(transports[t]->received, datagrams, sizeof(datagrams));
+            transports[t]->receivedCount = 2;
+            transports[t]->readCount = 0;
+            transports[t]->sentCount = 0;
+        }
+
+        ASSERT_EQ(0, nimbleServerReadFromMultiTransport(&serialServer));
+        ASSERT_EQ(0, nimbleServerReadFromMultiTransport(&batchServer));
+        ASSERT_EQ(2u, testPool.jobCount);
+
+        // The serial path replies to the first party before the steps from the second party are composed, so only
+        // the replies to the last datagram of the tick are the same
+        ASSERT_EQ(2u, serialTransport.sentCount);
+        ASSERT_EQ(2u, batchTransport.sentCount);
+        ASSERT_EQ(1, serialTransport.sent[1].connectionIndex);
+        ASSERT_EQ(1, batchTransport.sent[1].connectionIndex);
+        ASSERT_EQ(serialTransport.sent[1].octetCount, batchTransport.sent[1].octetCount);
+        ASSERT_EQ(0, memcmp(serialTransport.sent[1].octets, batchTransport.sent[1].octets,
+                            serialTransport.sent[1].octetCount));
+    }
+
+    const NbsSteps* serialSteps = &serialServer.game.authoritativeSteps;
+    const NbsSteps* batchSteps = &batchServer.game.authoritativeSteps;
+    ASSERT_EQ(114u, serialSteps->expectedWriteId);
+    ASSERT_EQ(serialSteps->expectedWriteId, batchSteps->expectedWriteId);
+    for (StepId stepId = 100; stepId < serialSteps->expectedWriteId; ++stepId) {
+        uint8_t serialStep[64];
+        uint8_t batchStep[64];
+        int serialOctetCount = nbsStepsReadAtIndex(serialSteps, nbsStepsGetIndexForStep(serialSteps, stepId),
+                                                   serialStep, sizeof(serialStep));
+        int batchOctetCount = nbsStepsReadAtIndex(batchSteps, nbsStepsGetIndexForStep(batchSteps, stepId), batchStep,
+                                                  sizeof(batchStep));
+        ASSERT_LT(0, serialOctetCount);
+        ASSERT_EQ(serialOctetCount, batchOctetCount);
+        ASSERT_EQ(0, memcmp(serialStep, batchStep, (size_t) serialOctetCount));
+    }
+
+    // The jobs update the connection and party stats, which must end up the same as when they are read in order
+    static NimbleServerMetrics serialMetrics;
+    static NimbleServerMetrics batchMetrics;
+    nimbleServerMetricsSnapshot(&serialServer, &serialMetrics);
+    nimbleServerMetricsSnapshot(&batchServer, &batchMetrics);
+    ASSERT_EQ(2u, serialMetrics.connectionCount);
+    ASSERT_EQ(serialMetrics.connectionCount, batchMetrics.connectionCount);
+    for (size_t i = 0; i < serialMetrics.connectionCount; ++i) {
+        const NimbleServerConnectionMetrics* serialConnection = &serialMetrics.connections[i];
+        const NimbleServerConnectionMetrics* batchConnection = &batchMetrics.connections[i];
+        ASSERT_EQ(serialConnection->connectionId, batchConnection->connectionId);
+        ASSERT_EQ(serialConnection->droppedDatagramCount, batchConnection->droppedDatagramCount);
+        ASSERT_EQ(serialConnection->droppedPredictedStepCount, batchConnection->droppedPredictedStepCount);
+        ASSERT_EQ(serialConnection->lostDatagramCount, batchConnection->lostDatagramCount);
+        ASSERT_EQ(serialConnection->retransmitCount, batchConnection->retransmitCount);
+    }
+    ASSERT_EQ(2u, serialMetrics.partyCount);
+    ASSERT_EQ(serialMetrics.partyCount, batchMetrics.partyCount);
+    for (size_t i = 0; i < serialMetrics.partyCount; ++i) {
+        const NimbleServerPartyMetrics* serialParty = &serialMetrics.parties[i];
+        const NimbleServerPartyMetrics* batchParty = &batchMetrics.parties[i];
+        ASSERT_EQ(serialParty->partyId, batchParty->partyId);
+        ASSERT_EQ(serialParty->stepsInBufferCount, batchParty->stepsInBufferCount);
+        ASSERT_EQ(serialParty->forcedStepInRowCount, batchParty->forcedStepInRowCount);
+        ASSERT_EQ(serialParty->providedStepsInARowCount, batchParty->providedStepsInARowCount);
+        ASSERT_EQ(serialParty->addedStepsToBufferCount, batchParty->addedStepsToBufferCount);
+    }
+}
+
+static int initSpectatorServer(NimbleServer* server, ImprintDefaultSetup* imprintSetup)
+{
+    return initTestServer(server, testServerSetup(imprintSetup, 1, 2), 100, 1000);
+}
+
+static int countSentDatagram(void* self_, const uint8_t* octets, size_t octetCount)
+{
+    (void) octets;
+    (void) octetCount;
+    size_t* sentCount = (size_t*) self_;
+    (*sentCount)++;
+    return 0;
+}
+
+/// Feeds a join request with playerCount local players, zero players joins as a spectator
+static int feedJoinRequest(NimbleServer* server, uint8_t connectionIndex, OrderedDatagramOutLogic* orderedDatagramOut,
+                           size_t playerCount)
+{
+    uint8_t octets[64];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    orderedDatagramOutLogicPrepare(orderedDatagramOut, &outStream);
+
+    NimbleSerializeJoinGameRequest joinRequest;
+    joinRequest.joinGameType = NimbleSerializeJoinGameTypeNoSecret;
+    joinRequest.playerCount = playerCount;
+    for (size_t i = 0; i < playerCount; ++i) {
+        joinRequest.players[i].localIndex = (uint8_t) i;
+    }
+    joinRequest.requestId = 1;
+    Clog log = {.config = &g_clog, .constantPrefix = "client"};
+    nimbleSerializeClientOutJoinGameRequest(&outStream, &joinRequest, &log);
+    orderedDatagramOutLogicCommit(orderedDatagramOut);
+
+    size_t sentCount = 0;
+    DatagramTransportOut transportOut = {.self = &sentCount, .send = countSentDatagram};
+    NimbleServerResponse response = {.transportOut = &transportOut};
+
+    return nimbleServerFeed(server, connectionIndex, octets, outStream.pos, &response);
+}
+
+UTEST(NimbleServer, verifySpectatorsHaveTheirOwnLimit)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+    ASSERT_EQ(0, initSpectatorServer(&server, &imprintSetup));
+
+    OrderedDatagramOutLogic orderedDatagramOuts[4];
+    for (size_t i = 0; i < 4; ++i) {
+        orderedDatagramOutLogicInit(&orderedDatagramOuts[i]);
+    }
+
+    // The only participant slot is taken, but spectators do not use participant slots
+    ASSERT_EQ(0, feedJoinRequest(&server, 0, &orderedDatagramOuts[0], 1));
+    ASSERT_TRUE(feedJoinRequest(&server, 1, &orderedDatagramOuts[1], 1) < 0);
+    ASSERT_EQ(0, feedJoinRequest(&server, 1, &orderedDatagramOuts[1], 0));
+    ASSERT_EQ(0, feedJoinRequest(&server, 2, &orderedDatagramOuts[2], 0));
+    ASSERT_TRUE(server.transportConnections[1].isSpectator);
+    ASSERT_TRUE(server.transportConnections[2].isSpectator);
+    ASSERT_EQ(2u, server.spectatorCount);
+    ASSERT_TRUE(server.transportConnections[1].assignedParty == 0);
+
+    // The spectator limit is reached, even if it is larger than the participant limit
+    ASSERT_EQ(NimbleServerErrSessionFull, feedJoinRequest(&server, 3, &orderedDatagramOuts[3], 0));
+    ASSERT_FALSE(server.transportConnections[3].isSpectator);
+    ASSERT_EQ(2u, server.spectatorCount);
+
+    // Joining again as a spectator on the same connection does not count twice
+    ASSERT_EQ(0, feedJoinRequest(&server, 1, &orderedDatagramOuts[1], 0));
+    ASSERT_EQ(2u, server.spectatorCount);
+}
+
+UTEST(NimbleServer, verifySpectatorCountFollowsDisconnectAndRejoin)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+    ASSERT_EQ(0, initSpectatorServer(&server, &imprintSetup));
+
+    OrderedDatagramOutLogic orderedDatagramOuts[3];
+    for (size_t i = 0; i < 3; ++i) {
+        orderedDatagramOutLogicInit(&orderedDatagramOuts[i]);
+    }
+
+    ASSERT_EQ(0, feedJoinRequest(&server, 0, &orderedDatagramOuts[0], 0));
+    ASSERT_EQ(0, feedJoinRequest(&server, 1, &orderedDatagramOuts[1], 0));
+    ASSERT_EQ(2u, server.spectatorCount);
+
+    ASSERT_EQ(0, nimbleServerConnectionDisconnected(&server, 1));
+    ASSERT_FALSE(server.transportConnections[1].isSpectator);
+    ASSERT_EQ(1u, server.spectatorCount);
+
+    // The freed spectator slot can be used by another connection, and then by the reconnected one
+    ASSERT_EQ(0, feedJoinRequest(&server, 2, &orderedDatagramOuts[2], 0));
+    ASSERT_EQ(2u, server.spectatorCount);
+    ASSERT_EQ(0, nimbleServerConnectionDisconnected(&server, 2));
+
+    orderedDatagramOutLogicInit(&orderedDatagramOuts[1]);
+    ASSERT_EQ(0, feedJoinRequest(&server, 1, &orderedDatagramOuts[1], 0));
+    ASSERT_TRUE(server.transportConnections[1].isSpectator);
+    ASSERT_EQ(2u, server.spectatorCount);
+
+    // A spectator that joins with a participant is no longer a spectator
+    ASSERT_EQ(0, feedJoinRequest(&server, 1, &orderedDatagramOuts[1], 1));
+    ASSERT_FALSE(server.transportConnections[1].isSpectator);
+    ASSERT_EQ(1u, server.spectatorCount);
+}
+
+UTEST(NimbleServer, verifySpectatorStepIsFollowedByCommands)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+    ASSERT_EQ(0, initSpectatorServer(&server, &imprintSetup));
+
+    OrderedDatagramOutLogic orderedDatagramOut;
+    orderedDatagramOutLogicInit(&orderedDatagramOut);
+    ASSERT_EQ(0, feedJoinRequest(&server, 0, &orderedDatagramOut, 0));
+
+    for (size_t encoding = 0; encoding < 2; ++encoding) {
+        bool isCompact = encoding == 1;
+        server.transportConnections[0].stepEncoding = isCompact ? NimbleServerStepEncodingCompact
+                                                                : NimbleServerStepEncodingNormal;
+
+        uint8_t octets[128];
+        FldOutStream outStream;
+        fldOutStreamInit(&outStream, octets, sizeof(octets));
+        orderedDatagramOutLogicPrepare(&orderedDatagramOut, &outStream);
+
+        // Predicted steps that a spectator client should not send, but that must not hide the ping after them
+        Clog log = {.config = &g_clog, .constantPrefix = "client"};
+        nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdGameStep, &log);
+        nbsPendingStepsSerializeOutHeader(&outStream, 100);
+        if (isCompact) {
+            writeCompactPredictedSteps(&outStream, 0, 100, 2, 4);
+        } else {
+            fldOutStreamWriteUInt32(&outStream, 100);
+            fldOutStreamWriteUInt8(&outStream, 1);
+            fldOutStreamWriteUInt8(&outStream, 0);
+            fldOutStreamWriteUInt8(&outStream, 0);
+            fldOutStreamWriteUInt8(&outStream, 2);
+            for (size_t i = 0; i < 2; ++i) {
+                uint8_t step[4] = {(uint8_t) (100 + i), 0xca, 0xfe, 0x00};
+                fldOutStreamWriteUInt8(&outStream, sizeof(step));
+                fldOutStreamWriteOctets(&outStream, step, sizeof(step));
+            }
+        }
+        nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdPingRequest, &log);
+        fldOutStreamWriteUInt64(&outStream, 42);
+        orderedDatagramOutLogicCommit(&orderedDatagramOut);
+
+        size_t sentCount = 0;
+        DatagramTransportOut transportOut = {.self = &sentCount, .send = countSentDatagram};
+        NimbleServerResponse response = {.transportOut = &transportOut};
+        ASSERT_EQ(0, nimbleServerFeed(&server, 0, octets, outStream.pos, &response));
+        ASSERT_EQ(2u, sentCount);
+        ASSERT_EQ(100U, server.game.authoritativeSteps.expectedWriteId);
+    }
+}
+
+/// Feeds a datagram with stepCount predicted steps for each of the participants
+static int feedPredictedStepsForParticipants(NimbleServer* server, uint8_t connectionIndex,
+                                             OrderedDatagramOutLogic* orderedDatagramOut,
+                                             const uint8_t* participantIds, size_t participantCount,
+                                             StepId firstStepId, size_t stepCount)
+{
+    uint8_t octets[256];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    orderedDatagramOutLogicPrepare(orderedDatagramOut, &outStream);
+
+    Clog log = {.config = &g_clog, .constantPrefix = "client"};
+    nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdGameStep, &log);
+    nbsPendingStepsSerializeOutHeader(&outStream, firstStepId);
+    fldOutStreamWriteUInt32(&outStream, firstStepId);
+    fldOutStreamWriteUInt8(&outStream, (uint8_t) participantCount);
+    for (size_t participantIndex = 0; participantIndex < participantCount; ++participantIndex) {
+        fldOutStreamWriteUInt8(&outStream, participantIds[participantIndex]);
+        fldOutStreamWriteUInt8(&outStream, 0);
+        fldOutStreamWriteUInt8(&outStream, (uint8_t) stepCount);
+        for (size_t i = 0; i < stepCount; ++i) {
+            uint8_t step[4] = {(uint8_t) (firstStepId + i), participantIds[participantIndex], 0xca, 0xfe};
+            fldOutStreamWriteUInt8(&outStream, sizeof(step));
+            fldOutStreamWriteOctets(&outStream, step, sizeof(step));
+        }
+    }
+    orderedDatagramOutLogicCommit(orderedDatagramOut);
+
+    size_t sentCount = 0;
+    DatagramTransportOut transportOut = {.self = &sentCount, .send = countSentDatagram};
+    NimbleServerResponse response = {.transportOut = &transportOut};
+
+    return nimbleServerFeed(server, connectionIndex, octets, outStream.pos, &response);
+}
+
+UTEST(NimbleServer, verifyRateLimitedDatagramIsNotPartlyIngested)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, 4, 0);
+    setup.maxParticipantCountForEachConnection = 2;
+    setup.ingressRateLimit.predictedStepsPerSecond = 60;
+    NimbleServer server;
+    ASSERT_EQ(0, initTestServer(&server, setup, 100, 1000));
+
+    OrderedDatagramOutLogic orderedDatagramOut;
+    orderedDatagramOutLogicInit(&orderedDatagramOut);
+    ASSERT_EQ(0, feedJoinRequest(&server, 0, &orderedDatagramOut, 2));
+
+    const NimbleServerLocalParty* party = server.transportConnections[0].assignedParty;
+    ASSERT_TRUE(party != 0);
+    ASSERT_EQ(2u, party->participantReferences.participantReferenceCount);
+    uint8_t participantIds[2];
+    StepId expectedWriteIds[2];
+    for (size_t i = 0; i < 2; ++i) {
+        participantIds[i] = party->participantReferences.participantReferences[i]->id;
+        expectedWriteIds[i] = party->participantReferences.participantReferences[i]->steps.expectedWriteId;
+    }
+
+    // Room for the steps of the first participant, but not for the whole datagram
+    NimbleServerRateLimit* rateLimit = transportConnectionRateLimit(&server.transportConnections[0]);
+    rateLimit->predictedSteps.milliTokens = 6 * 1000U;
+    ASSERT_EQ(NimbleServerErrRateLimited, feedPredictedStepsForParticipants(&server, 0, &orderedDatagramOut,
+                                                                            participantIds, 2, expectedWriteIds[0], 4));
+    for (size_t i = 0; i < 2; ++i) {
+        ASSERT_EQ(expectedWriteIds[i], party->participantReferences.participantReferences[i]->steps.expectedWriteId);
+    }
+    ASSERT_EQ(6 * 1000U, rateLimit->predictedSteps.milliTokens);
+
+    rateLimit->predictedSteps.milliTokens = 8 * 1000U;
+    ASSERT_EQ(0, feedPredictedStepsForParticipants(&server, 0, &orderedDatagramOut, participantIds, 2,
+                                                   expectedWriteIds[0], 4));
+    for (size_t i = 0; i < 2; ++i) {
+        ASSERT_EQ((StepId) (expectedWriteIds[i] + 4),
+                  party->participantReferences.participantReferences[i]->steps.expectedWriteId);
+    }
+}
+
+/// Feeds a datagram with a connect request
+static int feedConnectRequest(NimbleServer* server, uint8_t connectionIndex,
+                              OrderedDatagramOutLogic* orderedDatagramOut, uint8_t clientRequestId)
+{
+    uint8_t octets[64];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    orderedDatagramOutLogicPrepare(orderedDatagramOut, &outStream);
+
+    NimbleSerializeConnectRequest connectRequest;
+    connectRequest.applicationVersion = server->applicationVersion;
+    connectRequest.nimbleVersion.major = 0;
+    connectRequest.nimbleVersion.minor = 0;
+    connectRequest.nimbleVersion.patch = 0;
+    connectRequest.clientRequestId = clientRequestId;
+    connectRequest.useDebugStreams = false;
+    Clog log = {.config = &g_clog, .constantPrefix = "client"};
+    nimbleSerializeClientOutConnectRequest(&outStream, &connectRequest, &log);
+    orderedDatagramOutLogicCommit(orderedDatagramOut);
+
+    size_t sentCount = 0;
+    DatagramTransportOut transportOut = {.self = &sentCount, .send = countSentDatagram};
+    NimbleServerResponse response = {.transportOut = &transportOut};
+
+    return nimbleServerFeed(server, connectionIndex, octets, outStream.pos, &response);
+}
+
+UTEST(NimbleServer, verifyConnectDoesNotTakeOverAConnectedTransportConnection)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+    ASSERT_EQ(0, initTestServer(&server, testServerSetup(&imprintSetup, 4, 0), 100, 1000));
+
+    OrderedDatagramOutLogic orderedDatagramOut;
+    orderedDatagramOutLogicInit(&orderedDatagramOut);
+
+    const NimbleServerTransportConnection* transportConnection = &server.transportConnections[1];
+    ASSERT_EQ(0, feedConnectRequest(&server, 1, &orderedDatagramOut, 1));
+    ASSERT_TRUE(transportConnection->hasConnectRequest);
+    ASSERT_EQ(NbTransportConnectionPhaseConnected, transportConnection->phase);
+    ASSERT_EQ(1, server.transportConnectionsHot.connectedFromConnectRequestId[1]);
+
+    // A resent connect request gets the same connection
+    ASSERT_EQ(0, feedConnectRequest(&server, 1, &orderedDatagramOut, 1));
+    ASSERT_EQ(0, feedJoinRequest(&server, 1, &orderedDatagramOut, 1));
+    const NimbleServerLocalParty* party = transportConnection->assignedParty;
+    ASSERT_TRUE(party != 0);
+
+    // A connect with another client request id is refused, and the joined connection is kept
+    ASSERT_EQ(NimbleServerErrTransportConnectionInUse, feedConnectRequest(&server, 1, &orderedDatagramOut, 2));
+    ASSERT_TRUE(nimbleServerIsErrorExternal(NimbleServerErrTransportConnectionInUse));
+    ASSERT_EQ(1, server.transportConnectionsHot.connectedFromConnectRequestId[1]);
+    ASSERT_TRUE(transportConnection->assignedParty == party);
+    ASSERT_TRUE(party->isUsed);
+
+    // After the disconnect, the transport connection index can be connected again
+    ASSERT_EQ(0, nimbleServerConnectionDisconnected(&server, 1));
+    ASSERT_FALSE(transportConnectionIsUsed(transportConnection));
+    ASSERT_FALSE(party->isUsed);
+    ASSERT_TRUE(transportConnection->assignedParty == 0);
+
+    orderedDatagramOutLogicInit(&orderedDatagramOut);
+    ASSERT_EQ(0, feedConnectRequest(&server, 1, &orderedDatagramOut, 2));
+    ASSERT_EQ(2, server.transportConnectionsHot.connectedFromConnectRequestId[1]);
+
+    // A connection that never joined is also freed by the disconnect
+    ASSERT_EQ(0, nimbleServerConnectionDisconnected(&server, 1));
+    ASSERT_FALSE(transportConnectionIsUsed(transportConnection));
+    ASSERT_EQ(NimbleServerErrUnknownConnection, nimbleServerConnectionDisconnected(&server, 1));
+}
+
+UTEST(NimbleServer, verifyPredictedStepsAreAcceptedForParticipantsThatAreNotFirst)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+    ASSERT_EQ(0, initTestServer(&server, testServerSetup(&imprintSetup, 4, 0), 100, 1000));
+
+    OrderedDatagramOutLogic orderedDatagramOuts[2];
+    for (size_t i = 0; i < 2; ++i) {
+        orderedDatagramOutLogicInit(&orderedDatagramOuts[i]);
+        ASSERT_EQ(0, feedJoinRequest(&server, (uint8_t) i, &orderedDatagramOuts[i], 1));
+    }
+
+    // The participant id is larger than the participant count of its party, which only has one participant
+    const NimbleServerLocalParty* party = server.transportConnections[1].assignedParty;
+    ASSERT_TRUE(party != 0);
+    ASSERT_EQ(1u, party->participantReferences.participantReferenceCount);
+    NimbleServerParticipant* participant = party->participantReferences.participantReferences[0];
+    ASSERT_LE(1u, participant->id);
+
+    uint8_t participantId = participant->id;
+    StepId expectedWriteId = participant->steps.expectedWriteId;
+    ASSERT_EQ(0, feedPredictedStepsForParticipants(&server, 1, &orderedDatagramOuts[1], &participantId, 1,
+                                                   expectedWriteId, 3));
+    ASSERT_EQ((StepId) (expectedWriteId + 3), participant->steps.expectedWriteId);
+}
+
+/// Feeds a datagram with a ping request
+static int feedPingRequest(NimbleServer* server, uint8_t connectionIndex, OrderedDatagramOutLogic* orderedDatagramOut)
+{
+    uint8_t octets[32];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    orderedDatagramOutLogicPrepare(orderedDatagramOut, &outStream);
+
+    Clog log = {.config = &g_clog, .constantPrefix = "client"};
+    nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdPingRequest, &log);
+    fldOutStreamWriteUInt64(&outStream, 42);
+    orderedDatagramOutLogicCommit(orderedDatagramOut);
+
+    size_t sentCount = 0;
+    DatagramTransportOut transportOut = {.self = &sentCount, .send = countSentDatagram};
+    NimbleServerResponse response = {.transportOut = &transportOut};
+
+    return nimbleServerFeed(server, connectionIndex, octets, outStream.pos, &response);
+}
+
+UTEST(NimbleServer, verifyRateLimitedDatagramIsNotCountedAsLoss)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, 4, 0);
+    setup.ingressRateLimit.datagramsPerSecond = 4;
+    NimbleServer server;
+    ASSERT_EQ(0, initTestServer(&server, setup, 100, 1000));
+
+    OrderedDatagramOutLogic orderedDatagramOut;
+    orderedDatagramOutLogicInit(&orderedDatagramOut);
+    ASSERT_EQ(0, feedPingRequest(&server, 0, &orderedDatagramOut));
+    ASSERT_EQ(NimbleServerErrRateLimited, feedPingRequest(&server, 0, &orderedDatagramOut));
+
+    transportConnectionRateLimit(&server.transportConnections[0])->datagrams.milliTokens = 1000U;
+    ASSERT_EQ(0, feedPingRequest(&server, 0, &orderedDatagramOut));
+
+    const NimbleServerRedundancy* redundancy = &server.transportConnections[0].redundancy;
+    ASSERT_EQ(0u, redundancy->lostDatagramCount);
+    ASSERT_EQ(0u, nimbleServerRedundancyLossPermille(redundancy));
+}
+
+UTEST(NimbleServer, verifySpectatorStepsKeepLatestSteps)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    NimbleServerSpectatorSteps spectatorSteps;
+    Clog log = {.config = &g_clog, .constantPrefix = "spectator"};
+    nimbleServerSpectatorStepsInit(&spectatorSteps, &imprintSetup.tagAllocator.info, 4, 8, log);
+
+    StepId latestStepId;
+    ASSERT_FALSE(nimbleServerSpectatorStepsLatest(&spectatorSteps, &latestStepId));
+
+    for (StepId stepId = 10; stepId < 16; ++stepId) {
+        uint8_t step[2] = {(uint8_t) stepId, 0xca};
+        nimbleServerSpectatorStepsPublish(&spectatorSteps, stepId, step, sizeof(step));
+    }
+
+    ASSERT_TRUE(nimbleServerSpectatorStepsLatest(&spectatorSteps, &latestStepId));
+    ASSERT_EQ(15U, latestStepId);
+
+    uint8_t target[8];
+    ASSERT_EQ(NimbleServerErrSpectatorStepNotAvailable,
+              nimbleServerSpectatorStepsRead(&spectatorSteps, 11, target, sizeof(target)));
+    ASSERT_EQ(NimbleServerErrSpectatorStepNotAvailable,
+              nimbleServerSpectatorStepsRead(&spectatorSteps, 16, target, sizeof(target)));
+    ASSERT_EQ(2, nimbleServerSpectatorStepsRead(&spectatorSteps, 12, target, sizeof(target)));
+    ASSERT_EQ(12, target[0]);
+    ASSERT_EQ(0xca, target[1]);
+
+    nimbleServerSpectatorStepsReset(&spectatorSteps);
+    ASSERT_FALSE(nimbleServerSpectatorStepsLatest(&spectatorSteps, &latestStepId));
+    ASSERT_EQ(NimbleServerErrSpectatorStepNotAvailable,
+              nimbleServerSpectatorStepsRead(&spectatorSteps, 15, target, sizeof(target)));
+}
+
+UTEST(NimbleServer, verifyRelayChainPullsSteps)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    Clog log = {.config = &g_clog, .constantPrefix = "upstream"};
+    NimbleServerSpectatorSteps upstream;
+    nimbleServerSpectatorStepsInit(&upstream, &imprintSetup.tagAllocator.info, 8, 64, log);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, 4, 16);
+    setup.spectatorStepCapacity = 8;
+    setup.isRelay = true;
+    setup.log.constantPrefix = "relay";
+
+    NimbleServer relays[2];
+    const uint8_t gameState[] = {0x01, 0x02, 0x03};
+    for (size_t i = 0; i < 2; ++i) {
+        ASSERT_EQ(0, initTestServer(&relays[i], setup, 0, 0));
+    }
+
+    // The game state follows the chain in the same way as the steps
+    ASSERT_EQ(0, nimbleServerRelayPullGameState(&relays[1], &relays[0]));
+    ASSERT_EQ(0, nimbleServerRelaySetGameState(&relays[0], 100, gameState, sizeof(gameState)));
+    ASSERT_EQ(1, nimbleServerRelayPullGameState(&relays[1], &relays[0]));
+    ASSERT_EQ(0, nimbleServerRelayPullGameState(&relays[1], &relays[0]));
+    ASSERT_EQ(100U, relays[1].relay.gameState.stepId);
+
+    for (StepId stepId = 100; stepId < 105; ++stepId) {
+        uint8_t step[1] = {(uint8_t) stepId};
+        nimbleServerSpectatorStepsPublish(&upstream, stepId, step, sizeof(step));
+    }
+
+    ASSERT_EQ(5, nimbleServerRelayPull(&relays[0], &upstream));
+    ASSERT_EQ(5, nimbleServerRelayPull(&relays[1], nimbleServerSpectatorSteps(&relays[0])));
+    ASSERT_EQ(0, nimbleServerRelayPull(&relays[1], nimbleServerSpectatorSteps(&relays[0])));
+    ASSERT_EQ(105U, relays[1].game.authoritativeSteps.expectedWriteId);
+
+    // Falling further behind than the upstream keeps steps requires a newer game state
+    for (StepId stepId = 105; stepId < 120; ++stepId) {
+        uint8_t step[1] = {(uint8_t) stepId};
+        nimbleServerSpectatorStepsPublish(&upstream, stepId, step, sizeof(step));
+    }
+    ASSERT_EQ(NimbleServerErrRelayNotSynchronized, nimbleServerRelayPull(&relays[0], &upstream));
+
+    ASSERT_EQ(0, nimbleServerRelaySetGameState(&relays[0], 115, gameState, sizeof(gameState)));
+    ASSERT_EQ(5, nimbleServerRelayPull(&relays[0], &upstream));
+
+    // The relay further down is too far behind to continue from its steps, so it starts over from the game state
+    ASSERT_EQ(1, nimbleServerRelayPullGameState(&relays[1], &relays[0]));
+    ASSERT_EQ(115U, relays[1].relay.gameState.stepId);
+    ASSERT_EQ(5, nimbleServerRelayPull(&relays[1], nimbleServerSpectatorSteps(&relays[0])));
+    ASSERT_EQ(120U, relays[1].game.authoritativeSteps.expectedWriteId);
+}
+
+static bool containsOctets(const uint8_t* octets, size_t octetCount, const uint8_t* find, size_t findOctetCount)
+{
+    for (size_t i = 0; i + findOctetCount <= octetCount; ++i) {
+        if (memcmp(octets + i, find, findOctetCount) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Queues a datagram from the downstream client on the transport of the relay
+static NimbleServerIoDatagram* prepareClientDatagram(TestDatagramTransport* transport, FldOutStream* outStream,
+                                                     OrderedDatagramOutLogic* orderedDatagramOut)
+{
+    NimbleServerIoDatagram* datagram = &transport->received[transport->receivedCount++];
+    datagram->connectionIndex = 0;
+    fldOutStreamInit(outStream, datagram->octets, sizeof(datagram->octets));
+    orderedDatagramOutLogicPrepare(orderedDatagramOut, outStream);
+    return datagram;
+}
+
+static void commitClientDatagram(NimbleServerIoDatagram* datagram, const FldOutStream* outStream,
+                                 OrderedDatagramOutLogic* orderedDatagramOut)
+{
+    orderedDatagramOutLogicCommit(orderedDatagramOut);
+    datagram->octetCount = outStream->pos;
+}
+
+UTEST(NimbleServer, verifyRelayServesSpectatorOverTransport)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    TestDatagramTransport transport;
+    transport.receivedCount = 0;
+    transport.readCount = 0;
+    transport.sentCount = 0;
+
+    DatagramTransportMulti multiTransport;
+    multiTransport.self = &transport;
+    multiTransport.receiveFrom = testDatagramReceiveFrom;
+    multiTransport.sendTo = testDatagramSendTo;
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, 4, 4);
+    setup.spectatorStepCapacity = 8;
+    setup.isRelay = true;
+    setup.log.constantPrefix = "relay";
+
+    NimbleServer upstreamRelay;
+    ASSERT_EQ(0, initTestServer(&upstreamRelay, setup, 0, 0));
+
+    setup.multiTransport = multiTransport;
+    NimbleServer relay;
+    ASSERT_EQ(0, initTestServer(&relay, setup, 0, 1000));
+
+    const uint8_t gameState[] = {0x01, 0x02, 0x03, 0x04, 0x05};
+    ASSERT_EQ(0, nimbleServerRelaySetGameState(&upstreamRelay, 100, gameState, sizeof(gameState)));
+    for (StepId stepId = 100; stepId < 104; ++stepId) {
+        uint8_t step[3] = {0x5e, 0x1a, (uint8_t) stepId};
+        ASSERT_EQ(1, nimbleServerRelayAddAuthoritativeStep(&upstreamRelay, stepId, step, sizeof(step)));
+    }
+
+    ASSERT_EQ(1, nimbleServerRelayPullGameState(&relay, &upstreamRelay));
+    ASSERT_EQ(4, nimbleServerRelayPull(&relay, nimbleServerSpectatorSteps(&upstreamRelay)));
+
+    OrderedDatagramOutLogic orderedDatagramOut;
+    orderedDatagramOutLogicInit(&orderedDatagramOut);
+    Clog log = {.config = &g_clog, .constantPrefix = "client"};
+    FldOutStream outStream;
+
+    // The downstream client joins as a spectator and asks for the steps from the game state
+    {
+        NimbleServerIoDatagram* datagram = prepareClientDatagram(&transport, &outStream, &orderedDatagramOut);
+        NimbleSerializeJoinGameRequest joinRequest;
+        joinRequest.joinGameType = NimbleSerializeJoinGameTypeNoSecret;
+        joinRequest.playerCount = 0;
+        joinRequest.requestId = 1;
+        nimbleSerializeClientOutJoinGameRequest(&outStream, &joinRequest, &log);
+        commitClientDatagram(datagram, &outStream, &orderedDatagramOut);
+    }
+    {
+        NimbleServerIoDatagram* datagram = prepareClientDatagram(&transport, &outStream, &orderedDatagramOut);
+        nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdGameStep, &log);
+        nbsPendingStepsSerializeOutHeader(&outStream, 100);
+        fldOutStreamWriteUInt32(&outStream, 100);
+        fldOutStreamWriteUInt8(&outStream, 0);
+        commitClientDatagram(datagram, &outStream, &orderedDatagramOut);
+    }
+
+    ASSERT_EQ(0, nimbleServerReadFromMultiTransport(&relay));
+    ASSERT_TRUE(relay.transportConnections[0].isSpectator);
+    ASSERT_EQ(2u, transport.sentCount);
+
+    const NimbleServerIoDatagram* stepReply = &transport.sent[1];
+    ASSERT_EQ(0, stepReply->connectionIndex);
+    for (StepId stepId = 100; stepId < 104; ++stepId) {
+        uint8_t step[3] = {0x5e, 0x1a, (uint8_t) stepId};
+        ASSERT_TRUE(containsOctets(stepReply->octets, stepReply->octetCount, step, sizeof(step)));
+    }
+
+    // The game state that the relay took from the upstream relay is downloaded through a blob stream
+    transport.receivedCount = 0;
+    transport.readCount = 0;
+    transport.sentCount = 0;
+    {
+        NimbleServerIoDatagram* datagram = prepareClientDatagram(&transport, &outStream, &orderedDatagramOut);
+        nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdDownloadGameStateRequest, &log);
+        fldOutStreamWriteUInt8(&outStream, 1);
+        commitClientDatagram(datagram, &outStream, &orderedDatagramOut);
+    }
+
+    ASSERT_EQ(0, nimbleServerReadFromMultiTransport(&relay));
+    ASSERT_LE(2u, transport.sentCount);
+
+    const NimbleServerTransportConnectionDownload* download = relay.transportConnections[0].download;
+    ASSERT_TRUE(download != 0);
+    ASSERT_EQ(100U, download->gameState.stepId);
+
+    BlobStreamIn blobStreamIn;
+    BlobStreamLogicIn blobStreamLogicIn;
+    blobStreamInInit(&blobStreamIn, &imprintSetup.tagAllocator.info, &imprintSetup.slabAllocator.info,
+                     download->gameState.octetCount, BLOB_STREAM_CHUNK_SIZE, log);
+    blobStreamLogicInInit(&blobStreamLogicIn, &blobStreamIn);
+
+    OrderedDatagramInLogic orderedDatagramIn;
+    orderedDatagramInLogicInit(&orderedDatagramIn);
+    for (size_t i = 0; i < transport.sentCount; ++i) {
+        FldInStream inStream;
+        fldInStreamInit(&inStream, transport.sent[i].octets, transport.sent[i].octetCount);
+        ASSERT_EQ(0, orderedDatagramInLogicReceive(&orderedDatagramIn, &inStream));
+        uint8_t cmd;
+        ASSERT_EQ(0, fldInStreamReadUInt8(&inStream, &cmd));
+        // The game state response that starts the transfer is not parsed, only the chunks that follow it
+        if (cmd != NimbleSerializeCmdServerOutBlobStream) {
+            continue;
+        }
+        ASSERT_LE(0, blobStreamLogicInReceive(&blobStreamLogicIn, &inStream));
+    }
+
+    ASSERT_TRUE(blobStreamInIsComplete(&blobStreamIn));
+    ASSERT_EQ(0, memcmp(gameState, blobStreamIn.blob, sizeof(gameState)));
+    blobStreamInDestroy(&blobStreamIn);
+}
+
+UTEST(NimbleServer, verifyJournalRoundTrip)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    CaptureBuffer buffer;
+    buffer.octetCount = 0;
+
+    Clog log = {.config = &g_clog, .constantPrefix = "journal"};
+    NimbleServerJournal journal;
+    nimbleServerJournalInit(&journal, &imprintSetup.tagAllocator.info, 32 * NIMBLE_SERVER_JOURNAL_CHUNK_COUNT, log);
+
+    NimbleServerJournalOut out = {.self = &buffer, .write = writeToCaptureBuffer};
+    ASSERT_EQ(0, nimbleServerJournalStart(&journal, out));
+
+    for (StepId stepId = 100; stepId < 106; ++stepId) {
+        uint8_t step[3] = {(uint8_t) stepId, 0xca, 0xfe};
+        ASSERT_EQ(0, nimbleServerJournalAppend(&journal, stepId, step, sizeof(step)));
+    }
+
+    // Only the full chunks are written
+    ASSERT_EQ(3, nimbleServerJournalFlush(&journal));
+    ASSERT_EQ(96U, buffer.octetCount);
+
+    nimbleServerJournalStop(&journal);
+    ASSERT_EQ(1, nimbleServerJournalFlush(&journal));
+    ASSERT_EQ(112U, buffer.octetCount);
+
+    NimbleServerJournalReader reader;
+    ASSERT_EQ(0, nimbleServerJournalReaderInit(&reader, &imprintSetup.tagAllocator.info, buffer.octets,
+                                               buffer.octetCount));
+    ASSERT_EQ(6U, reader.recordCount);
+
+    const uint8_t* octets;
+    size_t octetCount;
+    ASSERT_EQ(1, nimbleServerJournalReaderRead(&reader, 104, &octets, &octetCount));
+    ASSERT_EQ(3U, octetCount);
+    ASSERT_EQ(104, octets[0]);
+    ASSERT_EQ(0xfe, octets[2]);
+    ASSERT_EQ(0, nimbleServerJournalReaderRead(&reader, 106, &octets, &octetCount));
+
+    // Steps are dropped instead of waiting for the chunks to be written
+    buffer.octetCount = 0;
+    ASSERT_EQ(0, nimbleServerJournalStart(&journal, out));
+    for (StepId stepId = 0; stepId < 20; ++stepId) {
+        uint8_t step[3] = {0};
+        nimbleServerJournalAppend(&journal, stepId, step, sizeof(step));
+    }
+    ASSERT_EQ(5U, journal.droppedStepCount);
+}
+
+UTEST(NimbleServer, verifyJournalReaderIndexIsSizedByRecords)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    CaptureBuffer buffer;
+    buffer.octetCount = 0;
+
+    Clog log = {.config = &g_clog, .constantPrefix = "journal"};
+    NimbleServerJournal journal;
+    nimbleServerJournalInit(&journal, &imprintSetup.tagAllocator.info, 32 * NIMBLE_SERVER_JOURNAL_CHUNK_COUNT, log);
+    NimbleServerJournalOut out = {.self = &buffer, .write = writeToCaptureBuffer};
+    ASSERT_EQ(0, nimbleServerJournalStart(&journal, out));
+
+    // Step ids that are far apart, as in a segment from a broken or hostile writer
+    const StepId stepIds[3] = {100, 0x10000000, 0x7ffffff0};
+    for (size_t i = 0; i < 3; ++i) {
+        uint8_t step[1] = {(uint8_t) i};
+        ASSERT_EQ(0, nimbleServerJournalAppend(&journal, stepIds[i], step, sizeof(step)));
+    }
+    nimbleServerJournalStop(&journal);
+    ASSERT_LT(0, nimbleServerJournalFlush(&journal));
+
+    // An index for every step id in the span would not fit in the memory of the setup
+    NimbleServerJournalReader reader;
+    ASSERT_EQ(0, nimbleServerJournalReaderInit(&reader, &imprintSetup.tagAllocator.info, buffer.octets,
+                                               buffer.octetCount));
+    ASSERT_EQ(3U, reader.recordCount);
+
+    const uint8_t* octets;
+    size_t octetCount;
+    for (size_t i = 0; i < 3; ++i) {
+        ASSERT_EQ(1, nimbleServerJournalReaderRead(&reader, stepIds[i], &octets, &octetCount));
+        ASSERT_EQ(1U, octetCount);
+        ASSERT_EQ(i, octets[0]);
+    }
+    ASSERT_EQ(0, nimbleServerJournalReaderRead(&reader, 99, &octets, &octetCount));
+    ASSERT_EQ(0, nimbleServerJournalReaderRead(&reader, 101, &octets, &octetCount));
+    ASSERT_EQ(0, nimbleServerJournalReaderRead(&reader, 0x7ffffff1, &octets, &octetCount));
+}
+
+/// Journal out that fails after a number of writes, e.g. when the disk is full
+typedef struct FailingJournalOut {
+    CaptureBuffer buffer;
+    size_t writeCountBeforeFailure;
+} FailingJournalOut;
+
+static int writeUntilFailure(void* self_, const uint8_t* octets, size_t octetCount)
+{
+    FailingJournalOut* self = (FailingJournalOut*) self_;
+    if (self->writeCountBeforeFailure == 0) {
+        return -1;
+    }
+    self->writeCountBeforeFailure--;
+    return writeToCaptureBuffer(&self->buffer, octets, octetCount);
+}
+
+UTEST(NimbleServer, verifyJournalStopsAfterFailedWrite)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    FailingJournalOut failingOut;
+    failingOut.buffer.octetCount = 0;
+    failingOut.writeCountBeforeFailure = 1;
+
+    Clog log = {.config = &g_clog, .constantPrefix = "journal"};
+    NimbleServerJournal journal;
+    nimbleServerJournalInit(&journal, &imprintSetup.tagAllocator.info, 32 * NIMBLE_SERVER_JOURNAL_CHUNK_COUNT, log);
+    NimbleServerJournalOut out = {.self = &failingOut, .write = writeUntilFailure};
+    ASSERT_EQ(0, nimbleServerJournalStart(&journal, out));
+
+    for (StepId stepId = 100; stepId < 106; ++stepId) {
+        uint8_t step[3] = {(uint8_t) stepId, 0xca, 0xfe};
+        ASSERT_EQ(0, nimbleServerJournalAppend(&journal, stepId, step, sizeof(step)));
+    }
+
+    // Only the chunk before the failed write is in the segment, the chunks after it are not appended
+    ASSERT_EQ(-1, nimbleServerJournalFlush(&journal));
+    ASSERT_EQ(1U, journal.failedWriteCount);
+    ASSERT_EQ(32U, failingOut.buffer.octetCount);
+
+    uint8_t step[3] = {106, 0xca, 0xfe};
+    ASSERT_EQ(NimbleServerErrJournal, nimbleServerJournalAppend(&journal, 106, step, sizeof(step)));
+    ASSERT_FALSE(journal.isEnabled);
+    ASSERT_EQ(0, nimbleServerJournalAppend(&journal, 107, step, sizeof(step)));
+
+    failingOut.writeCountBeforeFailure = 8;
+    ASSERT_EQ(NimbleServerErrJournal, nimbleServerJournalFlush(&journal));
+    ASSERT_EQ(1U, journal.failedWriteCount);
+    ASSERT_EQ(32U, failingOut.buffer.octetCount);
+
+    // A new segment can be started when the out works again
+    failingOut.buffer.octetCount = 0;
+    ASSERT_EQ(0, nimbleServerJournalStart(&journal, out));
+    ASSERT_EQ(0, nimbleServerJournalAppend(&journal, 108, step, sizeof(step)));
+    nimbleServerJournalStop(&journal);
+    ASSERT_EQ(1, nimbleServerJournalFlush(&journal));
+    ASSERT_EQ(32U, failingOut.buffer.octetCount);
+}
+
+UTEST(NimbleServer, verifyCatchUpStepsAreReadFromJournal)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    CaptureBuffer buffer;
+    buffer.octetCount = 0;
+
+    Clog log = {.config = &g_clog, .constantPrefix = "journal"};
+    NimbleServerJournal journal;
+    nimbleServerJournalInit(&journal, &imprintSetup.tagAllocator.info, 32 * NIMBLE_SERVER_JOURNAL_CHUNK_COUNT, log);
+    NimbleServerJournalOut out = {.self = &buffer, .write = writeToCaptureBuffer};
+    ASSERT_EQ(0, nimbleServerJournalStart(&journal, out));
+    for (StepId stepId = 100; stepId < 110; ++stepId) {
+        uint8_t step[1] = {(uint8_t) stepId};
+        ASSERT_EQ(0, nimbleServerJournalAppend(&journal, stepId, step, sizeof(step)));
+    }
+    nimbleServerJournalStop(&journal);
+    ASSERT_LT(0, nimbleServerJournalFlush(&journal));
+
+    NimbleServerJournalReader reader;
+    ASSERT_EQ(0, nimbleServerJournalReaderInit(&reader, &imprintSetup.tagAllocator.info, buffer.octets,
+                                               buffer.octetCount));
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, 4, 0);
+    NimbleServer server;
+    ASSERT_EQ(0, initTestServer(&server, setup, 108, 0));
+    nimbleServerSetJournalSource(&server, nimbleServerJournalReaderSource(&reader));
+
+    // Only the steps before the authoritative steps in memory are read from the journal
+    ASSERT_EQ(5, nimbleServerGameReadCatchUpSteps(&server.game, 103, DATAGRAM_TRANSPORT_MAX_SIZE));
+    ASSERT_EQ(103U, server.game.catchUpSteps->expectedReadId);
+    ASSERT_EQ(108U, server.game.catchUpSteps->expectedWriteId);
+    ASSERT_EQ(0, nimbleServerGameReadCatchUpSteps(&server.game, 90, DATAGRAM_TRANSPORT_MAX_SIZE));
+
+    // Only the steps that fit in the octet count of the reply are read, each step is two octets with its length
+    ASSERT_EQ(3, nimbleServerGameReadCatchUpSteps(&server.game, 103, 6));
+    ASSERT_EQ(106U, server.game.catchUpSteps->expectedWriteId);
+    ASSERT_EQ(1, nimbleServerGameReadCatchUpSteps(&server.game, 103, 1));
+
+    ASSERT_EQ(0, nimbleServerReInitWithGame(&server, 120, 0));
+    ASSERT_EQ(0, nimbleServerGameReadCatchUpSteps(&server.game, 103, DATAGRAM_TRANSPORT_MAX_SIZE));
+}
+
+/// A composed authoritative step where two participants keep the same input
+static void appendCatchUpStep(NimbleServerJournal* journal, StepId stepId)
+{
+    const uint8_t step[] = {2, 1, 1, 0xAA, 2, 1, 0xBB};
+    nimbleServerJournalAppend(journal, stepId, step, sizeof(step));
+}
+
+UTEST(NimbleServer, verifyCatchUpStepRangesAreSentFromLiveJournal)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, 4, 0);
+    NimbleServer server;
+    ASSERT_EQ(0, initTestServer(&server, setup, 108, 1000));
+    for (StepId stepId = 108; stepId < 112; ++stepId) {
+        const uint8_t step[] = {2, 1, 1, 0xAA, 2, 1, 0xBB};
+        ASSERT_LE(0, nbsStepsWrite(&server.game.authoritativeSteps, stepId, step, sizeof(step)));
+    }
+
+    CaptureBuffer buffer;
+    buffer.octetCount = 0;
+    Clog log = {.config = &g_clog, .constantPrefix = "journal"};
+    NimbleServerJournal journal;
+    nimbleServerJournalInit(&journal, &imprintSetup.tagAllocator.info, 32 * NIMBLE_SERVER_JOURNAL_CHUNK_COUNT, log);
+    NimbleServerJournalOut out = {.self = &buffer, .write = writeToCaptureBuffer};
+    ASSERT_EQ(0, nimbleServerJournalStart(&journal, out));
+    for (StepId stepId = 100; stepId < 106; ++stepId) {
+        appendCatchUpStep(&journal, stepId);
+    }
+
+    // The live segment is indexed as the chunks are written, step 105 is still in the open chunk
+    NimbleServerJournalReader reader;
+    nimbleServerJournalReaderInitLive(&reader, &imprintSetup.tagAllocator.info, 64);
+    ASSERT_EQ(0, nimbleServerJournalReaderAppend(&reader, buffer.octets, 0));
+    ASSERT_EQ(3, nimbleServerJournalFlush(&journal));
+    ASSERT_EQ(5, nimbleServerJournalReaderAppend(&reader, buffer.octets, buffer.octetCount));
+    nimbleServerSetJournalSource(&server, nimbleServerJournalReaderSource(&reader));
+
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+
+    NimbleServerTransportConnection* partial = initStepRangeConnection(&server, 0, 0);
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_EQ(1, nimbleServerSendStepRanges(&outStream, partial, &server.game, 100));
+    ASSERT_EQ(104U, partial->roundTripTime.highestSentStepId);
+
+    for (StepId stepId = 106; stepId < 108; ++stepId) {
+        appendCatchUpStep(&journal, stepId);
+    }
+    nimbleServerJournalStop(&journal);
+    ASSERT_LT(0, nimbleServerJournalFlush(&journal));
+    ASSERT_EQ(3, nimbleServerJournalReaderAppend(&reader, buffer.octets, buffer.octetCount));
+    ASSERT_EQ(0, nimbleServerJournalReaderAppend(&reader, buffer.octets, buffer.octetCount));
+
+    // All the steps before the authoritative steps in memory are sent from the journal
+    NimbleServerTransportConnection* normal = initStepRangeConnection(&server, 1, 0);
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_EQ(1, nimbleServerSendStepRanges(&outStream, normal, &server.game, 100));
+    ASSERT_EQ(107U, normal->roundTripTime.highestSentStepId);
+    size_t normalOctetCount = outStream.pos;
+
+    NimbleServerTransportConnection* compact = initStepRangeConnection(&server, 2, 0);
+    compact->stepEncoding = NimbleServerStepEncodingCompact;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_EQ(1, nimbleServerSendStepRanges(&outStream, compact, &server.game, 100));
+    ASSERT_EQ(107U, compact->roundTripTime.highestSentStepId);
+    ASSERT_LT(outStream.pos, normalOctetCount);
+
+    // The journaled steps are shrunk to the octet cap of the reply, in the same way as the steps in memory
+    NimbleServerTransportConnection* capped = initStepRangeConnection(&server, 3, 24);
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    ASSERT_EQ(1, nimbleServerSendStepRanges(&outStream, capped, &server.game, 100));
+    ASSERT_LE(outStream.pos - stepHeaderOctetCount(), 24u);
+    ASSERT_LE(100U, capped->roundTripTime.highestSentStepId);
+    ASSERT_LT(capped->roundTripTime.highestSentStepId, 107U);
+}